@@ -40,10 +40,14 @@ NotifyCategoryDef(lightmgr, "");
  *   storage. You should set a command list and shadow manager before calling
  *   InternalLightManager::update. s
  */
-InternalLightManager::InternalLightManager() {
+InternalLightManager::InternalLightManager() :
+  _dirty_lights(MAX_LIGHT_COUNT),
+  _dirty_sources(MAX_SHADOW_SOURCES),
+  _sources_with_region(MAX_SHADOW_SOURCES) {
   _shadow_update_distance = 100.0;
   _cmd_list = nullptr;
   _shadow_manager = nullptr;
+  _frame_index = 0;
 }
 
 /**
@@ -90,7 +94,7 @@ void InternalLightManager::add_light(PT(RPLight) light) {
   light->ref();
 
   // Reserve the slot
-  light->assign_slot(slot);
+  light->assign_slot(slot, &_dirty_lights);
   _lights.reserve_slot(slot, light);
 
   // Setup the shadows in case the light uses them
@@ -138,14 +142,15 @@ void InternalLightManager::setup_shadows(RPLight* light) {
   for (size_t i = 0; i < num_sources; ++i) {
     ShadowSource* source = light->get_shadow_source(i);
 
-    // Set the source as dirty, so it gets updated in the beginning
-    source->set_needs_update(true);
-
     // Assign the slot to the source. Since we got consecutive slots, we can
     // just do base_slot + N.
     size_t slot = base_slot + i;
     _shadow_sources.reserve_slot(slot, source);
-    source->set_slot(slot);
+    source->set_slot(slot, &_dirty_sources);
+    source->set_last_update_frame(_frame_index);
+
+    // Set the source as dirty, so it gets updated in the beginning
+    source->set_needs_update(true);
   }
 }
 
@@ -194,19 +199,24 @@ void InternalLightManager::remove_light(PT(RPLight) light) {
     // the shadow atlas.
     for (size_t i = 0; i < light->get_num_shadow_sources(); ++i) {
       ShadowSource* source = light->get_shadow_source(i);
+      if (source->has_region()) {
+        free_source_region(source);
+      }
       if (source->has_slot()) {
         _shadow_sources.free_slot(source->get_slot());
       }
-      if (source->has_region()) {
-        _shadow_manager->get_atlas()->free_region(source->get_region());
-        source->clear_region();
-      }
     }
 
     // Remove all sources of the light by emitting a consecutive remove command
     gpu_remove_consecutive_sources(light->get_shadow_source(0),
                      light->get_num_shadow_sources());
 
+    // Any dirty bits left for the sources get skipped on the next update,
+    // since their slots are empty now.
+    for (size_t i = 0; i < light->get_num_shadow_sources(); ++i) {
+      light->get_shadow_source(i)->set_slot(-1, nullptr);
+    }
+
     // Finally remove all shadow sources. This is important in case the light
     // will be re-attached. Otherwise an assertion will get triggered.
     light->clear_shadow_sources();
@@ -302,128 +312,260 @@ void InternalLightManager::gpu_update_source(ShadowSource* source) {
 
 /**
  * @brief Internal method to update all lights
- * @details This is called by the main update method, and iterates over the list
- *   of lights. If a light is marked as dirty, it will recieve an update of its
- *   data and its shadow sources.
+ * @details This is called by the main update method, and iterates over the
+ *   slots of the lights which were marked dirty since the last update. Each
+ *   of those lights recieves an update of its data and its shadow sources.
+ *
+ *   The slots are processed in ascending order, so when a range of consecutive
+ *   lights changed, their store commands end up next to each other in the
+ *   command list as well.
  */
 void InternalLightManager::update_lights() {
-  for (auto iter = _lights.begin(); iter != _lights.end(); ++iter) {
-    RPLight* light = *iter;
+  _dirty_lights.pop_all([this](size_t slot) {
+    RPLight* light = _lights.get(slot);
+
+    // The light might have been detached, or already stored by add_light
     if (light && light->get_needs_update()) {
       if (light->get_casts_shadows()) {
         light->update_shadow_sources();
       }
       gpu_update_light(light);
     }
-  }
+  });
 }
 
 /**
- * @brief Compares shadow sources by their priority
- * @details Returns if a has a greater priority than b. This depends on the
- *   resolution of the source, and also if the source has a region or not.
- *   This method can be passed to std::sort.
+ * @brief Returns the update priority of a shadow source
+ * @details Sources which cover a bigger part of the screen, and sources whose
+ *   shadow map was not regenerated for a longer time, get a higher priority.
+ *   The size on screen is approximated with the angular size of the sources
+ *   bounds as seen from the camera.
  *
- * @param a First source
- * @param b Second source
+ * @param source The source to compute the priority for
+ * @return Priority, higher values should get updated first
+ */
+PN_stdfloat InternalLightManager::get_update_priority(const ShadowSource* source) const {
+  const BoundingSphere& bounds = source->get_bounds();
+  PN_stdfloat radius = bounds.get_radius();
+  PN_stdfloat distance = (_camera_pos - bounds.get_center()).length();
+  PN_stdfloat screen_size = radius / std::max(distance, std::max(radius, (PN_stdfloat)1e-4));
+  unsigned int staleness = _frame_index - source->get_last_update_frame();
+  return screen_size * (PN_stdfloat)(1 + staleness);
+}
+
+/**
+ * @brief Returns whether a shadow source is within the update distance
+ * @details This checks if the bounds of the source are closer to the camera
+ *   than the shadow update distance. Sources outside of that distance do not
+ *   get updated, and do not keep their region in the shadow atlas.
  *
- * @return true if a is more important than b, else false
+ * @param source The source to check
+ * @return true if the source is in range, false otherwise
  */
-bool InternalLightManager::compare_shadow_sources(const ShadowSource* a, const ShadowSource* b) const {
+bool InternalLightManager::is_in_update_range(const ShadowSource* source) const {
+  const BoundingSphere& bounds = source->get_bounds();
+  PN_stdfloat distance_to_camera = (_camera_pos - bounds.get_center()).length() - bounds.get_radius();
+  return distance_to_camera < _shadow_update_distance;
+}
 
-  // Make sure that sources which already have a region (but maybe outdated)
-  // come after sources which have no region at all.
-  if (a->has_region() != b->has_region()) {
-    return b->has_region();
+/**
+ * @brief Returns whether a shadow source is visible
+ * @details This checks the bounds of the source against the camera frustum
+ *   set with InternalLightManager::set_camera_frustum. If no frustum was set,
+ *   every source counts as visible.
+ *
+ * @param source The source to check
+ * @return true if the source is visible, false otherwise
+ */
+bool InternalLightManager::is_in_camera_frustum(const ShadowSource* source) const {
+  if (_camera_frustum == nullptr) {
+    return true;
   }
+  return _camera_frustum->contains(&source->get_bounds()) != BoundingVolume::IF_no_intersection;
+}
 
-  // Compare sources based on their distance to the camera
-  PN_stdfloat dist_a = (_camera_pos - a->get_bounds().get_center()).length_squared();
-  PN_stdfloat dist_b = (_camera_pos - a->get_bounds().get_center()).length_squared();
-
-  // XXX: Should also compare based on source size, so that huge sources recieve
-  // more updates
-
-  return dist_b > dist_a;
+/**
+ * @brief Internal method to free the atlas region of a shadow source
+ * @details This releases the region of the source in the shadow atlas, and
+ *   clears the region of the source. The source must have a region and a slot.
+ *
+ * @param source The source to free the region of
+ */
+void InternalLightManager::free_source_region(ShadowSource* source) {
+  nassertv(source->has_region());
+  nassertv(source->has_slot());
+  _shadow_manager->get_atlas()->free_region(source->get_region());
+  source->clear_region();
+  _sources_with_region.clear(source->get_slot());
 }
 
 /**
  * @brief Internal method to update all shadow sources
  * @details This updates all shadow sources which are marked dirty. It will sort
- *   the list of all dirty shadow sources by their resolution, take the first
+ *   the list of all dirty shadow sources by their priority, take the first
  *   n entries, and update them. The amount of sources processed depends on the
  *   max_updates of the ShadowManager.
+ *
+ *   When there is no space left in the shadow atlas for a visible source, the
+ *   sources which were not visible for the longest time lose their region.
  */
 void InternalLightManager::update_shadow_sources() {
 
-  // Find all dirty shadow sources and make a list of them
-  std::vector<ShadowSource*> sources_to_update;
-   for (auto iter = _shadow_sources.begin(); iter != _shadow_sources.end(); ++iter) {
-    ShadowSource* source = *iter;
-    if (source) {
-      const BoundingSphere& bounds = source->get_bounds();
-
-      // Check if source is in range
-      PN_stdfloat distance_to_camera = (_camera_pos - bounds.get_center()).length() - bounds.get_radius();
-      if (distance_to_camera < _shadow_update_distance) {
-        if (source->get_needs_update()) {
-          sources_to_update.push_back(source);
-        }
-      } else {
+  // Free regions of sources which are out of the update radius, to make
+  // space for other regions. They need an update as soon as they get back
+  // in range, so they stay in the dirty set. The GPU gets an empty region
+  // for them, so it does not sample a region some other source gets.
+  _sources_with_region.for_each([this](size_t slot) {
+    ShadowSource* source = _shadow_sources.get(slot);
+    if (source == nullptr) {
+      return;
+    }
+    if (!is_in_update_range(source)) {
+      free_source_region(source);
+      source->set_needs_update(true);
+      gpu_update_source(source);
+      _dirty_sources.set(slot);
+    } else if (is_in_camera_frustum(source)) {
+      source->set_last_visible_frame(_frame_index);
+    }
+  });
 
-        // Free regions of sources which are out of the update radius,
-        // to make space for other regions
-        if (source->has_region()) {
-          _shadow_manager->get_atlas()->free_region(source->get_region());
-          source->clear_region();
+  struct SourceUpdate {
+    ShadowSource* source;
+    bool visible_without_region;
+    PN_stdfloat priority;
+  };
+
+  // Find all dirty shadow sources in range and make a list of them. Sources
+  // out of range are remembered, and get checked again on the next update.
+  std::vector<SourceUpdate> sources_to_update;
+  std::vector<size_t> deferred_slots;
+  _dirty_sources.pop_all([&](size_t slot) {
+    ShadowSource* source = _shadow_sources.get(slot);
+    if (source && source->get_needs_update()) {
+      if (is_in_update_range(source)) {
+        bool visible = is_in_camera_frustum(source);
+        if (visible) {
+          source->set_last_visible_frame(_frame_index);
         }
+        sources_to_update.push_back({ source, visible && !source->has_region(),
+                                      get_update_priority(source) });
+      } else {
+        deferred_slots.push_back(slot);
       }
     }
+  });
 
-  }
-
-  // Sort the sources based on their importance, so that sources with a bigger
-  // priority come first. This helps to get a better packing on the shadow atlas.
-  // However, we also need to prioritize sources which have no current region,
-  // because no shadows are worse than outdated-shadows.
-  std::sort(sources_to_update.begin(), sources_to_update.end(), [this](const ShadowSource* a, const ShadowSource* b) {
-    return this->compare_shadow_sources(a, b);
+  // Only a limited amount of sources can get updated per frame, so find the
+  // most important ones. Visible sources which have no region come first,
+  // because no shadows are worse than outdated shadows.
+  size_t update_slots = std::min(sources_to_update.size(),
+                _shadow_manager->get_num_update_slots_left());
+  std::partial_sort(sources_to_update.begin(), sources_to_update.begin() + update_slots,
+                    sources_to_update.end(), [](const SourceUpdate& a, const SourceUpdate& b) {
+    if (a.visible_without_region != b.visible_without_region) {
+      return a.visible_without_region;
+    }
+    return a.priority > b.priority;
   });
 
   // Get a handle to the atlas, will be frequently used
   ShadowAtlas *atlas = _shadow_manager->get_atlas();
 
-  // Free the regions of all sources which will get updated. We have to take into
-  // account that only a limited amount of sources can get updated per frame.
-  size_t update_slots = std::min(sources_to_update.size(),
-                _shadow_manager->get_num_update_slots_left());
-  for(size_t i = 0; i < update_slots; ++i) {
-    if (sources_to_update[i]->has_region()) {
-       atlas->free_region(sources_to_update[i]->get_region());
+  // Free the regions of all sources which will get updated.
+  for (size_t i = 0; i < update_slots; ++i) {
+    if (sources_to_update[i].source->has_region()) {
+      free_source_region(sources_to_update[i].source);
     }
   }
 
+  // All sources which do not fit into this update stay dirty
+  for (size_t i = update_slots; i < sources_to_update.size(); ++i) {
+    deferred_slots.push_back(sources_to_update[i].source->get_slot());
+  }
+
+  // Sources which may lose their region, least recently visible first. They
+  // are collected before any region is handed out, so sources which get
+  // their region in this update are never evicted again right away. Only
+  // sorted once the atlas actually runs full.
+  std::vector<ShadowSource*> eviction_candidates;
+  if (update_slots > 0) {
+    _sources_with_region.for_each([&](size_t slot) {
+      ShadowSource* candidate = _shadow_sources.get(slot);
+      if (candidate && candidate->get_last_visible_frame() != _frame_index) {
+        eviction_candidates.push_back(candidate);
+      }
+    });
+  }
+  size_t next_candidate = 0;
+  bool candidates_sorted = false;
+
   // Find an atlas spot for all regions which are supposed to get an update
   for (size_t i = 0; i < update_slots; ++i) {
-    ShadowSource *source = sources_to_update[i];
+    ShadowSource *source = sources_to_update[i].source;
+    size_t region_size = atlas->get_required_tiles(source->get_resolution());
+
+    // Only visible sources may evict other sources, otherwise sources which
+    // are out of view would keep taking each others regions.
+    if (!atlas->has_free_region(region_size, region_size) &&
+        source->get_last_visible_frame() == _frame_index) {
+      if (!candidates_sorted) {
+        std::sort(eviction_candidates.begin(), eviction_candidates.end(),
+                  [](const ShadowSource* a, const ShadowSource* b) {
+          return a->get_last_visible_frame() < b->get_last_visible_frame();
+        });
+        candidates_sorted = true;
+      }
+
+      while (!atlas->has_free_region(region_size, region_size) &&
+             next_candidate < eviction_candidates.size()) {
+        ShadowSource* victim = eviction_candidates[next_candidate++];
+        if (victim->has_region()) {
+          // The victim has to be rendered again once it gets a new region,
+          // and the GPU must stop sampling the region it had.
+          free_source_region(victim);
+          victim->set_needs_update(true);
+          gpu_update_source(victim);
+          _dirty_sources.set(victim->get_slot());
+        }
+      }
+    }
+
+    if (!atlas->has_free_region(region_size, region_size)) {
+      // Try again once some space got freed. The region of the source was
+      // already freed above and may be handed to another source in this
+      // update, so the GPU must stop sampling it.
+      deferred_slots.push_back(source->get_slot());
+      gpu_update_source(source);
+      continue;
+    }
 
     if(!_shadow_manager->add_update(source)) {
       // In case the ShadowManager lied about the number of updates left
       lightmgr_cat.error() << "ShadowManager ensured update slot, but slot is taken!" << endl;
+      for (size_t k = i; k < update_slots; ++k) {
+        deferred_slots.push_back(sources_to_update[k].source->get_slot());
+        gpu_update_source(sources_to_update[k].source);
+      }
       break;
     }
 
     // We have an update slot, and are guaranteed to get updated as soon
     // as possible, so we can start getting a new atlas position.
-    size_t region_size = atlas->get_required_tiles(source->get_resolution());
     LVecBase4i new_region = atlas->find_and_reserve_region(region_size, region_size);
     LVecBase4 new_uv_region = atlas->region_to_uv(new_region);
     source->set_region(new_region, new_uv_region);
+    _sources_with_region.set(source->get_slot());
 
     // Mark the source as updated
     source->set_needs_update(false);
+    source->set_last_update_frame(_frame_index);
     gpu_update_source(source);
   }
+
+  for (size_t slot : deferred_slots) {
+    _dirty_sources.set(slot);
+  }
 }
 
 /**
@@ -438,6 +580,7 @@ void InternalLightManager::update() {
   nassertv(_shadow_manager != nullptr); // Not initialized yet!
   nassertv(_cmd_list != nullptr);     // Not initialized yet!
 
+  ++_frame_index;
   update_lights();
   update_shadow_sources();
 }
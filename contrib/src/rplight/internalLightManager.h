@@ -28,11 +28,13 @@
 #define INTERNALLIGHTMANAGER_H
 
 #include "referenceCount.h"
+#include "geometricBoundingVolume.h"
 #include "rpLight.h"
 #include "shadowSource.h"
 #include "shadowAtlas.h"
 #include "shadowManager.h"
 #include "pointerSlotStorage.h"
+#include "slotBitSet.h"
 #include "gpuCommandList.h"
 
 #define MAX_LIGHT_COUNT 65535
@@ -56,6 +58,7 @@ PUBLISHED:
 
   void update();
   inline void set_camera_pos(const LPoint3 &pos);
+  inline void set_camera_frustum(const GeometricBoundingVolume *frustum);
   inline void set_shadow_update_distance(PN_stdfloat dist);
 
   inline int get_max_light_index() const;
@@ -81,7 +84,10 @@ protected:
   void gpu_remove_consecutive_sources(ShadowSource *first_source, size_t num_sources);
 
   void setup_shadows(RPLight* light);
-  bool compare_shadow_sources(const ShadowSource* a, const ShadowSource* b) const;
+  PN_stdfloat get_update_priority(const ShadowSource* source) const;
+  bool is_in_update_range(const ShadowSource* source) const;
+  bool is_in_camera_frustum(const ShadowSource* source) const;
+  void free_source_region(ShadowSource* source);
 
   void update_lights();
   void update_shadow_sources();
@@ -92,7 +98,17 @@ protected:
   PointerSlotStorage<RPLight*, MAX_LIGHT_COUNT> _lights;
   PointerSlotStorage<ShadowSource*, MAX_SHADOW_SOURCES> _shadow_sources;
 
+  // Slots of the lights and sources which changed since the last update.
+  // Sources which still need an update, but could not get one, stay in here.
+  SlotBitSet _dirty_lights;
+  SlotBitSet _dirty_sources;
+
+  // Slots of the sources which currently own a region in the shadow atlas
+  SlotBitSet _sources_with_region;
+
   LPoint3 _camera_pos;
+  CPT(GeometricBoundingVolume) _camera_frustum;
+  unsigned int _frame_index;
   float _shadow_update_distance;
 
 };
@@ -98,6 +98,19 @@ public:
     return _num_entries;
   }
 
+  /**
+   * @brief Returns the pointer stored in a slot
+   * @details This returns the pointer stored in the given slot, or a nullptr
+   *   if the slot is free.
+   *
+   * @param slot Slot to look up
+   * @return Pointer stored in the slot
+   */
+  T get(size_t slot) const {
+    nassertr(slot < SIZE, nullptr);
+    return _data[slot];
+  }
+
   /**
    * @brief Finds a free slot
    * @details This finds the first slot which is a nullptr and returns it.
@@ -40,6 +40,7 @@ RPLight::RPLight(LightType light_type) {
   _needs_update = false;
   _casts_shadows = false;
   _slot = -1;
+  _dirty_slots = nullptr;
   _position.fill(0);
   _color.fill(1);
   _ies_profile = -1;
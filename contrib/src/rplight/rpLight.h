@@ -31,6 +31,7 @@
 #include "luse.h"
 #include "gpuCommand.h"
 #include "shadowSource.h"
+#include "slotBitSet.h"
 
 /**
  * @brief Base class for Lights
@@ -67,7 +68,7 @@ public:
   inline bool has_slot() const;
   inline int get_slot() const;
   inline void remove_slot();
-  inline void assign_slot(int slot);
+  inline void assign_slot(int slot, SlotBitSet *dirty_slots);
 
 PUBLISHED:
   inline void invalidate_shadows();
@@ -112,6 +113,7 @@ PUBLISHED:
 
 protected:
   int _slot;
+  SlotBitSet *_dirty_slots;
   int _ies_profile;
   size_t _source_resolution;
   bool _needs_update;
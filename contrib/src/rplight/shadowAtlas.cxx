@@ -26,7 +26,7 @@
 
 
 #include "shadowAtlas.h"
-#include <string.h>
+#include <algorithm>
 
 NotifyCategoryDef(shadowatlas, "");
 
@@ -55,6 +55,7 @@ ShadowAtlas::ShadowAtlas(size_t size, size_t tile_size) {
   _size = size;
   _tile_size = tile_size;
   _num_used_tiles = 0;
+  _nodes = nullptr;
   init_tiles();
 }
 
@@ -63,44 +64,97 @@ ShadowAtlas::ShadowAtlas(size_t size, size_t tile_size) {
  * @details This destructs the shadow atlas, freeing all used resources.
  */
 ShadowAtlas::~ShadowAtlas() {
-  delete [] _flags;
+  delete [] _nodes;
 }
 
 /**
  * @brief Internal method to init the storage.
- * @details This method setups the storage used for storing the tile flags.
+ * @details This method setups the quadtree used for storing which parts of the
+ *   atlas are free. Level n of the tree has 4^n nodes, and the leaves are the
+ *   tiles. When the amount of tiles is not a power of two, the tree gets
+ *   rounded up, and all tiles outside of the atlas are marked as full.
  */
 void ShadowAtlas::init_tiles() {
   _num_tiles = _size / _tile_size;
-  _flags = new bool[_num_tiles * _num_tiles];
-  memset(_flags, 0x0, sizeof(bool) * _num_tiles * _num_tiles);
+  _num_levels = 0;
+  while (((size_t)1 << _num_levels) < _num_tiles) {
+    ++_num_levels;
+  }
+
+  size_t num_nodes = 0;
+  for (size_t depth = 0; depth <= _num_levels; ++depth) {
+    _level_offsets[depth] = num_nodes;
+    num_nodes += (size_t)1 << (2 * depth);
+  }
+  _nodes = new int8_t[num_nodes];
+
+  // Leaves are free when they are inside of the atlas
+  size_t leaves_per_row = (size_t)1 << _num_levels;
+  for (size_t y = 0; y < leaves_per_row; ++y) {
+    for (size_t x = 0; x < leaves_per_row; ++x) {
+      bool inside = x < _num_tiles && y < _num_tiles;
+      _nodes[get_node_index(_num_levels, x, y)] = inside ? 0 : NS_full;
+    }
+  }
+
+  // Then fill in the parents, level by level
+  for (size_t depth = _num_levels; depth-- > 0;) {
+    int child_order = _num_levels - depth - 1;
+    size_t nodes_per_row = (size_t)1 << depth;
+    for (size_t y = 0; y < nodes_per_row; ++y) {
+      for (size_t x = 0; x < nodes_per_row; ++x) {
+        int8_t c0 = _nodes[get_node_index(depth + 1, 2 * x, 2 * y)];
+        int8_t c1 = _nodes[get_node_index(depth + 1, 2 * x + 1, 2 * y)];
+        int8_t c2 = _nodes[get_node_index(depth + 1, 2 * x, 2 * y + 1)];
+        int8_t c3 = _nodes[get_node_index(depth + 1, 2 * x + 1, 2 * y + 1)];
+        int8_t value;
+        if (c0 == child_order && c1 == child_order && c2 == child_order && c3 == child_order) {
+          value = child_order + 1;
+        } else {
+          value = std::max(std::max(c0, c1), std::max(c2, c3));
+        }
+        _nodes[get_node_index(depth, x, y)] = value;
+      }
+    }
+  }
 }
 
 /**
- * @brief Internal method to reserve a region in the atlas.
- * @details This reserves a given region in the shadow atlas. The region should
- *   be in tile space.This is called by the ShadowAtlas::find_and_reserve_region.
- *   It sets all flags in that region to true, indicating that those are used.
- *   When an invalid region is passed, an assertion is triggered. If assertions
- *   are optimized out, undefined behaviour occurs.
- *
- * @param x x- start positition of the region
- * @param y y- start position of the region
- * @param w width of the region
- * @param h height of the region
+ * @brief Internal method to update the tree after a node changed.
+ * @details This recomputes the biggest free block of all parents of the given
+ *   node, up to the root. A parent whose four children are completely free is
+ *   completely free as well, otherwise it can store the biggest block of any
+ *   of its children.
+ *
+ * @param depth Depth of the node which changed
+ * @param x x- position of the node on its level
+ * @param y y- position of the node on its level
  */
-void ShadowAtlas::reserve_region(size_t x, size_t y, size_t w, size_t h) {
-  // Check if we are out of bounds, this should be disabled for performance
-  // reasons at some point.
-  nassertv(x >= 0 && y >= 0 && x + w <= _num_tiles && y + h <= _num_tiles);
+void ShadowAtlas::update_parents(size_t depth, size_t x, size_t y) {
+  while (depth > 0) {
+    --depth;
+    x >>= 1;
+    y >>= 1;
 
-  _num_used_tiles += w * h;
+    int child_order = _num_levels - depth - 1;
+    int8_t c0 = _nodes[get_node_index(depth + 1, 2 * x, 2 * y)];
+    int8_t c1 = _nodes[get_node_index(depth + 1, 2 * x + 1, 2 * y)];
+    int8_t c2 = _nodes[get_node_index(depth + 1, 2 * x, 2 * y + 1)];
+    int8_t c3 = _nodes[get_node_index(depth + 1, 2 * x + 1, 2 * y + 1)];
+    int8_t value;
+    if (c0 == child_order && c1 == child_order && c2 == child_order && c3 == child_order) {
+      value = child_order + 1;
+    } else {
+      value = std::max(std::max(c0, c1), std::max(c2, c3));
+      value = std::max(value, (int8_t)NS_full);
+    }
 
-  // Iterate over every tile in the region and mark it as used
-  for (size_t cx = 0; cx < w; ++cx) {
-    for (size_t cy = 0; cy < h; ++cy) {
-      set_tile(cx + x, cy + y, true);
+    int8_t &node = _nodes[get_node_index(depth, x, y)];
+    if (node == value) {
+      // Nothing changes further up
+      break;
     }
+    node = value;
   }
 }
 
@@ -110,6 +164,10 @@ void ShadowAtlas::reserve_region(size_t x, size_t y, size_t w, size_t h) {
  *   size in the atlas. tile_width and tile_height should be already in tile
  *   space. They can be converted using ShadowAtlas::get_required_tiles.
  *
+ *   The region is placed in a power-of-two sized block of the atlas, big
+ *   enough to contain the region. Regions which are not power-of-two sized
+ *   waste the rest of their block.
+ *
  *   If no region is found, or an invalid size is passed, an integer vector with
  *   all components set to -1 is returned.
  *
@@ -141,22 +199,44 @@ LVecBase4i ShadowAtlas::find_and_reserve_region(size_t tile_width, size_t tile_h
     return LVecBase4i(-1);
   }
 
-  // Iterate over every possible region and check if its still free
-  for (size_t x = 0; x <= _num_tiles - tile_width; ++x) {
-    for (size_t y = 0; y <= _num_tiles - tile_height; ++y) {
-      if (region_is_free(x, y, tile_width, tile_height)) {
-        // Found free region, now reserve it
-        reserve_region(x, y, tile_width, tile_height);
-        return LVecBase4i(x, y, tile_width, tile_height);
+  int order = get_block_order(tile_width, tile_height);
+  if (_nodes[0] < order) {
+    // The atlas seems to be full.
+    shadowatlas_cat.error() << "Failed to find a free region of size " << tile_width
+                << " x " << tile_height << "!"  << std::endl;
+    return LVecBase4i(-1);
+  }
+
+  // Walk down the tree until we reach a node of the block size. Of all
+  // children which fit, take the one with the smallest free block, to keep
+  // the big blocks intact for big regions.
+  size_t depth = 0;
+  size_t x = 0, y = 0;
+  while ((int)(_num_levels - depth) > order) {
+    size_t best_x = 0, best_y = 0;
+    int8_t best_value = INT8_MAX;
+    for (size_t i = 0; i < 4; ++i) {
+      size_t cx = 2 * x + (i & 1);
+      size_t cy = 2 * y + (i >> 1);
+      int8_t value = _nodes[get_node_index(depth + 1, cx, cy)];
+      if (value >= order && value < best_value) {
+        best_value = value;
+        best_x = cx;
+        best_y = cy;
       }
     }
+    nassertr(best_value != INT8_MAX, LVecBase4i(-1)); // Tree is inconsistent
+    x = best_x;
+    y = best_y;
+    ++depth;
   }
 
-  // When we reached this part, we couldn't find a free region, so the atlas
-  // seems to be full.
-  shadowatlas_cat.error() << "Failed to find a free region of size " << tile_width
-              << " x " << tile_height << "!"  << std::endl;
-  return LVecBase4i(-1);
+  _nodes[get_node_index(depth, x, y)] = NS_reserved;
+  update_parents(depth, x, y);
+
+  size_t block_size = (size_t)1 << order;
+  _num_used_tiles += block_size * block_size;
+  return LVecBase4i(x * block_size, y * block_size, tile_width, tile_height);
 }
 
 /**
@@ -173,14 +253,23 @@ LVecBase4i ShadowAtlas::find_and_reserve_region(size_t tile_width, size_t tile_h
 void ShadowAtlas::free_region(const LVecBase4i& region) {
   // Out of bounds check, can't hurt
   nassertv(region.get_x() >= 0 && region.get_y() >= 0);
+  nassertv(region.get_z() >= 1 && region.get_w() >= 1);
   nassertv(region.get_x() + region.get_z() <= (int)_num_tiles && region.get_y() + region.get_w() <= (int)_num_tiles);
 
-  _num_used_tiles -= region.get_z() * region.get_w();
+  int order = get_block_order(region.get_z(), region.get_w());
+  size_t block_size = (size_t)1 << order;
+  nassertv(region.get_x() % block_size == 0 && region.get_y() % block_size == 0);
 
-  for (int x = 0; x < region.get_z(); ++x) {
-    for (int y = 0; y < region.get_w(); ++y) {
-      // Could do an assert here, that the tile should have been used (=true) before
-      set_tile(region.get_x() + x, region.get_y() + y, false);
-    }
-  }
+  size_t depth = _num_levels - order;
+  size_t x = region.get_x() >> order;
+  size_t y = region.get_y() >> order;
+  int8_t &node = _nodes[get_node_index(depth, x, y)];
+  nassertv(node == NS_reserved); // Region was not reserved
+
+  // The children were left untouched while the block was reserved, so they
+  // are still completely free.
+  node = order;
+  update_parents(depth, x, y);
+
+  _num_used_tiles -= block_size * block_size;
 }
@@ -30,6 +30,9 @@
 #include "pandabase.h"
 #include "luse.h"
 
+#include <algorithm>
+#include <stdint.h>
+
 NotifyCategoryDecl(shadowatlas, EXPORT_CLASS, EXPORT_TEMPL);
 
 
@@ -37,6 +40,11 @@ NotifyCategoryDecl(shadowatlas, EXPORT_CLASS, EXPORT_TEMPL);
  * @brief Class which manages distributing shadow maps in an atlas.
  * @details This class manages the shadow atlas. It handles finding and reserving
  *   space for new shadow maps.
+ *
+ *   The atlas is split up like a quadtree, and regions are handed out as
+ *   power-of-two sized blocks (buddy allocation). Each node of the tree knows
+ *   the biggest free block below it, so finding and freeing a region both
+ *   only have to walk one path of the tree.
  */
 class ShadowAtlas {
 PUBLISHED:
@@ -49,10 +57,9 @@ PUBLISHED:
   MAKE_PROPERTY(num_used_tiles, get_num_used_tiles);
   MAKE_PROPERTY(coverage, get_coverage);
 
-public:
-
   LVecBase4i find_and_reserve_region(size_t tile_width, size_t tile_height);
   void free_region(const LVecBase4i& region);
+  inline bool has_free_region(size_t tile_width, size_t tile_height) const;
   inline LVecBase4 region_to_uv(const LVecBase4i& region);
 
   inline int get_tile_size() const;
@@ -60,19 +67,28 @@ public:
 
 protected:
 
-  void init_tiles();
+  // Node values, apart from the order of the biggest free block
+  enum NodeState {
+    NS_full = -1,
+    NS_reserved = -2,
+  };
 
-  inline void set_tile(size_t x, size_t y, bool flag);
-  inline bool get_tile(size_t x, size_t y) const;
+  void init_tiles();
+  void update_parents(size_t depth, size_t x, size_t y);
 
-  inline bool region_is_free(size_t x, size_t y, size_t w, size_t h) const;
-  void reserve_region(size_t x, size_t y, size_t w, size_t h);
+  inline size_t get_node_index(size_t depth, size_t x, size_t y) const;
+  inline int get_block_order(size_t tile_width, size_t tile_height) const;
 
   size_t _size;
   size_t _num_tiles;
   size_t _tile_size;
   size_t _num_used_tiles;
-  bool* _flags;
+
+  // The tree covers 2^_num_levels tiles in each direction, tiles past
+  // _num_tiles are marked as full.
+  size_t _num_levels;
+  size_t _level_offsets[32];
+  int8_t* _nodes;
 };
 
 #include "shadowAtlas.I"
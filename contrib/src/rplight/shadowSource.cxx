@@ -33,9 +33,12 @@
  */
 ShadowSource::ShadowSource() {
   _slot = -1;
+  _dirty_slots = nullptr;
   _needs_update = true;
   _resolution = 512;
   _mvp.fill(0.0);
   _region.fill(-1);
   _region_uv.fill(0);
+  _last_visible_frame = 0;
+  _last_update_frame = 0;
 }
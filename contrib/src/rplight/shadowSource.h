@@ -40,6 +40,7 @@
 #include "geometricBoundingVolume.h"
 
 #include "gpuCommand.h"
+#include "slotBitSet.h"
 
 /**
  * @brief This class represents a single shadow source.
@@ -55,13 +56,15 @@ public:
   inline void write_to_command(GPUCommand &cmd) const;
 
   inline void set_needs_update(bool flag);
-  inline void set_slot(int slot);
+  inline void set_slot(int slot, SlotBitSet *dirty_slots);
   inline void set_region(const LVecBase4i& region, const LVecBase4& region_uv);
   inline void set_resolution(size_t resolution);
   inline void set_perspective_lens(PN_stdfloat fov, PN_stdfloat near_plane,
                                    PN_stdfloat far_plane, LVecBase3 pos,
                                    LVecBase3 direction);
   inline void set_matrix_lens(const LMatrix4& mvp);
+  inline void set_last_visible_frame(unsigned int frame);
+  inline void set_last_update_frame(unsigned int frame);
 
   inline bool has_region() const;
   inline bool has_slot() const;
@@ -74,16 +77,21 @@ public:
   inline const LMatrix4& get_mvp() const;
   inline const LVecBase4i& get_region() const;
   inline const LVecBase4& get_uv_region() const;
+  inline unsigned int get_last_visible_frame() const;
+  inline unsigned int get_last_update_frame() const;
 
   inline const BoundingSphere& get_bounds() const;
 
 private:
   int _slot;
+  SlotBitSet *_dirty_slots;
   bool _needs_update;
   size_t _resolution;
   LMatrix4 _mvp;
   LVecBase4i _region;
   LVecBase4 _region_uv;
+  unsigned int _last_visible_frame;
+  unsigned int _last_update_frame;
 
   BoundingSphere _bounds;
 };
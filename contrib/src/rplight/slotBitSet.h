@@ -0,0 +1,182 @@
+/**
+ *
+ * RenderPipeline
+ *
+ * Copyright (c) 2014-2016 tobspr <tobias.springer1@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef SLOTBITSET_H
+#define SLOTBITSET_H
+
+
+#ifdef CPPPARSER
+
+// Dummy implementation for interrogate
+class SlotBitSet {};
+
+#else // CPPPARSER
+
+
+#include "pandabase.h"
+#include "pbitops.h"
+
+#include <atomic>
+#include <memory>
+
+/**
+ * @brief Class to keep track of a set of slots.
+ * @details This class stores one bit per slot, plus one summary bit per 64
+ *   slots, so the set slots can be visited in ascending order without looking
+ *   at the empty parts of the set. Setting a slot is lock-free and may happen
+ *   from any thread, e.g. when a light gets modified, while the owner
+ *   collects the slots once per frame.
+ */
+class SlotBitSet {
+public:
+  /**
+   * @brief Constructs a new SlotBitSet
+   * @details This constructs a new SlotBitSet which can store the slots from
+   *   0 up to num_slots - 1. Initially no slot is set.
+   *
+   * @param num_slots Number of slots
+   */
+  SlotBitSet(size_t num_slots) {
+    _num_slots = num_slots;
+    _num_words = (num_slots + 63) / 64;
+    _num_summary_words = (_num_words + 63) / 64;
+    _words.reset(new std::atomic<uint64_t>[_num_words]);
+    _summary.reset(new std::atomic<uint64_t>[_num_summary_words]);
+    for (size_t i = 0; i < _num_words; ++i) {
+      _words[i].store(0, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < _num_summary_words; ++i) {
+      _summary[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @brief Sets a slot
+   * @details This adds the slot to the set. Setting a slot which is already
+   *   set does nothing. This method is lock-free.
+   *
+   * @param slot Slot to set
+   */
+  void set(size_t slot) {
+    nassertv(slot < _num_slots);
+    size_t word = slot >> 6;
+    uint64_t bit = (uint64_t)1 << (slot & 63);
+    if ((_words[word].fetch_or(bit, std::memory_order_acq_rel) & bit) == 0) {
+      _summary[word >> 6].fetch_or((uint64_t)1 << (word & 63), std::memory_order_release);
+    }
+  }
+
+  /**
+   * @brief Clears a slot
+   * @details This removes the slot from the set. The summary bit is left as
+   *   it is, and gets cleaned up when the set is visited the next time.
+   *
+   * @param slot Slot to clear
+   */
+  void clear(size_t slot) {
+    nassertv(slot < _num_slots);
+    _words[slot >> 6].fetch_and(~((uint64_t)1 << (slot & 63)), std::memory_order_acq_rel);
+  }
+
+  /**
+   * @brief Returns whether a slot is set
+   * @param slot Slot to check
+   * @return true if the slot is set, false otherwise
+   */
+  bool test(size_t slot) const {
+    nassertr(slot < _num_slots, false);
+    return (_words[slot >> 6].load(std::memory_order_acquire) >> (slot & 63)) & 1;
+  }
+
+  /**
+   * @brief Visits all set slots
+   * @details This calls func(slot) for every set slot, in ascending order.
+   *   The set is not modified, apart from dropping stale summary bits.
+   *   The callback may clear the slot it gets passed.
+   *
+   * @param func Callback to call for each slot
+   */
+  template <typename Func>
+  void for_each(Func func) {
+    for (size_t s = 0; s < _num_summary_words; ++s) {
+      uint64_t summary = _summary[s].load(std::memory_order_acquire);
+      while (summary != 0) {
+        int summary_bit = get_lowest_on_bit(summary);
+        summary &= summary - 1;
+        size_t word = (s << 6) + summary_bit;
+        uint64_t bits = _words[word].load(std::memory_order_acquire);
+        if (bits == 0) {
+          // Every slot of this word got cleared, drop the summary bit. Set
+          // it again if a slot was set in the meantime.
+          _summary[s].fetch_and(~((uint64_t)1 << summary_bit), std::memory_order_acq_rel);
+          if (_words[word].load(std::memory_order_acquire) != 0) {
+            _summary[s].fetch_or((uint64_t)1 << summary_bit, std::memory_order_release);
+          }
+          continue;
+        }
+        while (bits != 0) {
+          func((word << 6) + get_lowest_on_bit(bits));
+          bits &= bits - 1;
+        }
+      }
+    }
+  }
+
+  /**
+   * @brief Removes all set slots
+   * @details This behaves like SlotBitSet::for_each, but clears every slot
+   *   before passing it to func. Slots which get set while this method runs
+   *   are either passed to func, or stay set for the next call.
+   *
+   * @param func Callback to call for each slot
+   */
+  template <typename Func>
+  void pop_all(Func func) {
+    for (size_t s = 0; s < _num_summary_words; ++s) {
+      uint64_t summary = _summary[s].exchange(0, std::memory_order_acq_rel);
+      while (summary != 0) {
+        size_t word = (s << 6) + get_lowest_on_bit(summary);
+        summary &= summary - 1;
+        uint64_t bits = _words[word].exchange(0, std::memory_order_acq_rel);
+        while (bits != 0) {
+          func((word << 6) + get_lowest_on_bit(bits));
+          bits &= bits - 1;
+        }
+      }
+    }
+  }
+
+private:
+  size_t _num_slots;
+  size_t _num_words;
+  size_t _num_summary_words;
+  std::unique_ptr<std::atomic<uint64_t>[]> _words;
+  std::unique_ptr<std::atomic<uint64_t>[]> _summary;
+};
+
+#endif // CPPPARSER
+
+#endif // SLOTBITSET_H
@@ -14,6 +14,7 @@
 #include "dcField.h"
 #include "dcFile.h"
 #include "dcPacker.h"
+#include "dcPackerProgram.h"
 #include "dcClass.h"
 #include "hashGenerator.h"
 #include "dcmsgtypes.h"
@@ -34,6 +35,7 @@ DCField() :
   _has_default_value = false;
 
   _bogus_field = false;
+  _program = nullptr;
 
   _has_nested_fields = true;
   _num_nested_fields = 0;
@@ -61,6 +63,7 @@ DCField(const std::string &name, DCClass *dclass) :
   _default_value_stale = true;
 
   _bogus_field = false;
+  _program = nullptr;
 
   _has_nested_fields = true;
   _num_nested_fields = 0;
@@ -76,6 +79,7 @@ DCField(const std::string &name, DCClass *dclass) :
  */
 DCField::
 ~DCField() {
+  delete _program;
 }
 
 /**
@@ -248,6 +252,17 @@ set_name(const std::string &name) {
   }
 }
 
+/**
+ * Makes the DCPackerProgram for this field, if it can have one.  This is
+ * called for each field once the DCFile has been read.
+ */
+void DCField::
+make_program() {
+  if (_program == nullptr && !_bogus_field) {
+    _program = DCPackerProgram::make_program(this);
+  }
+}
+
 /**
  * Recomputes the default value of the field by repacking it.
  */
@@ -25,6 +25,7 @@
 #endif
 
 class DCPacker;
+class DCPackerProgram;
 class DCAtomicField;
 class DCMolecularField;
 class DCParameter;
@@ -63,6 +64,7 @@ PUBLISHED:
   INLINE const vector_uchar &get_default_value() const;
 
   INLINE bool is_bogus_field() const;
+  INLINE bool has_program() const;
 
   INLINE bool is_required() const;
   INLINE bool is_broadcast() const;
@@ -100,6 +102,9 @@ public:
   INLINE void set_class(DCClass *dclass);
   INLINE void set_default_value(vector_uchar default_value);
 
+  INLINE const DCPackerProgram *get_program() const;
+  void make_program();
+
 protected:
   void refresh_default_value();
 
@@ -112,6 +117,7 @@ protected:
 
 private:
   vector_uchar _default_value;
+  DCPackerProgram *_program;
 
 #ifdef WITHIN_PANDA
   PStatCollector _field_update_pcollector;
@@ -172,7 +172,18 @@ read(std::istream &in, const string &filename) {
   dcyyparse();
   dc_cleanup_parser();
 
-  return (dc_error_count() == 0);
+  if (dc_error_count() != 0) {
+    return false;
+  }
+
+  // Now that the fields are complete, flatten the ones we can into
+  // DCPackerPrograms.
+  FieldsByIndex::iterator fi;
+  for (fi = _fields_by_index.begin(); fi != _fields_by_index.end(); ++fi) {
+    (*fi)->make_program();
+  }
+
+  return true;
 }
 
 /**
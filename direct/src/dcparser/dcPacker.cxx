@@ -43,6 +43,7 @@ DCPacker() {
   _pack_error = false;
   _range_error = false;
   _stack = nullptr;
+  _use_programs = true;
 
   clear();
 }
@@ -56,6 +56,9 @@ PUBLISHED:
   void begin_repack(const DCPackerInterface *root);
   bool end_repack();
 
+  INLINE void set_use_programs(bool use_programs);
+  INLINE bool get_use_programs() const;
+
   bool seek(const std::string &field_name);
   bool seek(int seek_index);
 
@@ -253,6 +256,7 @@ private:
   size_t _pop_marker;
   int _num_nested_fields;
   const DCSwitchParameter *_last_switch;
+  bool _use_programs;
 
   bool _parse_error;
   bool _pack_error;
@@ -0,0 +1,111 @@
+/**
+ * PANDA 3D SOFTWARE
+ * Copyright (c) Carnegie Mellon University.  All rights reserved.
+ *
+ * All use of this software is subject to the terms of the revised BSD
+ * license.  You should have received a copy of this license along
+ * with this source code in a file named "LICENSE."
+ *
+ * @file dcPackerProgram.cxx
+ * @author agent
+ * @date 2026-10-17
+ */
+
+#include "dcPackerProgram.h"
+#include "dcField.h"
+#include "dcAtomicField.h"
+#include "dcMolecularField.h"
+
+/**
+ *
+ */
+DCPackerProgram::
+DCPackerProgram() :
+  _has_fixed_byte_size(false),
+  _fixed_byte_size(0)
+{
+}
+
+/**
+ * Returns a new program for packing and unpacking the indicated field, or
+ * NULL if the field has an argument that is not a simple value, in which case
+ * it must be packed by walking the field with push() and pop() as usual.  The
+ * caller owns the returned program.
+ */
+DCPackerProgram *DCPackerProgram::
+make_program(const DCField *field) {
+  DCPackerProgram *program = new DCPackerProgram;
+  bool okflag = true;
+
+  const DCAtomicField *atomic = field->as_atomic_field();
+  const DCMolecularField *molecular = field->as_molecular_field();
+  if (atomic != nullptr) {
+    int num_elements = atomic->get_num_elements();
+    for (int i = 0; i < num_elements && okflag; ++i) {
+      okflag = program->add_element(atomic->get_element(i));
+    }
+
+  } else if (molecular != nullptr) {
+    // The arguments of a molecular field are those of its atomic fields, one
+    // after the other.
+    int num_atomics = molecular->get_num_atomics();
+    for (int i = 0; i < num_atomics && okflag; ++i) {
+      atomic = molecular->get_atomic(i);
+      int num_elements = atomic->get_num_elements();
+      for (int j = 0; j < num_elements && okflag; ++j) {
+        okflag = program->add_element(atomic->get_element(j));
+      }
+    }
+
+  } else {
+    // A parameter field is packed as a single value, not as a list of
+    // arguments.
+    okflag = false;
+  }
+
+  if (!okflag || (int)program->_ops.size() != field->get_num_nested_fields()) {
+    delete program;
+    return nullptr;
+  }
+
+  program->_has_fixed_byte_size = field->has_fixed_byte_size();
+  program->_fixed_byte_size = field->get_fixed_byte_size();
+  return program;
+}
+
+/**
+ * Adds the operation for packing the indicated argument.  Returns true on
+ * success, or false if the argument is not a simple value.
+ */
+bool DCPackerProgram::
+add_element(const DCParameter *element) {
+  const DCSimpleParameter *simple = element->as_simple_parameter();
+  if (simple == nullptr) {
+    return false;
+  }
+
+  DCPackType pack_type = simple->get_pack_type();
+  switch (pack_type) {
+  case PT_double:
+  case PT_int:
+  case PT_uint:
+  case PT_int64:
+  case PT_uint64:
+  case PT_string:
+  case PT_blob:
+    break;
+
+  default:
+    // The array types, like int16array, have nested fields.
+    return false;
+  }
+
+  Op op;
+  op._param = simple;
+  op._type = simple->get_type();
+  op._pack_type = pack_type;
+  op._raw = (simple->get_divisor() == 1 && !simple->has_modulus() &&
+             !simple->has_range_limits());
+  _ops.push_back(op);
+  return true;
+}
@@ -0,0 +1,92 @@
+/**
+ * PANDA 3D SOFTWARE
+ * Copyright (c) Carnegie Mellon University.  All rights reserved.
+ *
+ * All use of this software is subject to the terms of the revised BSD
+ * license.  You should have received a copy of this license along
+ * with this source code in a file named "LICENSE."
+ *
+ * @file dcPackerProgram.h
+ * @author agent
+ * @date 2026-10-17
+ */
+
+#ifndef DCPACKERPROGRAM_H
+#define DCPACKERPROGRAM_H
+
+#include "dcbase.h"
+#include "dcPackerInterface.h"
+#include "dcSimpleParameter.h"
+#include "dcPackData.h"
+
+class DCField;
+
+/**
+ * A flattened description of how to pack or unpack a field whose arguments
+ * are all simple values: a list of operations, one for each argument, that
+ * can be run in order without walking the DCPackerInterface tree with push()
+ * and pop().  Most fields sent over the wire are like this.
+ *
+ * A program is made for each such field when the DCFile is read.  Fields
+ * with switches, arrays, or class parameters don't get one, and are always
+ * packed by walking the tree.
+ */
+class EXPCL_DIRECT_DCPARSER DCPackerProgram {
+private:
+  DCPackerProgram();
+
+public:
+  // One simple argument of the field.  Arguments that are stored as they are,
+  // without a divisor, modulus or range, are packed and unpacked inline;
+  // the rest are handed to the DCSimpleParameter.
+  class Op {
+  public:
+    INLINE void pack_double(DCPackData &pack_data, double value,
+                            bool &pack_error, bool &range_error) const;
+    INLINE void pack_int(DCPackData &pack_data, int value,
+                         bool &pack_error, bool &range_error) const;
+    INLINE void pack_uint(DCPackData &pack_data, unsigned int value,
+                          bool &pack_error, bool &range_error) const;
+    INLINE void pack_int64(DCPackData &pack_data, int64_t value,
+                           bool &pack_error, bool &range_error) const;
+    INLINE void pack_uint64(DCPackData &pack_data, uint64_t value,
+                            bool &pack_error, bool &range_error) const;
+
+    INLINE void unpack_double(const char *data, size_t length, size_t &p,
+                              double &value, bool &pack_error, bool &range_error) const;
+    INLINE void unpack_int(const char *data, size_t length, size_t &p,
+                           int &value, bool &pack_error, bool &range_error) const;
+    INLINE void unpack_uint(const char *data, size_t length, size_t &p,
+                            unsigned int &value, bool &pack_error, bool &range_error) const;
+    INLINE void unpack_int64(const char *data, size_t length, size_t &p,
+                             int64_t &value, bool &pack_error, bool &range_error) const;
+    INLINE void unpack_uint64(const char *data, size_t length, size_t &p,
+                              uint64_t &value, bool &pack_error, bool &range_error) const;
+
+    const DCSimpleParameter *_param;
+    DCSubatomicType _type;
+    DCPackType _pack_type;
+    bool _raw;
+  };
+
+  static DCPackerProgram *make_program(const DCField *field);
+
+  INLINE int get_num_ops() const;
+  INLINE const Op &get_op(int n) const;
+
+  INLINE bool has_fixed_byte_size() const;
+  INLINE size_t get_fixed_byte_size() const;
+
+private:
+  bool add_element(const DCParameter *element);
+
+  typedef pvector<Op> Ops;
+  Ops _ops;
+
+  bool _has_fixed_byte_size;
+  size_t _fixed_byte_size;
+};
+
+#include "dcPackerProgram.I"
+
+#endif
@@ -31,6 +31,16 @@ pack_object(PyObject *object) {
            _this->_mode == DCPacker::Mode::M_repack);
   DCPackType pack_type = _this->get_pack_type();
 
+  if (pack_type == PT_field && _this->_use_programs &&
+      _this->_mode == DCPacker::Mode::M_pack) {
+    // If the whole field has a program, run that instead of walking it.
+    const DCField *field = _this->_current_field->as_field();
+    if (field != nullptr && field->get_program() != nullptr &&
+        pack_program(field->get_program(), object)) {
+      return;
+    }
+  }
+
   // had to add this for basic 64 and unsigned data to get packed right .. Not
   // sure if we can just do the rest this way..
 
@@ -171,6 +181,15 @@ unpack_object() {
 
   DCPackType pack_type = _this->get_pack_type();
 
+  if (pack_type == PT_field && _this->_use_programs &&
+      _this->_mode == DCPacker::Mode::M_unpack) {
+    // If the whole field has a program, run that instead of walking it.
+    const DCField *field = _this->_current_field->as_field();
+    if (field != nullptr && field->get_program() != nullptr) {
+      return unpack_program(field->get_program());
+    }
+  }
+
   switch (pack_type) {
   case PT_invalid:
     object = Py_None;
@@ -279,6 +298,184 @@ unpack_object() {
   return object;
 }
 
+/**
+ * Packs the tuple or list of arguments for the current field by running the
+ * field's program, giving the same result as pack_object() would by walking
+ * the field.  Returns false without packing anything if the object is not a
+ * sequence of simple values of the right length; pack_object() should then
+ * walk the field as usual, which will report the problem.
+ */
+bool Extension<DCPacker>::
+pack_program(const DCPackerProgram *program, PyObject *object) {
+  if (!PyTuple_Check(object) && !PyList_Check(object)) {
+    return false;
+  }
+
+  int num_ops = program->get_num_ops();
+  if (PySequence_Fast_GET_SIZE(object) != num_ops) {
+    return false;
+  }
+
+  PyObject **items = PySequence_Fast_ITEMS(object);
+  for (int i = 0; i < num_ops; ++i) {
+    PyObject *item = items[i];
+    if (!PyLong_Check(item) && !PyFloat_Check(item) &&
+        !PyUnicode_Check(item) && !PyBytes_Check(item)) {
+      return false;
+    }
+  }
+
+  DCPackData &pack_data = _this->_pack_data;
+  bool &pack_error = _this->_pack_error;
+  bool &range_error = _this->_range_error;
+
+  for (int i = 0; i < num_ops; ++i) {
+    const DCPackerProgram::Op &op = program->get_op(i);
+    PyObject *item = items[i];
+
+    // This makes the same calls, in the same order of preference, as
+    // pack_object() does for a simple value.
+    if (PyLong_Check(item)) {
+      switch (op._pack_type) {
+      case PT_int64:
+        op.pack_int64(pack_data, PyLong_AsLongLong(item), pack_error, range_error);
+        break;
+
+      case PT_uint64:
+        op.pack_uint64(pack_data, PyLong_AsUnsignedLongLong(item), pack_error, range_error);
+        break;
+
+      case PT_uint:
+        op.pack_uint(pack_data, PyLong_AsUnsignedLong(item), pack_error, range_error);
+        break;
+
+      default:
+        op.pack_int(pack_data, PyLong_AsLong(item), pack_error, range_error);
+        break;
+      }
+
+    } else if (PyFloat_Check(item)) {
+      op.pack_double(pack_data, PyFloat_AS_DOUBLE(item), pack_error, range_error);
+
+    } else if (PyUnicode_Check(item)) {
+      Py_ssize_t length;
+      const char *buffer = PyUnicode_AsUTF8AndSize(item, &length);
+      if (buffer) {
+        op._param->pack_string(pack_data, std::string(buffer, length),
+                               pack_error, range_error);
+      } else {
+        pack_error = true;
+      }
+
+    } else {
+      char *buffer;
+      Py_ssize_t length;
+      PyBytes_AsStringAndSize(item, &buffer, &length);
+      op._param->pack_blob(pack_data, vector_uchar((const unsigned char *)buffer,
+                                                   (const unsigned char *)buffer + length),
+                           pack_error, range_error);
+    }
+  }
+
+  _this->advance();
+  return true;
+}
+
+/**
+ * Unpacks the arguments of the current field into a tuple by running the
+ * field's program, giving the same result as unpack_object() would by
+ * walking the field.
+ */
+PyObject *Extension<DCPacker>::
+unpack_program(const DCPackerProgram *program) {
+  const char *data = _this->_unpack_data;
+  size_t length = _this->_unpack_length;
+  size_t &p = _this->_unpack_p;
+  bool &pack_error = _this->_pack_error;
+  bool &range_error = _this->_range_error;
+
+  int num_ops = program->get_num_ops();
+  PyObject *tuple = PyTuple_New(num_ops);
+
+  for (int i = 0; i < num_ops; ++i) {
+    const DCPackerProgram::Op &op = program->get_op(i);
+    PyObject *value;
+
+    switch (op._pack_type) {
+    case PT_double:
+      {
+        double v = 0.0;
+        op.unpack_double(data, length, p, v, pack_error, range_error);
+        value = PyFloat_FromDouble(v);
+      }
+      break;
+
+    case PT_int:
+      {
+        int v = 0;
+        op.unpack_int(data, length, p, v, pack_error, range_error);
+        value = PyLong_FromLong(v);
+      }
+      break;
+
+    case PT_uint:
+      {
+        unsigned int v = 0;
+        op.unpack_uint(data, length, p, v, pack_error, range_error);
+        value = PyLong_FromLong(v);
+      }
+      break;
+
+    case PT_int64:
+      {
+        int64_t v = 0;
+        op.unpack_int64(data, length, p, v, pack_error, range_error);
+        value = PyLong_FromLongLong(v);
+      }
+      break;
+
+    case PT_uint64:
+      {
+        uint64_t v = 0;
+        op.unpack_uint64(data, length, p, v, pack_error, range_error);
+        value = PyLong_FromUnsignedLongLong(v);
+      }
+      break;
+
+    case PT_blob:
+      {
+        std::string str;
+        op._param->unpack_string(data, length, p, str, pack_error, range_error);
+        value = PyBytes_FromStringAndSize(str.data(), str.size());
+      }
+      break;
+
+    case PT_string:
+      {
+        std::string str;
+        op._param->unpack_string(data, length, p, str, pack_error, range_error);
+        value = PyUnicode_FromStringAndSize(str.data(), str.size());
+      }
+      break;
+
+    default:
+      value = nullptr;
+      break;
+    }
+
+    if (value == nullptr) {
+      // Probably a string that isn't valid UTF-8.
+      pack_error = true;
+      value = Py_None;
+      Py_INCREF(value);
+    }
+    PyTuple_SET_ITEM(tuple, i, value);
+  }
+
+  _this->advance();
+  return tuple;
+}
+
 /**
  * Given that the current element is a ClassParameter for a Python class
  * object, try to extract the appropriate values from the class object and
@@ -20,6 +20,7 @@
 
 #include "extension.h"
 #include "dcPacker.h"
+#include "dcPackerProgram.h"
 #include "py_panda.h"
 
 /**
@@ -32,6 +33,9 @@ public:
   void pack_object(PyObject *object);
   PyObject *unpack_object();
 
+  bool pack_program(const DCPackerProgram *program, PyObject *object);
+  PyObject *unpack_program(const DCPackerProgram *program);
+
   void pack_class_object(const DCClass *dclass, PyObject *object);
   PyObject *unpack_class_object(const DCClass *dclass);
   void set_class_element(PyObject *class_def, PyObject *&object,
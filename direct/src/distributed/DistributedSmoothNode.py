@@ -104,6 +104,10 @@ class DistributedSmoothNode(DistributedNode.DistributedNode,
         DistributedNode.DistributedNode.disable(self)
         self.smoother = None
 
+    def setLocation(self, parentId, zoneId, teleport=0):
+        DistributedNode.DistributedNode.setLocation(self, parentId, zoneId, teleport)
+        self.setCnodeLocation()
+
     def delete(self):
         DistributedSmoothNodeBase.DistributedSmoothNodeBase.delete(self)
         DistributedNode.DistributedNode.delete(self)
@@ -278,6 +282,35 @@ class DistributedSmoothNode(DistributedNode.DistributedNode,
         self.setComponentR(r)
         self.setComponentTLive(timestamp)
 
+    def setSmDeltaXY(self, dx, dy, timestamp=None):
+        self._checkResume(timestamp)
+        self.setComponentDX(dx)
+        self.setComponentDY(dy)
+        self.setComponentTLive(timestamp)
+    def setSmDeltaXYH(self, dx, dy, dh, timestamp=None):
+        self._checkResume(timestamp)
+        self.setComponentDX(dx)
+        self.setComponentDY(dy)
+        self.setComponentDH(dh)
+        self.setComponentTLive(timestamp)
+    def setSmDeltaXYZH(self, dx, dy, dz, dh, timestamp=None):
+        self._checkResume(timestamp)
+        self.setComponentDX(dx)
+        self.setComponentDY(dy)
+        self.setComponentDZ(dz)
+        self.setComponentDH(dh)
+        self.setComponentTLive(timestamp)
+    def setSmDeltas(self, deltas, timestamp=None):
+        # The offsets of every node broadcasting together in our location,
+        # including this one.  The server only checks that the sender may
+        # update this node, so a node anywhere else is left alone.
+        location = self.getLocation()
+        for doId, dx, dy, dz, dh in deltas:
+            node = self.cr.doId2do.get(doId)
+            if isinstance(node, DistributedSmoothNode) and \
+               node.getLocation() == location:
+                node.setSmDeltaXYZH(dx, dy, dz, dh, timestamp)
+
     def setSmPosHprL(self, l, x, y, z, h, p, r, timestamp=None):
         self._checkResume(timestamp)
         self.setComponentL(l)
@@ -313,6 +346,20 @@ class DistributedSmoothNode(DistributedNode.DistributedNode,
     def setComponentR(self, r):
         self.smoother.setR(r)
     @report(types = ['args'], dConfigParam = 'smoothnode')
+    def setComponentDX(self, dx):
+        # The offsets are from the last position we were sent, rounded to
+        # the tenth it was sent as, so that they don't drift.
+        self.smoother.setX(round(self.smoother.getSamplePos()[0] + dx, 1))
+    @report(types = ['args'], dConfigParam = 'smoothnode')
+    def setComponentDY(self, dy):
+        self.smoother.setY(round(self.smoother.getSamplePos()[1] + dy, 1))
+    @report(types = ['args'], dConfigParam = 'smoothnode')
+    def setComponentDZ(self, dz):
+        self.smoother.setZ(round(self.smoother.getSamplePos()[2] + dz, 1))
+    @report(types = ['args'], dConfigParam = 'smoothnode')
+    def setComponentDH(self, dh):
+        self.smoother.setH(round(self.smoother.getSampleHpr()[0] + dh, 1) % 360)
+    @report(types = ['args'], dConfigParam = 'smoothnode')
     def setComponentL(self, l):
         if (l != self.zoneId):
             # only perform set location if location is different
@@ -342,6 +389,12 @@ class DistributedSmoothNode(DistributedNode.DistributedNode,
         # path
         self.forceToTruePosition()
 
+    @report(types = ['args'], dConfigParam = 'smoothnode')
+    def setComponentDT(self, timestamp):
+        # The timestamp of a setSmDelta* or setSmDeltas message, which is
+        # never kept by the server, so it is always live.
+        self.setComponentTLive(timestamp)
+
     @report(types = ['args'], dConfigParam = 'smoothnode')
     def setComponentTLive(self, timestamp):
         # This is the variant of setComponentT() that will be called
@@ -17,6 +17,10 @@ class DistributedSmoothNodeAI(DistributedNodeAI.DistributedNodeAI,
         DistributedSmoothNodeBase.DistributedSmoothNodeBase.disable(self)
         DistributedNodeAI.DistributedNodeAI.disable(self)
 
+    def setLocation(self, parentId, zoneId, teleport=0):
+        DistributedNodeAI.DistributedNodeAI.setLocation(self, parentId, zoneId, teleport)
+        self.setCnodeLocation()
+
     def delete(self):
         DistributedSmoothNodeBase.DistributedSmoothNodeBase.delete(self)
         DistributedNodeAI.DistributedNodeAI.delete(self)
@@ -63,6 +67,30 @@ class DistributedSmoothNodeAI(DistributedNodeAI.DistributedNodeAI,
     def setSmPosHprL(self, l, x, y, z, h, p, r, t=None):
         self.setPosHpr(x, y, z, h, p, r)
 
+    # The offsets are from where the node was last put, and anything left
+    # out is unchanged.
+    def setSmDeltaXY(self, dx, dy, t=None):
+        self.setComponentDX(dx)
+        self.setComponentDY(dy)
+
+    def setSmDeltaXYH(self, dx, dy, dh, t=None):
+        self.setComponentDX(dx)
+        self.setComponentDY(dy)
+        self.setComponentDH(dh)
+
+    def setSmDeltaXYZH(self, dx, dy, dz, dh, t=None):
+        self.setComponentDX(dx)
+        self.setComponentDY(dy)
+        self.setComponentDZ(dz)
+        self.setComponentDH(dh)
+
+    def setSmDeltas(self, deltas, t=None):
+        # The server only checks that the sender may update this node, so
+        # the offsets for any other node are ignored.
+        for doId, dx, dy, dz, dh in deltas:
+            if doId == self.doId:
+                self.setSmDeltaXYZH(dx, dy, dz, dh)
+
     def clearSmoothing(self, bogus = None):
         pass
 
@@ -84,6 +112,18 @@ class DistributedSmoothNodeAI(DistributedNodeAI.DistributedNodeAI,
         pass
     def setComponentT(self, t):
         pass
+    # Rounded to the tenth the position was sent as, so that the offsets
+    # don't drift.
+    def setComponentDX(self, dx):
+        self.setX(round(self.getX() + dx, 1))
+    def setComponentDY(self, dy):
+        self.setY(round(self.getY() + dy, 1))
+    def setComponentDZ(self, dz):
+        self.setZ(round(self.getZ() + dz, 1))
+    def setComponentDH(self, dh):
+        self.setH(round(self.getH() + dh, 1) % 360)
+    def setComponentDT(self, t):
+        pass
 
     def getComponentX(self):
         return self.getX()
@@ -14,16 +14,24 @@ DummyTask = DummyTaskClass()
 class DistributedSmoothNodeBase:
     """common base class for DistributedSmoothNode and DistributedSmoothNodeAI
     """
-    BroadcastTypes = Enum('FULL, XYH, XY')
+    BroadcastTypes = Enum('FULL, XYH, XY, DELTA')
+
+    # The nodes broadcasting with BroadcastTypes.DELTA, by broadcast period.
+    # Each period has one task that broadcasts all of its nodes together, so
+    # that the offsets of all of the nodes in one location go out as a single
+    # setSmDeltas message.
+    __deltaNodes = {}
 
     def __init__(self):
         self.__broadcastPeriod = None
+        self.__deltaPeriod = None
         self.cnode = None
 
     def generate(self):
         self.cnode = CDistributedSmoothNodeBase()
         self.cnode.setClockDelta(globalClockDelta)
         self.d_broadcastPosHpr = None
+        self.setCnodeLocation()
 
     def disable(self):
         self.cnode = None
@@ -39,6 +47,15 @@ class DistributedSmoothNodeBase:
     def d_clearSmoothing(self):
         self.sendUpdate("clearSmoothing", [0])
 
+    def setCnodeLocation(self):
+        # The cnode batches our offsets with those of the other nodes in our
+        # location, and only applies the offsets it receives for the nodes in
+        # the same location as the node they are sent on.
+        if self.cnode is None:
+            return
+        parentId, zoneId = self.getLocation() or (0, 0)
+        self.cnode.setLocation(parentId or 0, zoneId or 0)
+
     ### posHprBroadcast ###
 
     def getPosHprBroadcastTaskName(self):
@@ -55,6 +72,7 @@ class DistributedSmoothNodeBase:
 
     def stopPosHprBroadcast(self):
         taskMgr.remove(self.getPosHprBroadcastTaskName())
+        self.__removeDeltaNode()
         # Delete this callback because it maintains a reference to self
         self.d_broadcastPosHpr = None
 
@@ -78,6 +96,7 @@ class DistributedSmoothNodeBase:
             BT.FULL: self.cnode.broadcastPosHprFull,
             BT.XYH:  self.cnode.broadcastPosHprXyh,
             BT.XY:  self.cnode.broadcastPosHprXy,
+            BT.DELTA: self.__broadcastPosHprDelta,
             }
         # this comment is here so it will show up in a grep for 'def d_broadcastPosHpr'
         self.d_broadcastPosHpr = broadcastFuncs[self.broadcastType]
@@ -97,13 +116,18 @@ class DistributedSmoothNodeBase:
 
         # remove any old tasks
         taskMgr.remove(taskName)
+        self.__removeDeltaNode()
         # spawn the new task
         delay = 0.
         if stagger:
             delay = randFloat(period)
         if self.wantSmoothPosBroadcastTask():
-            taskMgr.doMethodLater(self.__broadcastPeriod + delay,
-                                  self._posHprBroadcast, taskName)
+            if self.broadcastType == BT.DELTA:
+                # These are not staggered, so that they can go out together.
+                self.__addDeltaNode()
+            else:
+                taskMgr.doMethodLater(self.__broadcastPeriod + delay,
+                                      self._posHprBroadcast, taskName)
 
     def _posHprBroadcast(self, task=DummyTask):
         # TODO: we explicitly stagger the initial task timing in
@@ -113,6 +137,42 @@ class DistributedSmoothNodeBase:
         task.setDelay(self.__broadcastPeriod)
         return Task.again
 
+    def __broadcastPosHprDelta(self):
+        # Broadcasting by itself, so send the offsets right away.
+        self.cnode.broadcastPosHprDelta()
+        CDistributedSmoothNodeBase.flushDeltas()
+
+    def __addDeltaNode(self):
+        period = self.__broadcastPeriod
+        nodes = DistributedSmoothNodeBase.__deltaNodes.setdefault(period, {})
+        if not nodes:
+            taskMgr.doMethodLater(period, DistributedSmoothNodeBase.__broadcastDeltas,
+                                  'sendPosHprDeltas-%s' % period,
+                                  extraArgs = [period], appendTask = True)
+        nodes[self.doId] = self
+        self.__deltaPeriod = period
+
+    def __removeDeltaNode(self):
+        period = self.__deltaPeriod
+        if period is None:
+            return
+        self.__deltaPeriod = None
+        nodes = DistributedSmoothNodeBase.__deltaNodes.get(period)
+        if nodes is not None and nodes.get(self.doId) is self:
+            del nodes[self.doId]
+            if not nodes:
+                del DistributedSmoothNodeBase.__deltaNodes[period]
+                taskMgr.remove('sendPosHprDeltas-%s' % period)
+
+    @staticmethod
+    def __broadcastDeltas(period, task):
+        # The cnodes sort the offsets out by location.
+        nodes = DistributedSmoothNodeBase.__deltaNodes.get(period, {})
+        for node in nodes.values():
+            node.cnode.broadcastPosHprDelta()
+        CDistributedSmoothNodeBase.flushDeltas()
+        return Task.again
+
     def sendCurrentPosition(self):
         # if we're not currently broadcasting, make sure things are set up
         if self.d_broadcastPosHpr is None:
@@ -36,6 +36,9 @@ const string CConnectionRepository::_overflow_event_name = "CRDatagramOverflow";
 
 #ifndef CPPPARSER
 PStatCollector CConnectionRepository::_update_pcollector("App:Show code:readerPollTask:Update");
+PStatCollector CConnectionRepository::_native_update_pcollector("App:Show code:readerPollTask:Native update");
+PStatCollector CConnectionRepository::_send_batch_datagrams_pcollector("Net:Send batch:Datagrams");
+PStatCollector CConnectionRepository::_send_batch_calls_pcollector("Net:Send batch:Calls");
 #endif  // CPPPARSER
 
 /**
@@ -304,9 +307,13 @@ check_datagram() {
     }
 
     switch (_msg_type) {
-#ifdef HAVE_PYTHON
     case CLIENT_OBJECT_SET_FIELD:
     case STATESERVER_OBJECT_SET_FIELD:
+      if (!_native_fields.is_empty() && handle_native_update_field()) {
+        // A C++ handler took care of it; Python never sees this update.
+        break;
+      }
+#ifdef HAVE_PYTHON
       if (_handle_c_updates) {
         if (_has_owner_view) {
           if (!handle_update_field_owner()) {
@@ -322,6 +329,8 @@ check_datagram() {
         return true;
       }
       break;
+#else
+      return true;
 #endif  // HAVE_PYTHON
 
     default:
@@ -544,7 +553,7 @@ consider_flush() {
 
 #ifdef HAVE_NET
   if (_net_conn) {
-    return _net_conn->consider_flush();
+    return flush_net_conn(true);
   }
 #endif  // HAVE_NET
 
@@ -575,7 +584,7 @@ flush() {
 
   #ifdef HAVE_NET
   if (_net_conn) {
-    return _net_conn->flush();
+    return flush_net_conn(false);
   }
   #endif  // HAVE_NET
 
@@ -665,6 +674,123 @@ do_check_datagram() {
   return false;
 }
 
+/**
+ * Binds a C++ handler to updates of the indicated field on the indicated
+ * object, or on every object if do_id is 0.  From now on, check_datagram()
+ * hands these updates straight to the handler, without making any Python
+ * objects or calling into Python at all.  A binding for a particular object
+ * takes precedence over one for all objects.
+ *
+ * If notify is true, each update the handler applies is also recorded, for
+ * Python to pick up in bulk with get_num_native_updates().
+ */
+void CConnectionRepository::
+bind_field(DOID_TYPE do_id, const DCField *field,
+           CDistributedFieldHandler *handler, bool notify) {
+  ReMutexHolder holder(_lock);
+  nassertv(field != nullptr && handler != nullptr);
+
+  NativeBinding binding;
+  binding._handler = handler;
+  binding._notify = notify;
+  _native_fields.store(((uint64_t)do_id << 32) | (uint32_t)field->get_number(),
+                       binding);
+}
+
+/**
+ * Removes the handler bound to the indicated field with bind_field(), so
+ * that its updates go back to Python.
+ */
+void CConnectionRepository::
+unbind_field(DOID_TYPE do_id, const DCField *field) {
+  ReMutexHolder holder(_lock);
+  nassertv(field != nullptr);
+
+  _native_fields.remove(((uint64_t)do_id << 32) | (uint32_t)field->get_number());
+}
+
+/**
+ * Removes all of the handlers bound to fields of the indicated object.  This
+ * should be called when the object is disabled.
+ */
+void CConnectionRepository::
+unbind_object(DOID_TYPE do_id) {
+  ReMutexHolder holder(_lock);
+
+  size_t i = 0;
+  while (i < _native_fields.get_num_entries()) {
+    if ((DOID_TYPE)(_native_fields.get_key(i) >> 32) == do_id) {
+      // This moves the last entry into slot i.
+      _native_fields.remove_element(i);
+    } else {
+      ++i;
+    }
+  }
+}
+
+/**
+ * Handles an update message on a field that has a C++ handler bound to it
+ * with bind_field().  Returns true if the update was handled, or false if it
+ * should be handed to Python as usual, in which case the datagram has not
+ * been consumed.
+ */
+bool CConnectionRepository::
+handle_native_update_field() {
+  if (_in_quiet_zone) {
+    // Leave it to Python, which knows which objects may ignore the quiet
+    // zone.
+    return false;
+  }
+
+  DatagramIterator di(_di);
+  DOID_TYPE do_id = di.get_uint32();
+  int field_id = di.get_uint16();
+
+  int index = _native_fields.find(((uint64_t)do_id << 32) | (uint32_t)field_id);
+  if (index == -1) {
+    index = _native_fields.find((uint64_t)field_id);
+    if (index == -1) {
+      return false;
+    }
+  }
+
+  DCField *field = _dc_file.get_field_by_index(field_id);
+  nassertr(field != nullptr, false);
+
+  PStatTimer timer(_native_update_pcollector);
+
+  // Hold a reference, in case the handler unbinds itself.
+  const NativeBinding &binding = _native_fields.get_data(index);
+  PT(CDistributedFieldHandler) handler = binding._handler;
+  bool notify = binding._notify;
+
+  DCPacker packer;
+  const char *data = (const char *)di.get_datagram().get_data();
+  packer.set_unpack_data(data + di.get_current_index(),
+                         di.get_remaining_size(), false);
+  packer.begin_unpack(field);
+  if (!handler->handle_update(do_id, field, packer)) {
+    return false;
+  }
+
+  // The handler has applied the update by now, so it must not go to Python
+  // as well, even if the rest of the field turns out to be bad.
+  if (!packer.end_unpack()) {
+    distributed_cat.warning()
+      << "Error unpacking native update of " << field->get_name()
+      << " on object " << do_id << "\n";
+  }
+
+  if (notify) {
+    NativeUpdate update;
+    update._do_id = do_id;
+    update._field_index = field_id;
+    _native_updates.push_back(update);
+  }
+
+  return true;
+}
+
 /**
  * Directly handles an update message on a field.  Python never touches the
  * datagram; it just gets its distributed method called with the appropriate
@@ -995,3 +1121,33 @@ describe_message(std::ostream &out, const string &prefix,
     }
   }
 }
+
+#ifdef HAVE_NET
+/**
+ * Flushes the datagrams queued on _net_conn, or only considers flushing them
+ * if consider is true, and reports the size of the batch that was sent to
+ * PStats.  Assumes the lock is already held.
+ */
+bool CConnectionRepository::
+flush_net_conn(bool consider) {
+  size_t num_datagrams = _net_conn->get_num_datagrams_sent();
+  size_t num_calls = _net_conn->get_num_send_calls();
+
+  bool result = consider ? _net_conn->consider_flush() : _net_conn->flush();
+
+  num_datagrams = _net_conn->get_num_datagrams_sent() - num_datagrams;
+  num_calls = _net_conn->get_num_send_calls() - num_calls;
+  if (num_datagrams != 0) {
+    _send_batch_datagrams_pcollector.set_level((double)num_datagrams);
+    _send_batch_calls_pcollector.set_level((double)num_calls);
+
+    if (distributed_cat.is_spam()) {
+      distributed_cat.spam()
+        << "Flushed " << num_datagrams << " datagram(s) in "
+        << num_calls << " send call(s)\n";
+    }
+  }
+
+  return result;
+}
+#endif  // HAVE_NET
@@ -25,6 +25,9 @@
 #include "clockObject.h"
 #include "reMutex.h"
 #include "reMutexHolder.h"
+#include "simpleHashMap.h"
+#include "pvector.h"
+#include "cDistributedFieldHandler.h"
 
 #ifdef HAVE_NET
 #include "queuedConnectionManager.h"
@@ -156,14 +159,30 @@ PUBLISHED:
   INLINE void set_time_warning(float time_warning);
   INLINE float get_time_warning() const;
 
+  BLOCKING INLINE int get_num_native_updates() const;
+  BLOCKING INLINE DOID_TYPE get_native_update_do_id(int n) const;
+  BLOCKING INLINE int get_native_update_field_index(int n) const;
+  BLOCKING INLINE void clear_native_updates();
+
+public:
+  void bind_field(DOID_TYPE do_id, const DCField *field,
+                  CDistributedFieldHandler *handler, bool notify = false);
+  void unbind_field(DOID_TYPE do_id, const DCField *field);
+  void unbind_object(DOID_TYPE do_id);
+
 private:
   bool do_check_datagram();
+  bool handle_native_update_field();
   bool handle_update_field();
   bool handle_update_field_owner();
 
   void describe_message(std::ostream &out, const std::string &prefix,
                         const Datagram &dg) const;
 
+#ifdef HAVE_NET
+  bool flush_net_conn(bool consider);
+#endif
+
 private:
   ReMutex _lock;
 
@@ -212,7 +231,30 @@ private:
   typedef std::vector< std::string > BundledMsgVector;
   BundledMsgVector _bundle_msgs;
 
+  // Fields whose updates are handled in C++, keyed on the doId in the upper
+  // 32 bits and the field index in the lower.  A doId of 0 binds the field
+  // on every object.
+  class NativeBinding {
+  public:
+    PT(CDistributedFieldHandler) _handler;
+    bool _notify;
+  };
+  typedef SimpleHashMap<uint64_t, NativeBinding, integer_hash<uint64_t> > NativeFields;
+  NativeFields _native_fields;
+
+  // The updates handled in C++ that Python asked to hear about.
+  class NativeUpdate {
+  public:
+    DOID_TYPE _do_id;
+    int _field_index;
+  };
+  typedef pvector<NativeUpdate> NativeUpdates;
+  NativeUpdates _native_updates;
+
   static PStatCollector _update_pcollector;
+  static PStatCollector _native_update_pcollector;
+  static PStatCollector _send_batch_datagrams_pcollector;
+  static PStatCollector _send_batch_calls_pcollector;
 };
 
 #include "cConnectionRepository.I"
@@ -0,0 +1,43 @@
+/**
+ * PANDA 3D SOFTWARE
+ * Copyright (c) Carnegie Mellon University.  All rights reserved.
+ *
+ * All use of this software is subject to the terms of the revised BSD
+ * license.  You should have received a copy of this license along
+ * with this source code in a file named "LICENSE."
+ *
+ * @file cDistributedFieldHandler.h
+ * @author agent
+ * @date 2026-10-17
+ */
+
+#ifndef CDISTRIBUTEDFIELDHANDLER_H
+#define CDISTRIBUTEDFIELDHANDLER_H
+
+#include "directbase.h"
+#include "referenceCount.h"
+#include "dcbase.h"
+
+class DCField;
+class DCPacker;
+
+/**
+ * The base class for C++ handlers of distributed field updates.  A handler
+ * bound to a field with CConnectionRepository::bind_field() receives the
+ * field's updates directly from the datagram, without the values ever being
+ * turned into Python objects or a Python method being called.
+ */
+class EXPCL_DIRECT_DISTRIBUTED CDistributedFieldHandler : public ReferenceCount {
+public:
+  virtual ~CDistributedFieldHandler();
+
+  // The packer has already had begin_unpack() called on the field.  The
+  // handler should unpack all of the field's values and return true, or
+  // return false to hand the update up to Python instead.  Once it returns
+  // true the update is never given to Python, so it should check
+  // packer.had_error() before it applies anything.
+  virtual bool handle_update(DOID_TYPE do_id, const DCField *field,
+                             DCPacker &packer)=0;
+};
+
+#endif
@@ -15,6 +15,8 @@
 #include "cConnectionRepository.h"
 #include "dcField.h"
 #include "dcClass.h"
+#include "dcAtomicField.h"
+#include "dcMolecularField.h"
 #include "dcmsgtypes.h"
 #include "config_distributed.h"
 
@@ -25,11 +27,121 @@
 static const PN_stdfloat smooth_node_epsilon = 0.01;
 static const double network_time_precision = 100.0;  // Matches ClockDelta.py
 
+// The precision of the setComponent* fields and the range of the
+// setComponentD* fields in direct.dc.  Heading offsets are sent in half
+// degrees.
+static const int smooth_units_per_foot = 10;
+static const int smooth_units_per_circle = 360 * smooth_units_per_foot;
+static const int smooth_units_per_delta_h = smooth_units_per_foot / 2;
+static const int smooth_delta_limit = 127;
+
+CDistributedSmoothNodeBase::DeltaBatches CDistributedSmoothNodeBase::_delta_batches;
+uint64_t CDistributedSmoothNodeBase::_num_bytes_sent = 0;
+int CDistributedSmoothNodeBase::_num_updates_sent = 0;
+
+/**
+ * Returns the value as the number of tenths it is sent as.
+ */
+static INLINE int
+to_smooth_units(PN_stdfloat value) {
+  return (int)cfloor(value * smooth_units_per_foot + 0.5);
+}
+
+/**
+ * Returns the angle as the number of tenths of a degree it is sent as, in the
+ * range [0, 3600).
+ */
+static INLINE int
+to_smooth_angle_units(PN_stdfloat angle) {
+  int units = to_smooth_units(angle) % smooth_units_per_circle;
+  return units < 0 ? units + smooth_units_per_circle : units;
+}
+
+/**
+ * Returns the value moved by the indicated offset, rounded to the tenth it is
+ * sent as, so that offsets applied one after another don't drift.
+ */
+static INLINE PN_stdfloat
+add_smooth_offset(PN_stdfloat value, double offset) {
+  int units = to_smooth_units(value) + (int)cfloor(offset * smooth_units_per_foot + 0.5);
+  return (PN_stdfloat)units / smooth_units_per_foot;
+}
+
+/**
+ * Returns the angle turned by the indicated offset, rounded to the tenth of a
+ * degree it is sent as, in the range [0, 360).
+ */
+static INLINE PN_stdfloat
+add_smooth_angle_offset(PN_stdfloat angle, double offset) {
+  int units = (to_smooth_angle_units(angle) +
+               (int)cfloor(offset * smooth_units_per_foot + 0.5)) % smooth_units_per_circle;
+  if (units < 0) {
+    units += smooth_units_per_circle;
+  }
+  return (PN_stdfloat)units / smooth_units_per_foot;
+}
+
+/**
+ * Applies setSm* and setComponent* updates received for a
+ * CDistributedSmoothNodeBase directly to its node, the way
+ * DistributedSmoothNodeAI does: each component that is sent is set, and the
+ * timestamp and zone are ignored.  The offsets in setSmDelta* and setSmDeltas
+ * updates are added to where the node was last put.
+ *
+ * The server only checks that the sender of an update may update the object
+ * it is sent on, so the offsets a setSmDeltas update carries for other nodes
+ * are only applied on a client, and only to nodes in the same location.
+ */
+class CDistributedSmoothNodeBase::SmoothFieldHandler : public CDistributedFieldHandler {
+public:
+  enum Component {
+    C_skip,
+    C_x,
+    C_y,
+    C_z,
+    C_h,
+    C_p,
+    C_r,
+    C_dx,
+    C_dy,
+    C_dz,
+    C_dh,
+  };
+  typedef pvector<Component> Components;
+
+  SmoothFieldHandler(CDistributedSmoothNodeBase *node) :
+    _node(node), _deltas_field(nullptr) {}
+
+  static Component get_component(const std::string &name);
+  void add_atomic(Components &components, const DCAtomicField *atomic);
+
+  virtual bool handle_update(DOID_TYPE do_id, const DCField *field,
+                             DCPacker &packer);
+  bool handle_deltas(DCPacker &packer);
+
+  CDistributedSmoothNodeBase *_node;
+  pmap<const DCField *, Components> _fields;
+  const DCField *_deltas_field;
+
+  // The nodes bound with bind_native_updates(), which a setSmDeltas update
+  // may carry offsets for.
+  typedef std::pair<CConnectionRepository *, DOID_TYPE> NodeKey;
+  typedef pmap<NodeKey, CDistributedSmoothNodeBase *> Nodes;
+  static Nodes _nodes;
+};
+
+CDistributedSmoothNodeBase::SmoothFieldHandler::Nodes
+CDistributedSmoothNodeBase::SmoothFieldHandler::_nodes;
+
 /**
  *
  */
 CDistributedSmoothNodeBase::
 CDistributedSmoothNodeBase() {
+  _dclass = nullptr;
+  _do_id = 0;
+  _parent_id = 0;
+  _zone_id = 0;
   _repository = nullptr;
   _is_ai = false;
   _ai_id = 0;
@@ -40,6 +152,14 @@ CDistributedSmoothNodeBase() {
 
   _currL[0] = 0;
   _currL[1] = 0;
+
+  for (int i = 0; i < 4; ++i) {
+    _key_units[i] = 0;
+    _sent_units[i] = 0;
+  }
+  _has_key = false;
+  _num_deltas = 0;
+  _delta_queued = false;
 }
 
 /**
@@ -47,6 +167,19 @@ CDistributedSmoothNodeBase() {
  */
 CDistributedSmoothNodeBase::
 ~CDistributedSmoothNodeBase() {
+  if (_delta_queued) {
+    // Drop our offsets, which can't be sent without us.
+    DeltaEntries &entries = _delta_batches[get_batch_key()];
+    DeltaEntries::iterator ei = entries.begin();
+    while (ei != entries.end()) {
+      if ((*ei)._node == this) {
+        ei = entries.erase(ei);
+      } else {
+        ++ei;
+      }
+    }
+  }
+  unbind_native_updates();
 }
 
 /**
@@ -66,6 +199,27 @@ initialize(const NodePath &node_path, DCClass *dclass, CHANNEL_TYPE do_id) {
   _store_xyz = _node_path.get_pos();
   _store_hpr = _node_path.get_hpr();
   _store_stop = false;
+  _has_key = false;
+}
+
+/**
+ * Records the location of the object, as set by setLocation.  The offsets
+ * queued by broadcast_pos_hpr_delta() go out with those of the other nodes in
+ * the same location, and a setSmDeltas update received on another node only
+ * moves this one if that node is in the same location.
+ */
+void CDistributedSmoothNodeBase::
+set_location(DOID_TYPE parent_id, ZONEID_TYPE zone_id) {
+  if (parent_id == _parent_id && zone_id == _zone_id) {
+    return;
+  }
+
+  if (_delta_queued) {
+    // Our queued offsets belong to the old location; send them there.
+    flush_deltas();
+  }
+  _parent_id = parent_id;
+  _zone_id = zone_id;
 }
 
 /**
@@ -73,9 +227,14 @@ initialize(const NodePath &node_path, DCClass *dclass, CHANNEL_TYPE do_id) {
  */
 void CDistributedSmoothNodeBase::
 send_everything() {
+  if (_delta_queued) {
+    // Send our queued offsets first, so that they arrive in order.
+    flush_deltas();
+  }
   _currL[0] = _currL[1];
   d_setSmPosHprL(_store_xyz[0], _store_xyz[1], _store_xyz[2],
                  _store_hpr[0], _store_hpr[1], _store_hpr[2], _currL[0]);
+  set_key_frame();
 }
 
 /**
@@ -88,6 +247,7 @@ broadcast_pos_hpr_full() {
   LVecBase3 hpr = _node_path.get_hpr();
 
   int flags = 0;
+  _has_key = false;
 
   if (!IS_THRESHOLD_EQUAL(_store_xyz[0], xyz[0], smooth_node_epsilon)) {
     _store_xyz[0] = xyz[0];
@@ -193,6 +353,7 @@ broadcast_pos_hpr_xyh() {
   LVecBase3 hpr = _node_path.get_hpr();
 
   int flags = 0;
+  _has_key = false;
 
   if (!IS_THRESHOLD_EQUAL(_store_xyz[0], xyz[0], smooth_node_epsilon)) {
     _store_xyz[0] = xyz[0];
@@ -242,6 +403,7 @@ broadcast_pos_hpr_xy() {
   LPoint3 xyz = _node_path.get_pos();
 
   int flags = 0;
+  _has_key = false;
 
   if (!IS_THRESHOLD_EQUAL(_store_xyz[0], xyz[0], smooth_node_epsilon)) {
     _store_xyz[0] = xyz[0];
@@ -267,6 +429,165 @@ broadcast_pos_hpr_xy() {
   }
 }
 
+/**
+ * Examines X, Y, Z, and H of the pos/hpr information, and queues them as small
+ * offsets from the last position sent, to go out with those of the other nodes
+ * in the same location on the next call to flush_deltas().
+ *
+ * The position is sent in full instead, as a keyframe, whenever P, R or the
+ * zone changes, an offset doesn't fit, or smooth-delta-keyframe-interval
+ * offsets have been sent; the server keeps only the keyframes, for observers
+ * that arrive later.  When the node comes to rest away from its last
+ * keyframe, the rest position is sent as a keyframe too.
+ */
+void CDistributedSmoothNodeBase::
+broadcast_pos_hpr_delta() {
+  if (_delta_queued) {
+    // We were called again before our last offsets went out.  Send them
+    // first, so that they arrive in order.
+    flush_deltas();
+  }
+
+  LPoint3 xyz = _node_path.get_pos();
+  LVecBase3 hpr = _node_path.get_hpr();
+
+  int units[4];
+  units[0] = to_smooth_units(xyz[0]);
+  units[1] = to_smooth_units(xyz[1]);
+  units[2] = to_smooth_units(xyz[2]);
+  units[3] = to_smooth_angle_units(hpr[0]);
+
+  bool key_frame = !_has_key || _currL[0] != _currL[1] ||
+    !IS_THRESHOLD_EQUAL(_store_hpr[1], hpr[1], smooth_node_epsilon) ||
+    !IS_THRESHOLD_EQUAL(_store_hpr[2], hpr[2], smooth_node_epsilon);
+
+  int delta[4];
+  delta[0] = units[0] - _sent_units[0];
+  delta[1] = units[1] - _sent_units[1];
+  delta[2] = units[2] - _sent_units[2];
+
+  // Take the short way around to the new heading, to the nearest half degree.
+  int dh = units[3] - _sent_units[3];
+  if (dh >= smooth_units_per_circle / 2) {
+    dh -= smooth_units_per_circle;
+  } else if (dh < -smooth_units_per_circle / 2) {
+    dh += smooth_units_per_circle;
+  }
+  const int half_step = smooth_units_per_delta_h / 2;
+  delta[3] = (dh >= 0 ? dh + half_step : dh - half_step) / smooth_units_per_delta_h;
+
+  bool moved = false;
+  for (int i = 0; i < 4; ++i) {
+    if (delta[i] != 0) {
+      moved = true;
+      if (delta[i] > smooth_delta_limit || delta[i] < -smooth_delta_limit) {
+        key_frame = true;
+      }
+    }
+  }
+
+  if (!moved && !key_frame) {
+    // No change.  Send one and only one "stop" message, which is a keyframe
+    // if we have stopped away from the last one.
+    if (_store_stop) {
+      return;
+    }
+    _store_stop = true;
+    if (_sent_units[0] == _key_units[0] && _sent_units[1] == _key_units[1] &&
+        _sent_units[2] == _key_units[2] && _sent_units[3] == _key_units[3]) {
+      d_setSmStop();
+      return;
+    }
+    key_frame = true;
+
+  } else {
+    _store_stop = false;
+  }
+
+  if (key_frame || _num_deltas >= smooth_delta_keyframe_interval) {
+    _store_xyz = xyz;
+    _store_hpr = hpr;
+    if (_currL[0] != _currL[1]) {
+      _currL[0] = _currL[1];
+      d_setSmPosHprL(_store_xyz[0], _store_xyz[1], _store_xyz[2],
+                     _store_hpr[0], _store_hpr[1], _store_hpr[2], _currL[0]);
+    } else {
+      d_setSmPosHpr(_store_xyz[0], _store_xyz[1], _store_xyz[2],
+                    _store_hpr[0], _store_hpr[1], _store_hpr[2]);
+    }
+    set_key_frame();
+    return;
+  }
+
+  _store_xyz = xyz;
+  _store_hpr[0] = hpr[0];
+  _sent_units[0] = units[0];
+  _sent_units[1] = units[1];
+  _sent_units[2] = units[2];
+  _sent_units[3] = (_sent_units[3] + delta[3] * smooth_units_per_delta_h +
+                    smooth_units_per_circle) % smooth_units_per_circle;
+  ++_num_deltas;
+
+  nassertv(_repository != nullptr);
+  DeltaEntry entry;
+  entry._node = this;
+  for (int i = 0; i < 4; ++i) {
+    entry._delta[i] = delta[i];
+  }
+  _delta_batches[get_batch_key()].push_back(entry);
+  _delta_queued = true;
+}
+
+/**
+ * Sends the offsets queued by broadcast_pos_hpr_delta() since the last call.
+ * On the AI, the offsets of several nodes in the same location go out
+ * together as one setSmDeltas update, on the first of them.  A lone node, or
+ * any node on a client, which may only update its own objects, sends its own
+ * setSmDelta* update.
+ */
+void CDistributedSmoothNodeBase::
+flush_deltas() {
+  DeltaBatches batches;
+  batches.swap(_delta_batches);
+
+  DeltaBatches::const_iterator bi;
+  for (bi = batches.begin(); bi != batches.end(); ++bi) {
+    const DeltaEntries &entries = (*bi).second;
+    DeltaEntries::const_iterator ei;
+    for (ei = entries.begin(); ei != entries.end(); ++ei) {
+      (*ei)._node->_delta_queued = false;
+    }
+
+    if (entries.empty()) {
+      continue;
+    }
+
+    CDistributedSmoothNodeBase *carrier = entries[0]._node;
+    if (entries.size() == 1 || !carrier->_is_ai) {
+      for (ei = entries.begin(); ei != entries.end(); ++ei) {
+        (*ei)._node->send_delta((*ei)._delta);
+      }
+      continue;
+    }
+
+    DCPacker packer;
+    carrier->begin_send_update(packer, "setSmDeltas");
+    packer.push();
+    for (ei = entries.begin(); ei != entries.end(); ++ei) {
+      const int *delta = (*ei)._delta;
+      packer.push();
+      packer.pack_uint((*ei)._node->_do_id);
+      packer.pack_double((double)delta[0] / smooth_units_per_foot);
+      packer.pack_double((double)delta[1] / smooth_units_per_foot);
+      packer.pack_double((double)delta[2] / smooth_units_per_foot);
+      packer.pack_double((double)(delta[3] * smooth_units_per_delta_h) / smooth_units_per_foot);
+      packer.pop();
+    }
+    packer.pop();
+    carrier->finish_send_update(packer);
+  }
+}
+
 /**
  * Fills up the packer with the data appropriate for sending an update on the
  * indicated field name, up until the arguments.
@@ -325,6 +646,8 @@ finish_send_update(DCPacker &packer) {
     Datagram dg(packer.get_data(), packer.get_length());
     nassertv(_repository != nullptr);
     _repository->send_datagram(dg);
+    _num_bytes_sent += dg.get_length();
+    ++_num_updates_sent;
 
   } else {
 #ifndef NDEBUG
@@ -358,6 +681,40 @@ finish_send_update(DCPacker &packer) {
   }
 }
 
+/**
+ * Records the pos/hpr just sent in full as the new keyframe, which
+ * broadcast_pos_hpr_delta() sends offsets from until it sends another.
+ */
+void CDistributedSmoothNodeBase::
+set_key_frame() {
+  _key_units[0] = to_smooth_units(_store_xyz[0]);
+  _key_units[1] = to_smooth_units(_store_xyz[1]);
+  _key_units[2] = to_smooth_units(_store_xyz[2]);
+  _key_units[3] = to_smooth_angle_units(_store_hpr[0]);
+  for (int i = 0; i < 4; ++i) {
+    _sent_units[i] = _key_units[i];
+  }
+  _has_key = true;
+  _num_deltas = 0;
+}
+
+/**
+ * Sends the indicated offsets, queued by broadcast_pos_hpr_delta(), in the
+ * smallest setSmDelta* update that holds them.
+ */
+void CDistributedSmoothNodeBase::
+send_delta(const int delta[4]) {
+  const PN_stdfloat scale = 1.0f / smooth_units_per_foot;
+  PN_stdfloat dh = delta[3] * smooth_units_per_delta_h * scale;
+  if (delta[2] != 0) {
+    d_setSmDeltaXYZH(delta[0] * scale, delta[1] * scale, delta[2] * scale, dh);
+  } else if (delta[3] != 0) {
+    d_setSmDeltaXYH(delta[0] * scale, delta[1] * scale, dh);
+  } else {
+    d_setSmDeltaXY(delta[0] * scale, delta[1] * scale);
+  }
+}
+
 /**
  * Appends the timestamp and sends the update.
  */
@@ -370,3 +727,286 @@ void CDistributedSmoothNodeBase::
 print_curr_l() {
   std::cout << "printCurrL: sent l: " << _currL[1] << " last set l: " << _currL[0] << "\n";
 }
+
+/**
+ * Binds the smooth position fields of this object in the repository, so that
+ * updates to them are applied to the node directly in C++, without calling
+ * into Python at all.  This replaces the Python setSm* and setComponent*
+ * methods, which will no longer be called, so it is only appropriate for
+ * objects that simply put the node where it is told, as the AI does.
+ *
+ * If notify is true, the repository also lists the updates, to be collected
+ * with get_num_native_updates().  initialize() and set_repository() must have
+ * been called first.
+ */
+void CDistributedSmoothNodeBase::
+bind_native_updates(bool notify) {
+  nassertv(_repository != nullptr && _dclass != nullptr);
+  unbind_native_updates();
+
+  SmoothFieldHandler *handler = new SmoothFieldHandler(this);
+  _field_handler = handler;
+  SmoothFieldHandler::_nodes[SmoothFieldHandler::NodeKey(_repository, _do_id)] = this;
+
+  int num_fields = _dclass->get_num_inherited_fields();
+  for (int i = 0; i < num_fields; ++i) {
+    DCField *field = _dclass->get_inherited_field(i);
+    const std::string &name = field->get_name();
+    if (name.compare(0, 5, "setSm") != 0 &&
+        name.compare(0, 12, "setComponent") != 0) {
+      continue;
+    }
+
+    if (name == "setSmDeltas") {
+      handler->_deltas_field = field;
+      _repository->bind_field(_do_id, field, handler, notify);
+      continue;
+    }
+
+    SmoothFieldHandler::Components &components = handler->_fields[field];
+    const DCMolecularField *molecular = field->as_molecular_field();
+    if (molecular != nullptr) {
+      int num_atomics = molecular->get_num_atomics();
+      for (int j = 0; j < num_atomics; ++j) {
+        handler->add_atomic(components, molecular->get_atomic(j));
+      }
+    } else if (field->as_atomic_field() != nullptr) {
+      handler->add_atomic(components, field->as_atomic_field());
+    } else {
+      continue;
+    }
+
+    _repository->bind_field(_do_id, field, handler, notify);
+  }
+}
+
+/**
+ * Undoes the effect of a previous call to bind_native_updates(), so that
+ * updates to the smooth position fields go to Python again.
+ */
+void CDistributedSmoothNodeBase::
+unbind_native_updates() {
+  if (_field_handler == nullptr) {
+    return;
+  }
+
+  SmoothFieldHandler *handler = (SmoothFieldHandler *)_field_handler.p();
+  if (_repository != nullptr) {
+    pmap<const DCField *, SmoothFieldHandler::Components>::const_iterator fi;
+    for (fi = handler->_fields.begin(); fi != handler->_fields.end(); ++fi) {
+      _repository->unbind_field(_do_id, (*fi).first);
+    }
+    if (handler->_deltas_field != nullptr) {
+      _repository->unbind_field(_do_id, handler->_deltas_field);
+    }
+  }
+  SmoothFieldHandler::Nodes::iterator ni =
+    SmoothFieldHandler::_nodes.find(SmoothFieldHandler::NodeKey(_repository, _do_id));
+  if (ni != SmoothFieldHandler::_nodes.end() && (*ni).second == this) {
+    SmoothFieldHandler::_nodes.erase(ni);
+  }
+
+  // The repository may still be holding the handler, if it is in the middle
+  // of an update.
+  handler->_node = nullptr;
+  _field_handler = nullptr;
+}
+
+/**
+ * Returns the component of the node set by the indicated setComponent*
+ * field, or C_skip for one that is not applied.
+ */
+CDistributedSmoothNodeBase::SmoothFieldHandler::Component
+CDistributedSmoothNodeBase::SmoothFieldHandler::
+get_component(const std::string &name) {
+  if (name == "setComponentX") {
+    return C_x;
+  } else if (name == "setComponentY") {
+    return C_y;
+  } else if (name == "setComponentZ") {
+    return C_z;
+  } else if (name == "setComponentH") {
+    return C_h;
+  } else if (name == "setComponentP") {
+    return C_p;
+  } else if (name == "setComponentR") {
+    return C_r;
+  } else if (name == "setComponentDX") {
+    return C_dx;
+  } else if (name == "setComponentDY") {
+    return C_dy;
+  } else if (name == "setComponentDZ") {
+    return C_dz;
+  } else if (name == "setComponentDH") {
+    return C_dh;
+  }
+
+  // setComponentL, setComponentT, and anything we don't know about.
+  return C_skip;
+}
+
+/**
+ * Appends the components set by each element of the indicated atomic field,
+ * in the order they appear on the wire.
+ */
+void CDistributedSmoothNodeBase::SmoothFieldHandler::
+add_atomic(Components &components, const DCAtomicField *atomic) {
+  Component component = get_component(atomic->get_name());
+  int num_elements = atomic->get_num_elements();
+  for (int i = 0; i < num_elements; ++i) {
+    components.push_back(i == 0 ? component : C_skip);
+  }
+}
+
+/**
+ * Unpacks the update and applies it to the node.
+ */
+bool CDistributedSmoothNodeBase::SmoothFieldHandler::
+handle_update(DOID_TYPE do_id, const DCField *field, DCPacker &packer) {
+  if (_node == nullptr || _node->_node_path.is_empty()) {
+    return false;
+  }
+
+  if (field == _deltas_field) {
+    return handle_deltas(packer);
+  }
+
+  pmap<const DCField *, Components>::const_iterator fi = _fields.find(field);
+  if (fi == _fields.end()) {
+    return false;
+  }
+  const Components &components = (*fi).second;
+
+  LPoint3 pos = _node->_node_path.get_pos();
+  LVecBase3 hpr = _node->_node_path.get_hpr();
+  int flags = 0;
+
+  packer.push();
+  Components::const_iterator ci;
+  for (ci = components.begin(); ci != components.end(); ++ci) {
+    switch (*ci) {
+    case C_x:
+      pos[0] = packer.unpack_double();
+      flags |= F_new_x;
+      break;
+    case C_y:
+      pos[1] = packer.unpack_double();
+      flags |= F_new_y;
+      break;
+    case C_z:
+      pos[2] = packer.unpack_double();
+      flags |= F_new_z;
+      break;
+    case C_h:
+      hpr[0] = packer.unpack_double();
+      flags |= F_new_h;
+      break;
+    case C_p:
+      hpr[1] = packer.unpack_double();
+      flags |= F_new_p;
+      break;
+    case C_r:
+      hpr[2] = packer.unpack_double();
+      flags |= F_new_r;
+      break;
+    case C_dx:
+      pos[0] = add_smooth_offset(pos[0], packer.unpack_double());
+      flags |= F_new_x;
+      break;
+    case C_dy:
+      pos[1] = add_smooth_offset(pos[1], packer.unpack_double());
+      flags |= F_new_y;
+      break;
+    case C_dz:
+      pos[2] = add_smooth_offset(pos[2], packer.unpack_double());
+      flags |= F_new_z;
+      break;
+    case C_dh:
+      hpr[0] = add_smooth_angle_offset(hpr[0], packer.unpack_double());
+      flags |= F_new_h;
+      break;
+    default:
+      packer.unpack_skip();
+      break;
+    }
+  }
+  packer.pop();
+
+  if (packer.had_error()) {
+    return false;
+  }
+
+  if (flags & (F_new_x | F_new_y | F_new_z)) {
+    _node->_node_path.set_pos(pos);
+  }
+  if (flags & (F_new_h | F_new_p | F_new_r)) {
+    _node->_node_path.set_hpr(hpr);
+  }
+  return true;
+}
+
+/**
+ * Unpacks a setSmDeltas update and applies each of its offsets to its node.
+ * On the AI, only the offsets of the node the update was sent on are applied;
+ * on a client, those of the nodes in the same location as it.  The rest are
+ * ignored.  If any of the nodes to be moved is not bound here, the whole
+ * update is left to Python, which knows about all of them.
+ */
+bool CDistributedSmoothNodeBase::SmoothFieldHandler::
+handle_deltas(DCPacker &packer) {
+  CConnectionRepository *repository = _node->_repository;
+  bool is_ai = _node->_is_ai;
+  Location location(_node->_parent_id, _node->_zone_id);
+
+  class Delta {
+  public:
+    CDistributedSmoothNodeBase *_node;
+    double _offset[4];
+  };
+  pvector<Delta> deltas;
+  bool all_bound = true;
+
+  packer.push();
+  packer.push();
+  while (packer.more_nested_fields()) {
+    Delta delta;
+    packer.push();
+    DOID_TYPE do_id = packer.unpack_uint();
+    for (int i = 0; i < 4; ++i) {
+      delta._offset[i] = packer.unpack_double();
+    }
+    packer.pop();
+
+    if (is_ai && do_id != _node->_do_id) {
+      continue;
+    }
+
+    Nodes::const_iterator ni = _nodes.find(NodeKey(repository, do_id));
+    if (ni == _nodes.end() || (*ni).second->_node_path.is_empty()) {
+      all_bound = false;
+    } else if (Location((*ni).second->_parent_id, (*ni).second->_zone_id) == location) {
+      delta._node = (*ni).second;
+      deltas.push_back(delta);
+    }
+  }
+  packer.pop();
+  // The timestamp.
+  packer.unpack_skip();
+  packer.pop();
+
+  if (packer.had_error() || !all_bound) {
+    return false;
+  }
+
+  pvector<Delta>::const_iterator di;
+  for (di = deltas.begin(); di != deltas.end(); ++di) {
+    NodePath &node_path = (*di)._node->_node_path;
+    LPoint3 pos = node_path.get_pos();
+    pos[0] = add_smooth_offset(pos[0], (*di)._offset[0]);
+    pos[1] = add_smooth_offset(pos[1], (*di)._offset[1]);
+    pos[2] = add_smooth_offset(pos[2], (*di)._offset[2]);
+    node_path.set_pos(pos);
+    node_path.set_h(add_smooth_angle_offset(node_path.get_h(), (*di)._offset[3]));
+  }
+  return true;
+}
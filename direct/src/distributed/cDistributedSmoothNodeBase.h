@@ -19,6 +19,10 @@
 #include "dcbase.h"
 #include "dcPacker.h"
 #include "clockObject.h"
+#include "cDistributedFieldHandler.h"
+#include "pointerTo.h"
+#include "pmap.h"
+#include "pvector.h"
 
 class DCClass;
 class CConnectionRepository;
@@ -43,16 +47,25 @@ PUBLISHED:
 
   void initialize(const NodePath &node_path, DCClass *dclass,
                   CHANNEL_TYPE do_id);
+  void set_location(DOID_TYPE parent_id, ZONEID_TYPE zone_id);
 
   void send_everything();
 
   void broadcast_pos_hpr_full();
   void broadcast_pos_hpr_xyh();
   void broadcast_pos_hpr_xy();
+  void broadcast_pos_hpr_delta();
+  static void flush_deltas();
 
   void set_curr_l(uint64_t l);
   void print_curr_l();
 
+  BLOCKING void bind_native_updates(bool notify = false);
+  BLOCKING void unbind_native_updates();
+
+  INLINE static uint64_t get_num_bytes_sent();
+  INLINE static int get_num_updates_sent();
+
 private:
   INLINE static bool only_changed(int flags, int compare);
 
@@ -67,6 +80,12 @@ private:
   INLINE void d_setSmXYZH(PN_stdfloat x, PN_stdfloat y, PN_stdfloat z, PN_stdfloat h);
   INLINE void d_setSmPosHpr(PN_stdfloat x, PN_stdfloat y, PN_stdfloat z, PN_stdfloat h, PN_stdfloat p, PN_stdfloat r);
   INLINE void d_setSmPosHprL(PN_stdfloat x, PN_stdfloat y, PN_stdfloat z, PN_stdfloat h, PN_stdfloat p, PN_stdfloat r, uint64_t l);
+  INLINE void d_setSmDeltaXY(PN_stdfloat dx, PN_stdfloat dy);
+  INLINE void d_setSmDeltaXYH(PN_stdfloat dx, PN_stdfloat dy, PN_stdfloat dh);
+  INLINE void d_setSmDeltaXYZH(PN_stdfloat dx, PN_stdfloat dy, PN_stdfloat dz, PN_stdfloat dh);
+
+  void set_key_frame();
+  void send_delta(const int delta[4]);
 
   void begin_send_update(DCPacker &packer, const std::string &field_name);
   void finish_send_update(DCPacker &packer);
@@ -83,6 +102,8 @@ private:
   NodePath _node_path;
   DCClass *_dclass;
   CHANNEL_TYPE _do_id;
+  DOID_TYPE _parent_id;
+  ZONEID_TYPE _zone_id;
 
   CConnectionRepository *_repository;
   bool _is_ai;
@@ -97,6 +118,38 @@ private:
   // contains most recently sent location info as index 0, index 1 contains
   // most recently set location info
   uint64_t _currL[2];
+
+  // The x, y, z, h last sent in full, which the server keeps for later
+  // observers, and the x, y, z, h last sent in any form, which
+  // broadcast_pos_hpr_delta() sends offsets from; in tenths as they appear
+  // on the wire.
+  int _key_units[4];
+  int _sent_units[4];
+  bool _has_key;
+  int _num_deltas;
+  bool _delta_queued;
+
+  // The offsets queued by broadcast_pos_hpr_delta() for flush_deltas(), by
+  // repository and location.  The heading offset is in half degrees.
+  class DeltaEntry {
+  public:
+    CDistributedSmoothNodeBase *_node;
+    int _delta[4];
+  };
+  typedef pvector<DeltaEntry> DeltaEntries;
+  typedef std::pair<DOID_TYPE, ZONEID_TYPE> Location;
+  typedef std::pair<CConnectionRepository *, Location> BatchKey;
+  typedef pmap<BatchKey, DeltaEntries> DeltaBatches;
+  static DeltaBatches _delta_batches;
+
+  INLINE BatchKey get_batch_key() const;
+
+  static uint64_t _num_bytes_sent;
+  static int _num_updates_sent;
+
+  // Applies incoming setSm* and setComponent* updates to _node_path.
+  class SmoothFieldHandler;
+  PT(CDistributedFieldHandler) _field_handler;
 };
 
 #include "cDistributedSmoothNodeBase.I"
@@ -50,6 +50,14 @@ ConfigVariableBool handle_datagrams_internally
           "for performance reasons.  When it is false, all datagrams "
           "are handled by the Python implementation."));
 
+ConfigVariableInt smooth_delta_keyframe_interval
+("smooth-delta-keyframe-interval", 20,
+ PRC_DESC("The number of position offsets a DistributedSmoothNode "
+          "broadcasting with BroadcastTypes.DELTA may send before it sends "
+          "a full setSmPosHpr again, to refresh the position the server "
+          "keeps for clients that enter the zone later.  Such a client is "
+          "off by the offsets it missed until then."));
+
 /**
  * Initializes the library.  This must be called at least once before any of
  * the functions or classes in this library can be used.  Normally it will be
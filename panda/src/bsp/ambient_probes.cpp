@@ -32,9 +32,10 @@
 #include <virtualFileSystem.h>
 #include <modelNode.h>
 #include <pstatTimer.h>
+#include <lightMutexHolder.h>
 #include <lineSegs.h>
 
-#include <bitset>
+#include <memory>
 
 #include "bsp_trace.h"
 #include "aux_data_attrib.h"
@@ -51,13 +52,19 @@ static PStatCollector addlights_collector               ( "AmbientProbes:UpdateN
 static PStatCollector fadelights_collector              ( "AmbientProbes:UpdateNodes:FadeLights" );
 static PStatCollector ambientboost_collector( "AmbientProbes:UpdateNodes:BoostAmbient" );
 static PStatCollector xformlight_collector( "AmbientProbes:XformLight" );
-static PStatCollector loadcubemap_collector( "AmbientProbes:UpdateNodes:LoadCubemap" );
 static PStatCollector findcubemap_collector( "AmbientProbes:UpdateNodes:FindCubemap" );
+static PStatCollector tracevis_collector( "AmbientProbes:TraceVisibility" );
 
 static ConfigVariableBool cfg_lightaverage
 ( "light-average", true, "Activates/deactivate light averaging" );
 static ConfigVariableDouble cfg_lightinterp
 ( "light-lerp-speed", 5.0, "Controls the speed of light interpolation, 0 turns off interpolation" );
+static ConfigVariableInt cfg_lightupdatebudget
+( "light-update-budget", 0, "Maximum number of moving nodes that may refresh their ambient probe, "
+  "cubemap and local lights each frame. The rest wait for a later frame. 0 means no limit." );
+static ConfigVariableBool cfg_lightbatchvis
+( "light-batch-visibility", false, "Defers the light visibility rays of moving nodes and traces them "
+  "together once per frame as ray packets. Lighting of moving nodes lags by one frame." );
 
 static ConfigVariableBool r_ambientboost
 ( "r_ambientboost", true, "Boosts ambient term if it is totally swamped by local lights." );
@@ -80,9 +87,8 @@ static light_t *dummy_light = new light_t;
 AmbientProbeManager::AmbientProbeManager() :
         _loader( nullptr ),
         _sunlight( nullptr ),
-        //_light_kdtree( nullptr ),
-        //_probe_kdtree( nullptr ),
-        _envmap_kdtree( nullptr )
+        _budget_frame( -1 ),
+        _budget_used( 0 )
 {
         dummy_light->id = -1;
         dummy_light->leaf = 0;
@@ -92,9 +98,8 @@ AmbientProbeManager::AmbientProbeManager() :
 AmbientProbeManager::AmbientProbeManager( BSPLoader *loader ) :
         _loader( loader ),
         _sunlight( nullptr ),
-        //_light_kdtree( nullptr ),
-        //_probe_kdtree( nullptr ),
-        _envmap_kdtree( nullptr )
+        _budget_frame( -1 ),
+        _budget_used( 0 )
 {
 }
 
@@ -252,14 +257,15 @@ void AmbientProbeManager::process_ambient_probes()
                 }
         }
 
+        _probe_grids.clear();
+        _probe_grids.resize( _loader->_bspdata->leafambientindex.size() );
         for ( size_t i = 0; i < _loader->_bspdata->leafambientindex.size(); i++ )
         {
                 dleafambientindex_t *ambidx = &_loader->_bspdata->leafambientindex[i];
                 dleaf_t *leaf = _loader->_bspdata->dleafs + i;
                 _probes[i] = pvector<PT( ambientprobe_t )>();
 
-                _probe_kdtrees[i] = new KDTree( 3 );
-                vector<vector<double>> probe_points;
+                pvector<LPoint3> probe_points;
 
                 for ( int j = 0; j < ambidx->num_ambient_samples; j++ )
                 {
@@ -304,15 +310,12 @@ void AmbientProbeManager::process_ambient_probes()
 #endif
                         _probes[i].push_back( probe );
 
-                        // insert probe into the k-d tree so we can find them quickly
-                        probe_points.push_back( { probe->pos[0], probe->pos[1], probe->pos[2] } );
+                        // insert probe into the grid so we can find them quickly
+                        probe_points.push_back( probe->pos );
                         _all_probes.push_back( probe );
                 }
 
-                if ( probe_points.size() )
-                {
-                        _probe_kdtrees[i]->build( probe_points );
-                }
+                _probe_grids[i].build( probe_points );
         }
 
         
@@ -321,8 +324,7 @@ void AmbientProbeManager::process_ambient_probes()
 void AmbientProbeManager::load_cubemaps()
 {
         std::cout << _loader->_bspdata->cubemaps.size() << " cubemaps " << std::endl;
-        _envmap_kdtree = new KDTree( 3 );
-        vector<vector<double>> envmap_points;
+        pvector<LPoint3> envmap_points;
         for ( size_t i = 0; i < _loader->_bspdata->cubemaps.size(); i++ )
         {
                 dcubemap_t *dcm = &_loader->_bspdata->cubemaps[i];
@@ -345,8 +347,8 @@ void AmbientProbeManager::load_cubemaps()
                 cm->size = dcm->size;
                 cm->has_full_cubemap = true;
 
-                // insert into k-d tree
-                envmap_points.push_back( { cm->pos[0], cm->pos[1], cm->pos[2] } );
+                // insert into the grid
+                envmap_points.push_back( cm->pos );
 
 		// Cubemap is in linear space.
                 cm->cubemap_tex = new Texture( "cubemap_tex" );
@@ -392,10 +394,44 @@ void AmbientProbeManager::load_cubemaps()
                 _cubemaps.push_back( cm );
         }
 
-        if ( envmap_points.size() )
+        _cubemap_grid.build( envmap_points );
+}
+
+/**
+ * Returns the ray traced toward the sun from a node at the indicated point.
+ * Nodes updated right away and nodes queued for trace_pending_visibility()
+ * trace the same rays through the same scene, so they are lit the same.
+ */
+INLINE RayTraceRay make_sky_ray( const LPoint3 &point, const light_t *sun )
+{
+        LPoint3 start = ( point + LPoint3( 0, 0, 0.05 ) ) * 16;
+        return RayTraceRay( start, start + ( sun->direction.get_xyz() * 10000 ), TRACETYPE_WORLD );
+}
+
+/**
+ * Returns the ray traced toward a local light from a node at the indicated
+ * point.
+ */
+INLINE RayTraceRay make_light_ray( const LPoint3 &point, const light_t *light )
+{
+        RayTraceRay ray( ( point + LPoint3( 0, 0, 0.05 ) ) * 16, light->pos * 16, TRACETYPE_WORLD );
+        // Hits right at the light don't count.
+        ray.distance *= 1.0f - EQUAL_EPSILON;
+        return ray;
+}
+
+/**
+ * Returns true if a ray made by make_sky_ray() ended on a sky face.
+ */
+INLINE bool AmbientProbeManager::is_sky_hit( const RayTraceHitResult &result ) const
+{
+        if ( (int)result.geom_id == -1 || result.hit_fraction >= 1.0 - EQUAL_EPSILON )
         {
-                _envmap_kdtree->build( envmap_points );
-        }      
+                return false;
+        }
+
+        const dface_t *face = _loader->_trace->lookup_dface( (int)result.geom_id );
+        return face != nullptr && ( _loader->_bspdata->texinfo[face->texinfo].flags & TEX_SKY ) != 0;
 }
 
 INLINE bool AmbientProbeManager::is_sky_visible( const LPoint3 &point )
@@ -405,22 +441,128 @@ INLINE bool AmbientProbeManager::is_sky_visible( const LPoint3 &point )
                 return false;
         }
 
-        LPoint3 start( ( point + LPoint3( 0, 0, 0.05 ) ) * 16 );
-        LPoint3 end = start + ( _sunlight->direction.get_xyz() * 10000 );
-        Ray ray( start, end, LPoint3::zero(), LPoint3::zero() );
-        Trace trace;
-        CM_BoxTrace( ray, 0, CONTENTS_SKY | CONTENTS_SOLID, false, _loader->_colldata, trace );
-
-        return trace.has_hit() && trace.hit_contents == CONTENTS_SKY;
+        RayTraceRay ray = make_sky_ray( point, _sunlight );
+        RayTraceHitResult result;
+        _loader->_trace->get_scene()->trace_rays( &ray, &result, 1 );
+        return is_sky_hit( result );
 }
 
 INLINE bool AmbientProbeManager::is_light_visible( const LPoint3 &point, const light_t *light )
 {
-        Ray ray( ( point + LPoint3( 0, 0, 0.05 ) ) * 16, light->pos * 16, LPoint3::zero(), LPoint3::zero() );
-        Trace trace;
-        CM_BoxTrace( ray, 0, CONTENTS_SOLID, false, _loader->_colldata, trace );
+        RayTraceRay ray = make_light_ray( point, light );
+        bool occluded;
+        _loader->_trace->get_scene()->occluded_rays( &ray, &occluded, 1 );
+        return !occluded;
+}
+
+/**
+ * Queues the node to have the visibility of its candidate lights traced
+ * by the next call to trace_pending_visibility(). The node's lock must be
+ * held.
+ */
+void AmbientProbeManager::queue_visibility_update( CNodeShaderInput *input, const LPoint3 &pos )
+{
+        input->lighting_pos = pos;
+        if ( input->visibility_pending )
+        {
+                return;
+        }
+        input->visibility_pending = true;
+
+        LightMutexHolder holder( _pending_lock );
+        _pending_visibility.push_back( input );
+}
+
+/**
+ * Traces the light visibility rays of every node that moved since the last
+ * call, as one stream of rays. Should be called once per frame after culling,
+ * the results are used the next time each node is updated.
+ */
+void AmbientProbeManager::trace_pending_visibility()
+{
+        pvector<PT( CNodeShaderInput )> pending;
+        {
+                LightMutexHolder holder( _pending_lock );
+                pending.swap( _pending_visibility );
+        }
+
+        if ( pending.empty() || !_loader->has_active_level() )
+        {
+                return;
+        }
+
+        PStatTimer timer( tracevis_collector );
+
+        struct visray_t
+        {
+                size_t node;
+                int light_id;
+        };
+        // The sun needs to know what it hit, the other lights only whether
+        // anything is in the way, so they go into separate streams.
+        pvector<visray_t> light_rays, sky_rays;
+        pvector<RayTraceRay> light_stream, sky_stream;
+
+        // Gather one ray per candidate light of every pending node.
+        for ( size_t i = 0; i < pending.size(); i++ )
+        {
+                CNodeShaderInput *input = pending[i];
+                LightMutexHolder holder( input->lock );
+
+                input->visibility_pending = false;
+
+                size_t numlights = std::min( input->locallights.size(), (size_t)MAX_TOTAL_LIGHTS );
+                for ( size_t j = 0; j < numlights; j++ )
+                {
+                        const light_t *light = input->locallights[j];
+                        if ( (int)j == input->sky_idx )
+                        {
+                                sky_rays.push_back( { i, light->id } );
+                                sky_stream.push_back( make_sky_ray( input->lighting_pos, light ) );
+                        }
+                        else
+                        {
+                                light_rays.push_back( { i, light->id } );
+                                light_stream.push_back( make_light_ray( input->lighting_pos, light ) );
+                        }
+                }
+        }
+
+        pvector<BitArray> occluded( pending.size() );
+        pvector<bool> sky_visible( pending.size(), false );
+
+        RayTraceScene *scene = _loader->_trace->get_scene();
+
+        if ( !light_stream.empty() )
+        {
+                std::unique_ptr<bool[]> light_occluded( new bool[light_stream.size()] );
+                scene->occluded_rays( light_stream.data(), light_occluded.get(), light_stream.size() );
+                for ( size_t i = 0; i < light_rays.size(); i++ )
+                {
+                        if ( light_occluded[i] )
+                        {
+                                occluded[light_rays[i].node].set_bit( light_rays[i].light_id );
+                        }
+                }
+        }
+
+        if ( !sky_stream.empty() )
+        {
+                pvector<RayTraceHitResult> sky_results( sky_stream.size() );
+                scene->trace_rays( sky_stream.data(), sky_results.data(), sky_stream.size() );
+                for ( size_t i = 0; i < sky_rays.size(); i++ )
+                {
+                        // The sun is visible if the ray ends on a sky face.
+                        sky_visible[sky_rays[i].node] = is_sky_hit( sky_results[i] );
+                }
+        }
 
-        return !trace.has_hit();
+        for ( size_t i = 0; i < pending.size(); i++ )
+        {
+                LightMutexHolder holder( pending[i]->lock );
+                pending[i]->occluded_lights = occluded[i];
+                pending[i]->sky_visible = sky_visible[i];
+        }
 }
 
 INLINE LMatrix4 pack_lightdata( const light_t *light )
@@ -449,8 +591,6 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
 {
         PStatTimer timer( updatenode_collector );
 
-        MutexHolder holder( _cache_mutex );
-
         if ( !node || !curr_trans )
         {
                 return nullptr;
@@ -474,16 +614,25 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         PT( CNodeShaderInput ) input = DCAST( CNodeShaderInput, node->get_user_data() );
         if ( !input )
         {
-                input = new CNodeShaderInput;
-                input->state_with_input = RenderState::make( AuxDataAttrib::make( input ) );
-                input->last_transform = curr_trans;
-                input->level_context = _loader->_level_context;
-                node->set_user_data( input );
-                new_instance = true;
+                MutexHolder holder( _cache_mutex );
+
+                // Another thread might have gotten here first.
+                input = DCAST( CNodeShaderInput, node->get_user_data() );
+                if ( !input )
+                {
+                        input = new CNodeShaderInput;
+                        input->state_with_input = RenderState::make( AuxDataAttrib::make( input ) );
+                        input->last_transform = curr_trans;
+                        input->level_context = _loader->_level_context;
+                        node->set_user_data( input );
+                        new_instance = true;
+                }
         }
 
         finddata_collector.stop();
 
+        LightMutexHolder node_holder( input->lock );
+
 	if ( !should_update && !new_instance )
 	{
 		// Just retrieving the current state, no updating.
@@ -517,6 +666,13 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                 average_lighting = false;
                 pos_changed = true;
         }
+        else if ( pos_changed && !new_instance && !consume_update_budget() )
+        {
+                // Too many nodes have moved this frame. Keep the old lighting,
+                // the move is still noticed next frame since we don't
+                // record the new position.
+                pos_changed = false;
+        }
 
         double now = ClockObject::get_global_clock()->get_frame_time();
         float dt = now - input->lighting_time;
@@ -542,12 +698,12 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         if ( pos_changed )
         {
                 // Update ambient cube
-                if ( _probes[leaf_id].size() > 0 )
+                update_ac_collector.start();
+                ambientprobe_t *sample = find_closest_probe( leaf_id, curr_net );
+                input->amb_probe = sample;
+                update_ac_collector.stop();
+                if ( sample != nullptr )
                 {
-                        update_ac_collector.start();
-                        ambientprobe_t *sample = find_closest_in_kdtree( get_probe_kdtree( leaf_id ), curr_net, _probes[leaf_id] );
-                        input->amb_probe = sample;
-                        update_ac_collector.stop();
 
 #ifdef VISUALIZE_AMBPROBES
                         std::cout << "Box colors:" << std::endl;
@@ -555,9 +711,10 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                         {
                                 std::cout << "\t" << sample->cube[i] << std::endl;
                         }
-                        for ( size_t j = 0; j < _probes[leaf_id].size(); j++ )
+                        const pvector<PT( ambientprobe_t )> &probes = _probes.get_data( _probes.find( leaf_id ) );
+                        for ( size_t j = 0; j < probes.size(); j++ )
                         {
-                                _probes[leaf_id][j]->visnode.set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
+                                probes[j]->visnode.set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
                         }
                         if ( !sample->visnode.is_empty() )
                         {
@@ -565,30 +722,21 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                         }
 #endif
                 }
-                else
-                {
-                        input->amb_probe = nullptr;
-                }
 
                 // Update envmap
                 if ( _cubemaps.size() > 0 )
                 {
                         findcubemap_collector.start();
-                        cubemap_t *cm = find_closest_in_kdtree( _envmap_kdtree, curr_net, _cubemaps );
+                        cubemap_t *cm = find_closest_cubemap( curr_net );
                         findcubemap_collector.stop();
                         if ( cm && cm->has_full_cubemap && cm != input->cubemap )
                         {
-                                loadcubemap_collector.start();
+                                // Use the level's cubemap texture directly, every
+                                // node near it shares the one texture.
                                 input->cubemap = cm;
-				// Cubemap is in linear space
-                                input->cubemap_tex->setup_cube_map( cm->size, Texture::T_unsigned_short, Texture::F_rgb );
-                                input->cubemap_tex->set_ram_image( cm->cubemap_tex->get_ram_image(),
-                                                                   cm->cubemap_tex->get_ram_image_compression(),
-                                                                   cm->cubemap_tex->get_ram_image_size() );
+                                input->cubemap_tex = cm->cubemap_tex;
                                 input->cubemap_changed = true;
-                                loadcubemap_collector.stop();
                         }
-                        
                 }
 
                 // Cache the last position.
@@ -615,11 +763,15 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         }
         interp_ac_collector.stop();
 
+        // A node that was just created or came from another level has
+        // nothing to show in the meantime, so it is always traced right away.
+        bool defer_visibility = pos_changed && cfg_lightbatchvis.get_value() &&
+                !new_instance && lighting_current;
+        bool trace_visibility = pos_changed && !defer_visibility;
+
         update_locallights_collector.start();
         if ( pos_changed )
         {
-                input->occluded_lights.reset();
-
                 // Update local light sources
                 input->locallights = _light_pvs[leaf_id];
                 // Sort local lights from closest to furthest distance from node, we will choose the two closest lights.
@@ -629,12 +781,30 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
                 } );
 
                 int sky_idx = -1;
-                if ( is_sky_visible( curr_net ) )
+                if ( defer_visibility )
+                {
+                        // Keep the sun as a candidate so the batched trace tests
+                        // the sky. Like the other lights, it is only shown if
+                        // the last trace saw it, until the new results are in.
+                        if ( _sunlight != nullptr )
+                        {
+                                input->locallights.insert( input->locallights.begin(), _sunlight );
+                                sky_idx = 0;
+                        }
+                        queue_visibility_update( input, curr_net );
+                }
+                else
                 {
-                        // If we hit the sky from current position, sunlight takes
-                        // precedence over all other local light sources.
-			input->locallights.insert( input->locallights.begin(), _sunlight );
-                        sky_idx = 0;
+                        input->occluded_lights.clear();
+                        input->sky_visible = is_sky_visible( curr_net );
+
+                        if ( input->sky_visible )
+                        {
+                                // If we hit the sky from current position, sunlight takes
+                                // precedence over all other local light sources.
+                                input->locallights.insert( input->locallights.begin(), _sunlight );
+                                sky_idx = 0;
+                        }
                 }
 
                 input->sky_idx = sky_idx;
@@ -677,19 +847,17 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         {
                 light_t *light = input->locallights[i];
 
-                bool occluded = false;
-
-                if ( pos_changed )
+                if ( trace_visibility )
                 {
                         if ( i != input->sky_idx && !is_light_visible( curr_net, light ) )
                         {
                                 // The light is occluded, don't add it.
-                                input->occluded_lights.set( i );
-                                occluded = true;
+                                input->occluded_lights.set_bit( light->id );
                         }
                 }
 
-                if ( occluded || input->occluded_lights.test( i ) )
+                if ( (int)i == input->sky_idx ? !input->sky_visible :
+                     input->occluded_lights.get_bit( light->id ) )
                 {
                         // light occluded
                         continue;
@@ -890,16 +1058,81 @@ void AmbientProbeManager::xform_lights( const TransformState *cam_trans )
         }
 }
 
-template<class T>
-T AmbientProbeManager::find_closest_in_kdtree( KDTree *tree, const LPoint3 &pos,
-                                               const pvector<T> &items )
+/**
+ * Returns the ambient probe in the indicated leaf closest to the position,
+ * or nullptr if the leaf has no probes.
+ */
+ambientprobe_t *AmbientProbeManager::find_closest_probe( int leaf, const LPoint3 &pos ) const
+{
+        if ( leaf < 0 || leaf >= (int)_probe_grids.size() )
+        {
+                return nullptr;
+        }
+
+        int n = _probe_grids[leaf].find_nearest( pos );
+        if ( n == -1 )
+        {
+                return nullptr;
+        }
+
+        int itr = _probes.find( leaf );
+        nassertr( itr != -1, nullptr );
+        return _probes.get_data( itr )[n];
+}
+
+/**
+ * Returns the cubemap closest to the position, or nullptr if the level has
+ * no cubemaps.
+ */
+cubemap_t *AmbientProbeManager::find_closest_cubemap( const LPoint3 &pos ) const
 {
-        if ( !tree )
+        int n = _cubemap_grid.find_nearest( pos );
+        if ( n == -1 )
+        {
                 return nullptr;
+        }
+
+        return _cubemaps[n];
+}
 
-        std::vector<double> data = { pos[0], pos[1], pos[2] };
-        auto res = tree->query( data );
-        return items[res.first];
+/**
+ * Takes one node update from this frame's light-update-budget. Returns false
+ * if the budget is used up and the node should wait for a later frame.
+ */
+bool AmbientProbeManager::consume_update_budget()
+{
+        int budget = cfg_lightupdatebudget.get_value();
+        if ( budget <= 0 )
+        {
+                return true;
+        }
+
+        AtomicAdjust::Integer frame = ClockObject::get_global_clock()->get_frame_count();
+        AtomicAdjust::Integer last_frame = AtomicAdjust::get( _budget_frame );
+        if ( last_frame != frame &&
+             AtomicAdjust::compare_and_exchange( _budget_frame, last_frame, frame ) == last_frame )
+        {
+                // First update of a new frame.
+                AtomicAdjust::set( _budget_used, 0 );
+        }
+
+        return AtomicAdjust::add( _budget_used, 1 ) <= budget;
+}
+
+/**
+ * Returns the cubemap that nodes use before they have been assigned one from
+ * the level.
+ */
+Texture *CNodeShaderInput::get_blank_cubemap()
+{
+        static PT( Texture ) blank = []()
+        {
+                PT( Texture ) tex = new Texture( "cubemap_image" );
+                tex->setup_cube_map( 32, Texture::T_unsigned_byte, Texture::F_rgb8 );
+                tex->clear_image();
+                return tex;
+        }();
+        return blank;
 }
 
 void AmbientProbeManager::cleanup()
@@ -907,13 +1140,14 @@ void AmbientProbeManager::cleanup()
         MutexHolder holder( _cache_mutex );
 
         _sunlight = nullptr;
-        //_probe_kdtree = nullptr;
-        //_light_kdtree = nullptr;
-        _envmap_kdtree = nullptr;
-        _probe_kdtrees.clear();
+        _cubemap_grid.clear();
+        _probe_grids.clear();
         _probes.clear();
         _all_probes.clear();
         _light_pvs.clear();
         _all_lights.clear();
         _cubemaps.clear();
+
+        LightMutexHolder pending_holder( _pending_lock );
+        _pending_visibility.clear();
 }
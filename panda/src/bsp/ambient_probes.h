@@ -22,18 +22,20 @@
 #include <cullableObject.h>
 #include <shaderAttrib.h>
 #include <updateSeq.h>
+#include <lightMutex.h>
+#include <atomicAdjust.h>
+#include <bitArray.h>
 
 #include <unordered_map>
-#include <bitset>
-
-#include "kdtree/KDTree.h"
 
 #include "config_bsp.h"
+#include "nearest_point_grid.h"
 
 class BSPLoader;
 struct dleafambientindex_t;
 struct dleafambientlighting_t;
 class cubemap_t;
+class RayTraceHitResult;
 
 enum
 {
@@ -106,11 +108,24 @@ public:
 
         ambientprobe_t *amb_probe;
         cubemap_t *cubemap;
+        // Shared with the cubemap_t, or the blank cubemap.
         PT( Texture ) cubemap_tex;
         bool cubemap_changed;
         pvector<light_t *> locallights;
         int sky_idx;
-        std::bitset<0xFFF> occluded_lights;
+        // Whether the sky was visible from the node when it was last traced.
+        bool sky_visible;
+        // Indexed by light id.
+        BitArray occluded_lights;
+
+        // Position the light visibility rays were queued from, when
+        // visibility is traced in batches.
+        LPoint3 lighting_pos;
+        bool visibility_pending;
+
+        // Nodes may be updated from any cull thread, this guards the
+        // lighting state of this one node.
+        LightMutex lock;
 
         CPT( RenderState ) state_with_input;
         CPT( TransformState ) last_transform;
@@ -126,10 +141,13 @@ public:
                 active_lights = other->active_lights;
         }
 
+        static Texture *get_blank_cubemap();
+
         INLINE CNodeShaderInput( const CNodeShaderInput *other ) :
                 TypedReferenceCount()
         {
                 copy_needed( other );
+                visibility_pending = false;
         }
 
         CNodeShaderInput() :
@@ -146,10 +164,10 @@ public:
                 cubemap = nullptr;
                 state_with_input = nullptr;
                 last_transform = nullptr;
-                cubemap_tex = new Texture( "cubemap_image" );
-		cubemap_tex->setup_cube_map( 32, Texture::T_unsigned_byte, Texture::F_rgb8 );
-                cubemap_tex->clear_image();
+                cubemap_tex = get_blank_cubemap();
                 sky_idx = -1;
+                sky_visible = false;
+                visibility_pending = false;
                 active_lights = 0;
                 ambient_boost = false;
                 memset( boxcolor, 0, sizeof( LVector3 ) * 6 );
@@ -165,8 +183,11 @@ public:
                 amb_probe( other.amb_probe ),
                 locallights( other.locallights ),
                 sky_idx( other.sky_idx ),
+                sky_visible( other.sky_visible ),
                 active_lights( other.active_lights ),
                 occluded_lights( other.occluded_lights ),
+                lighting_pos( other.lighting_pos ),
+                visibility_pending( false ),
                 cubemap_tex( other.cubemap_tex ),
                 state_with_input( other.state_with_input ),
                 last_transform( other.last_transform )
@@ -199,34 +220,15 @@ public:
         void process_ambient_probes();
 
 	const RenderState *update_node( PandaNode *node, CPT( TransformState ) net_ts, bool should_update = true );
+        void trace_pending_visibility();
 
         void load_cubemaps();
 
-        template<class T>
-        T find_closest_in_kdtree( KDTree *tree, const LPoint3 &pos,
-                                  const pvector<T> &items );
-
-        template<class T>
-        T find_closest_n_in_kdtree( KDTree *tree, const LPoint3 &pos,
-                                  const pvector<T> &items, int n );
+        ambientprobe_t *find_closest_probe( int leaf, const LPoint3 &pos ) const;
+        cubemap_t *find_closest_cubemap( const LPoint3 &pos ) const;
 
         void cleanup();
 
-        //INLINE KDTree *get_light_kdtree() const
-        //{
-        //        return _light_kdtree;
-        //}
-        INLINE KDTree *get_envmap_kdtree() const
-        {
-                return _envmap_kdtree;
-        }
-        INLINE KDTree *get_probe_kdtree( int leaf ) const
-        {
-                int itr = _probe_kdtrees.find( leaf );
-                if ( itr == -1 )
-                        return nullptr;
-                return _probe_kdtrees.get_data( itr );
-        }
         INLINE const pvector<PT( cubemap_t )> &get_cubemaps()
         {
                 return _cubemaps;
@@ -242,23 +244,26 @@ public:
         void xform_lights( const TransformState *cam_trans );
 
 private:
+        INLINE bool is_sky_hit( const RayTraceHitResult &result ) const;
         INLINE bool is_sky_visible( const LPoint3 &point );
         INLINE bool is_light_visible( const LPoint3 &point, const light_t *light );
+        bool consume_update_budget();
+        void queue_visibility_update( CNodeShaderInput *input, const LPoint3 &pos );
 
 private:
         BSPLoader *_loader;
 
         // NodePaths to be influenced by the ambient probes.
         SimpleHashMap<int, pvector<PT( ambientprobe_t )>, int_hash> _probes;
-        SimpleHashMap<int, PT( KDTree ), int_hash> _probe_kdtrees;
+        // Indexed by leaf.
+        pvector<NearestPointGrid> _probe_grids;
         pvector<ambientprobe_t *> _all_probes;
         pvector<PT( light_t )> _all_lights;
         pvector<PT( cubemap_t )> _cubemaps;
         pvector<pvector<light_t *>> _light_pvs;
         light_t *_sunlight;
 
-       // PT( KDTree ) _light_kdtree;
-        PT( KDTree ) _envmap_kdtree;
+        NearestPointGrid _cubemap_grid;
 
         NodePath _vis_root;
 
@@ -266,8 +271,20 @@ private:
 
         double _last_garbage_collect_time;
 
+        // Only guards attaching lighting state to new nodes, and the level
+        // data while it is being built or torn down. The level data is
+        // read-only while a level is active, so nodes are otherwise updated
+        // in parallel.
         Mutex _cache_mutex;
 
+        // Nodes that moved and are waiting on a batched visibility trace.
+        pvector<PT( CNodeShaderInput )> _pending_visibility;
+        LightMutex _pending_lock;
+
+        // Number of nodes that have refreshed their lighting this frame.
+        AtomicAdjust::Integer _budget_frame;
+        AtomicAdjust::Integer _budget_used;
+
 public:
         friend class NodeWeakCallback;
 };
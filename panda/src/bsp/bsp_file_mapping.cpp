@@ -0,0 +1,203 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file bsp_file_mapping.cpp
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#include "bsp_file_mapping.h"
+#include "bsploader.h"
+
+#include <virtualFileSystem.h>
+#include <virtualFileSimple.h>
+#include <subfileInfo.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+BSPFileMapping::BSPFileMapping() :
+        _data( nullptr ),
+        _size( 0 ),
+        _map_base( nullptr ),
+        _map_size( 0 )
+#ifdef _WIN32
+        , _file_handle( nullptr ),
+        _map_handle( nullptr )
+#endif
+{
+}
+
+BSPFileMapping::~BSPFileMapping()
+{
+        close();
+}
+
+/**
+ * Makes the contents of the indicated file available through get_data().
+ * Returns false if the file could not be read at all.
+ */
+bool BSPFileMapping::open( const Filename &filename, bool allow_mapping )
+{
+        close();
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        PT( VirtualFile ) vfile = vfs->get_file( filename );
+        if ( vfile == nullptr )
+        {
+                return false;
+        }
+
+        if ( allow_mapping )
+        {
+                // An implicit .pz file reports the compressed bytes on disk,
+                // those have to go through the VFS.
+                bool implicit_pz = vfile->is_of_type( VirtualFileSimple::get_class_type() ) &&
+                        DCAST( VirtualFileSimple, vfile )->is_implicit_pz_file();
+
+                SubfileInfo info;
+                if ( !implicit_pz && vfile->get_system_info( info ) &&
+                     map_subfile( info.get_filename(), (size_t)info.get_start(), (size_t)info.get_size() ) )
+                {
+                        return true;
+                }
+        }
+
+        if ( !vfile->read_file( _buffer, true ) || _buffer.empty() )
+        {
+                _buffer.clear();
+                return false;
+        }
+
+        _data = _buffer.data();
+        _size = _buffer.size();
+        return true;
+}
+
+/**
+ * Releases the mapping or buffer. Anything referring into get_data() is no
+ * longer valid afterwards.
+ */
+void BSPFileMapping::close()
+{
+#ifdef _WIN32
+        if ( _map_base != nullptr )
+        {
+                UnmapViewOfFile( _map_base );
+        }
+        if ( _map_handle != nullptr )
+        {
+                CloseHandle( (HANDLE)_map_handle );
+        }
+        if ( _file_handle != nullptr )
+        {
+                CloseHandle( (HANDLE)_file_handle );
+        }
+        _map_handle = nullptr;
+        _file_handle = nullptr;
+#else
+        if ( _map_base != nullptr )
+        {
+                munmap( _map_base, _map_size );
+        }
+#endif
+        _map_base = nullptr;
+        _map_size = 0;
+
+        _buffer.clear();
+        _buffer.shrink_to_fit();
+
+        _data = nullptr;
+        _size = 0;
+}
+
+/**
+ * Maps the byte range [start, start + size) of the indicated physical file.
+ * The view is copy-on-write, so stray writes never reach the file.
+ */
+bool BSPFileMapping::map_subfile( const Filename &filename, size_t start, size_t size )
+{
+        if ( size == 0 )
+        {
+                return false;
+        }
+
+        std::string os_filename = filename.to_os_specific();
+
+#ifdef _WIN32
+        SYSTEM_INFO sysinfo;
+        GetSystemInfo( &sysinfo );
+        size_t granularity = sysinfo.dwAllocationGranularity;
+        size_t aligned_start = start - ( start % granularity );
+        size_t slack = start - aligned_start;
+
+        HANDLE file = CreateFileA( os_filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                   nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        if ( file == INVALID_HANDLE_VALUE )
+        {
+                return false;
+        }
+
+        HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr );
+        if ( mapping == nullptr )
+        {
+                CloseHandle( file );
+                return false;
+        }
+
+        void *base = MapViewOfFile( mapping, FILE_MAP_COPY,
+                                    (DWORD)( (unsigned long long)aligned_start >> 32 ),
+                                    (DWORD)( aligned_start & 0xFFFFFFFF ),
+                                    slack + size );
+        if ( base == nullptr )
+        {
+                CloseHandle( mapping );
+                CloseHandle( file );
+                return false;
+        }
+
+        _file_handle = file;
+        _map_handle = mapping;
+#else
+        size_t granularity = (size_t)sysconf( _SC_PAGESIZE );
+        size_t aligned_start = start - ( start % granularity );
+        size_t slack = start - aligned_start;
+
+        int fd = ::open( os_filename.c_str(), O_RDONLY );
+        if ( fd < 0 )
+        {
+                return false;
+        }
+
+        void *base = mmap( nullptr, slack + size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                           fd, (off_t)aligned_start );
+        // The mapping holds its own reference to the file.
+        ::close( fd );
+        if ( base == MAP_FAILED )
+        {
+                return false;
+        }
+#endif
+
+        _map_base = base;
+        _map_size = slack + size;
+        _data = (unsigned char *)base + slack;
+        _size = size;
+
+        bspfile_cat.debug()
+                << "Mapped " << size << " bytes of " << filename
+                << " at offset " << start << "\n";
+
+        return true;
+}
@@ -0,0 +1,77 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file bsp_file_mapping.h
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#ifndef BSP_FILE_MAPPING_H
+#define BSP_FILE_MAPPING_H
+
+#include "config_bsp.h"
+
+#include <filename.h>
+#include <vector_uchar.h>
+
+/**
+ * Keeps the bytes of a .bsp file resident for the lifetime of a level, so the
+ * lumps in bspdata_t can refer directly into it.
+ *
+ * When the file lives directly on disk, either loose or as an uncompressed,
+ * unencrypted Multifile subfile, it is memory-mapped copy-on-write and pages
+ * are only faulted in as the loader touches them. Otherwise the file is read
+ * once into a single buffer owned by this object.
+ */
+class EXPCL_PANDABSP BSPFileMapping
+{
+public:
+        BSPFileMapping();
+        ~BSPFileMapping();
+
+        bool open( const Filename &filename, bool allow_mapping = true );
+        void close();
+
+        INLINE const unsigned char *get_data() const
+        {
+                return _data;
+        }
+        INLINE size_t get_size() const
+        {
+                return _size;
+        }
+        INLINE bool is_open() const
+        {
+                return _data != nullptr;
+        }
+        INLINE bool is_mapped() const
+        {
+                return _map_base != nullptr;
+        }
+
+private:
+        bool map_subfile( const Filename &os_filename, size_t start, size_t size );
+
+        BSPFileMapping( const BSPFileMapping & ) = delete;
+        BSPFileMapping &operator =( const BSPFileMapping & ) = delete;
+
+private:
+        unsigned char *_data;
+        size_t _size;
+
+        // Page-aligned view backing _data when the file is mapped.
+        void *_map_base;
+        size_t _map_size;
+#ifdef _WIN32
+        void *_file_handle;
+        void *_map_handle;
+#endif
+
+        // Backing store when the file could not be mapped.
+        vector_uchar _buffer;
+};
+
+#endif // BSP_FILE_MAPPING_H
@@ -27,7 +27,6 @@
 static PStatCollector pvs_test_geom_collector( "Cull:BSP:AddForDraw:Geom_LeafBoundsIntersect" );
 static PStatCollector pvs_test_node_collector( "Cull:BSP:Node_LeafBoundsIntersect" );
 static PStatCollector pvs_xform_collector( "Cull:BSP:AddForDraw:Geom_LeafBoundsXForm" );
-static PStatCollector pvs_node_xform_collector( "Cull:BSP:Node_LeafBoundsXForm" );
 static PStatCollector addfordraw_collector( "Cull:BSP:AddForDraw" );
 static PStatCollector findgeomshader_collector( "Cull:BSP:FindGeomShader" );
 static PStatCollector applyshaderattrib_collector( "Cull:BSP:ApplyShaderAttrib" );
@@ -42,6 +41,9 @@ BSPCullTraverser::BSPCullTraverser( CullTraverser *trav, BSPLoader *loader ) :
         CullTraverser( *trav ),
         _loader( loader )
 {
+        // Grab the visible leafs once for the whole traversal, they are
+        // immutable so no further locking is needed.
+        _visible_leafs = loader->get_visible_leaf_set();
 }
 
 bool BSPCullTraverser::is_in_view( CullTraverserData &data )
@@ -67,14 +69,10 @@ bool BSPCullTraverser::is_in_view( CullTraverserData &data )
 		// View frustum test passed.
 		// Now test against PVS (AABBs of all potentially visible leafs).
 
-		pvs_node_xform_collector.start();
-		CPT( GeometricBoundingVolume ) bbox = loader->make_net_bounds(
-			data.get_net_transform( this ),
-			data.node()->get_bounds()->as_geometric_bounding_volume() );
-		pvs_node_xform_collector.stop();
-
 		pvs_test_node_collector.start();
-		bool ret = loader->pvs_bounds_test( bbox, get_required_leaf_flags() );
+		bool ret = loader->pvs_node_test( _visible_leafs, data.node(),
+						  data.get_net_transform( this ),
+						  get_required_leaf_flags() );
 		pvs_test_node_collector.stop();
 		return ret;
 	}
@@ -178,7 +176,7 @@ INLINE void BSPCullTraverser::add_geomnode_for_draw( GeomNode *node, CullTravers
 					pvs_test_geom_collector.start();
 					// Test geom bounds against visible leaf bounding boxes.
 					// Always test against PVS even if camera's bit isn't set in CAMERA_MASK_CULLING.
-					if ( !loader->pvs_bounds_test( net_geom_volume, get_required_leaf_flags() ) )
+					if ( !loader->pvs_bounds_test( _visible_leafs, net_geom_volume, get_required_leaf_flags() ) )
 					{
 						// Didn't intersect any, cull.
 						pvs_test_geom_collector.stop();
@@ -252,11 +250,12 @@ void BSPCullTraverser::traverse_below( CullTraverserData &data )
 			keep_going = false;
 
 			_loader->_leaf_aabb_lock.acquire();
-			bool should_render = _loader->_curr_leaf_idx != 0;
+			int curr_leaf = _visible_leafs != nullptr ? _visible_leafs->get_leaf() : 0;
+			bool should_render = curr_leaf != 0;
 
 			if ( should_render )
 			{
-				const GeomNode::Geoms &world_geoms = _loader->_leaf_world_geoms[_loader->_curr_leaf_idx];
+				const GeomNode::Geoms &world_geoms = _loader->_leaf_world_geoms[curr_leaf];
 
 				int num_world_geoms = world_geoms.get_num_geoms();
 				for ( int i = 0; i < num_world_geoms; i++ )
@@ -419,19 +418,24 @@ BSPRender::BSPRender( const std::string &name, BSPLoader *loader ) :
 
 bool BSPRender::cull_callback( CullTraverser *trav, CullTraverserData &data )
 {
-        BSPCullTraverser bsp_trav( trav, _loader );
-        bsp_trav.local_object();
-
-	if ( bsp_trav.has_camera_bits( CAMERA_MAIN ) && _loader->has_visibility() )
+	if ( ( trav->get_camera_mask() & CAMERA_MAIN ) != 0u && _loader->has_visibility() )
 	{
-		// Update visible leafs on main camera pass.
+		// Update visible leafs on main camera pass, before the traverser
+		// takes its snapshot of them.
 		_loader->update_visibility(
 			trav->get_camera_transform()->get_pos() );
 	}
 
+        BSPCullTraverser bsp_trav( trav, _loader );
+        bsp_trav.local_object();
+
         bsp_trav.traverse_below( data );
         bsp_trav.end_traverse();
 
+        // Trace the light visibility of every node that moved during this
+        // traversal in one go.
+        _loader->_amb_probe_mgr.trace_pending_visibility();
+
         // No need for CullTraverser to go further down this node,
         // the BSPCullTraverser has already handled it.
         return false;
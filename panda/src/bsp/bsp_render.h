@@ -24,6 +24,7 @@
 #include "shader_generator.h"
 
 class BSPLoader;
+class VisibleLeafSet;
 class CNodeShaderInput;
 
 class EXPCL_PANDABSP BSPCullTraverser : public CullTraverser
@@ -69,6 +70,7 @@ private:
 
 private:
         BSPLoader *_loader;
+        CPT( VisibleLeafSet ) _visible_leafs;
 };
 
 /**
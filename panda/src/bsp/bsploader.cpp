@@ -14,6 +14,7 @@
 #include "bsp_render.h"
 #include "bspfile.h"
 #include "mathlib.h"
+#include "mathlib/ssemath.h"
 #include "bsp_material.h"
 #include "cubemaps.h"
 #include "shader_generator.h"
@@ -24,9 +25,14 @@
 
 #include <array>
 #include <bitset>
+#include <thread>
+#include <tuple>
+#include <float.h>
 #include <math.h>
 
 #include <asyncTaskManager.h>
+#include <asyncTaskChain.h>
+#include <genericAsyncTask.h>
 #include <eggData.h>
 #include <eggPolygon.h>
 #include <eggVertexUV.h>
@@ -34,6 +40,7 @@
 #include <geomNode.h>
 #include <load_egg_file.h>
 #include <loader.h>
+#include <pset.h>
 #include <nodePathCollection.h>
 #include <pointLight.h>
 #include <randomizer.h>
@@ -60,6 +67,9 @@
 #include <lightReMutexHolder.h>
 #include <geomVertexData.h>
 #include <geomVertexRewriter.h>
+#include <geomVertexWriter.h>
+#include <geomVertexFormat.h>
+#include <geomTriangles.h>
 #include <sceneGraphReducer.h>
 #include <characterJointEffect.h>
 #include <orthographicLens.h>
@@ -72,14 +82,36 @@
 #include <bulletTriangleMeshShape.h>
 #include <bulletWorld.h>
 #include <omniBoundingVolume.h>
+#include <clockObject.h>
+#include <pbitops.h>
+#include <finiteBoundingVolume.h>
+
+static ConfigVariableBool bsp_map_levels
+( "bsp-map-levels", true, "Memory-map level files when they reside directly on disk, instead of reading them into memory." );
 
 static LVector3 default_shadow_dir( 0.5, 0, -0.9 );
 static LVector4 default_shadow_color( 0.5, 0.5, 0.5, 1.0 );
 
 static PT( InternalName ) static_vertex_lighting_name = InternalName::make( "static_vertex_lighting" );
+static PT( InternalName ) instance_matrix_name = InternalName::make( "instanceMatrix" );
 
 static ConfigVariableBool dumpcubemaps( "dumpcubemaps", false );
 
+static ConfigVariableInt bsp_preload_threads
+( "bsp-preload-threads", -1, "Number of threads to load a level's materials, textures and static props on before its geometry is built.  -1 uses one per core, 0 loads them as they are needed." );
+
+static ConfigVariableBool bsp_prewarm_shaders
+( "bsp-prewarm-shaders", true, "Generate and compile the shaders for the whole level while it is loading, instead of as things come into view." );
+
+static ConfigVariableBool bsp_instance_static_props
+( "bsp-instance-static-props", false, "Draw the statically lit props of the same model with one instanced draw per Geom, instead of a node per prop.  Off by default, since the shaders don't implement the STATIC_PROP_INSTANCED permutation yet." );
+
+static ConfigVariableDouble bsp_static_prop_instance_cell
+( "bsp-static-prop-instance-cell", 2048.0, "Size in Hammer units of the grid cells static prop instances are grouped by, so the groups can still be culled by the PVS.  0 groups the whole level together." );
+
+static ConfigVariableBool bsp_batch_world_faces
+( "bsp-batch-world-faces", true, "Build the world's faces straight into one vertex buffer per lightmap palette and draw the faces visible from each leaf in one batch per material, instead of making a Geom per face through egg." );
+
 static const pvector<std::string> world_entities =
 {
 	"worldspawn",
@@ -172,6 +204,9 @@ size_t BSPFaceAttrib::get_hash_impl() const
 // where 1 Hammer unit is 0.0625 Panda units.
 #define LEAF_NUDGE 1.0
 
+// Frames a cached node PVS result survives without being asked for.
+#define PVS_NODE_CACHE_LIFETIME 120
+
 int BSPLoader::extract_modelnum_s( entity_t *ent )
 {
         string model = ValueForKey( ent, "model" );
@@ -392,6 +427,158 @@ PT( EggVertex ) BSPLoader::make_vertex( EggVertexPool *vpool, EggPolygon *poly,
         return v;
 }
 
+struct preloaditem_t
+{
+        std::string name;
+        bool want_textures;
+};
+
+/**
+ * Loads the textures a material's shader will ask for, with the same
+ * arguments, so the shader finds them in the TexturePool.
+ */
+static void preload_material_textures( const BSPMaterial *mat )
+{
+        static const char *texture_keys[] = { "$bumpmap", "$detail", "$lightwarp", "$arme" };
+
+        if ( mat->has_keyvalue( "$basetexture" ) )
+        {
+                if ( mat->has_keyvalue( "$basetexture_alpha" ) )
+                {
+                        TexturePool::load_texture( mat->get_keyvalue( "$basetexture" ),
+                                                   mat->get_keyvalue( "$basetexture_alpha" ) );
+                }
+                else
+                {
+                        TexturePool::load_texture( mat->get_keyvalue( "$basetexture" ) );
+                }
+        }
+
+        for ( size_t i = 0; i < sizeof( texture_keys ) / sizeof( texture_keys[0] ); i++ )
+        {
+                if ( mat->has_keyvalue( texture_keys[i] ) )
+                {
+                        TexturePool::load_texture( mat->get_keyvalue( texture_keys[i] ) );
+                }
+        }
+
+        if ( mat->has_keyvalue( "$envmap" ) && mat->get_keyvalue( "$envmap" ) != "env_cubemap" )
+        {
+                TexturePool::load_cube_map( mat->get_keyvalue( "$envmap" ) );
+        }
+}
+
+static AsyncTask::DoneStatus preload_material_task( GenericAsyncTask *task, void *data )
+{
+        preloaditem_t *item = (preloaditem_t *)data;
+        const BSPMaterial *mat = BSPMaterial::get_from_file( item->name );
+        if ( mat != nullptr && item->want_textures )
+        {
+                preload_material_textures( mat );
+        }
+        return AsyncTask::DS_done;
+}
+
+static AsyncTask::DoneStatus preload_prop_task( GenericAsyncTask *task, void *data )
+{
+        preloaditem_t *item = (preloaditem_t *)data;
+
+        // The model stays in the ModelPool for load_static_props().
+        PT( PandaNode ) model = Loader::get_global_ptr()->load_sync( item->name );
+        if ( model == nullptr )
+        {
+                return AsyncTask::DS_done;
+        }
+
+        NodePathCollection npc = NodePath( model ).find_all_matches( "**/+GeomNode" );
+        for ( int i = 0; i < npc.get_num_paths(); i++ )
+        {
+                GeomNode *gn = DCAST( GeomNode, npc.get_path( i ).node() );
+                for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                {
+                        const BSPMaterialAttrib *bma;
+                        if ( gn->get_geom_state( j )->get_attrib( bma ) && bma->get_material() != nullptr )
+                        {
+                                preload_material_textures( bma->get_material() );
+                        }
+                }
+        }
+
+        return AsyncTask::DS_done;
+}
+
+/**
+ * Loads the materials named by the texref lump, the textures they use, and
+ * the static prop models on a pool of threads, before the level geometry is
+ * built.  Building the geometry then finds all of them already in their
+ * caches, instead of loading them one at a time.
+ */
+void BSPLoader::preload_resources()
+{
+        int num_threads = 0;
+        if ( Thread::is_threading_supported() )
+        {
+                num_threads = bsp_preload_threads.get_value();
+                if ( num_threads < 0 )
+                {
+                        num_threads = std::max( (int)std::thread::hardware_concurrency(), 1 );
+                }
+        }
+        if ( num_threads == 0 )
+        {
+                return;
+        }
+
+        pvector<preloaditem_t> materials;
+        pvector<preloaditem_t> props;
+        pset<std::string> seen;
+
+        for ( int i = 0; i < _bspdata->numtexrefs; i++ )
+        {
+                std::string name = _bspdata->dtexrefs[i].name;
+                if ( seen.insert( name ).second )
+                {
+                        materials.push_back( { name, !_ai } );
+                }
+        }
+
+        if ( !_ai )
+        {
+                for ( size_t i = 0; i < _bspdata->dstaticprops.size(); i++ )
+                {
+                        std::string name = _bspdata->dstaticprops[i].name;
+                        if ( seen.insert( name ).second )
+                        {
+                                props.push_back( { name, true } );
+                        }
+                }
+        }
+
+        AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+        AsyncTaskChain *chain = mgr->make_task_chain( "bsp_preload" );
+        chain->set_num_threads( num_threads );
+
+        // Props first, they take the longest.
+        for ( size_t i = 0; i < props.size(); i++ )
+        {
+                PT( GenericAsyncTask ) task = new GenericAsyncTask( "preload-prop", preload_prop_task, &props[i] );
+                task->set_task_chain( "bsp_preload" );
+                mgr->add( task );
+        }
+        for ( size_t i = 0; i < materials.size(); i++ )
+        {
+                PT( GenericAsyncTask ) task = new GenericAsyncTask( "preload-material", preload_material_task, &materials[i] );
+                task->set_task_chain( "bsp_preload" );
+                mgr->add( task );
+        }
+
+        chain->wait_for_tasks();
+
+        bspfile_cat.info()
+                << "Preloaded " << materials.size() << " materials and "
+                << props.size() << " static props on " << num_threads << " threads\n";
+}
+
 CPT( BSPMaterial ) BSPLoader::try_load_texref( texref_t *tref )
 {
         if ( _texref_materials.find( tref ) != _texref_materials.end() )
@@ -769,6 +956,122 @@ void BSPLoader::init_dface_lightmap_info( dface_lightmap_info_t *info, int facen
 	info->t_scale = info->texsize[1] * info->t_scale;
 }
 
+struct worldvertex_t
+{
+        LPoint3 pos;
+        LNormal normal;
+        LTexCoord uv;
+        LTexCoord lightmap_uv;
+        LVector3 tangent;
+        LVector3 binormal;
+        LVector3 lightmap_tangent;
+        LVector3 lightmap_binormal;
+};
+
+/**
+ * The world faces collected by make_faces(), before build_world_batches()
+ * writes them into vertex and index buffers.
+ */
+struct worldfacebuilder_t
+{
+        struct facebatch_t
+        {
+                int palette;
+                CPT( RenderState ) state;
+                pvector<int> faces;
+        };
+
+        // One vertex list per lightmap palette.
+        pvector<pvector<worldvertex_t>> palettes;
+        pmap<const LightmapPaletteDirectory::LightmapPaletteEntry *, int> palette_index;
+        pvector<facebatch_t> batches;
+        pmap<std::pair<int, const RenderState *>, int> batch_index;
+
+        // Where each face's vertices are in its palette's list, by facenum.
+        pvector<int> first_vertex;
+        pvector<int> num_vertices;
+
+        void add_face( int facenum, const LightmapPaletteDirectory::LightmapPaletteEntry *palette,
+                       const RenderState *state, const pvector<worldvertex_t> &verts )
+        {
+                auto pitr = palette_index.insert( std::make_pair( palette, (int)palettes.size() ) ).first;
+                if ( pitr->second == (int)palettes.size() )
+                {
+                        palettes.push_back( pvector<worldvertex_t>() );
+                }
+                pvector<worldvertex_t> &pverts = palettes[pitr->second];
+
+                auto bitr = batch_index.insert( std::make_pair( std::make_pair( pitr->second, state ),
+                                                                (int)batches.size() ) ).first;
+                if ( bitr->second == (int)batches.size() )
+                {
+                        facebatch_t batch;
+                        batch.palette = pitr->second;
+                        batch.state = state;
+                        batches.push_back( batch );
+                }
+                batches[bitr->second].faces.push_back( facenum );
+
+                first_vertex[facenum] = (int)pverts.size();
+                num_vertices[facenum] = (int)verts.size();
+                pverts.insert( pverts.end(), verts.begin(), verts.end() );
+        }
+};
+
+/**
+ * Computes the tangent and binormal of each vertex of a face the same way
+ * EggGroupNode::recompute_tangent_binormal() does, from the triangle the
+ * vertex makes with its two neighbors.
+ */
+static void compute_face_tangent_binormal( pvector<worldvertex_t> &verts,
+                                           LTexCoord worldvertex_t::*uv,
+                                           LVector3 worldvertex_t::*tangent,
+                                           LVector3 worldvertex_t::*binormal )
+{
+        size_t count = verts.size();
+        for ( size_t i = 0; i < count; i++ )
+        {
+                worldvertex_t &v1 = verts[i];
+                const worldvertex_t &v2 = verts[( i + 1 ) % count];
+                const worldvertex_t &v3 = verts[( i + count - 1 ) % count];
+
+                LVector3 x1 = v2.pos - v1.pos;
+                LVector3 x2 = v3.pos - v1.pos;
+                LVector2 w1 = v2.*uv - v1.*uv;
+                LVector2 w2 = v3.*uv - v1.*uv;
+
+                LVector3 sdir( 0 );
+                LVector3 tdir( 0 );
+                PN_stdfloat denom = w1[0] * w2[1] - w2[0] * w1[1];
+                if ( denom != 0.0f )
+                {
+                        sdir = ( x1 * w2[1] - x2 * w1[1] ) / denom;
+                        tdir = ( x2 * w1[0] - x1 * w2[0] ) / denom;
+                }
+
+                if ( !sdir.normalize() )
+                {
+                        sdir.set( 1, 0, 0 );
+                }
+                if ( !tdir.normalize() )
+                {
+                        tdir = sdir.cross( LVector3( 0, 0, -1 ) );
+                }
+
+                LVector3 t = sdir - v1.normal * v1.normal.dot( sdir );
+                t.normalize();
+                LVector3 b = v1.normal.cross( t );
+                if ( b.dot( tdir ) < 0.0f )
+                {
+                        b = -b;
+                }
+                b.normalize();
+
+                v1.*tangent = t;
+                v1.*binormal = b;
+        }
+}
+
 void BSPLoader::make_faces()
 {
         bspfile_cat.info()
@@ -788,6 +1091,13 @@ void BSPLoader::make_faces()
 
 	_model_data.resize( _bspdata->nummodels );
 
+        // The world's faces are written straight into batched vertex data by
+        // build_world_batches(), brush entities still go through egg.
+        bool batch_world = bsp_batch_world_faces;
+        worldfacebuilder_t builder;
+        builder.first_vertex.resize( _bspdata->numfaces, -1 );
+        builder.num_vertices.resize( _bspdata->numfaces, 0 );
+
         // In BSP files, models are brushes that have been grouped together to be used as an entity.
         // We can group all of the face GeomNodes of the model to a root node.
         for ( int modelnum = 0; modelnum < _bspdata->nummodels; modelnum++ )
@@ -806,7 +1116,7 @@ void BSPLoader::make_faces()
 		mdata.model_root = modelroot;
 		mdata.origin = center;
 		mdata.origin_matrix = LMatrix4f::translate_mat( center );
-		NodePath rbcnp = NodePath( mdata.decal_rbc );
+		NodePath rbcnp = NodePath( mdata.decal_node );
 		if ( modelnum != 0 )
 		{
 			rbcnp.reparent_to( mdata.model_root );
@@ -823,16 +1133,23 @@ void BSPLoader::make_faces()
 
                 for ( int facenum = firstface; facenum < firstface + numfaces; facenum++ )
                 {
-                        PT( EggData ) data = new EggData;
-                        PT( EggVertexPool ) vpool = new EggVertexPool( "facevpool" );
-                        data->add_child( vpool );
+                        bool batched = batch_world && modelnum == 0;
+
+                        PT( EggData ) data;
+                        PT( EggVertexPool ) vpool;
+                        PT( EggPolygon ) poly;
+                        if ( !batched )
+                        {
+                                data = new EggData;
+                                vpool = new EggVertexPool( "facevpool" );
+                                data->add_child( vpool );
+                                poly = new EggPolygon;
+                                data->add_child( poly );
+                        }
 
                         dface_t *face = &_bspdata->dfaces[facenum];
 			_dface_dmodels[face] = model;
 
-                        PT( EggPolygon ) poly = new EggPolygon;
-                        data->add_child( poly );
-
                         texinfo_t *texinfo = &_bspdata->texinfo[face->texinfo];
 
                         texref_t *texref = &_bspdata->dtexrefs[texinfo->texref];
@@ -886,6 +1203,15 @@ void BSPLoader::make_faces()
                         LVertexd centroid( 0 );
                         int verts = 0;
 
+                        pvector<worldvertex_t> face_verts;
+                        double df_width = 1.0;
+                        double df_height = 1.0;
+                        if ( tex != nullptr )
+                        {
+                                df_width = tex->get_orig_file_x_size();
+                                df_height = tex->get_orig_file_y_size();
+                        }
+
                         for ( int j = face->numedges - 1; j >= 0; j-- )
                         {
                                 LNormald normal( 0 );
@@ -911,6 +1237,21 @@ void BSPLoader::make_faces()
 					index = 1;
 				}
 
+				if ( batched )
+				{
+					dvertex_t *vert = &_bspdata->dvertexes[edge->v[index]];
+					worldvertex_t wv;
+					wv.pos.set( vert->point[0], vert->point[1], vert->point[2] );
+					wv.normal = LCAST( PN_stdfloat, normal );
+					LTexCoord uv = get_vertex_uv( texinfo, vert );
+					wv.uv.set( uv[0] / df_width, -uv[1] / df_height );
+					wv.lightmap_uv = get_lightcoords( facenum, wv.pos );
+					face_verts.push_back( wv );
+					centroid += LCAST( double, wv.pos );
+					verts++;
+					continue;
+				}
+
 				PT( EggVertex ) v = make_vertex( vpool, poly, edge, texinfo,
 					face, index, tex );
 				v->set_normal( normal );
@@ -920,14 +1261,31 @@ void BSPLoader::make_faces()
 				verts++;
                         }
 
-                        data->remove_unused_vertices( true );
-                        data->remove_invalid_primitives( true );
+                        NodePath faceroot;
+                        if ( batched )
+                        {
+                                if ( face_verts.size() < 3 )
+                                {
+                                        continue;
+                                }
+
+                                centroid /= verts;
+
+                                // The face isn't a node of its own, this just
+                                // collects its render state.
+                                faceroot = NodePath( "face" );
+                        }
+                        else
+                        {
+                                data->remove_unused_vertices( true );
+                                data->remove_invalid_primitives( true );
 
-                        centroid /= verts;
+                                centroid /= verts;
 
-                        data->recompute_tangent_binormal( GlobPattern( "*" ) );
+                                data->recompute_tangent_binormal( GlobPattern( "*" ) );
 
-                        NodePath faceroot = _result.attach_new_node( load_egg_data( data ) );
+                                faceroot = _result.attach_new_node( load_egg_data( data ) );
+                        }
 
                         if ( has_transparency )
                         {
@@ -955,7 +1313,10 @@ void BSPLoader::make_faces()
                                 }
                         }
 
-                        faceroot.wrt_reparent_to( modelroot );
+                        if ( !batched )
+                        {
+                                faceroot.wrt_reparent_to( modelroot );
+                        }
 
                         if ( bspmat->has_keyvalue( "$envmap" ) )
                         {
@@ -978,6 +1339,20 @@ void BSPLoader::make_faces()
 
                         faceroot.set_attrib( BSPMaterialAttrib::make( bspmat ) );
 
+                        if ( batched )
+                        {
+                                if ( !skip )
+                                {
+                                        compute_face_tangent_binormal( face_verts, &worldvertex_t::uv,
+                                                                       &worldvertex_t::tangent, &worldvertex_t::binormal );
+                                        compute_face_tangent_binormal( face_verts, &worldvertex_t::lightmap_uv,
+                                                                       &worldvertex_t::lightmap_tangent, &worldvertex_t::lightmap_binormal );
+                                        builder.add_face( facenum, has_lighting ? lminfo.palette_entry->palette : nullptr,
+                                                          faceroot.get_state(), face_verts );
+                                }
+                                continue;
+                        }
+
                         NodePathCollection gn_npc = faceroot.find_all_matches( "**/+GeomNode" );
                         for ( int i = 0; i < gn_npc.get_num_paths(); i++ )
                         {
@@ -998,111 +1373,399 @@ void BSPLoader::make_faces()
                 }
         }
 
+        build_world_batches( builder );
+
         bspfile_cat.info()
                 << "Finished making faces.\n";
 }
 
-LColor color_from_rgb_scalar( vec_t *color )
-{
-        double scalar = color[3];
-        return LColor( color[0] * scalar / 255.0,
-                       color[1] * scalar / 255.0,
-                       color[2] * scalar / 255.0,
-                       1.0 );
-}
-
-LColor color_from_value( const string &value, bool scale, bool gamma )
+static CPT( GeomVertexFormat ) get_world_vertex_format()
 {
-        double r, g, b, s;
-        sscanf( value.c_str(), "%lf %lf %lf %lf", &r, &g, &b, &s );
-
-	r /= 255.0;
-	g /= 255.0;
-	b /= 255.0;
-
-	if ( gamma )
-	{
-		r = pow( r, 2.2f );
-		g = pow( g, 2.2f );
-		b = pow( b, 2.2f );
-	}
-
-        if ( scale )
+        static CPT( GeomVertexFormat ) format = nullptr;
+        if ( format == nullptr )
         {
-                r *= s / 255.0;
-                g *= s / 255.0;
-                b *= s / 255.0;
+                PT( GeomVertexArrayFormat ) array = new GeomVertexArrayFormat;
+                array->add_column( InternalName::get_vertex(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_point );
+                array->add_column( InternalName::get_normal(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_normal );
+                array->add_column( InternalName::get_texcoord(), 2, GeomEnums::NT_stdfloat, GeomEnums::C_texcoord );
+                array->add_column( InternalName::get_texcoord_name( "lightmap" ), 2,
+                                   GeomEnums::NT_stdfloat, GeomEnums::C_texcoord );
+                array->add_column( InternalName::get_tangent(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_vector );
+                array->add_column( InternalName::get_binormal(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_vector );
+                array->add_column( InternalName::get_tangent_name( "lightmap" ), 3,
+                                   GeomEnums::NT_stdfloat, GeomEnums::C_vector );
+                array->add_column( InternalName::get_binormal_name( "lightmap" ), 3,
+                                   GeomEnums::NT_stdfloat, GeomEnums::C_vector );
+                format = GeomVertexFormat::register_format( array );
         }
 
-        LColor col( r, g, b, 1.0 );
-
-        return col;
+        return format;
 }
 
-int BSPLoader::extract_modelnum( int entnum )
+/**
+ * Writes the world faces collected by make_faces() into one GeomVertexData
+ * per lightmap palette, and the faces of each batch into an index list with
+ * a range per leaf.  Each face is owned by the first leaf it is in, and is
+ * also remembered as shared if other leafs have it too.
+ */
+void BSPLoader::build_world_batches( worldfacebuilder_t &builder )
 {
-        return extract_modelnum_s( _bspdata->entities + entnum );
-}
+        _world_batches.clear();
 
-void BSPLoader::get_model_bounds( int modelnum, LPoint3 &mins, LPoint3 &maxs )
-{
-        dmodel_t *mdl = _bspdata->dmodels + modelnum;
-        VectorCopy( mdl->mins, mins );
-        VectorCopy( mdl->maxs, maxs );
-        mins /= 16.0;
-        maxs /= 16.0;
-}
+        int numfaces = _bspdata->numfaces;
+        int numleafs = _bspdata->dmodels[0].visleafs + 1;
 
-void BuildGeomNodes_r( PandaNode *node, pvector<PT( GeomNode )> &list )
-{
-        if ( node->is_of_type( GeomNode::get_class_type() ) )
+        pvector<int> counts( numfaces, 0 );
+        for ( int leafnum = 1; leafnum < numleafs; leafnum++ )
         {
-                list.push_back( DCAST( GeomNode, node ) );
+                const dleaf_t *leaf = _bspdata->dleafs + leafnum;
+                for ( int i = 0; i < leaf->nummarksurfaces; i++ )
+                {
+                        counts[_bspdata->dmarksurfaces[leaf->firstmarksurface + i]]++;
+                }
+        }
+        _face_leafs_start.resize( numfaces + 1 );
+        _face_leafs_start[0] = 0;
+        for ( int i = 0; i < numfaces; i++ )
+        {
+                _face_leafs_start[i + 1] = _face_leafs_start[i] + counts[i];
+                counts[i] = 0;
+        }
+        _face_leafs.resize( _face_leafs_start[numfaces] );
+        for ( int leafnum = 1; leafnum < numleafs; leafnum++ )
+        {
+                const dleaf_t *leaf = _bspdata->dleafs + leafnum;
+                for ( int i = 0; i < leaf->nummarksurfaces; i++ )
+                {
+                        int facenum = _bspdata->dmarksurfaces[leaf->firstmarksurface + i];
+                        _face_leafs[_face_leafs_start[facenum] + counts[facenum]++] = leafnum;
+                }
         }
 
-        for ( int i = 0; i < node->get_num_children(); i++ )
+        CPT( GeomVertexFormat ) format = get_world_vertex_format();
+        pvector<CPT( GeomVertexData )> vdatas;
+        for ( size_t i = 0; i < builder.palettes.size(); i++ )
         {
-                BuildGeomNodes_r( node->get_child( i ), list );
+                const pvector<worldvertex_t> &verts = builder.palettes[i];
+
+                PT( GeomVertexData ) vdata = new GeomVertexData( "world", format, GeomEnums::UH_static );
+                vdata->unclean_set_num_rows( (int)verts.size() );
+                GeomVertexWriter vwriter( vdata, InternalName::get_vertex() );
+                GeomVertexWriter nwriter( vdata, InternalName::get_normal() );
+                GeomVertexWriter twriter( vdata, InternalName::get_texcoord() );
+                GeomVertexWriter lwriter( vdata, InternalName::get_texcoord_name( "lightmap" ) );
+                GeomVertexWriter tanwriter( vdata, InternalName::get_tangent() );
+                GeomVertexWriter binwriter( vdata, InternalName::get_binormal() );
+                GeomVertexWriter ltanwriter( vdata, InternalName::get_tangent_name( "lightmap" ) );
+                GeomVertexWriter lbinwriter( vdata, InternalName::get_binormal_name( "lightmap" ) );
+                for ( size_t j = 0; j < verts.size(); j++ )
+                {
+                        const worldvertex_t &v = verts[j];
+                        // Hammer units, like the egg path.  The world is
+                        // drawn with model 0's transform, which scales it.
+                        vwriter.set_data3( v.pos );
+                        nwriter.set_data3( v.normal );
+                        twriter.set_data2( v.uv );
+                        lwriter.set_data2( v.lightmap_uv );
+                        tanwriter.set_data3( v.tangent );
+                        binwriter.set_data3( v.binormal );
+                        ltanwriter.set_data3( v.lightmap_tangent );
+                        lbinwriter.set_data3( v.lightmap_binormal );
+                }
+
+                vdatas.push_back( vdata );
         }
-}
 
-pvector<PT( GeomNode )> BuildGeomNodes( const NodePath &root )
-{
-        pvector<PT( GeomNode )> list;
+        for ( size_t i = 0; i < builder.batches.size(); i++ )
+        {
+                worldfacebuilder_t::facebatch_t &fb = builder.batches[i];
 
-        BuildGeomNodes_r( root.node(), list );
+                // Group the faces by the leaf that owns them.  Faces that
+                // aren't in any leaf come first and are owned by leaf 0.
+                pvector<std::pair<int, int>> faces;
+                faces.reserve( fb.faces.size() );
+                for ( size_t j = 0; j < fb.faces.size(); j++ )
+                {
+                        int facenum = fb.faces[j];
+                        int start = _face_leafs_start[facenum];
+                        int owner = start != _face_leafs_start[facenum + 1] ? _face_leafs[start] : 0;
+                        faces.push_back( std::make_pair( owner, facenum ) );
+                }
+                std::sort( faces.begin(), faces.end() );
 
-        return list;
-}
+                worldbatch_t batch;
+                batch.state = fb.state;
+                batch.vdata = vdatas[fb.palette];
+                batch.index_type = builder.palettes[fb.palette].size() > 0xffff ?
+                        GeomEnums::NT_uint32 : GeomEnums::NT_uint16;
 
-struct VDataDef
-{
-        CPT( GeomVertexData ) vdata;
-        CPT( Geom ) geom;
-};
+                for ( size_t j = 0; j < faces.size(); j++ )
+                {
+                        int owner = faces[j].first;
+                        int facenum = faces[j].second;
 
-struct GNWG_result
-{
-        PT( GeomNode ) geomnode;
-        int geomidx;
-};
+                        if ( batch.ranges.empty() || batch.ranges.back().leaf != owner )
+                        {
+                                worldbatch_t::leafrange_t range;
+                                range.leaf = owner;
+                                range.first_index = (unsigned int)batch.indices.size();
+                                range.num_indices = 0;
+                                range.first_shared = (unsigned int)batch.shared.size();
+                                range.num_shared = 0;
+                                batch.ranges.push_back( range );
+                        }
+                        worldbatch_t::leafrange_t &range = batch.ranges.back();
 
-INLINE GNWG_result get_geomnode_with_geom( const NodePath &root, CPT( Geom ) geom )
-{
-        GNWG_result result;
-        result.geomnode = nullptr;
+                        // Triangle fan, in the order the vertices were added.
+                        unsigned int first_index = (unsigned int)batch.indices.size();
+                        uint32_t first_vertex = builder.first_vertex[facenum];
+                        for ( int k = 1; k + 1 < builder.num_vertices[facenum]; k++ )
+                        {
+                                batch.indices.push_back( first_vertex );
+                                batch.indices.push_back( first_vertex + k );
+                                batch.indices.push_back( first_vertex + k + 1 );
+                        }
+                        unsigned int num_indices = (unsigned int)batch.indices.size() - first_index;
+                        range.num_indices += num_indices;
 
-        NodePathCollection npc = root.find_all_matches( "**/+GeomNode" );
-        for ( int i = 0; i < npc.get_num_paths(); i++ )
-        {
-                PT( GeomNode ) gn = DCAST( GeomNode, npc.get_path( i ).node() );
-                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                {
-                        CPT( Geom ) g = gn->get_geom( j );
-                        if ( geom == g )
+                        if ( _face_leafs_start[facenum + 1] - _face_leafs_start[facenum] > 1 )
                         {
-                                result.geomnode = gn;
-                                result.geomidx = j;
+                                worldbatch_t::sharedface_t shared;
+                                shared.facenum = facenum;
+                                shared.first_index = first_index;
+                                shared.num_indices = num_indices;
+                                batch.shared.push_back( shared );
+                                range.num_shared++;
+                        }
+                }
+
+                _world_batches.push_back( batch );
+        }
+
+        bspfile_cat.info()
+                << "Batched world faces into " << _world_batches.size() << " batches on "
+                << vdatas.size() << " vertex buffers.\n";
+}
+
+/**
+ * Gathers the world faces visible from the indicated leaf into one Geom per
+ * batch.  Called with _leaf_aabb_lock held for every leaf when the level is
+ * loaded.
+ */
+void BSPLoader::build_leaf_world_geoms( int leaf )
+{
+        PT( GeomNode ) lgn = new GeomNode( "leafnode" );
+
+        pvector<uint32_t> indices;
+        for ( size_t i = 0; i < _world_batches.size(); i++ )
+        {
+                const worldbatch_t &batch = _world_batches[i];
+
+                indices.clear();
+                for ( size_t j = 0; j < batch.ranges.size(); j++ )
+                {
+                        const worldbatch_t::leafrange_t &range = batch.ranges[j];
+                        if ( range.leaf == 0 || is_cluster_visible( leaf, range.leaf ) )
+                        {
+                                indices.insert( indices.end(),
+                                                batch.indices.begin() + range.first_index,
+                                                batch.indices.begin() + range.first_index + range.num_indices );
+                                continue;
+                        }
+
+                        // We can't see the leaf that owns these faces, but
+                        // we might see another leaf that has one of them.
+                        for ( unsigned int k = range.first_shared; k < range.first_shared + range.num_shared; k++ )
+                        {
+                                const worldbatch_t::sharedface_t &shared = batch.shared[k];
+                                for ( int l = _face_leafs_start[shared.facenum] + 1;
+                                      l < _face_leafs_start[shared.facenum + 1]; l++ )
+                                {
+                                        if ( is_cluster_visible( leaf, _face_leafs[l] ) )
+                                        {
+                                                indices.insert( indices.end(),
+                                                                batch.indices.begin() + shared.first_index,
+                                                                batch.indices.begin() + shared.first_index + shared.num_indices );
+                                                break;
+                                        }
+                                }
+                        }
+                }
+
+                if ( indices.empty() )
+                {
+                        continue;
+                }
+
+                PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_static );
+                tris->set_index_type( batch.index_type );
+                PT( GeomVertexArrayData ) index_data = tris->make_index_data();
+                index_data->unclean_set_num_rows( (int)indices.size() );
+                {
+                        PT( GeomVertexArrayDataHandle ) handle = index_data->modify_handle();
+                        unsigned char *ptr = handle->get_write_pointer();
+                        if ( batch.index_type == GeomEnums::NT_uint16 )
+                        {
+                                uint16_t *dest = (uint16_t *)ptr;
+                                for ( size_t j = 0; j < indices.size(); j++ )
+                                {
+                                        dest[j] = (uint16_t)indices[j];
+                                }
+                        }
+                        else
+                        {
+                                memcpy( ptr, indices.data(), indices.size() * sizeof( uint32_t ) );
+                        }
+                }
+                tris->set_vertices( index_data );
+
+                PT( Geom ) geom = new Geom( batch.vdata );
+                geom->add_primitive( tris );
+                geom->set_bounds_type( BoundingVolume::BT_box );
+                lgn->add_geom( geom, batch.state );
+        }
+
+        if ( _world_extra_geoms != nullptr )
+        {
+                PT( GeomNode ) egn = new GeomNode( "leafextras" );
+                NodePath extranode( egn );
+
+                int numvisleafs = _bspdata->dmodels[0].visleafs + 1;
+                for ( int geomnum = 0; geomnum < _world_extra_geoms->get_num_geoms(); geomnum++ )
+                {
+                        const Geom *geom = _world_extra_geoms->get_geom( geomnum );
+
+                        // We are going to assume that world Geoms are already in world space
+                        // ( and they definitely should be )
+                        CPT( GeometricBoundingVolume ) geom_gbv = geom->get_bounds()
+                                ->as_geometric_bounding_volume();
+
+                        for ( int pvsidx = 1; pvsidx < numvisleafs; pvsidx++ )
+                        {
+                                if ( !is_cluster_visible( leaf, pvsidx ) )
+                                        continue;
+
+                                BoundingBox *leaf_bounds = _leaf_bboxs[pvsidx];
+
+                                if ( leaf_bounds->contains( geom_gbv ) != BoundingVolume::IF_no_intersection )
+                                {
+                                        egn->add_geom( _world_extra_geoms->modify_geom( geomnum ),
+                                                       _world_extra_geoms->get_geom_state( geomnum ) );
+                                        break;
+                                }
+                        }
+                }
+
+                // aggressively combine all geoms visibible from this leaf
+                extranode.clear_model_nodes();
+                extranode.flatten_strong();
+                lgn->add_geoms_from( egn );
+        }
+
+        _leaf_world_geoms[leaf] = lgn->get_geoms();
+}
+
+LColor color_from_rgb_scalar( vec_t *color )
+{
+        double scalar = color[3];
+        return LColor( color[0] * scalar / 255.0,
+                       color[1] * scalar / 255.0,
+                       color[2] * scalar / 255.0,
+                       1.0 );
+}
+
+LColor color_from_value( const string &value, bool scale, bool gamma )
+{
+        double r, g, b, s;
+        sscanf( value.c_str(), "%lf %lf %lf %lf", &r, &g, &b, &s );
+
+	r /= 255.0;
+	g /= 255.0;
+	b /= 255.0;
+
+	if ( gamma )
+	{
+		r = pow( r, 2.2f );
+		g = pow( g, 2.2f );
+		b = pow( b, 2.2f );
+	}
+
+        if ( scale )
+        {
+                r *= s / 255.0;
+                g *= s / 255.0;
+                b *= s / 255.0;
+        }
+
+        LColor col( r, g, b, 1.0 );
+
+        return col;
+}
+
+int BSPLoader::extract_modelnum( int entnum )
+{
+        return extract_modelnum_s( _bspdata->entities + entnum );
+}
+
+void BSPLoader::get_model_bounds( int modelnum, LPoint3 &mins, LPoint3 &maxs )
+{
+        dmodel_t *mdl = _bspdata->dmodels + modelnum;
+        VectorCopy( mdl->mins, mins );
+        VectorCopy( mdl->maxs, maxs );
+        mins /= 16.0;
+        maxs /= 16.0;
+}
+
+void BuildGeomNodes_r( PandaNode *node, pvector<PT( GeomNode )> &list )
+{
+        if ( node->is_of_type( GeomNode::get_class_type() ) )
+        {
+                list.push_back( DCAST( GeomNode, node ) );
+        }
+
+        for ( int i = 0; i < node->get_num_children(); i++ )
+        {
+                BuildGeomNodes_r( node->get_child( i ), list );
+        }
+}
+
+pvector<PT( GeomNode )> BuildGeomNodes( const NodePath &root )
+{
+        pvector<PT( GeomNode )> list;
+
+        BuildGeomNodes_r( root.node(), list );
+
+        return list;
+}
+
+struct VDataDef
+{
+        CPT( GeomVertexData ) vdata;
+        CPT( Geom ) geom;
+};
+
+struct GNWG_result
+{
+        PT( GeomNode ) geomnode;
+        int geomidx;
+};
+
+INLINE GNWG_result get_geomnode_with_geom( const NodePath &root, CPT( Geom ) geom )
+{
+        GNWG_result result;
+        result.geomnode = nullptr;
+
+        NodePathCollection npc = root.find_all_matches( "**/+GeomNode" );
+        for ( int i = 0; i < npc.get_num_paths(); i++ )
+        {
+                PT( GeomNode ) gn = DCAST( GeomNode, npc.get_path( i ).node() );
+                for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                {
+                        CPT( Geom ) g = gn->get_geom( j );
+                        if ( geom == g )
+                        {
+                                result.geomnode = gn;
+                                result.geomidx = j;
                         }
                 }
         }
@@ -1124,27 +1787,407 @@ void BSPLoader::clear_model_nodes_below( const NodePath &top )
         }
 }
 
+/**
+ * Returns a vertex data that shares all of the arrays of the indicated one,
+ * plus a new array to hold the baked per-vertex lighting of a single prop.
+ * Every instance of the prop then shares the model's vertex buffers and
+ * only has a buffer of its own for the lighting.
+ */
+static PT( GeomVertexData ) make_static_lighting_vdata( const GeomVertexData *vdata,
+                                                        pmap<CPT( GeomVertexFormat ), CPT( GeomVertexFormat )> &formats )
+{
+        CPT( GeomVertexFormat ) orig_format = vdata->get_format();
+
+        auto fitr = formats.find( orig_format );
+        if ( fitr == formats.end() )
+        {
+                PT( GeomVertexArrayFormat ) array = new GeomVertexArrayFormat;
+                array->add_column( static_vertex_lighting_name, 4, GeomEnums::NT_uint16, GeomEnums::C_color );
+                PT( GeomVertexFormat ) format = new GeomVertexFormat( *orig_format );
+                format->add_array( array );
+                fitr = formats.insert( std::make_pair( orig_format, GeomVertexFormat::register_format( format ) ) ).first;
+        }
+
+        PT( GeomVertexData ) mod_vdata = new GeomVertexData( vdata->get_name(), fitr->second, vdata->get_usage_hint() );
+        for ( size_t i = 0; i < vdata->get_num_arrays(); i++ )
+        {
+                mod_vdata->set_array( i, vdata->get_array( i ) );
+        }
+        mod_vdata->modify_array( vdata->get_num_arrays() )->unclean_set_num_rows( vdata->get_num_rows() );
+        mod_vdata->set_transform_table( vdata->get_transform_table() );
+        mod_vdata->set_transform_blend_table( vdata->get_transform_blend_table() );
+        mod_vdata->set_slider_table( vdata->get_slider_table() );
+
+        return mod_vdata;
+}
+
+/**
+ * Returns true if the baked vertex lighting of a static prop should be
+ * applied to the Geoms of the indicated GeomNode, and sets use_cubemap if
+ * any of them has a material that wants an environment cubemap.
+ */
+static bool wants_static_lighting( const GeomNode *gn, bool &use_cubemap )
+{
+        if ( gn->get_name() == "__lightsource__" )
+        {
+                return false;
+        }
+
+        for ( int j = 0; j < gn->get_num_geoms(); j++ )
+        {
+                const RenderState *state = gn->get_geom_state( j );
+#ifdef CIO
+                // game specific code, yuck
+                //
+                // don't apply vertex lighting to shadow models
+                const TextureAttrib *tattr;
+                if ( state->get_attrib( tattr ) && tattr->get_num_on_stages() != 0 )
+                {
+                        Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
+                        if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
+                             tex->get_name().find( "drop-shadow" ) != string::npos )
+                        {
+                                return false;
+                        }
+                }
+#endif
+                const BSPMaterialAttrib *bma;
+                state->get_attrib_def( bma );
+                if ( bma->get_material() && bma->get_material()->has_env_cubemap() )
+                {
+                        use_cubemap = true;
+                }
+        }
+
+        return true;
+}
+
+#ifdef CIO
+/**
+ * Removes the fake drop shadows from a prop that has lightmap or realtime
+ * depth shadows instead.  GeomNodes with the drop_shadow texture on any of
+ * the RenderStates are completely removed.  It's a little brute force, but
+ * should work.
+ */
+static void strip_drop_shadows( const NodePath &propmdl )
+{
+        NodePathCollection npc = propmdl.find_all_matches( "**/+GeomNode" );
+        for ( int i = 0; i < npc.get_num_paths(); i++ )
+        {
+                NodePath np = npc[i];
+                GeomNode *gn = DCAST( GeomNode, np.node() );
+                for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                {
+                        const RenderState *state = gn->get_geom_state( j );
+                        const TextureAttrib *tattr;
+                        if ( state->get_attrib( tattr ) )
+                        {
+                                if ( tattr->get_num_on_stages() == 0 )
+                                {
+                                        continue;
+                                }
+                                Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
+                                if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
+                                     tex->get_name().find( "drop-shadow" ) != string::npos )
+                                {
+                                        np.remove_node();
+                                }
+                        }
+                }
+        }
+}
+#endif
+
+/**
+ * Returns true if the indicated static prop can be drawn as an instance of
+ * its model.  That is the case for props that only use their baked vertex
+ * lighting, when the lighting still matches the model.
+ */
+static bool can_instance_static_prop( const bspdata_t *bspdata, const dstaticprop_t *prop,
+                                      PandaNode *proto )
+{
+        if ( prop->first_vertex_data == -1 ||
+             ( prop->flags & STATICPROPFLAGS_STATICLIGHTING ) == 0 ||
+             ( prop->flags & ( STATICPROPFLAGS_DYNAMICLIGHTING |
+                               STATICPROPFLAGS_GROUPFLATTEN |
+                               STATICPROPFLAGS_REALSHADOWS ) ) != 0 )
+        {
+                return false;
+        }
+
+        int num_geoms = 0;
+        pvector<PT( GeomNode )> geomnodes = BuildGeomNodes( NodePath( proto ) );
+        for ( size_t i = 0; i < geomnodes.size(); i++ )
+        {
+                GeomNode *gn = geomnodes[i];
+                for ( int j = 0; j < gn->get_num_geoms(); j++ )
+                {
+                        const GeomVertexData *vdata = gn->get_geom( j )->get_vertex_data();
+                        if ( num_geoms >= prop->num_vertex_datas ||
+                             vdata->get_transform_blend_table() != nullptr ||
+                             vdata->get_format()->get_animation().get_animation_type() != GeomEnums::AT_none )
+                        {
+                                return false;
+                        }
+
+                        const dstaticpropvertexdata_t *dvdata =
+                                &bspdata->dstaticpropvertexdatas[prop->first_vertex_data + num_geoms];
+                        if ( dvdata->num_lighting_samples != vdata->get_num_rows() )
+                        {
+                                return false;
+                        }
+                        num_geoms++;
+                }
+        }
+
+        return num_geoms == prop->num_vertex_datas;
+}
+
+/**
+ * The static props of one model, with the same flags and cubemap, in one
+ * cell of the instancing grid.  They are drawn with one instanced draw per
+ * Geom of the model.
+ */
+struct staticpropgroup_t
+{
+        PT( PandaNode ) proto;
+        cubemap_t *cubemap;
+        pvector<LMatrix4> transforms;
+        pvector<const dstaticprop_t *> props;
+};
+
+/**
+ * Makes the node that draws a group of static prop instances.  Each Geom of
+ * the model gets a vertex data that shares the model's arrays, plus an array
+ * with a transform per instance, and a buffer texture with the baked
+ * lighting of every instance.
+ */
+static NodePath make_static_prop_instances( const bspdata_t *bspdata, const std::string &name,
+                                            int flags, const staticpropgroup_t &group,
+                                            pmap<CPT( GeomVertexFormat ), CPT( GeomVertexFormat )> &formats )
+{
+        static CPT( GeomVertexArrayFormat ) instance_format = nullptr;
+        if ( instance_format == nullptr )
+        {
+                PT( GeomVertexArrayFormat ) array = new GeomVertexArrayFormat;
+                array->add_column( instance_matrix_name, 16, GeomEnums::NT_stdfloat, GeomEnums::C_matrix );
+                array->set_divisor( 1 );
+                instance_format = GeomVertexArrayFormat::register_format( array );
+        }
+
+        int num_instances = (int)group.transforms.size();
+
+        PT( GeomVertexArrayData ) instances = new GeomVertexArrayData( instance_format, GeomEnums::UH_static );
+        instances->unclean_set_num_rows( num_instances );
+        {
+                GeomVertexWriter mwriter( instances, 0 );
+                for ( int i = 0; i < num_instances; i++ )
+                {
+                        mwriter.set_matrix4( group.transforms[i] );
+                }
+        }
+
+        // Props with the same model, flags and cubemap are drawn with one
+        // ModelRoot that nothing is allowed to flatten into, since the vertex
+        // data can't be combined with anything else.
+        PT( ModelRoot ) groupnode = new ModelRoot( name );
+        groupnode->set_preserve_transform( ModelNode::PT_no_touch );
+        NodePath groupnp( groupnode );
+        groupnp.set_shader_auto( 1 );
+        groupnp.set_instance_count( num_instances );
+        groupnp.set_light_off( 1 );
+        // These props don't cast depth shadows, and the shadow shaders don't
+        // know about instancing.
+        groupnp.hide( CAMERA_SHADOW );
+
+        NodePath propmdl( group.proto->copy_subgraph() );
+        propmdl.reparent_to( groupnp );
+
+#ifdef CIO
+        if ( flags & STATICPROPFLAGS_LIGHTMAPSHADOWS )
+        {
+                strip_drop_shadows( propmdl );
+        }
+#endif
+
+        bool use_cubemap = false;
+        int geomnum = 0;
+        pvector<PT( GeomNode )> geomnodes = BuildGeomNodes( propmdl );
+        for ( size_t i = 0; i < geomnodes.size(); i++ )
+        {
+                GeomNode *gn = geomnodes[i];
+                bool lit = wants_static_lighting( gn, use_cubemap );
+
+                for ( int j = 0; j < gn->get_num_geoms(); j++, geomnum++ )
+                {
+                        CPT( Geom ) geom = gn->get_geom( j );
+                        const GeomVertexData *vdata = geom->get_vertex_data();
+                        int num_rows = vdata->get_num_rows();
+
+                        CPT( GeomVertexFormat ) orig_format = vdata->get_format();
+                        auto fitr = formats.find( orig_format );
+                        if ( fitr == formats.end() )
+                        {
+                                PT( GeomVertexFormat ) format = new GeomVertexFormat( *orig_format );
+                                format->add_array( instance_format );
+                                fitr = formats.insert( std::make_pair( orig_format, GeomVertexFormat::register_format( format ) ) ).first;
+                        }
+
+                        PT( GeomVertexData ) inst_vdata = new GeomVertexData( vdata->get_name(), fitr->second, vdata->get_usage_hint() );
+                        for ( size_t k = 0; k < vdata->get_num_arrays(); k++ )
+                        {
+                                inst_vdata->set_array( k, vdata->get_array( k ) );
+                        }
+                        inst_vdata->set_array( vdata->get_num_arrays(), instances );
+
+                        // The lighting of instance i for vertex n is texel i * rows + n.
+                        PT( Texture ) lighting = nullptr;
+                        if ( lit )
+                        {
+                                lighting = new Texture( name + "-lighting" );
+                                lighting->setup_buffer_texture( num_rows * num_instances, Texture::T_unsigned_short,
+                                                                Texture::F_rgba16, GeomEnums::UH_static );
+                                PTA_uchar image = lighting->modify_ram_image();
+                                uint16_t *texels = (uint16_t *)image.p();
+                                for ( int inst = 0; inst < num_instances; inst++ )
+                                {
+                                        const dstaticprop_t *prop = group.props[inst];
+                                        const dstaticpropvertexdata_t *dvdata =
+                                                &bspdata->dstaticpropvertexdatas[prop->first_vertex_data + geomnum];
+                                        for ( int n = 0; n < num_rows; n++ )
+                                        {
+                                                const colorrgbexp32_t *sample =
+                                                        &bspdata->staticproplighting[dvdata->first_lighting_sample + n];
+                                                LVector3 vtx_rgb;
+                                                ColorRGBExp32ToVector( *sample, vtx_rgb );
+                                                vtx_rgb /= 255.0f;
+
+                                                // Texture components are stored BGRA.
+                                                uint16_t *texel = texels + ( (size_t)inst * num_rows + n ) * 4;
+                                                texel[0] = (uint16_t)( std::min( std::max( vtx_rgb[2], 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+                                                texel[1] = (uint16_t)( std::min( std::max( vtx_rgb[1], 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+                                                texel[2] = (uint16_t)( std::min( std::max( vtx_rgb[0], 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+                                                texel[3] = 65535;
+                                        }
+                                }
+                        }
+
+                        // The model's bounds put at every instance.
+                        PT( BoundingBox ) bounds = new BoundingBox;
+                        CPT( GeometricBoundingVolume ) geom_gbv = geom->get_bounds()->as_geometric_bounding_volume();
+                        for ( int inst = 0; inst < num_instances; inst++ )
+                        {
+                                PT( GeometricBoundingVolume ) inst_gbv = DCAST( GeometricBoundingVolume, geom_gbv->make_copy() );
+                                inst_gbv->xform( group.transforms[inst] );
+                                bounds->extend_by( inst_gbv );
+                        }
+
+                        PT( Geom ) mod_geom = gn->modify_geom( j );
+                        mod_geom->set_vertex_data( inst_vdata );
+                        mod_geom->set_bounds( bounds );
+                        gn->set_geom_state( j, gn->get_geom_state( j )->set_attrib(
+                                StaticPropAttrib::make_instanced( lighting, num_rows ) ) );
+                }
+        }
+
+        if ( use_cubemap && group.cubemap != nullptr )
+        {
+                groupnp.set_texture( TextureStages::get_cubemap(), group.cubemap->cubemap_tex );
+        }
+
+        if ( flags & STATICPROPFLAGS_DOUBLESIDE )
+        {
+                propmdl.set_two_sided( true, 1 );
+        }
+
+        return groupnp;
+}
+
 void BSPLoader::load_static_props()
 {
         SimpleHashMap<int, NodePath, int_hash> leaf2props;
 
+        // Each model is loaded and flattened once, every instance of it is a
+        // copy that shares its Geoms and vertex data.
+        pmap<std::string, PT( PandaNode )> prototypes;
+        pmap<CPT( GeomVertexFormat ), CPT( GeomVertexFormat )> lighting_formats;
+
+        // Statically lit props are drawn as instances of their model, keyed
+        // by model, flags, cubemap and grid cell.
+        typedef std::tuple<std::string, int, cubemap_t *, int, int, int> PropGroupKey;
+        pmap<PropGroupKey, staticpropgroup_t> groups;
+        pmap<CPT( GeomVertexFormat ), CPT( GeomVertexFormat )> instance_formats;
+
         for ( size_t propnum = 0; propnum < _bspdata->dstaticprops.size(); propnum++ )
         {
                 dstaticprop_t *prop = &_bspdata->dstaticprops[propnum];
 
+                auto pitr = prototypes.find( prop->name );
+                if ( pitr == prototypes.end() )
+                {
+                        PT( PandaNode ) proto = Loader::get_global_ptr()->load_sync( prop->name );
+                        if ( proto == nullptr )
+                        {
+                                bspfile_cat.warning()
+                                        << "Could not load static prop " << prop->name << "\n";
+                        }
+                        else
+                        {
+                                NodePath protonp( proto );
+                                protonp.clear_model_nodes();
+                                protonp.flatten_light();
+                        }
+                        pitr = prototypes.insert( std::make_pair( std::string( prop->name ), proto ) ).first;
+                }
+                if ( pitr->second == nullptr )
+                {
+                        continue;
+                }
+
+                if ( bsp_instance_static_props &&
+                     can_instance_static_prop( _bspdata, prop, pitr->second ) )
+                {
+                        LPoint3 pos;
+                        VectorCopy( prop->pos, pos );
+                        LVector3 hpr;
+                        VectorCopy( prop->hpr, hpr );
+                        LVector3 scale;
+                        VectorCopy( prop->scale, scale );
+
+                        bool use_cubemap = false;
+                        pvector<PT( GeomNode )> geomnodes = BuildGeomNodes( NodePath( pitr->second ) );
+                        for ( size_t i = 0; i < geomnodes.size(); i++ )
+                        {
+                                wants_static_lighting( geomnodes[i], use_cubemap );
+                        }
+                        cubemap_t *cm = use_cubemap ? find_closest_cubemap( pos / 16.0 ) : nullptr;
+
+                        int cell[3] = { 0, 0, 0 };
+                        if ( bsp_static_prop_instance_cell > 0.0 )
+                        {
+                                for ( int i = 0; i < 3; i++ )
+                                {
+                                        cell[i] = (int)floor( pos[i] / bsp_static_prop_instance_cell );
+                                }
+                        }
+
+                        int flags = prop->flags & ( STATICPROPFLAGS_DOUBLESIDE | STATICPROPFLAGS_LIGHTMAPSHADOWS );
+                        staticpropgroup_t &group = groups[std::make_tuple( std::string( prop->name ), flags,
+                                                                             cm, cell[0], cell[1], cell[2] )];
+                        group.proto = pitr->second;
+                        group.cubemap = cm;
+                        group.transforms.push_back( TransformState::make_pos_hpr_scale(
+                                pos / 16.0, LVecBase3( hpr[1] - 90, hpr[0], hpr[2] ), scale )->get_mat() );
+                        group.props.push_back( prop );
+                        continue;
+                }
+
                 PT( BSPProp ) propnode = new BSPProp( prop->name );
                 propnode->set_preserve_transform( ModelNode::PT_local );
                 NodePath propnp = _result.attach_new_node( propnode );
                 propnp.set_shader_auto( 1 );
-                PT( PandaNode ) proproot = Loader::get_global_ptr()->load_sync( prop->name );
-                if ( proproot == nullptr )
-                {
-                        bspfile_cat.warning()
-                                << "Could not load static prop " << prop->name << "\n";
-                        continue;
-                }
 
-                NodePath propmdl( proproot );
+                NodePath propmdl( pitr->second->copy_subgraph() );
                 LPoint3 pos;
                 VectorCopy( prop->pos, pos );
                 LVector3 hpr;
@@ -1155,8 +2198,6 @@ void BSPLoader::load_static_props()
                 propnp.set_hpr( hpr[1] - 90, hpr[0], hpr[2] );
                 propnp.set_scale( scale );
                 propmdl.reparent_to( propnp );
-                propmdl.clear_model_nodes();
-                propmdl.flatten_light();
 
                 entity_t *lightsrc = nullptr;
                 LColor lightsrc_col;
@@ -1218,14 +2259,14 @@ void BSPLoader::load_static_props()
                                 dstaticpropvertexdata_t *dvdata = &_bspdata->dstaticpropvertexdatas[prop->first_vertex_data + i];
                                 VDataDef *def = &vdatadefs[i];
 
-                                PT( GeomVertexData ) mod_vdata = new GeomVertexData( *def->vdata );
-                                if ( !mod_vdata->has_column( static_vertex_lighting_name ) )
+                                PT( GeomVertexData ) mod_vdata;
+                                if ( !def->vdata->has_column( static_vertex_lighting_name ) )
+                                {
+                                        mod_vdata = make_static_lighting_vdata( def->vdata, lighting_formats );
+                                }
+                                else
                                 {
-                                        PT( GeomVertexFormat ) format = new GeomVertexFormat( *mod_vdata->get_format() );
-                                        PT( GeomVertexArrayFormat ) array = format->modify_array( 0 );
-                                        array->add_column( static_vertex_lighting_name, 4, GeomEnums::NT_uint16, GeomEnums::C_color );
-                                        format->set_array( 0, array );
-                                        mod_vdata->set_format( GeomVertexFormat::register_format( format ) );
+                                        mod_vdata = new GeomVertexData( *def->vdata );
                                 }
                                 GeomVertexWriter color_mod( mod_vdata, static_vertex_lighting_name );
 
@@ -1266,53 +2307,10 @@ void BSPLoader::load_static_props()
                                 //        }
                                 //}
 
-                                if ( res.geomnode->get_name() == "__lightsource__" )
+                                if ( !wants_static_lighting( res.geomnode, use_cubemap ) )
                                 {
                                         continue;
                                 }
-                                else
-                                {
-                                        // game specific code, yuck
-                                        //
-                                        // don't apply vertex lighting to shadow models
-#ifdef CIO
-                                        bool shadow_skip = false;
-#endif
- 
-                                        for ( int j = 0; j < res.geomnode->get_num_geoms(); j++ )
-                                        {
-                                                const RenderState *state = res.geomnode->get_geom_state( j );
-#ifdef CIO
-                                                const TextureAttrib *tattr;
-                                                if ( state->get_attrib( tattr ) )
-                                                {
-                                                        if ( tattr->get_num_on_stages() == 0 )
-                                                        {
-                                                                continue;
-                                                        }
-                                                        Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
-                                                        if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
-                                                             tex->get_name().find( "drop-shadow" ) != string::npos )
-                                                        {
-                                                                // don't apply vertex lighting to a shadow model
-                                                                shadow_skip = true;
-                                                                break;
-                                                        }
-                                                }
-#endif
-                                                const BSPMaterialAttrib *bma;
-                                                state->get_attrib_def( bma );
-                                                if ( bma->get_material() && bma->get_material()->has_env_cubemap() )
-                                                {
-                                                        use_cubemap = true;
-                                                }
-                                        }
-
-#ifdef CIO
-                                        if ( shadow_skip )
-                                                continue;
-#endif
-                                }
 
                                 mod_geom->set_vertex_data( mod_vdata );
                                 res.geomnode->set_geom( res.geomidx, mod_geom );
@@ -1340,40 +2338,13 @@ void BSPLoader::load_static_props()
 #ifdef CIO
                 if ( prop->flags & STATICPROPFLAGS_LIGHTMAPSHADOWS ||
                      prop->flags & STATICPROPFLAGS_REALSHADOWS )
-                {
-                        // game specific code!
-
-                        // we want to strip the fake drop shadows
-                        // since we either have lightmap shadows
-                        // or realtime depth shadows
-
-                        // GeomNodes with the drop_shadow texture on any of the RenderStates
-                        // will be completely removed. it's a little brute force, but should work.
-
-                        NodePathCollection npc = propmdl.find_all_matches( "**/+GeomNode" );
-                        for ( int i = 0; i < npc.get_num_paths(); i++ )
-                        {
-                                NodePath np = npc[i];
-                                GeomNode *gn = DCAST( GeomNode, np.node() );
-                                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                                {
-                                        const RenderState *state = gn->get_geom_state( j );
-                                        const TextureAttrib *tattr;
-                                        if ( state->get_attrib( tattr ) )
-                                        {
-                                                if ( tattr->get_num_on_stages() == 0 )
-                                                {
-                                                        continue;
-                                                }
-                                                Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
-                                                if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
-                                                     tex->get_name().find( "drop-shadow" ) != string::npos )
-                                                {
-                                                        np.remove_node();
-                                                }
-                                        }
-                                }
-                        }
+                {
+                        // game specific code!
+
+                        // we want to strip the fake drop shadows
+                        // since we either have lightmap shadows
+                        // or realtime depth shadows
+                        strip_drop_shadows( propmdl );
                 }
 #endif
 
@@ -1438,6 +2409,17 @@ void BSPLoader::load_static_props()
                 clear_model_nodes_below( groupnp );
                 groupnp.flatten_strong();
         }
+
+        size_t num_instances = 0;
+        for ( auto gitr = groups.begin(); gitr != groups.end(); ++gitr )
+        {
+                make_static_prop_instances( _bspdata, std::get<0>( gitr->first ), std::get<1>( gitr->first ),
+                                            gitr->second, instance_formats ).reparent_to( _result );
+                num_instances += gitr->second.transforms.size();
+        }
+        bspfile_cat.info()
+                << "Drawing " << num_instances << " static props as " << groups.size()
+                << " instanced groups.\n";
 }
 
 void BSPLoader::remove_model( int modelnum )
@@ -1469,8 +2451,140 @@ bool BSPLoader::is_cluster_visible( int curr_cluster, int cluster ) const
 
         // 1 means that the specified leaf is visible from the current leaf
         // 0 means it's not
-        int dat = _leaf_pvs[curr_cluster][( cluster - 1 ) >> 3] & ( 1 << ( ( cluster - 1 ) & 7 ) );
-        return dat != 0;
+        return ( get_pvs_row( curr_cluster )[( cluster - 1 ) >> 5] & ( 1u << ( ( cluster - 1 ) & 31 ) ) ) != 0;
+}
+
+VisibleLeafSet::VisibleLeafSet( int leaf ) :
+        _leaf( leaf )
+{
+}
+
+void VisibleLeafSet::add_leaf( int leaf, const LPoint3 &mins, const LPoint3 &maxs, int flags )
+{
+        for ( int i = 0; i < 3; i++ )
+        {
+                _mins[i].push_back( (float)mins[i] );
+                _maxs[i].push_back( (float)maxs[i] );
+        }
+        _flags.push_back( flags );
+        _leafs.push_back( leaf );
+}
+
+/**
+ * Pads the box arrays out to a multiple of four with boxes that can never
+ * intersect anything. Must be called once all leafs have been added.
+ */
+void VisibleLeafSet::finalize()
+{
+        while ( _mins[0].size() & 3 )
+        {
+                for ( int i = 0; i < 3; i++ )
+                {
+                        _mins[i].push_back( FLT_MAX );
+                        _maxs[i].push_back( -FLT_MAX );
+                }
+        }
+}
+
+/**
+ * Tests the indicated box against every visible leaf box, four at a time.
+ * Returns the index of the first visible leaf that intersects the box and
+ * has the required flags, or -1 if there is none.
+ */
+int VisibleLeafSet::test_box( const LPoint3 &mins, const LPoint3 &maxs, unsigned int required_leaf_flags ) const
+{
+        fltx4 qmins[3], qmaxs[3];
+        for ( int i = 0; i < 3; i++ )
+        {
+                qmins[i] = ReplicateX4( (float)mins[i] );
+                qmaxs[i] = ReplicateX4( (float)maxs[i] );
+        }
+
+        size_t num_boxes = _mins[0].size();
+        size_t num_leafs = _leafs.size();
+        for ( size_t i = 0; i < num_boxes; i += 4 )
+        {
+                // Boxes overlap when they overlap on every axis.
+                fltx4 hit = AndSIMD( CmpGeSIMD( qmaxs[0], LoadUnalignedSIMD( &_mins[0][i] ) ),
+                                     CmpLeSIMD( qmins[0], LoadUnalignedSIMD( &_maxs[0][i] ) ) );
+                hit = AndSIMD( hit, CmpGeSIMD( qmaxs[1], LoadUnalignedSIMD( &_mins[1][i] ) ) );
+                hit = AndSIMD( hit, CmpLeSIMD( qmins[1], LoadUnalignedSIMD( &_maxs[1][i] ) ) );
+                hit = AndSIMD( hit, CmpGeSIMD( qmaxs[2], LoadUnalignedSIMD( &_mins[2][i] ) ) );
+                hit = AndSIMD( hit, CmpLeSIMD( qmins[2], LoadUnalignedSIMD( &_maxs[2][i] ) ) );
+
+                int mask = TestSignSIMD( hit );
+                while ( mask != 0 )
+                {
+                        int bit = get_lowest_on_bit( (uint32_t)mask );
+                        mask &= ~( 1 << bit );
+
+                        size_t n = i + bit;
+                        if ( n >= num_leafs )
+                        {
+                                break;
+                        }
+                        if ( required_leaf_flags == 0 || ( _flags[n] & required_leaf_flags ) != 0 )
+                        {
+                                return (int)n;
+                        }
+                }
+        }
+
+        return -1;
+}
+
+/**
+ * Builds the set of leafs potentially visible from the indicated leaf.
+ * Walks the leaf's PVS row a word at a time, skipping empty words.
+ */
+CPT( VisibleLeafSet ) BSPLoader::build_visible_leaf_set( int leaf ) const
+{
+        PT( VisibleLeafSet ) set = new VisibleLeafSet( leaf );
+
+        // Add ourselves to the visible list.
+        set->add_leaf( leaf, _leaf_bboxs[leaf]->get_minq(), _leaf_bboxs[leaf]->get_maxq(),
+                       _bspdata->dleafs[leaf].flags );
+
+        int numvisleafs = _bspdata->dmodels[0].visleafs;
+
+        if ( leaf == 0 || !_has_pvs_data )
+        {
+                // Everything is visible from the solid leaf, and nothing else
+                // is visible from any leaf if we have no PVS.
+                if ( leaf == 0 )
+                {
+                        for ( int i = 1; i < numvisleafs + 1; i++ )
+                        {
+                                set->add_leaf( i, _leaf_bboxs[i]->get_minq(), _leaf_bboxs[i]->get_maxq(),
+                                               _bspdata->dleafs[i].flags );
+                        }
+                }
+                set->finalize();
+                return set;
+        }
+
+        // Bit n of the row is leaf n + 1.
+        const uint32_t *row = get_pvs_row( leaf );
+        for ( int w = 0; w < _pvs_row_words; w++ )
+        {
+                uint32_t word = row[w];
+                while ( word != 0 )
+                {
+                        int bit = get_lowest_on_bit( word );
+                        word &= word - 1;
+
+                        int i = w * 32 + bit + 1;
+                        if ( i == leaf || i > numvisleafs )
+                        {
+                                continue;
+                        }
+                        set->add_leaf( i, _leaf_bboxs[i]->get_minq(), _leaf_bboxs[i]->get_maxq(),
+                                       _bspdata->dleafs[i].flags );
+                }
+        }
+
+        set->finalize();
+        return set;
 }
 
 void BSPLoader::update_leaf( int leaf )
@@ -1478,37 +2592,35 @@ void BSPLoader::update_leaf( int leaf )
 	LightMutexHolder holder( _leaf_aabb_lock );
 
 	_curr_leaf_idx = leaf;
-	_visible_leaf_bboxs.clear();
-	_visible_leafs.clear();
 
-	// Add ourselves to the visible list.
-	_visible_leaf_bboxs.push_back( { _leaf_bboxs[leaf], _bspdata->dleafs[leaf].flags } );
-	_visible_leafs.push_back( leaf );
+        // A leaf's PVS never changes for the life of the level, so each set
+        // is only built the first time we enter the leaf.
+        if ( leaf >= 0 && leaf < (int)_leaf_visible_sets.size() )
+        {
+                if ( _leaf_visible_sets[leaf] == nullptr )
+                {
+                        _leaf_visible_sets[leaf] = build_visible_leaf_set( leaf );
+                }
+                _visible_leaf_set = _leaf_visible_sets[leaf];
+        }
+        else
+        {
+                _visible_leaf_set = nullptr;
+        }
 
 	if ( _vis_leafs )
 	{
-		_leaf_visnp[leaf].set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
-	}
-
-	for ( int i = 1; i < _bspdata->dmodels[0].visleafs + 1; i++ )
-	{
-		if ( i == leaf )
+		for ( int i = 1; i < _bspdata->dmodels[0].visleafs + 1; i++ )
 		{
-			continue;
-		}
-		const dleaf_t *pleaf = &_bspdata->dleafs[i];
-		if ( is_cluster_visible( leaf, i ) )
-		{
-			if ( _vis_leafs )
+			if ( i == leaf )
+			{
+				_leaf_visnp[i].set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
+			}
+			else if ( is_cluster_visible( leaf, i ) )
 			{
 				_leaf_visnp[i].set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
 			}
-			_visible_leaf_bboxs.push_back( { _leaf_bboxs[i], pleaf->flags } );
-			_visible_leafs.push_back( i );
-		}
-		else
-		{
-			if ( _vis_leafs )
+			else
 			{
 				_leaf_visnp[i].set_color_scale( LColor( 1, 0, 0, 1 ), 1 );
 			}
@@ -1516,6 +2628,17 @@ void BSPLoader::update_leaf( int leaf )
 	}
 }
 
+/**
+ * Returns the set of leafs that are potentially visible from the current
+ * leaf. The set is immutable, so it may be tested against without holding
+ * any lock, even after the current leaf changes.
+ */
+CPT( VisibleLeafSet ) BSPLoader::get_visible_leaf_set()
+{
+        LightMutexHolder holder( _leaf_aabb_lock );
+        return _visible_leaf_set;
+}
+
 void BSPLoader::update_visibility( const LPoint3 &pos )
 {
         // Update visibility
@@ -1623,36 +2746,58 @@ bool BSPLoader::read( const Filename &file, bool is_transition )
                 << "Reading " << file.get_fullpath() << "...\n";
         nassertr( vfs->exists( file ), false );
 
-        string data;
-        nassertr( vfs->read_file( file, data, true ), false );
-        int length = data.length();
-        char *buffer = new char[length + 1];
-        memcpy( buffer, data.c_str(), length );
-        _bspdata = LoadBSPImage( (dheader_t *)buffer );
+        // Keep the file resident for the life of the level and let the lumps
+        // refer straight into it, rather than copying every lump out.
+        if ( !_bsp_image.open( file, bsp_map_levels ) )
+        {
+                bspfile_cat.error()
+                        << "Could not read " << file.get_fullpath() << "\n";
+                return false;
+        }
+        _bspdata = LoadBSPImage( (const dheader_t *)_bsp_image.get_data(),
+                                 _bsp_image.get_size(), BSPLOAD_NOCOPY );
 
         _map_file = file;
 
         ParseEntities( _bspdata );
 
         _leaf_aabb_lock.acquire();
-	_leaf_pvs.resize( MAX_MAP_LEAFS );
 	_has_pvs_data = false;
         _leaf_bboxs.resize( MAX_MAP_LEAFS );
-        // Decompress the per leaf visibility data.
-        for ( int i = 0; i < _bspdata->dmodels[0].visleafs + 1; i++ )
-        {
-                dleaf_t *leaf = &_bspdata->dleafs[i];
 
-                uint8_t *pvs = new uint8_t[( MAX_MAP_LEAFS + 7 ) / 8];
-                memset( pvs, 0, ( _bspdata->dmodels[0].visleafs + 7 ) / 8 );
-
-                if ( leaf->visofs != -1 )
+        int numvisleafs = _bspdata->dmodels[0].visleafs;
+        const dvismatrix_t *vismatrix = GetVisMatrix( _bspdata );
+        if ( vismatrix != nullptr && vismatrix->numleafs == numvisleafs + 1 )
+        {
+                // Use the PVS in place, nothing to decompress.
+                _pvs_rows = vismatrix->get_rows();
+                _pvs_leaf_clusters = vismatrix->get_leaf_clusters();
+                _pvs_row_words = vismatrix->rowwords;
+                _has_pvs_data = true;
+        }
+        else
+        {
+                // Decompress the per leaf visibility data into one block.
+                _pvs_row_words = ( numvisleafs + 31 ) >> 5;
+                _pvs_storage.assign( (size_t)( numvisleafs + 1 ) * _pvs_row_words, 0u );
+                for ( int i = 0; i < numvisleafs + 1; i++ )
                 {
-                        DecompressVis( _bspdata, &_bspdata->dvisdata[leaf->visofs], pvs, ( MAX_MAP_LEAFS + 7 ) / 8 );
-                        _has_pvs_data = true;
+                        int visofs = _bspdata->dleafs[i].visofs;
+                        if ( visofs != -1 )
+                        {
+                                DecompressVis( _bspdata, &_bspdata->dvisdata[visofs],
+                                               (byte *)&_pvs_storage[(size_t)i * _pvs_row_words],
+                                               _pvs_row_words * sizeof( uint32_t ) );
+                                _has_pvs_data = true;
+                        }
                 }
+                _pvs_rows = _pvs_storage.data();
+                _pvs_leaf_clusters = nullptr;
+        }
 
-                _leaf_pvs[i] = pvs;
+        for ( int i = 0; i < numvisleafs + 1; i++ )
+        {
+                dleaf_t *leaf = &_bspdata->dleafs[i];
 
                 PT( BoundingBox ) bbox = new BoundingBox(
                         LVector3( ( leaf->mins[0] - LEAF_NUDGE ) / 16.0, ( leaf->mins[1] - LEAF_NUDGE ) / 16.0, ( leaf->mins[2] - LEAF_NUDGE ) / 16.0 ),
@@ -1660,8 +2805,14 @@ bool BSPLoader::read( const Filename &file, bool is_transition )
                 );
                 _leaf_bboxs[i] = bbox;
         }
+        // Visible leaf sets are built as each leaf is entered.
+        _leaf_visible_sets.clear();
+        _leaf_visible_sets.resize( _bspdata->dmodels[0].visleafs + 1 );
+        _visible_leaf_set = nullptr;
         _leaf_aabb_lock.release();
 
+        preload_resources();
+
 	load_geometry();
 
         load_entities();
@@ -1711,6 +2862,11 @@ bool BSPLoader::read( const Filename &file, bool is_transition )
 			// No cascaded shadows
 			_shgen->set_sun_light( NodePath() );
 		}
+
+                if ( bsp_prewarm_shaders )
+                {
+                        prewarm_shaders();
+                }
         }
 
         _colldata = SetupCollisionBSPData( _bspdata );
@@ -1720,6 +2876,22 @@ bool BSPLoader::read( const Filename &file, bool is_transition )
         return true;
 }
 
+/**
+ * Makes the shaders for every face, brush entity and static prop in the
+ * level, so none of them are generated or compiled during gameplay.  With
+ * bsp-shader-cache-dir set, this also fills the disk cache, so loading each
+ * level once prewarms it for later runs.
+ */
+void BSPLoader::prewarm_shaders()
+{
+        if ( _shgen == nullptr || _result.is_empty() )
+        {
+                return;
+        }
+
+        _shgen->prewarm_shaders( _result );
+}
+
 void BSPLoader::setup_raytrace_environment()
 {
 	_trace->add_dmodel( &_bspdata->dmodels[0], TRACETYPE_WORLD );
@@ -1800,7 +2972,7 @@ void BSPLoader::do_optimizations()
 				child.flatten_strong();
                         }
                         
-			mdata.decal_rbc->clear_transform();
+			mdata.decal_node->clear_transform();
                 }
         }
 
@@ -1817,66 +2989,38 @@ void BSPLoader::do_optimizations()
                         npc[i].flatten_strong();
                 }
 
-                // Another very important optimization is to try and flatten all faces together that are in the same PVS
-                // For each leaf, we will combine all potentially visible Geoms into as few batches as possible.
-                // This means that we will be duplicating Geoms (and lose a lot of view frustum culling on worldspawn, but
-                // it is worth it due to fewer batches).
+                // The world's faces were batched by material and lightmap palette when
+                // they were made. Whatever is left under worldspawn now is brush entities
+                // that were merged into it, which are culled against the PVS by their
+                // bounds. The Geoms to render from each leaf are gathered from both
+                // now, so entering a leaf for the first time doesn't hitch.
 
                 NodePath worldspawn = get_model( 0 );
                 NodePath npgn = worldspawn.find( "**/+GeomNode" );
-                PT( GeomNode ) gn = DCAST( GeomNode, npgn.node() );
-                int num_geoms = gn->get_num_geoms();
-                CPT( RenderState ) node_state = npgn.get_net_state();
 
                 int numvisleafs = _bspdata->dmodels[0].visleafs + 1;
 
-                // List of potentially visible Geoms in each leaf
-                // ( concatenation of Geoms in that leaf + Geoms of leafs in PVS )
-                _leaf_world_geoms.clear();
-                _leaf_world_geoms.resize( numvisleafs + 1 );
-
                 _leaf_aabb_lock.acquire();
 
-                for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
-                {
-                        // Build a list of worldspawn Geoms that we can render from this leaf.
-                        // We will then flatten those Geoms into as few batches as possible.
-
-                        PT( GeomNode ) lgn = new GeomNode( "leafnode" );
-                        NodePath leafnode( lgn );
+                _world_extra_geoms = npgn.is_empty() ? nullptr : DCAST( GeomNode, npgn.node() );
 
-                        for ( int geomnum = 0; geomnum < num_geoms; geomnum++ )
-                        {
-                                const Geom *geom = gn->get_geom( geomnum );
-
-                                // We are going to assume that world Geoms are already in world space
-                                // ( and they definitely should be )
-                                CPT( GeometricBoundingVolume ) geom_gbv = geom->get_bounds()
-                                        ->as_geometric_bounding_volume();
-
-                                for ( size_t pvsidx = 1; pvsidx < numvisleafs; pvsidx++ )
-                                {
-                                        if ( !is_cluster_visible( leafnum, pvsidx ) )
-                                                continue;
-
-                                        BoundingBox *leaf_bounds = _leaf_bboxs[pvsidx];
-
-                                        if ( leaf_bounds->contains( geom_gbv ) != BoundingVolume::IF_no_intersection )
-                                        {
-                                                lgn->add_geom( gn->modify_geom( geomnum ), gn->get_geom_state( geomnum ) );
-                                                break;
-                                        }
-                                }
-                        }
-
-                        // aggressively combine all geoms visibible from this leaf
-                        leafnode.clear_model_nodes();
-                        leafnode.flatten_strong();
-
-                        // We've created a batched list of Geoms to render when we are in this leaf.
-                        _leaf_world_geoms[leafnum] = lgn->get_geoms();
+                _leaf_world_geoms.clear();
+                _leaf_world_geoms.resize( numvisleafs + 1 );
+                for ( int leaf = 1; leaf < numvisleafs; leaf++ )
+                {
+                        build_leaf_world_geoms( leaf );
                 }
 
+                // The leaf Geoms share the batches' vertex data, the rest
+                // was only needed to build them.
+                _world_batches.clear();
+                _world_batches.shrink_to_fit();
+                _face_leafs_start.clear();
+                _face_leafs_start.shrink_to_fit();
+                _face_leafs.clear();
+                _face_leafs.shrink_to_fit();
+                _world_extra_geoms = nullptr;
+
                 _leaf_aabb_lock.release();
         }
 
@@ -1929,7 +3073,7 @@ cubemap_t *BSPLoader::find_closest_cubemap( const LPoint3 &pos )
         if ( !_amb_probe_mgr.get_cubemaps().size() )
                 return nullptr;
 
-        return _amb_probe_mgr.find_closest_in_kdtree( _amb_probe_mgr.get_envmap_kdtree(), pos, _amb_probe_mgr.get_cubemaps() );
+        return _amb_probe_mgr.find_closest_cubemap( pos );
 }
 
 void BSPLoader::load_cubemaps()
@@ -2138,13 +3282,31 @@ void BSPLoader::cleanup( bool is_transition )
         _materials.clear();
 
         _leaf_aabb_lock.acquire();
-	_leaf_pvs.clear();
+        _pvs_rows = nullptr;
+        _pvs_leaf_clusters = nullptr;
+        _pvs_row_words = 0;
+        _pvs_storage.clear();
+        _pvs_storage.shrink_to_fit();
         _leaf_world_geoms.clear();
-        _visible_leafs.clear();
+        _world_batches.clear();
+        _face_leafs_start.clear();
+        _face_leafs.clear();
+        _world_extra_geoms = nullptr;
         _leaf_bboxs.clear();
-        _visible_leaf_bboxs.clear();
+        _visible_leaf_set = nullptr;
+        _leaf_visible_sets.clear();
         _leaf_aabb_lock.release();
 
+        // Let go of the transforms and bounds held by the node results of
+        // every thread.
+        _pvs_thread_caches_lock.acquire();
+        for ( size_t i = 0; i < _pvs_thread_caches.size(); i++ )
+        {
+                LightMutexHolder cache_holder( _pvs_thread_caches[i]->lock );
+                _pvs_thread_caches[i]->nodes.clear();
+        }
+        _pvs_thread_caches_lock.release();
+
         _has_pvs_data = false;
 
 	cleanup_entities( is_transition );
@@ -2169,6 +3331,9 @@ void BSPLoader::cleanup( bool is_transition )
         if ( _bspdata )
                 delete _bspdata;
         _bspdata = nullptr;
+
+        // The lumps pointed into the image, release it after the bspdata.
+        _bsp_image.close();
 }
 
 void BSPLoader::cleanup_entities( bool is_transition )
@@ -2179,12 +3344,16 @@ void BSPLoader::cleanup_entities( bool is_transition )
 BSPLoader::BSPLoader() :
 	_win( nullptr ),
 	_has_pvs_data( false ),
+        _pvs_rows( nullptr ),
+        _pvs_leaf_clusters( nullptr ),
+        _pvs_row_words( 0 ),
 	_want_visibility( true ),
 	_physics_type( PT_panda ),
 	_vis_leafs( false ),
 	_want_lightmaps( true ),
 	_curr_leaf_idx( -1 ),
 	_leaf_aabb_lock( "leafAABBMutex" ),
+	_pvs_thread_caches_lock( "pvsThreadCachesMutex" ),
 	_gamma( DEFAULT_GAMMA ),
 	_amb_probe_mgr( this ),
 	_decal_mgr( this ),
@@ -2306,28 +3475,182 @@ BSPLoader *BSPLoader::get_global_ptr()
  */
 bool BSPLoader::pvs_bounds_test( const GeometricBoundingVolume *bounds, unsigned int required_leaf_flags )
 {
-        LightMutexHolder holder( _leaf_aabb_lock );
+        CPT( VisibleLeafSet ) set = get_visible_leaf_set();
+        return pvs_bounds_test( set, bounds, required_leaf_flags );
+}
 
-        size_t num_aabbs = _visible_leaf_bboxs.size();
-        for ( size_t i = 0; i < num_aabbs; i++ )
+/**
+ * Checks if the specified bounding volume intersects any of the leafs in the
+ * indicated visible set. Does not take any locks.
+ *
+ * Finite volumes are tested by their axis-aligned bounds, which is
+ * conservative. If hit_leaf is not null, it receives the leaf that
+ * intersected the volume.
+ */
+bool BSPLoader::pvs_bounds_test( const VisibleLeafSet *set, const GeometricBoundingVolume *bounds,
+                                 unsigned int required_leaf_flags, int *hit_leaf ) const
+{
+        if ( hit_leaf != nullptr )
         {
-		const visibleleafdata_t &data = _visible_leaf_bboxs[i];
+                *hit_leaf = -1;
+        }
 
-		if ( required_leaf_flags != 0 && ( data.flags & required_leaf_flags ) == 0 )
-		{
-			// Leaf doesn't have a flag set that is needed for the test to pass.
-			continue;
-		}
+        if ( set == nullptr || bounds->is_empty() )
+        {
+                return false;
+        }
+
+        if ( bounds->is_infinite() )
+        {
+                return true;
+        }
 
-                if (data.bbox->contains( bounds ) != BoundingVolume::IF_no_intersection )
+        int n = -1;
+
+        const FiniteBoundingVolume *fbv = bounds->as_finite_bounding_volume();
+        if ( fbv != nullptr )
+        {
+                n = set->test_box( fbv->get_min(), fbv->get_max(), required_leaf_flags );
+        }
+        else
+        {
+                // Some other kind of volume, test it the slow way.
+                int num_leafs = set->get_num_leafs();
+                for ( int i = 0; i < num_leafs; i++ )
                 {
-                        // Bounds intersected one of the potentially visible leafs.
-                        return true;
+                        if ( required_leaf_flags != 0 && ( set->get_leaf_flags( i ) & required_leaf_flags ) == 0 )
+                        {
+                                // Leaf doesn't have a flag set that is needed for the test to pass.
+                                continue;
+                        }
+
+                        if ( _leaf_bboxs[set->get_visible_leaf( i )]->contains( bounds ) != BoundingVolume::IF_no_intersection )
+                        {
+                                n = i;
+                                break;
+                        }
                 }
         }
 
-        // No intersections.
-        return false;
+        if ( n == -1 )
+        {
+                // No intersections.
+                return false;
+        }
+
+        if ( hit_leaf != nullptr )
+        {
+                *hit_leaf = set->get_visible_leaf( n );
+        }
+
+        // Bounds intersected one of the potentially visible leafs.
+        return true;
+}
+
+/**
+ * Returns the calling thread's cache of pvs_node_test() results, creating it
+ * on the thread's first test.
+ */
+BSPLoader::pvsthreadcache_t *BSPLoader::get_pvs_thread_cache()
+{
+        static thread_local const BSPLoader *loader = nullptr;
+        static thread_local pvsthreadcache_t *cache = nullptr;
+        if ( loader != this )
+        {
+                // First test on this thread. The cache stays with the loader,
+                // which empties it when the level is unloaded.
+                cache = new pvsthreadcache_t;
+                LightMutexHolder holder( _pvs_thread_caches_lock );
+                _pvs_thread_caches.push_back( cache );
+                loader = this;
+        }
+        return cache;
+}
+
+/**
+ * Tests a node's net bounds against the indicated visible set.
+ *
+ * The result is remembered per node. A node whose net transform and bounds
+ * have not changed since the last test skips the test entirely while the
+ * PVS stays the same, and when the PVS changes only checks whether the leaf
+ * it was last seen in is still visible.
+ *
+ * Each thread keeps its own results, so cull threads never wait on each
+ * other here. The results are dropped when the level is unloaded.
+ */
+bool BSPLoader::pvs_node_test( const VisibleLeafSet *set, const PandaNode *node,
+                               const TransformState *net_transform, unsigned int required_leaf_flags )
+{
+        if ( set == nullptr )
+        {
+                return false;
+        }
+
+        CPT( BoundingVolume ) bounds = node->get_bounds();
+        int frame = ClockObject::get_global_clock()->get_frame_count();
+
+        pvsthreadcache_t &cache = *get_pvs_thread_cache();
+        LightMutexHolder cache_holder( cache.lock );
+        if ( frame - cache.last_prune_frame > PVS_NODE_CACHE_LIFETIME )
+        {
+                // Drop results that nobody has asked about in a while, the
+                // node has most likely been removed.
+                for ( int i = (int)cache.nodes.get_num_entries() - 1; i >= 0; i-- )
+                {
+                        if ( frame - cache.nodes.get_data( i ).last_frame > PVS_NODE_CACHE_LIFETIME )
+                        {
+                                cache.nodes.remove_element( i );
+                        }
+                }
+                cache.last_prune_frame = frame;
+        }
+
+        {
+                int idx = cache.nodes.find( node );
+                if ( idx != -1 )
+                {
+                        pvsnodecache_t &entry = cache.nodes.modify_data( idx );
+                        if ( entry.net_transform == net_transform &&
+                             entry.bounds == bounds &&
+                             entry.required_leaf_flags == required_leaf_flags )
+                        {
+                                entry.last_frame = frame;
+
+                                if ( entry.pvs_leaf == set->get_leaf() )
+                                {
+                                        // Nothing has changed.
+                                        return entry.hit_leaf != -1;
+                                }
+
+                                if ( entry.hit_leaf != -1 &&
+                                     ( entry.hit_leaf == set->get_leaf() ||
+                                       is_cluster_visible( set->get_leaf(), entry.hit_leaf ) ) )
+                                {
+                                        // The leaf we were last seen in is still visible.
+                                        entry.pvs_leaf = set->get_leaf();
+                                        return true;
+                                }
+                        }
+                }
+        }
+
+        CPT( GeometricBoundingVolume ) net_bounds = make_net_bounds(
+                net_transform, bounds->as_geometric_bounding_volume() );
+
+        int hit_leaf;
+        bool result = pvs_bounds_test( set, net_bounds, required_leaf_flags, &hit_leaf );
+
+        pvsnodecache_t entry;
+        entry.net_transform = net_transform;
+        entry.bounds = bounds;
+        entry.required_leaf_flags = required_leaf_flags;
+        entry.pvs_leaf = set->get_leaf();
+        entry.hit_leaf = hit_leaf;
+        entry.last_frame = frame;
+
+        cache.nodes[node] = entry;
+
+        return result;
 }
 
 CPT( GeometricBoundingVolume ) BSPLoader::make_net_bounds( const TransformState *net_transform,
@@ -2355,8 +3678,7 @@ bool BSPLoader::trace_line( const LPoint3 &start, const LPoint3 &end )
                 return true;
         }
 
-	RayTraceHitResult res = _trace->get_scene()->trace_line( ( start + LPoint3( 0, 0, 0.05 ) ) * 16, end * 16, TRACETYPE_WORLD );
-	return !res.has_hit();
+	return !_trace->get_scene()->is_line_occluded( ( start + LPoint3( 0, 0, 0.05 ) ) * 16, end * 16, TRACETYPE_WORLD );
 }
 
 /**
@@ -2379,6 +3701,58 @@ LPoint3 BSPLoader::clip_line( const LPoint3 &start, const LPoint3 &end )
 	return clipped;
 }
 
+/**
+ * Runs every line of the batch against the level at once.  Each line is
+ * tested like trace_line(), or like clip_line() if clip is true.
+ */
+void BSPLoader::run_los_queries( LOSQueryBatch *batch, bool clip )
+{
+        nassertv( batch != nullptr );
+
+        // With no level there is nothing to hit, and every line is clear.
+        batch->run( _active_level ? _trace->get_scene() : nullptr, clip );
+}
+
+/**
+ * Returns the index of the nearest of the targets that can be seen from
+ * start, or -1 if none of them can.  Target positions are taken relative to
+ * the level's root.
+ */
+int BSPLoader::find_nearest_visible( const LPoint3 &start, const NodePathCollection &targets )
+{
+        int num_targets = targets.get_num_paths();
+        if ( num_targets == 0 )
+        {
+                return -1;
+        }
+
+        if ( !_active_level )
+        {
+                // Everything is visible, just find the nearest.
+                int nearest = 0;
+                PN_stdfloat nearest_dist = ( targets.get_path( 0 ).get_pos( _result ) - start ).length_squared();
+                for ( int i = 1; i < num_targets; i++ )
+                {
+                        PN_stdfloat dist = ( targets.get_path( i ).get_pos( _result ) - start ).length_squared();
+                        if ( dist < nearest_dist )
+                        {
+                                nearest = i;
+                                nearest_dist = dist;
+                        }
+                }
+                return nearest;
+        }
+
+        pvector<LPoint3> points( num_targets );
+        for ( int i = 0; i < num_targets; i++ )
+        {
+                points[i] = targets.get_path( i ).get_pos( _result );
+        }
+
+        return LOSQueryBatch::find_nearest_visible( _trace->get_scene(), start, points.data(),
+                                                    num_targets, TRACETYPE_WORLD );
+}
+
 int BSPLoader::get_brush_triangle_model_fast( BulletRigidBodyNode *rbnode, int triangle_idx )
 {
 	auto nodeitr = _brush_collision_data.find( rbnode );
@@ -21,14 +21,19 @@
 #include <nodePath.h>
 #include <genericAsyncTask.h>
 #include <geom.h>
+#include <geomNode.h>
+#include <geomVertexData.h>
 #include <graphicsStateGuardian.h>
 #include <texture.h>
 #include <renderAttrib.h>
 #include <boundingBox.h>
 #include <lightReMutex.h>
+#include <lightMutex.h>
+#include <simpleHashMap.h>
 #include <graphicsWindow.h>
 #include <bulletWorld.h>
 #include <bulletRigidBodyNode.h>
+#include <nodePathCollection.h>
 
 #include "lightmap_palettes.h"
 #include "ambient_probes.h"
@@ -36,6 +41,8 @@
 #include "decals.h"
 #include "raytrace.h"
 #include "bsp_trace.h"
+#include "los_query.h"
+#include "bsp_file_mapping.h"
 
 NotifyCategoryDeclNoExport(bspfile);
 
@@ -176,14 +183,95 @@ struct brush_model_data_t
 	LPoint3 origin;
 	LMatrix4f origin_matrix;
 	NodePath model_root;
-	PT( RigidBodyCombiner ) decal_rbc;
+	PT( PandaNode ) decal_node;
 
 	brush_model_data_t()
 	{
-		decal_rbc = new RigidBodyCombiner( "decal-rbc" );
+		decal_node = new PandaNode( "decals" );
 	}
 };
 
+/**
+ * The world faces that share a lightmap palette and a render state.  The
+ * faces' triangles are stored in one index list, grouped into a range per
+ * leaf, so the faces visible from a leaf can be gathered by copying ranges.
+ */
+struct worldbatch_t
+{
+        struct leafrange_t
+        {
+                // The leaf that owns the faces in the range, or 0 if they
+                // aren't in any leaf and are always drawn.
+                int leaf;
+                unsigned int first_index;
+                unsigned int num_indices;
+                // Faces in the range that other leafs contain as well.
+                unsigned int first_shared;
+                unsigned int num_shared;
+        };
+
+        struct sharedface_t
+        {
+                int facenum;
+                unsigned int first_index;
+                unsigned int num_indices;
+        };
+
+        CPT( RenderState ) state;
+        // Shared by every batch on the same lightmap palette.
+        CPT( GeomVertexData ) vdata;
+        GeomEnums::NumericType index_type;
+        pvector<uint32_t> indices;
+        pvector<leafrange_t> ranges;
+        pvector<sharedface_t> shared;
+};
+
+struct worldfacebuilder_t;
+
+/**
+ * The bounding boxes of every leaf that is potentially visible from one
+ * leaf, stored as a flat structure of arrays so they can be tested four at a
+ * time. A set is built once per leaf and never modified after that, so a cull
+ * thread can hold on to one and test against it without taking any lock.
+ */
+class EXPCL_PANDABSP VisibleLeafSet : public ReferenceCount
+{
+public:
+        VisibleLeafSet( int leaf );
+
+        void add_leaf( int leaf, const LPoint3 &mins, const LPoint3 &maxs, int flags );
+        void finalize();
+
+        int test_box( const LPoint3 &mins, const LPoint3 &maxs, unsigned int required_leaf_flags ) const;
+
+        INLINE int get_leaf() const
+        {
+                return _leaf;
+        }
+        INLINE int get_num_leafs() const
+        {
+                return (int)_leafs.size();
+        }
+        INLINE int get_visible_leaf( int n ) const
+        {
+                return _leafs[n];
+        }
+        INLINE int get_leaf_flags( int n ) const
+        {
+                return _flags[n];
+        }
+
+private:
+        int _leaf;
+
+        // One entry per visible leaf, padded with empty boxes up to a
+        // multiple of four so the test loop needs no remainder handling.
+        pvector<float> _mins[3];
+        pvector<float> _maxs[3];
+        pvector<int> _flags;
+        pvector<int> _leafs;
+};
+
 /**
  * Loads and handles the operations of PBSP files.
  */
@@ -229,6 +317,7 @@ PUBLISHED:
 
         virtual bool read( const Filename &file, bool is_transition = false );
 	void do_optimizations();
+	void prewarm_shaders();
 
 	void set_gamma( PN_stdfloat gamma, int overbright = 1 );
         INLINE PN_stdfloat get_gamma() const
@@ -260,6 +349,15 @@ PUBLISHED:
         {
                 _decal_mgr.decal_trace( decal_material, decal_scale, rotate, start, end, decal_color );
         }
+	INLINE void queue_decal( const std::string &decal_material, const LPoint2 &decal_scale,
+		float rotate, const LPoint3 &start, const LPoint3 &end, const LColorf &decal_color = LColorf( 1 ) )
+	{
+		_decal_mgr.queue_decal( decal_material, decal_scale, rotate, start, end, decal_color );
+	}
+	INLINE void flush_decals()
+	{
+		_decal_mgr.flush_decals();
+	}
 
         Texture *get_closest_cubemap_texture( const LPoint3 &pos );
 
@@ -280,6 +378,9 @@ PUBLISHED:
         bool trace_line( const LPoint3 &start, const LPoint3 &end );
         LPoint3 clip_line( const LPoint3 &start, const LPoint3 &end );
 
+        BLOCKING void run_los_queries( LOSQueryBatch *batch, bool clip = false );
+        BLOCKING int find_nearest_visible( const LPoint3 &start, const NodePathCollection &targets );
+
 	NodePath get_model( int modelnum ) const;
 
 	INLINE int find_leaf( const NodePath &np )
@@ -290,6 +391,11 @@ PUBLISHED:
 	int find_leaf( const LPoint3 &pos, int headnode = 0 );
         int find_node( const LPoint3 &pos );
         bool is_cluster_visible( int curr_cluster, int cluster ) const;
+        INLINE const uint32_t *get_pvs_row( int leaf ) const
+        {
+                int row = _pvs_leaf_clusters != nullptr ? _pvs_leaf_clusters[leaf] : leaf;
+                return _pvs_rows + (size_t)row * _pvs_row_words;
+        }
 
         bool pvs_bounds_test( const GeometricBoundingVolume *bounds, unsigned int required_leaf_flags = 0u );
         CPT( GeometricBoundingVolume ) make_net_bounds( const TransformState *net_transform,
@@ -391,6 +497,12 @@ public:
 
 	void update_visibility( const LPoint3 &pos );
 
+        CPT( VisibleLeafSet ) get_visible_leaf_set();
+        bool pvs_bounds_test( const VisibleLeafSet *set, const GeometricBoundingVolume *bounds,
+                              unsigned int required_leaf_flags = 0u, int *hit_leaf = nullptr ) const;
+        bool pvs_node_test( const VisibleLeafSet *set, const PandaNode *node,
+                            const TransformState *net_transform, unsigned int required_leaf_flags = 0u );
+
 protected:
 	virtual void load_geometry() = 0;
 	virtual void cleanup_entities( bool is_transition );
@@ -402,8 +514,11 @@ protected:
 	void setup_raytrace_environment();
 
 	void update_leaf( int leaf );
+        CPT( VisibleLeafSet ) build_visible_leaf_set( int leaf ) const;
+        void build_leaf_world_geoms( int leaf );
         
         void make_faces();
+        void build_world_batches( worldfacebuilder_t &builder );
 
         void make_faces_ai();
         NodePath make_faces_ai_base( const std::string &name, const vector_string &include_entities,
@@ -422,6 +537,7 @@ protected:
 
 	LTexCoord get_vertex_uv( texinfo_t *texinfo, dvertex_t *vert, bool lightmap = false ) const;
 
+        void preload_resources();
         CPT( BSPMaterial ) try_load_texref( texref_t *tref );
 
         PT( EggVertex ) make_vertex( EggVertexPool *vpool, EggPolygon *poly,
@@ -434,6 +550,7 @@ protected:
 	void init_dface_lightmap_info( dface_lightmap_info_t *info, int facenum );
 
 protected:
+        BSPFileMapping _bsp_image;
         bspdata_t *_bspdata;
         BSPShaderGenerator *_shgen;
         collbspdata_t *_colldata;
@@ -461,19 +578,56 @@ protected:
 
 	PT( BSPTrace ) _trace;
 
-	struct visibleleafdata_t
-	{
-		BoundingBox *bbox;
-		int flags;
-	};
-	pvector<visibleleafdata_t> _visible_leaf_bboxs;
-        pvector<int> _visible_leafs;
+        // The leafs visible from the current leaf, and the sets already built
+        // for each leaf we have been in. Protected by _leaf_aabb_lock.
+        CPT( VisibleLeafSet ) _visible_leaf_set;
+        pvector<CPT( VisibleLeafSet )> _leaf_visible_sets;
 	int _curr_leaf_idx;
+
+        // Result of the last PVS test of each dynamic node, so nodes that
+        // have not moved skip the test until the PVS changes. Each thread
+        // that culls keeps its own cache, see pvs_node_test().
+        struct pvsnodecache_t
+        {
+                CPT( TransformState ) net_transform;
+                CPT( BoundingVolume ) bounds;
+                unsigned int required_leaf_flags;
+                // Leaf whose PVS the result was computed against.
+                int pvs_leaf;
+                // The visible leaf the node was found in, or -1 if culled.
+                int hit_leaf;
+                int last_frame;
+        };
+        typedef SimpleHashMap<const PandaNode *, pvsnodecache_t, pointer_hash> PVSNodeCache;
+        struct pvsthreadcache_t
+        {
+                pvsthreadcache_t() :
+                        lock( "pvsThreadCacheMutex" ),
+                        last_prune_frame( 0 )
+                {
+                }
+
+                // Only ever waited on while the level is being unloaded.
+                LightMutex lock;
+                int last_prune_frame;
+                PVSNodeCache nodes;
+        };
+        pvsthreadcache_t *get_pvs_thread_cache();
+        // The cache of every thread that has culled, so that unloading the
+        // level can empty them all.
+        pvector<pvsthreadcache_t *> _pvs_thread_caches;
+        LightMutex _pvs_thread_caches_lock;
         Filename _map_file;
 
 	std::unordered_map<const dface_t *, const dmodel_t *> _dface_dmodels;
         pmap<texref_t *, CPT( BSPMaterial )> _texref_materials;
-        vector<uint8_t *> _leaf_pvs;
+        // PVS rows, bit n of a row is leaf n + 1. Points straight into the
+        // level's visibility lump when it has a PVS matrix, otherwise into
+        // _pvs_storage with one row per leaf.
+        const uint32_t *_pvs_rows;
+        const int *_pvs_leaf_clusters;
+        int _pvs_row_words;
+        pvector<uint32_t> _pvs_storage;
 	pvector<NodePath> _leaf_visnp;
 	pvector<PT( BoundingBox )> _leaf_bboxs;
 	pvector<brush_model_data_t> _model_data;
@@ -485,14 +639,24 @@ protected:
 	
         UpdateSeq _level_context;
 
-	typedef unordered_map<int, brush_collision_data_t> TriangleIndex2BSPCollisionData_t;
+	typedef std::unordered_map<int, brush_collision_data_t> TriangleIndex2BSPCollisionData_t;
 	typedef pmap<PT( BulletRigidBodyNode ), TriangleIndex2BSPCollisionData_t> BSPCollisionData_t;
 	BSPCollisionData_t _brush_collision_data;
 
         // A per-leaf list of world Geoms.
         // This list of Geoms will be rendered for the current leaf.
+        // Built for every leaf when the level is loaded.
         pvector<GeomNode::Geoms> _leaf_world_geoms;
 
+        pvector<worldbatch_t> _world_batches;
+        // The leafs each world face is in, starting at
+        // _face_leafs[_face_leafs_start[facenum]].
+        pvector<int> _face_leafs_start;
+        pvector<int> _face_leafs;
+        // Brush entities that were merged into the world after its faces
+        // were batched.
+        PT( GeomNode ) _world_extra_geoms;
+
 	friend class BSPFaceAttrib;
         friend class BSPGeomNode;
         friend class AmbientProbeManager;
@@ -502,9 +666,8 @@ protected:
 
         static BSPLoader *_global_ptr;
 
-        // While BSPLoader updates the visible leaf AABBs on the App thread,
-        // BSPGeomNode needs to access them from the Cull thread.
-        // So we'll use a mutex.
+        // Guards swapping the current visible leaf set. Cull threads only
+        // take it long enough to grab a reference to the set.
         LightMutex _leaf_aabb_lock;
 };
 
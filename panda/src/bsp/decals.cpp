@@ -37,11 +37,15 @@
 #include <depthWriteAttrib.h>
 #include <colorWriteAttrib.h>
 #include <cullFaceAttrib.h>
-#include <rigidBodyCombiner.h>
 #include <bulletWorld.h>
 #include <bulletClosestHitRayResult.h>
 #include <bitMask.h>
 #include <geomTristrips.h>
+#include <asyncTaskManager.h>
+#include <genericAsyncTask.h>
+#include <atomicAdjust.h>
+
+#include <thread>
 
 static const BitMask32 world_bitmask = BitMask32::bit( 1 ) | BitMask32::bit( 2 );
 
@@ -50,13 +54,15 @@ static PStatCollector decal_trace_collector( "BSP:DecalTrace:FindDecalPosition"
 static PStatCollector decal_node_collector( "BSP:DecalTrace:DecalNode" );
 static PStatCollector decal_state_collector( "BSP:DecalTrace:DecalState" );
 static PStatCollector decal_add_geom_collector( "BSP:DecalTrace:InsertGeometry" );
-static PStatCollector decal_init_collector( "BSP:DecalTrace:InitDecalInfo" );
-static PStatCollector decal_collect( "BSP:DecalTrace:BatchDecals" );
 
 static ConfigVariableInt decals_max( "decals_max", 20 );
 static ConfigVariableBool decals_remove_overlapping( "decals_remove_overlapping", true );
+static ConfigVariableInt decals_page_rows( "decals_page_rows", 4096 );
+static ConfigVariableInt decals_clip_threads( "decals_clip_threads", -1 );
 
 static const int MAX_DECALCLIPVERT = 48;
+static const int DECALS_PER_CLIP_THREAD = 8;
+static const char *decal_clip_chain_name = "decal_clip";
 static const float DECAL_CLIP_EPSILON = 0.01f;
 static const float DECAL_DISTANCE = 4.0f;
 static const float SIN_45_DEGREES = 0.70710678118654752440084436210485f;
@@ -127,8 +133,21 @@ struct decalvert_t
 	LVector2 coords;
 };
 
-static decalvert_t g_DecalClipVerts[MAX_DECALCLIPVERT];
-static decalvert_t g_DecalClipVerts2[MAX_DECALCLIPVERT];
+// Clip buffers. Each clipping thread has its own.
+struct decalscratch_t
+{
+	decalvert_t verts[MAX_DECALCLIPVERT];
+	decalvert_t verts2[MAX_DECALCLIPVERT];
+};
+
+// A clipped decal vertex, already in the space of the decal's model.
+struct decaloutvert_t
+{
+	LPoint3 position;
+	LVector3 normal;
+	LVector2 coords;
+	LTexCoord lightcoords;
+};
 
 struct decalinfo_t
 {
@@ -136,6 +155,7 @@ struct decalinfo_t
 	{
 		s_axis = nullptr;
 		face = nullptr;
+		scratch = nullptr;
 
 		data = bspdata;
 		position = pos;
@@ -143,6 +163,9 @@ struct decalinfo_t
 		decal_size = 1.0f / decal_scale.length();
 		decal_color = color;
 		vert_count = 0;
+		headnode = 0;
+		modelnum = 0;
+		flags = 0;
 
 		material = mat;
 		lightmap = false;
@@ -155,21 +178,6 @@ struct decalinfo_t
 				bumped_lightmap = true;
 			}
 		}
-
-		const GeomVertexFormat *format;
-		if ( lightmap )
-		{
-			format = get_decal_format_lightmap();
-		}
-		else
-		{
-			format = get_decal_format_no_lightmap();
-		}
-		vdata = new GeomVertexData( "decal", format, GeomEnums::UH_static );
-		vdata->reserve_num_rows( 256 );
-		vdata_row_count = 0;
-
-		geom = new Geom( vdata );
 	}
 
 	void change_surface( const dface_t *dface )
@@ -186,6 +194,9 @@ struct decalinfo_t
 	const bspdata_t *data;
 	LColor decal_color;
 	LMatrix4f decal_world_to_model;
+	int headnode;
+	int modelnum;
+	int flags;
 
 	//////////////////////////////////////////////////
 	// Updated for each surface being decalled
@@ -196,16 +207,22 @@ struct decalinfo_t
 	LVector3 *s_axis;
 	
 	int vert_count;
+	decalscratch_t *scratch;
 
 	const BSPMaterial *material;
 	bool lightmap;
 	bool bumped_lightmap;
 
-	int vdata_row_count;
-	PT( GeomVertexData ) vdata;
-	PT( Geom ) geom;
+	//////////////////////////////////////////////////
+	// Clipped geometry
+	pvector<decaloutvert_t> verts;
+	// Number of vertices in each clipped polygon.
+	pvector<int> polys;
+	LPoint3 mins;
+	LPoint3 maxs;
 };
 
+
 // Template classes for the clipper.
 class CPlane_Top
 {
@@ -402,11 +419,13 @@ void R_SetupDecalClip( decalinfo_t *decal )
 	decal->delta[1] = decal->position.dot( decal->texture_space_basis[1] );
 }
 
+
 void R_AddDecalVert( decalinfo_t *decal, const dvertex_t *vert, int idx )
 {
-	VectorCopy( vert->point, g_DecalClipVerts[idx].position );
-	g_DecalClipVerts[idx].coords[0] = g_DecalClipVerts[idx].position.dot( decal->texture_space_basis[0] ) - decal->delta[0] + 0.5f;
-	g_DecalClipVerts[idx].coords[1] = g_DecalClipVerts[idx].position.dot( decal->texture_space_basis[1] ) - decal->delta[1] + 0.5f;
+	decalvert_t *cvert = decal->scratch->verts + idx;
+	VectorCopy( vert->point, cvert->position );
+	cvert->coords[0] = cvert->position.dot( decal->texture_space_basis[0] ) - decal->delta[0] + 0.5f;
+	cvert->coords[1] = cvert->position.dot( decal->texture_space_basis[1] ) - decal->delta[1] + 0.5f;
 }
 
 void R_SetupDecalVertsForSurface( decalinfo_t *decal )
@@ -439,12 +458,15 @@ void R_DoDecalSHClip( decalinfo_t *info )
 	CPlane_Left left;
 	CPlane_Right right;
 	CPlane_Bottom bottom;
+
+	decalvert_t *verts = info->scratch->verts;
+	decalvert_t *verts2 = info->scratch->verts2;
 	
 	// Clip the polygon to the decal texture space
-	int out_count = SHClip( g_DecalClipVerts, info->vert_count, g_DecalClipVerts2, top );
-	out_count = SHClip( g_DecalClipVerts2, out_count, g_DecalClipVerts, left );
-	out_count = SHClip( g_DecalClipVerts, out_count, g_DecalClipVerts2, right );
-	out_count = SHClip( g_DecalClipVerts2, out_count, g_DecalClipVerts, bottom );
+	int out_count = SHClip( verts, info->vert_count, verts2, top );
+	out_count = SHClip( verts2, out_count, verts, left );
+	out_count = SHClip( verts, out_count, verts2, right );
+	out_count = SHClip( verts2, out_count, verts, bottom );
 	info->vert_count = out_count;
 }
 
@@ -459,60 +481,42 @@ void R_DecalSurface( const dface_t *face, decalinfo_t *pinfo )
 	R_SetupDecalVertsForSurface( pinfo );
 	R_DoDecalSHClip( pinfo );
 
-	if ( pinfo->vert_count == 0 )
+	if ( pinfo->vert_count < 3 )
 		return;
 
 	////////////////////////////////////////////////////////////////////////////////////
-	// Generate the decal geometry
-
-	int first_row = pinfo->vdata_row_count;
-	GeomVertexWriter vtx_writer( pinfo->vdata, InternalName::get_vertex() );
-	vtx_writer.set_row( first_row );
-	GeomVertexWriter norm_writer( pinfo->vdata, InternalName::get_normal() );
-	norm_writer.set_row( first_row );
-	GeomVertexWriter uv_writer( pinfo->vdata, InternalName::get_texcoord() );
-	uv_writer.set_row( first_row );
-	GeomVertexWriter col_writer( pinfo->vdata, InternalName::get_color() );
-	col_writer.set_row( first_row );
-	GeomVertexWriter lm_uv_writer;
-	if ( pinfo->lightmap )
-	{
-		lm_uv_writer = GeomVertexWriter( pinfo->vdata, in_texcoord_lightmap );
-		lm_uv_writer.set_row( first_row );
-	}
+	// Collect the clipped polygon, the geometry is written out later on the
+	// main thread.
 
 	LVector3 local_normal = pinfo->decal_world_to_model.xform_vec( pinfo->surface_normal );
 
 	for ( int i = pinfo->vert_count - 1; i >= 0; i-- )
 	{
-		decalvert_t *cvert = g_DecalClipVerts + i;
+		decalvert_t *cvert = pinfo->scratch->verts + i;
 
-		LPoint3 local_pos = pinfo->decal_world_to_model.xform_point( cvert->position / 16.0f );
-		vtx_writer.add_data3f( local_pos );
-		norm_writer.add_data3f( local_normal );
-		uv_writer.add_data2f( cvert->coords );
-		col_writer.add_data4f( pinfo->decal_color );
+		decaloutvert_t out;
+		out.position = pinfo->decal_world_to_model.xform_point( cvert->position / 16.0f );
+		out.normal = local_normal;
+		out.coords = cvert->coords;
 		if ( pinfo->lightmap )
 		{
-			lm_uv_writer.add_data2f( loader->get_lightcoords( facenum, cvert->position ) );
+			out.lightcoords = loader->get_lightcoords( facenum, cvert->position );
 		}
 
-		pinfo->vdata_row_count++;
-	}
+		if ( pinfo->verts.empty() )
+		{
+			pinfo->mins = pinfo->maxs = out.position;
+		}
+		else
+		{
+			pinfo->mins = pinfo->mins.fmin( out.position );
+			pinfo->maxs = pinfo->maxs.fmax( out.position );
+		}
 
-	PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_static );
-	int ntris = pinfo->vert_count - 2;
-	for ( int tri = 0; tri < ntris; tri++ )
-	{
-		tris->add_vertices(
-			first_row,
-			first_row + ( ( tri + 1 ) % pinfo->vert_count ),
-			first_row + ( ( tri + 2 ) % pinfo->vert_count )
-		);
+		pinfo->verts.push_back( out );
 	}
-	tris->close_primitive();
 
-	pinfo->geom->add_primitive( tris );
+	pinfo->polys.push_back( pinfo->vert_count );
 }
 
 void R_DecalNodeSurfaces( const dnode_t *pnode, decalinfo_t *info )
@@ -569,143 +573,375 @@ void R_DecalNode( int nodenum, decalinfo_t *info )
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////////////
+// Parallel clipping
+
+struct decalclipjob_t
+{
+	decalinfo_t *infos;
+	int count;
+	AtomicAdjust::Integer next;
+};
+
+static void clip_decals_work( void *data )
+{
+	decalclipjob_t *job = (decalclipjob_t *)data;
+	decalscratch_t scratch;
+
+	while ( true )
+	{
+		int i = (int)AtomicAdjust::add( job->next, 1 ) - 1;
+		if ( i >= job->count )
+			break;
+
+		decalinfo_t *info = job->infos + i;
+		info->scratch = &scratch;
+		R_DecalNode( info->headnode, info );
+		info->scratch = nullptr;
+	}
+}
+
+static AsyncTask::DoneStatus clip_decals_task( GenericAsyncTask *task, void *data )
+{
+	clip_decals_work( data );
+	return AsyncTask::DS_done;
+}
+
 /**
- * Trace a decal onto the world.
+ * Clips every decal in the batch against the BSP. Decals are shared out
+ * between the calling thread and the threads of the decal_clip task chain,
+ * each with its own clip buffers. The task chain is made the first time it
+ * is needed and its threads are kept for later batches.
  */
-void DecalManager::decal_trace( const std::string &decal_material, const LPoint2 &decal_scale,
-				float rotate, const LPoint3 &start, const LPoint3 &end, const LColorf &decal_color,
-				const int flags )
+static void clip_decals( pvector<decalinfo_t> &infos )
 {
-	PStatTimer timer( decal_collector );
+	decalclipjob_t job;
+	job.infos = infos.data();
+	job.count = (int)infos.size();
+	job.next = 0;
 
-	///////////////////////////////////////////////////////////////////////////////////////
-        // Find the surface to decal
-	LVector3 decal_origin;
-	int headnode = 0;
-	int modelnum = 0;
-	int merged_modelnum = 0;
-	brush_model_data_t mdata;
-	bool is_studio = false;
-	NodePath hitbox;
+	int num_threads = 0;
+	if ( Thread::is_true_threads() )
 	{
-		PStatTimer trace_timer( decal_trace_collector );
+		num_threads = decals_clip_threads.get_value();
+		if ( num_threads < 0 )
+		{
+			num_threads = std::min( (int)std::thread::hardware_concurrency() - 1, 4 );
+		}
+	}
 
-		BulletClosestHitRayResult result = _loader->get_physics_world()->
-			ray_test_closest( start, end, world_bitmask );
+	// Not worth waking up a thread for just a few decals.
+	int num_tasks = std::min( num_threads, job.count / DECALS_PER_CLIP_THREAD );
 
-		if ( !result.has_hit() )
-			return;
+	AsyncTaskChain *chain = nullptr;
+	if ( num_tasks > 0 )
+	{
+		AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+		chain = mgr->find_task_chain( decal_clip_chain_name );
+		if ( chain == nullptr )
+		{
+			chain = mgr->make_task_chain( decal_clip_chain_name );
+			chain->set_num_threads( num_threads );
+		}
 
-		int triangle_idx = result.get_triangle_index();
-		hitbox = NodePath( result.get_node() );
-		BulletRigidBodyNode *node = DCAST( BulletRigidBodyNode, result.get_node() );
-		int temp_modelnum = _loader->get_brush_triangle_model_fast( node, triangle_idx );
-		if ( temp_modelnum != -1 )
+		for ( int i = 0; i < num_tasks; i++ )
 		{
-			modelnum = temp_modelnum;
-			mdata = _loader->get_brush_model_data( modelnum );
-			merged_modelnum = mdata.merged_modelnum;
-			const dmodel_t *model = _loader->get_bspdata()->dmodels + modelnum;
-			headnode = model->headnode[0];
+			PT( GenericAsyncTask ) task = new GenericAsyncTask( "decal-clip", clip_decals_task, &job );
+			task->set_task_chain( decal_clip_chain_name );
+			mgr->add( task );
 		}
-		else
+	}
+
+	clip_decals_work( &job );
+
+	if ( chain != nullptr )
+	{
+		chain->wait_for_tasks();
+	}
+}
+
+/**
+ * Writes a clipped decal into the rows its page handed out.
+ */
+static void write_decal_geometry( DecalPage *page, const Decal *decal, const decalinfo_t &info )
+{
+	Geom *geom = page->get_geom();
+
+	PT( GeomVertexData ) vdata = geom->modify_vertex_data();
+	GeomVertexWriter vtx_writer( vdata, InternalName::get_vertex() );
+	vtx_writer.set_row( decal->first_row );
+	GeomVertexWriter norm_writer( vdata, InternalName::get_normal() );
+	norm_writer.set_row( decal->first_row );
+	GeomVertexWriter uv_writer( vdata, InternalName::get_texcoord() );
+	uv_writer.set_row( decal->first_row );
+	GeomVertexWriter col_writer( vdata, InternalName::get_color() );
+	col_writer.set_row( decal->first_row );
+	GeomVertexWriter lm_uv_writer;
+	if ( info.lightmap )
+	{
+		lm_uv_writer = GeomVertexWriter( vdata, in_texcoord_lightmap );
+		lm_uv_writer.set_row( decal->first_row );
+	}
+
+	for ( size_t i = 0; i < info.verts.size(); i++ )
+	{
+		const decaloutvert_t &vert = info.verts[i];
+		vtx_writer.set_data3f( vert.position );
+		norm_writer.set_data3f( vert.normal );
+		uv_writer.set_data2f( vert.coords );
+		col_writer.set_data4f( info.decal_color );
+		if ( info.lightmap )
 		{
-			return;
+			lm_uv_writer.set_data2f( vert.lightcoords );
 		}
+	}
 
-		VectorLerp( start, end, result.get_hit_fraction(), decal_origin );
-		
-		if ( merged_modelnum != 0 && !is_studio )
+	PT( GeomPrimitive ) tris = geom->modify_primitive( 0 );
+	PT( GeomVertexArrayData ) indices = tris->modify_vertices();
+	GeomVertexWriter index_writer( indices, 0 );
+	index_writer.set_row( decal->first_row * 3 );
+
+	int first_row = decal->first_row;
+	int num_indices = 0;
+	for ( size_t i = 0; i < info.polys.size(); i++ )
+	{
+		int ntris = info.polys[i] - 2;
+		for ( int tri = 0; tri < ntris; tri++ )
 		{
-			// A non-world model can be moved around.
-			// In order to correctly decal, we must move the decal position back
-			// relative to the model's original transform.
-			CPT( TransformState ) ts = mdata.model_root.get_net_transform();
+			index_writer.set_data1i( first_row );
+			index_writer.set_data1i( first_row + tri + 1 );
+			index_writer.set_data1i( first_row + tri + 2 );
+		}
+		num_indices += ntris * 3;
+		first_row += info.polys[i];
+	}
 
-			LPoint3 delta_origin = ts->get_pos() - mdata.origin;
-			LQuaternion delta_quat = ts->get_norm_quat();
-			LVector3 delta_scale = ts->get_scale();
+	// A decal owns three indices per row, collapse the ones it doesn't use.
+	for ( ; num_indices < decal->num_rows * 3; num_indices++ )
+	{
+		index_writer.set_data1i( 0 );
+	}
+}
 
-			CPT( TransformState ) delta_ts = TransformState::make_pos_quat_scale( delta_origin, delta_quat, delta_scale );
-			LMatrix4 matrix = delta_ts->get_mat();
-			matrix.invert_in_place();
+///////////////////////////////////////////////////////////////////////////////////////
+// DecalPage
+
+DecalPage::DecalPage( const GeomVertexFormat *format, const RenderState *state,
+		      int modelnum, bool ring, int num_rows, const NodePath &parent ) :
+	_state( state ),
+	_modelnum( modelnum ),
+	_ring( ring ),
+	_num_rows( num_rows ),
+	_head( 0 ),
+	_has_bounds( false ),
+	_bounds_stale( false )
+{
+	PT( GeomVertexData ) vdata = new GeomVertexData( "decal-page", format, GeomEnums::UH_dynamic );
+	vdata->set_num_rows( num_rows );
+
+	// Every index starts out as 0, so the whole page is degenerate triangles
+	// until decals are written into it.
+	PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_dynamic );
+	tris->set_index_type( num_rows * 3 <= 0xffff ? GeomEnums::NT_uint16 : GeomEnums::NT_uint32 );
+	PT( GeomVertexArrayData ) indices = tris->modify_vertices();
+	indices->set_num_rows( num_rows * 3 );
+
+	_geom = new Geom( vdata );
+	_geom->add_primitive( tris );
+
+	_geom_node = new GeomNode( "decal-page" );
+	_geom_node->add_geom( _geom, state );
+	_np = parent.attach_new_node( _geom_node );
+}
 
-			decal_origin = matrix.xform_point( decal_origin );
+/**
+ * Returns true if a decal of the indicated number of rows can be added to
+ * this page. A ring page always has room, the oldest decals make way.
+ */
+bool DecalPage::has_room( int num_rows ) const
+{
+	if ( _ring )
+	{
+		return num_rows <= _num_rows;
+	}
+
+	return _head + num_rows <= _num_rows;
+}
+
+/**
+ * Hands out the next num_rows rows of the page to the decal. On a ring page
+ * this expires whichever old decals are in the way.
+ */
+bool DecalPage::alloc( Decal *decal, int num_rows )
+{
+	if ( !has_room( num_rows ) )
+	{
+		return false;
+	}
+
+	if ( _ring )
+	{
+		if ( _head + num_rows > _num_rows )
+		{
+			// Wrap around. The decals left at the end of the page stay
+			// until the ring comes back around to them.
+			_head = 0;
 		}
 
-		decal_origin *= 16.0f;
+		int end = _head + num_rows;
+		while ( !_live.empty() )
+		{
+			Decal *oldest = _live.front();
+			if ( oldest->page == this &&
+			     oldest->first_row < end && oldest->first_row + oldest->num_rows > _head )
+			{
+				expire( oldest );
+			}
+			else if ( oldest->page == this )
+			{
+				break;
+			}
+
+			_live.pop_front();
+		}
 	}
-	
 
-	///////////////////////////////////////////////////////////////////////////////////////
+	decal->page = this;
+	decal->first_row = _head;
+	decal->num_rows = num_rows;
+	_head += num_rows;
+	_live.push_back( decal );
 
-	const BSPMaterial *mat = BSPMaterial::get_from_file( decal_material );
+	return true;
+}
+
+/**
+ * Removes the decal from the page by collapsing its index range. Its rows are
+ * reused once the ring comes back around to them.
+ */
+void DecalPage::expire( Decal *decal )
+{
+	if ( decal->page != this )
+	{
+		return;
+	}
 
-	decal_init_collector.start();
-	decalinfo_t info(
-		decal_origin,
-		decal_scale,
-		decal_color,
-		mat,
-		_loader->get_bspdata() );
-	if ( !is_studio )
+	PT( GeomPrimitive ) tris = _geom->modify_primitive( 0 );
+	PT( GeomVertexArrayData ) indices = tris->modify_vertices();
+	GeomVertexWriter index_writer( indices, 0 );
+	index_writer.set_row( decal->first_row * 3 );
+	for ( int i = 0; i < decal->num_rows * 3; i++ )
 	{
-		if ( merged_modelnum != 0 )
+		index_writer.set_data1i( 0 );
+	}
+
+	decal->page = nullptr;
+	_bounds_stale = true;
+}
+
+/**
+ * Shrinks the bounds of the page back down to the decals still on it, if any
+ * have been expired since the bounds were last computed.
+ */
+void DecalPage::update_bounds()
+{
+	if ( !_bounds_stale )
+	{
+		return;
+	}
+	_bounds_stale = false;
+
+	_has_bounds = false;
+	for ( size_t i = 0; i < _live.size(); i++ )
+	{
+		const Decal *decal = _live[i];
+		if ( decal->page != this )
 		{
-			info.decal_world_to_model = mdata.origin_matrix;
-			info.decal_world_to_model.invert_in_place();
+			continue;
+		}
+
+		if ( _has_bounds )
+		{
+			_mins = _mins.fmin( decal->bounds->get_minq() );
+			_maxs = _maxs.fmax( decal->bounds->get_maxq() );
 		}
 		else
 		{
-			info.decal_world_to_model = LMatrix4f::ident_mat();
+			_mins = decal->bounds->get_minq();
+			_maxs = decal->bounds->get_maxq();
+			_has_bounds = true;
 		}
-		decal_init_collector.stop();
+	}
 
-		decal_node_collector.start();
-		R_DecalNode( headnode, &info );
-		decal_node_collector.stop();
+	if ( _has_bounds )
+	{
+		_geom->set_bounds( new BoundingBox( _mins, _maxs ) );
 	}
 	else
 	{
-		NodePath studio_root = hitbox.get_parent();
-		NodePathCollection geom_nodes = studio_root.find_all_matches( "**/+GeomNode" );
-		for ( int i = 0; i < geom_nodes.size(); i++ )
+		// Nothing left to draw.
+		_geom->set_bounds( new BoundingBox );
+	}
+	_geom_node->mark_internal_bounds_stale();
+}
+
+/**
+ * Grows the bounds of the page to include a new decal. Setting them
+ * explicitly saves computing them over every row of the page.
+ */
+void DecalPage::extend_bounds( const LPoint3 &mins, const LPoint3 &maxs )
+{
+	// Drop the decals a ring page just wrapped over first.
+	update_bounds();
+
+	if ( _has_bounds )
+	{
+		_mins = _mins.fmin( mins );
+		_maxs = _maxs.fmax( maxs );
+	}
+	else
+	{
+		_mins = mins;
+		_maxs = maxs;
+		_has_bounds = true;
+	}
+
+	_geom->set_bounds( new BoundingBox( _mins, _maxs ) );
+	_geom_node->mark_internal_bounds_stale();
+}
+
+void DecalPage::remove()
+{
+	for ( size_t i = 0; i < _live.size(); i++ )
+	{
+		if ( _live[i]->page == this )
 		{
-			NodePath geom_np = geom_nodes[i];
-			GeomNode *gn = DCAST( GeomNode, geom_np.node() );
-			for ( int j = 0; j < gn->get_num_geoms(); j++ )
-			{
-				const Geom *geom = gn->get_geom( j );
-				const GeomVertexData *vdata = geom->get_vertex_data();
-				for ( int k = 0; k < geom->get_num_primitives(); k++ )
-				{
-					const GeomPrimitive *prim = geom->get_primitive( k );
-					for ( int l = 0; l < prim->get_num_primitives(); l++ )
-					{
-						int start = prim->get_primitive_start( l );
-						int end = prim->get_primitive_end( l );
-						if ( prim->is_of_type( GeomTristrips::get_class_type() ) )
-						{
-							for ( int vidx = start; vidx < end - 2; vidx++ )
-							{
-								bool ccw = ( vidx & 0x1 ) == 0;
-								int ti1 = vidx;
-								int ti2 = vidx + 1 + ccw;
-								int ti3 = vidx + 2 - ccw;
-								
-
-							}
-						}
-					}
-				}
-			}
+			_live[i]->page = nullptr;
 		}
 	}
+	_live.clear();
 
-	///////////////////////////////////////////////////////////////////////////////////////
-	// Setup decal render state / geometry
+	if ( !_np.is_empty() )
+	{
+		_np.remove_node();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// DecalManager
+
+/**
+ * Returns the render state for decals of the indicated material.
+ */
+const RenderState *DecalManager::get_decal_state( const BSPMaterial *mat )
+{
+	pmap<const BSPMaterial *, CPT( RenderState )>::const_iterator it = _decal_states.find( mat );
+	if ( it != _decal_states.end() )
+	{
+		return it->second;
+	}
 
-	decal_state_collector.start();
+	PStatTimer timer( decal_state_collector );
 
 	// Set the desired material
 	CPT( RenderAttrib ) bma = BSPMaterialAttrib::make( mat );
@@ -737,7 +973,7 @@ void DecalManager::decal_trace( const std::string &decal_material, const LPoint2
 	CPT( RenderState ) decal_state = RenderState::make( attribs, ARRAYSIZE( attribs ), 1 );
 
 	// Bind lightmaps if needed
-	if ( info.lightmap )
+	if ( mat->is_lightmapped() )
 	{
 		LightmapPaletteDirectory::LightmapPaletteEntry *entry = _loader->get_lightmap_dir()->entries[0];
 		Texture *lm_tex = entry->palette_tex;
@@ -763,74 +999,254 @@ void DecalManager::decal_trace( const std::string &decal_material, const LPoint2
 		decal_state = decal_state->set_attrib( GET_ATTRIB( decal_modulate ) );
 	}
 
-	decal_state_collector.stop();
+	_decal_states[mat] = decal_state;
+	return decal_state;
+}
 
-	decal_add_geom_collector.start();
-	PT( GeomNode ) decal_geomnode = new GeomNode( "decal" );
-	decal_geomnode->add_geom( info.geom, decal_state );
-	NodePath decalnp = NodePath( decal_geomnode );
-	NodePath rbcnp = NodePath( mdata.decal_rbc );
-	decalnp.reparent_to( rbcnp );
-	decal_add_geom_collector.stop();
+/**
+ * Returns a page with room for a decal of the indicated material and size on
+ * the indicated brush model, starting a new one if needed. Returns nullptr if
+ * the decal is too big to fit in a page at all.
+ */
+DecalPage *DecalManager::get_page( const BSPMaterial *mat, int modelnum, bool is_static, int num_rows )
+{
+	int page_rows = decals_page_rows.get_value();
+	if ( num_rows > page_rows )
+	{
+		return nullptr;
+	}
 
-	///////////////////////////////////////////////////////////////////////////////////////
+	const RenderState *state = get_decal_state( mat );
 
-        LPoint3 mins, maxs;
-        //decalnp.calc_tight_bounds( mins, maxs );
-        PT( BoundingBox ) bounds = new BoundingBox( mins, maxs );
-
-	if ( decals_remove_overlapping.get_value() && ( flags & DECALFLAGS_STATIC ) == 0 )
-        {
-                for ( int i = (int)_decals.size() - 1; i >= 0; i-- )
-                {
-                        Decal *other = _decals[i];
-
-                        // Check if we overlap with this decal.
-                        //
-                        // Only remove this decal if it is smaller than the decal
-                        // we are wanting to create over it, and it is not a static
-                        // decal (placed by the level designer, etc).
-                        if ( other->bounds->contains( bounds ) != BoundingVolume::IF_no_intersection &&
-                                other->bounds->get_volume() <= bounds->get_volume() &&
-                                ( other->flags & DECALFLAGS_STATIC ) == 0 )
-                        {
-                                if ( !other->decalnp.is_empty() )
-                                        other->decalnp.remove_node();
-				if ( other->brush_modelnum != merged_modelnum )
-					_loader->get_brush_model_data( other->brush_modelnum ).decal_rbc->collect();
-                                _decals.erase( std::find( _decals.begin(), _decals.end(), other ) );
-                        }
-                }
-        }
-
-        if ( _decals.size() == decals_max.get_value() )
-        {
-                // Remove the oldest decal to make space for the new one.
-                Decal *d = _decals.back();
-		if ( !d->decalnp.is_empty() )
+	for ( size_t i = 0; i < _pages.size(); i++ )
+	{
+		DecalPage *page = _pages[i];
+		if ( page->get_state() == state &&
+		     page->get_modelnum() == modelnum &&
+		     page->is_ring() != is_static &&
+		     page->has_room( num_rows ) )
 		{
-			d->decalnp.remove_node();
-			if ( d->brush_modelnum != merged_modelnum )
-				_loader->get_brush_model_data( d->brush_modelnum ).decal_rbc->collect();
+			return page;
 		}
-                _decals.pop_back();
-        }
-
-        PT( Decal ) decal = new Decal;
-        decal->decalnp = decalnp;
-        decal->bounds = bounds;
-        decal->flags = flags;
-	decal->brush_modelnum = merged_modelnum;
-	if ( ( flags & DECALFLAGS_STATIC ) != 0 )
-		_map_decals.push_back( decal );
+	}
+
+	const GeomVertexFormat *format;
+	if ( mat->is_lightmapped() )
+	{
+		format = get_decal_format_lightmap();
+	}
 	else
-		_decals.push_front( decal );
+	{
+		format = get_decal_format_no_lightmap();
+	}
+
+	NodePath parent( _loader->get_brush_model_data( modelnum ).decal_node );
+	PT( DecalPage ) page = new DecalPage( format, state, modelnum, !is_static, page_rows, parent );
+	_pages.push_back( page );
+	return page;
+}
+
+void DecalManager::expire_decal( Decal *decal )
+{
+	DecalPage *page = decal->page;
+	if ( page != nullptr )
+	{
+		page->expire( decal );
+		page->update_bounds();
+	}
+}
+
+/**
+ * Trace a decal onto the world.
+ */
+void DecalManager::decal_trace( const std::string &decal_material, const LPoint2 &decal_scale,
+				float rotate, const LPoint3 &start, const LPoint3 &end, const LColorf &decal_color,
+				const int flags )
+{
+	queue_decal( decal_material, decal_scale, rotate, start, end, decal_color, flags );
+	flush_decals();
+}
+
+/**
+ * Queues a decal to be traced onto the world by the next call to
+ * flush_decals(). Decals queued together are clipped in parallel.
+ */
+void DecalManager::queue_decal( const std::string &decal_material, const LPoint2 &decal_scale,
+				float rotate, const LPoint3 &start, const LPoint3 &end, const LColorf &decal_color,
+				const int flags )
+{
+	decalrequest_t req;
+	req.material = decal_material;
+	req.scale = decal_scale;
+	req.rotate = rotate;
+	req.start = start;
+	req.end = end;
+	req.color = decal_color;
+	req.flags = flags;
+	_pending.push_back( req );
+}
+
+/**
+ * Traces all of the queued decals onto the world.
+ */
+void DecalManager::flush_decals()
+{
+	if ( _pending.empty() )
+		return;
+
+	PStatTimer timer( decal_collector );
+
+	pvector<decalinfo_t> infos;
+	infos.reserve( _pending.size() );
 
-	decal_collect.start();
-	mdata.decal_rbc->collect();
-	//_decal_rbc->collect();
-	decal_collect.stop();
-	//_decal_rbc->get_internal_scene().ls();
+	///////////////////////////////////////////////////////////////////////////////////////
+        // Find the surfaces to decal. The physics world can only be used from
+	// one thread, so this part isn't parallel.
+	decal_trace_collector.start();
+	for ( size_t i = 0; i < _pending.size(); i++ )
+	{
+		const decalrequest_t &req = _pending[i];
+
+		BulletClosestHitRayResult result = _loader->get_physics_world()->
+			ray_test_closest( req.start, req.end, world_bitmask );
+
+		if ( !result.has_hit() )
+			continue;
+
+		int triangle_idx = result.get_triangle_index();
+		BulletRigidBodyNode *node = DCAST( BulletRigidBodyNode, result.get_node() );
+		int modelnum = _loader->get_brush_triangle_model_fast( node, triangle_idx );
+		if ( modelnum == -1 )
+			continue;
+
+		brush_model_data_t &mdata = _loader->get_brush_model_data( modelnum );
+		int merged_modelnum = mdata.merged_modelnum;
+		const dmodel_t *model = _loader->get_bspdata()->dmodels + modelnum;
+
+		LVector3 decal_origin;
+		VectorLerp( req.start, req.end, result.get_hit_fraction(), decal_origin );
+		
+		if ( merged_modelnum != 0 )
+		{
+			// A non-world model can be moved around.
+			// In order to correctly decal, we must move the decal position back
+			// relative to the model's original transform.
+			CPT( TransformState ) ts = mdata.model_root.get_net_transform();
+
+			LPoint3 delta_origin = ts->get_pos() - mdata.origin;
+			LQuaternion delta_quat = ts->get_norm_quat();
+			LVector3 delta_scale = ts->get_scale();
+
+			CPT( TransformState ) delta_ts = TransformState::make_pos_quat_scale( delta_origin, delta_quat, delta_scale );
+			LMatrix4 matrix = delta_ts->get_mat();
+			matrix.invert_in_place();
+
+			decal_origin = matrix.xform_point( decal_origin );
+		}
+
+		decal_origin *= 16.0f;
+
+		const BSPMaterial *mat = BSPMaterial::get_from_file( req.material );
+
+		infos.push_back( decalinfo_t( decal_origin, req.scale, req.color, mat, _loader->get_bspdata() ) );
+		decalinfo_t &info = infos.back();
+		info.headnode = model->headnode[0];
+		info.modelnum = merged_modelnum;
+		info.flags = req.flags;
+		if ( merged_modelnum != 0 )
+		{
+			info.decal_world_to_model = mdata.origin_matrix;
+			info.decal_world_to_model.invert_in_place();
+		}
+		else
+		{
+			info.decal_world_to_model = LMatrix4f::ident_mat();
+		}
+	}
+	decal_trace_collector.stop();
+
+	_pending.clear();
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// Clip the decals against the surfaces they touch
+
+	decal_node_collector.start();
+	clip_decals( infos );
+	decal_node_collector.stop();
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// Write the decals into their pages
+
+	decal_add_geom_collector.start();
+	for ( size_t i = 0; i < infos.size(); i++ )
+	{
+		const decalinfo_t &info = infos[i];
+		if ( info.polys.empty() )
+			continue;
+
+		bool is_static = ( info.flags & DECALFLAGS_STATIC ) != 0;
+		int num_rows = (int)info.verts.size();
+		DecalPage *page = get_page( info.material, info.modelnum, is_static, num_rows );
+		if ( page == nullptr )
+		{
+			bspfile_cat.warning()
+				<< "Decal with " << num_rows << " vertices does not fit in a decal page\n";
+			continue;
+		}
+
+		PT( Decal ) decal = new Decal;
+		decal->bounds = new BoundingBox( info.mins, info.maxs );
+		decal->flags = info.flags;
+		decal->brush_modelnum = info.modelnum;
+		page->alloc( decal, num_rows );
+		write_decal_geometry( page, decal, info );
+		page->extend_bounds( info.mins, info.maxs );
+
+		if ( is_static )
+		{
+			_map_decals.push_back( decal );
+			continue;
+		}
+
+		// Forget about decals that were overwritten by a page wrapping
+		// around.
+		for ( int j = (int)_decals.size() - 1; j >= 0; j-- )
+		{
+			if ( _decals[j]->page == nullptr )
+				_decals.erase( _decals.begin() + j );
+		}
+
+		if ( decals_remove_overlapping.get_value() )
+		{
+			for ( int j = (int)_decals.size() - 1; j >= 0; j-- )
+			{
+				Decal *other = _decals[j];
+
+				// Check if we overlap with this decal.
+				//
+				// Only remove this decal if it is smaller than the decal
+				// we are wanting to create over it, and it is not a static
+				// decal (placed by the level designer, etc).
+				if ( other->brush_modelnum == decal->brush_modelnum &&
+				     other->bounds->contains( decal->bounds ) != BoundingVolume::IF_no_intersection &&
+				     other->bounds->get_volume() <= decal->bounds->get_volume() )
+				{
+					expire_decal( other );
+					_decals.erase( _decals.begin() + j );
+				}
+			}
+		}
+
+		while ( !_decals.empty() && (int)_decals.size() >= decals_max.get_value() )
+		{
+			// Remove the oldest decal to make space for the new one.
+			expire_decal( _decals.back() );
+			_decals.pop_back();
+		}
+
+		_decals.push_front( decal );
+	}
+	decal_add_geom_collector.stop();
 }
 
 void DecalManager::studio_decal_trace( const std::string &decal_material, const LPoint2 &decal_scale,
@@ -842,31 +1258,27 @@ void DecalManager::studio_decal_trace( const std::string &decal_material, const
 
 void DecalManager::cleanup()
 {
-        for ( size_t i = 0; i < _decals.size(); i++ )
-        {
-                Decal *d = _decals[i];
-                if ( !d->decalnp.is_empty() )
-                        d->decalnp.remove_node();
-        }
-        _decals.clear();
+	_pending.clear();
 
-	for ( size_t i = 0; i < _map_decals.size(); i++ )
+	for ( size_t i = 0; i < _pages.size(); i++ )
 	{
-		Decal *d = _map_decals[i];
-		if ( !d->decalnp.is_empty() )
-			d->decalnp.remove_node();
+		_pages[i]->remove();
 	}
+	_pages.clear();
+	_decal_states.clear();
+
+        _decals.clear();
 	_map_decals.clear();
 
 	if ( !_decal_root.is_empty() )
 		_decal_root.remove_node();
-	_decal_rbc = nullptr;
+	_decal_node = nullptr;
 }
 
 void DecalManager::init()
 {
-	_decal_rbc = new RigidBodyCombiner( "decal-root" );
-	_decal_root = NodePath( _decal_rbc );
+	_decal_node = new PandaNode( "decal-root" );
+	_decal_root = NodePath( _decal_node );
 	_decal_root.reparent_to( _loader->get_result() );
 	_decal_root.hide( CAMERA_SHADOW );
 }
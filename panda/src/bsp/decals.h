@@ -16,11 +16,17 @@
 
 #include <pdeque.h>
 #include <pvector.h>
+#include <pmap.h>
 #include <nodePath.h>
 #include <boundingBox.h>
-#include <rigidBodyCombiner.h>
+#include <geom.h>
+#include <geomNode.h>
+#include <geomVertexFormat.h>
+#include <renderState.h>
 
 class BSPLoader;
+class BSPMaterial;
+class DecalPage;
 
 enum
 {
@@ -31,12 +37,75 @@ enum
 class Decal : public ReferenceCount
 {
 public:
-        NodePath decalnp;
+        // The page holding our geometry, or nullptr once we have expired.
+        DecalPage *page;
+        int first_row;
+        int num_rows;
         PT( BoundingBox ) bounds;
         int flags;
 	int brush_modelnum;
 };
 
+/**
+ * A preallocated block of decal vertices and triangle indices, sharing one
+ * render state under one brush model.
+ *
+ * Rows of a dynamic page are handed out as a ring: when the page is full the
+ * oldest decals are overwritten. Expiring a decal just collapses its index
+ * range into degenerate triangles, so adding or removing decals never
+ * rebuilds or re-collects anything. Static pages never wrap, a new page is
+ * started when one fills up.
+ */
+class EXPCL_PANDABSP DecalPage : public ReferenceCount
+{
+public:
+	DecalPage( const GeomVertexFormat *format, const RenderState *state,
+		   int modelnum, bool ring, int num_rows, const NodePath &parent );
+
+	bool has_room( int num_rows ) const;
+	bool alloc( Decal *decal, int num_rows );
+	void expire( Decal *decal );
+	void extend_bounds( const LPoint3 &mins, const LPoint3 &maxs );
+	void update_bounds();
+	void remove();
+
+	INLINE Geom *get_geom() const
+	{
+		return _geom;
+	}
+	INLINE const RenderState *get_state() const
+	{
+		return _state;
+	}
+	INLINE int get_modelnum() const
+	{
+		return _modelnum;
+	}
+	INLINE bool is_ring() const
+	{
+		return _ring;
+	}
+
+private:
+	PT( Geom ) _geom;
+	PT( GeomNode ) _geom_node;
+	NodePath _np;
+	CPT( RenderState ) _state;
+	int _modelnum;
+	bool _ring;
+	int _num_rows;
+	int _head;
+
+	// Decals in the order their rows were handed out.
+	pdeque<PT( Decal )> _live;
+
+	bool _has_bounds;
+	// Set when a decal is expired, the bounds may be able to shrink.
+	bool _bounds_stale;
+	LPoint3 _mins;
+	LPoint3 _maxs;
+};
+
 class EXPCL_PANDABSP DecalManager
 {
 public:
@@ -49,6 +118,12 @@ public:
 		float rotate, const LPoint3 &start, const LPoint3 &end,
 		const LColorf &decal_color = LColorf( 1 ), const int flags = 0 );
 
+	// Queue a decal to be traced by the next flush_decals()
+	void queue_decal( const std::string &decal_material, const LPoint2 &decal_scale,
+		float rotate, const LPoint3 &start, const LPoint3 &end,
+		const LColorf &decal_color = LColorf( 1 ), const int flags = 0 );
+	void flush_decals();
+
 	// Trace a decal onto a studio model
 	void studio_decal_trace( const std::string &decal_material, const LPoint2 &decal_scale,
 				 float rotate, const LPoint3 &start, const LPoint3 &end,
@@ -62,11 +137,31 @@ public:
 	}
 
 private:
-	PT( RigidBodyCombiner ) _decal_rbc;
+	struct decalrequest_t
+	{
+		std::string material;
+		LPoint2 scale;
+		float rotate;
+		LPoint3 start;
+		LPoint3 end;
+		LColorf color;
+		int flags;
+	};
+
+	const RenderState *get_decal_state( const BSPMaterial *mat );
+	DecalPage *get_page( const BSPMaterial *mat, int modelnum, bool is_static, int num_rows );
+	void expire_decal( Decal *decal );
+
+private:
+	PT( PandaNode ) _decal_node;
 	NodePath _decal_root;
         BSPLoader *_loader;
         pdeque<PT( Decal )> _decals;
 	pvector<PT( Decal )> _map_decals;
+
+	pvector<decalrequest_t> _pending;
+	pvector<PT( DecalPage )> _pages;
+	pmap<const BSPMaterial *, CPT( RenderState )> _decal_states;
 };
 
 #endif // BSP_DECALS_H
@@ -10,10 +10,88 @@
  */
 
 #include "interpolated.h"
+#include "mathlib/ssemath.h"
 
 #include "configVariableDouble.h"
+#include "configVariableBool.h"
 
 static ConfigVariableDouble interp_amount( "smooth-lag", 0.1 );
+static ConfigVariableBool interp_batched( "interp-batched", false,
+					  "If true, new CInterpolatedGroups are batched by default and "
+					  "are interpolated together by CInterpolatedGroup::interpolate_all()." );
+
+CInterpolationBatch *CInterpolationBatch::_global_ptr = nullptr;
+
+template <typename Type>
+static int add_to_batch( CInterpolatedGroup *group, IInterpolatedVar *watcher, void *data )
+{
+	return CInterpolationBatch::get_global_ptr()->add_var( group, watcher, (Type *)data );
+}
+
+CInterpolatedGroup::CInterpolatedGroup() :
+	_needs_interpolation( true ),
+	_enabled( true ),
+	_batched( false ),
+	_batch_index( -1 ),
+	_clock( ClockObject::get_global_clock() )
+{
+	if ( interp_batched )
+	{
+		set_batched( true );
+	}
+}
+
+CInterpolatedGroup::~CInterpolatedGroup()
+{
+	set_batched( false );
+}
+
+/**
+ * Moves the group's variables into or out of the shared CInterpolationBatch.
+ * interpolate() keeps working on a batched group, but the point is to call
+ * interpolate_all() once per frame instead.
+ */
+void CInterpolatedGroup::set_batched( bool batched )
+{
+	if ( batched == _batched )
+	{
+		return;
+	}
+
+	CInterpolationBatch *batch = CInterpolationBatch::get_global_ptr();
+
+	if ( batched )
+	{
+		batch->add_group( this );
+		_batched = true;
+
+		for ( size_t i = 0; i < _var_map.m_Entries.size(); i++ )
+		{
+			VarMapEntry_t *e = &_var_map.m_Entries[i];
+			if ( e->type & EXCLUDE_AUTO_INTERPOLATE )
+				continue;
+
+			e->batch_slot = e->add_to_batch( this, e->watcher, e->data );
+			batch->set_needs_interpolation( e->batch_slot, e->m_bNeedsToInterpolate != 0 );
+		}
+	}
+	else
+	{
+		for ( size_t i = 0; i < _var_map.m_Entries.size(); i++ )
+		{
+			VarMapEntry_t *e = &_var_map.m_Entries[i];
+			if ( e->batch_slot < 0 )
+				continue;
+
+			e->m_bNeedsToInterpolate = batch->get_needs_interpolation( e->batch_slot );
+			batch->remove_var( e->batch_slot );
+			e->batch_slot = -1;
+		}
+
+		batch->remove_group( this );
+		_batched = false;
+	}
+}
 
 template <typename Type>
 void CInterpolatedGroup::add_var( Type *data, IInterpolatedVar *watcher, int type )
@@ -40,6 +118,10 @@ void CInterpolatedGroup::add_var( Type *data, IInterpolatedVar *watcher, int typ
 		}
 	}
 
+	// The batch reads the var's setup when it mirrors it.
+	watcher->_Setup( (void *)data, type );
+	watcher->SetInterpolationAmount( interp_amount );
+
 	if ( bAddIt )
 	{
 		// watchers must have a debug name set
@@ -50,19 +132,23 @@ void CInterpolatedGroup::add_var( Type *data, IInterpolatedVar *watcher, int typ
 		map.watcher = watcher;
 		map.type = type;
 		map.m_bNeedsToInterpolate = true;
+		map.batch_slot = -1;
+		map.add_to_batch = &add_to_batch<Type>;
 		if ( type & EXCLUDE_AUTO_INTERPOLATE )
 		{
 			_var_map.m_Entries.push_back( map );
 		}
 		else
 		{
+			if ( _batched )
+			{
+				map.batch_slot = map.add_to_batch( this, watcher, (void *)data );
+			}
+
 			_var_map.m_Entries.insert( _var_map.m_Entries.begin(), map );
 			++_var_map.m_nInterpolatedEntries;
 		}
 	}
-
-	watcher->_Setup( (void *)data, type );
-	watcher->SetInterpolationAmount( interp_amount );
 }
 
 template <typename Type>
@@ -75,6 +161,9 @@ void CInterpolatedGroup::remove_var( Type *data, bool assert )
 			if ( !( _var_map.m_Entries[i].type & EXCLUDE_AUTO_INTERPOLATE ) )
 				--_var_map.m_nInterpolatedEntries;
 
+			if ( _var_map.m_Entries[i].batch_slot >= 0 )
+				CInterpolationBatch::get_global_ptr()->remove_var( _var_map.m_Entries[i].batch_slot );
+
 			_var_map.m_Entries.erase( _var_map.m_Entries.begin() + i );
 			return;
 		}
@@ -101,7 +190,10 @@ void CInterpolatedGroup::on_latch_interpolated_vars( int flags, float changetime
 
 		if ( watcher->NoteChanged( changetime, update_last ) )
 		{
-			e->m_bNeedsToInterpolate = true;
+			if ( e->batch_slot >= 0 )
+				CInterpolationBatch::get_global_ptr()->set_needs_interpolation( e->batch_slot, true );
+			else
+				e->m_bNeedsToInterpolate = true;
 		}
 
 	}
@@ -114,13 +206,18 @@ void CInterpolatedGroup::on_latch_interpolated_vars( int flags, float changetime
 
 bool CInterpolatedGroup::interp_interpolate( VarMapping_t *map, float curr_time )
 {
+	CInterpolationBatch *batch = _batched ? CInterpolationBatch::get_global_ptr() : nullptr;
+
 	bool done = true;
 	if ( curr_time < map->m_lastInterpolationTime )
 	{
 		for ( int i = 0; i < map->m_nInterpolatedEntries; i++ )
 		{
 			VarMapEntry_t *e = &map->m_Entries[i];
-			e->m_bNeedsToInterpolate = true;
+			if ( e->batch_slot >= 0 )
+				batch->set_needs_interpolation( e->batch_slot, true );
+			else
+				e->m_bNeedsToInterpolate = true;
 		}
 	}
 	map->m_lastInterpolationTime = curr_time;
@@ -129,17 +226,436 @@ bool CInterpolatedGroup::interp_interpolate( VarMapping_t *map, float curr_time
 	{
 		VarMapEntry_t *e = &map->m_Entries[i];
 
-		if ( !e->m_bNeedsToInterpolate )
+		bool needs = e->batch_slot >= 0 ? batch->get_needs_interpolation( e->batch_slot ) :
+			e->m_bNeedsToInterpolate != 0;
+		if ( !needs )
 			continue;
 
 		IInterpolatedVar *watcher = e->watcher;
 		assert( !( watcher->GetType() & EXCLUDE_AUTO_INTERPOLATE ) );
 
 		if ( watcher->Interpolate( curr_time ) )
-			e->m_bNeedsToInterpolate = false;
+		{
+			if ( e->batch_slot >= 0 )
+				batch->set_needs_interpolation( e->batch_slot, false );
+			else
+				e->m_bNeedsToInterpolate = false;
+		}
 		else
+		{
 			done = false;
+		}
 	}
 
 	return done;
 }
+
+///////////////////////////////////////////////////////////////////////////////////////
+// CInterpolationBatch
+
+CInterpolationBatch::CInterpolationBatch()
+{
+}
+
+CInterpolationBatch *CInterpolationBatch::get_global_ptr()
+{
+	if ( _global_ptr == nullptr )
+	{
+		_global_ptr = new CInterpolationBatch;
+	}
+
+	return _global_ptr;
+}
+
+int CInterpolationBatch::add_slot( CInterpolatedGroup *group, IInterpolatedVar *watcher, void *data,
+				   int num_components, int flags, SyncFunc *sync )
+{
+	int slot;
+	if ( !_free_slots.empty() )
+	{
+		slot = _free_slots.back();
+		_free_slots.pop_back();
+	}
+	else
+	{
+		slot = (int)_watchers.size();
+		_watchers.push_back( nullptr );
+		_data.push_back( nullptr );
+		_sync.push_back( nullptr );
+		_versions.push_back( 0 );
+		_slot_group.push_back( -1 );
+		_flags.push_back( 0 );
+		_needs.push_back( 0 );
+		_num_components.push_back( 0 );
+		_count.push_back( 0 );
+		_total_count.push_back( 0 );
+		_interp_amount.push_back( 0.0f );
+		_last_networked_time.push_back( 0.0f );
+		_times.resize( _times.size() + HISTORY );
+		_values.resize( _values.size() + HISTORY * MAX_COMPONENTS );
+	}
+
+	_watchers[slot] = watcher;
+	_data[slot] = data;
+	_sync[slot] = sync;
+	_slot_group[slot] = group->_batch_index;
+	_flags[slot] = (unsigned char)( flags | SF_in_use );
+	_needs[slot] = 1;
+	_num_components[slot] = (unsigned char)num_components;
+	_count[slot] = 0;
+	_total_count[slot] = 0;
+
+	if ( sync != nullptr )
+	{
+		sync( this, slot );
+	}
+
+	return slot;
+}
+
+void CInterpolationBatch::remove_var( int slot )
+{
+	_watchers[slot] = nullptr;
+	_data[slot] = nullptr;
+	_sync[slot] = nullptr;
+	_slot_group[slot] = -1;
+	_flags[slot] = 0;
+	_needs[slot] = 0;
+	_free_slots.push_back( slot );
+}
+
+void CInterpolationBatch::add_group( CInterpolatedGroup *group )
+{
+	group->_batch_index = (int)_groups.size();
+	_groups.push_back( group );
+	_group_active.push_back( 0 );
+	_group_pending.push_back( 0 );
+}
+
+/**
+ * Removes a group whose variables have already been removed. The last group
+ * takes its place in the list.
+ */
+void CInterpolationBatch::remove_group( CInterpolatedGroup *group )
+{
+	int index = group->_batch_index;
+	int last = (int)_groups.size() - 1;
+	nassertv( index >= 0 && index <= last && _groups[index] == group );
+
+	if ( index != last )
+	{
+		CInterpolatedGroup *moved = _groups[last];
+		_groups[index] = moved;
+		moved->_batch_index = index;
+		for ( size_t i = 0; i < _slot_group.size(); i++ )
+		{
+			if ( _slot_group[i] == last )
+				_slot_group[i] = index;
+		}
+	}
+
+	_groups.pop_back();
+	_group_active.pop_back();
+	_group_pending.pop_back();
+	group->_batch_index = -1;
+}
+
+/**
+ * Returns true if the two mirrored samples of the slot hold the same value.
+ */
+bool CInterpolationBatch::same_sample( int slot, int a, int b ) const
+{
+	const float *values = &_values[slot * HISTORY * MAX_COMPONENTS];
+	for ( int c = 0; c < _num_components[slot]; c++ )
+	{
+		if ( values[c * HISTORY + a] != values[c * HISTORY + b] )
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Interpolates every batched variable that needs it to the indicated time.
+ * This does the same thing as calling interpolate() on each batched group.
+ */
+void CInterpolationBatch::interpolate( float now )
+{
+	size_t num_groups = _groups.size();
+	for ( size_t g = 0; g < num_groups; g++ )
+	{
+		CInterpolatedGroup *group = _groups[g];
+		_group_pending[g] = 0;
+		_group_active[g] = group->_needs_interpolation;
+		if ( !_group_active[g] )
+			continue;
+
+		VarMapping_t *map = group->get_var_mapping();
+		if ( now < map->m_lastInterpolationTime )
+		{
+			// Time went backwards, everything has to be interpolated again.
+			_group_active[g] = 2;
+		}
+		map->m_lastInterpolationTime = now;
+	}
+
+	size_t num_slots = _watchers.size();
+	if ( _p0.size() < num_slots * MAX_COMPONENTS )
+	{
+		size_t size = num_slots * MAX_COMPONENTS;
+		_p0.resize( size );
+		_p1.resize( size );
+		_p2.resize( size );
+		_w0.resize( size );
+		_w1.resize( size );
+		_w2.resize( size );
+		_out.resize( size );
+		_dest.resize( size );
+	}
+
+	bool allow_extrapolation = CInterpolationContext::IsExtrapolationAllowed();
+	float last_timestamp = CInterpolationContext::GetLastTimeStamp();
+	float max_extrapolation = cl_extrapolate_amount;
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// Work out the samples and blend weights of each variable.
+
+	size_t num_lanes = 0;
+	for ( size_t slot = 0; slot < num_slots; slot++ )
+	{
+		if ( !( _flags[slot] & SF_in_use ) )
+			continue;
+
+		int g = _slot_group[slot];
+		if ( !_group_active[g] )
+			continue;
+		if ( _group_active[g] == 2 )
+			_needs[slot] = 1;
+		if ( !_needs[slot] )
+			continue;
+
+		IInterpolatedVar *watcher = _watchers[slot];
+		if ( _sync[slot] != nullptr && _versions[slot] != watcher->m_nHistoryVersion )
+		{
+			_sync[slot]( this, (int)slot );
+		}
+
+		int flags = _flags[slot];
+		bool fallback = ( flags & SF_fallback ) != 0;
+
+		const float *times = &_times[slot * HISTORY];
+		int count = _count[slot];
+		int total = _total_count[slot];
+		float amount = _interp_amount[slot];
+		float targettime = now - amount;
+
+		// Same search as CInterpolatedVarArrayBase::GetInterpolationInfo(). If
+		// it needs a sample older than the ones we mirrored, the var does it.
+		int newer = -1;
+		int older = -1;
+		int oldest = -1;
+		float frac = 0.0f;
+		bool hermite = false;
+		bool found = false;
+		int no_more_changes = 0;
+		int i = 0;
+		for ( ; !fallback && i < count; i++ )
+		{
+			older = i;
+
+			float older_change_time = times[i];
+			if ( older_change_time == 0.0f )
+				break;
+
+			if ( targettime < older_change_time )
+			{
+				newer = older;
+				continue;
+			}
+
+			found = true;
+
+			if ( newer == -1 )
+			{
+				newer = older;
+				no_more_changes = 1;
+				break;
+			}
+
+			float dt = times[newer] - older_change_time;
+			if ( dt > 0.0001f )
+			{
+				frac = std::min( ( targettime - older_change_time ) / dt, 2.0f );
+
+				int oldestindex = i + 1;
+				if ( !( flags & SF_linear_only ) )
+				{
+					if ( oldestindex < count )
+					{
+						oldest = oldestindex;
+						if ( older_change_time - times[oldest] > 0.0001f )
+							hermite = true;
+					}
+					else if ( oldestindex < total )
+					{
+						fallback = true;
+					}
+				}
+
+				if ( newer == 0 && same_sample( (int)slot, newer, older ) &&
+				     ( !hermite || same_sample( (int)slot, newer, oldest ) ) )
+				{
+					no_more_changes = 1;
+				}
+			}
+			break;
+		}
+
+		if ( !fallback && !found )
+		{
+			if ( i == count && count < total )
+			{
+				fallback = true;
+			}
+			else if ( newer != -1 )
+			{
+				older = newer;
+				found = true;
+			}
+			else
+			{
+				newer = older;
+				found = older != -1;
+			}
+		}
+
+		if ( fallback )
+		{
+			if ( watcher->Interpolate( now ) )
+				_needs[slot] = 0;
+			else
+				_group_pending[g] = 1;
+			continue;
+		}
+
+		if ( !found )
+		{
+			// No history at all.
+			_group_pending[g] = 1;
+			continue;
+		}
+
+		// Every case blends at most three samples: out = w0*p0 + w1*p1 + w2*p2.
+		int i0 = newer, i1 = newer, i2 = newer;
+		float w0 = 0.0f, w1 = 0.0f, w2 = 1.0f;
+
+		if ( hermite && ( flags & SF_hermite ) )
+		{
+			// Lerp_Hermite(), expanded into weights on the three samples.
+			float t = frac;
+			float t2 = t * t;
+			float t3 = t2 * t;
+			i0 = oldest;
+			i1 = older;
+			i2 = newer;
+			w0 = -( t3 - 2 * t2 + t );
+			w1 = 2 * t3 - 4 * t2 + t + 1;
+			w2 = -t3 + 2 * t2;
+
+			// TimeFixup_Hermite() replaces the oldest sample with a blend of
+			// it and the older one.
+			float dt1 = times[newer] - times[older];
+			float dt2 = times[older] - times[oldest];
+			if ( fabsf( dt1 - dt2 ) > 0.0001f && dt2 > 0.0001f )
+			{
+				float f = dt1 / dt2;
+				w1 += w0 * ( 1 - f );
+				w0 *= f;
+			}
+		}
+		else if ( newer == older )
+		{
+			int real_older = newer + 1;
+			if ( allow_extrapolation && real_older < total && amount > 0.000001f &&
+			     last_timestamp <= _last_networked_time[slot] )
+			{
+				if ( real_older >= count )
+				{
+					if ( watcher->Interpolate( now ) )
+						_needs[slot] = 0;
+					else
+						_group_pending[g] = 1;
+					continue;
+				}
+
+				// Same as _Extrapolate(). Types without an extrapolation
+				// just hold the newest value.
+				float dest_time = now - amount;
+				if ( times[real_older] != 0.0f && ( flags & SF_extrapolate ) &&
+				     fabsf( times[real_older] - times[newer] ) >= 0.001f &&
+				     dest_time > times[newer] )
+				{
+					float extrapolation = std::min( dest_time - times[newer], max_extrapolation );
+					float s = 1.0f + extrapolation / ( times[newer] - times[real_older] );
+					i1 = real_older;
+					w1 = 1.0f - s;
+					w2 = s;
+				}
+			}
+		}
+		else
+		{
+			i1 = older;
+			w1 = 1.0f - frac;
+			w2 = frac;
+		}
+
+		const float *values = &_values[slot * HISTORY * MAX_COMPONENTS];
+		float *dest = (float *)_data[slot];
+		for ( int c = 0; c < _num_components[slot]; c++ )
+		{
+			const float *history = values + c * HISTORY;
+			_p0[num_lanes] = history[i0];
+			_p1[num_lanes] = history[i1];
+			_p2[num_lanes] = history[i2];
+			_w0[num_lanes] = w0;
+			_w1[num_lanes] = w1;
+			_w2[num_lanes] = w2;
+			_dest[num_lanes] = dest + c;
+			num_lanes++;
+		}
+
+		if ( no_more_changes )
+			_needs[slot] = 0;
+		else
+			_group_pending[g] = 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////
+	// Blend every component, four at a time.
+
+	size_t lane = 0;
+	for ( ; lane + 4 <= num_lanes; lane += 4 )
+	{
+		fltx4 out = MulSIMD( LoadUnalignedSIMD( &_w0[lane] ), LoadUnalignedSIMD( &_p0[lane] ) );
+		out = MaddSIMD( LoadUnalignedSIMD( &_w1[lane] ), LoadUnalignedSIMD( &_p1[lane] ), out );
+		out = MaddSIMD( LoadUnalignedSIMD( &_w2[lane] ), LoadUnalignedSIMD( &_p2[lane] ), out );
+		StoreUnalignedSIMD( &_out[lane], out );
+	}
+	for ( ; lane < num_lanes; lane++ )
+	{
+		_out[lane] = _w0[lane] * _p0[lane] + _w1[lane] * _p1[lane] + _w2[lane] * _p2[lane];
+	}
+
+	for ( lane = 0; lane < num_lanes; lane++ )
+	{
+		*_dest[lane] = _out[lane];
+	}
+
+	for ( size_t g = 0; g < num_groups; g++ )
+	{
+		if ( _group_active[g] )
+		{
+			_groups[g]->_needs_interpolation = _group_pending[g] != 0;
+		}
+	}
+}
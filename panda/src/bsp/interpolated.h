@@ -16,6 +16,8 @@
 
 #include "clockObject.h"
 
+class CInterpolatedGroup;
+
 class VarMapEntry_t
 {
 public:
@@ -24,6 +26,12 @@ public:
 	// need Interpolate() called on it anymore.
 	void *data;
 	IInterpolatedVar *watcher;
+	// Slot in CInterpolationBatch, or -1 if this var isn't batched. A
+	// batched var keeps its needs-interpolation flag in the batch.
+	int batch_slot;
+
+	typedef int AddToBatchFunc( CInterpolatedGroup *group, IInterpolatedVar *watcher, void *data );
+	AddToBatchFunc *add_to_batch;
 };
 
 class VarMapping_t
@@ -40,6 +48,156 @@ public:
 	float m_lastInterpolationTime;
 };
 
+/**
+ * Describes how CInterpolationBatch handles a variable type. Types that
+ * aren't made of floats have no components and are never batched.
+ */
+template <typename Type>
+struct InterpBatchTraits
+{
+	static const int num_components = 0;
+	static const bool hermite = false;
+	static const bool extrapolate = false;
+};
+
+template <>
+struct InterpBatchTraits<float>
+{
+	static const int num_components = 1;
+	static const bool hermite = true;
+	static const bool extrapolate = true;
+};
+
+template <>
+struct InterpBatchTraits<LVector2f>
+{
+	static const int num_components = 2;
+	static const bool hermite = true;
+	static const bool extrapolate = false;
+};
+
+// Vec3s are usually angles, which only get a linear blend. See the
+// Lerp_Hermite specialization.
+template <>
+struct InterpBatchTraits<LVector3f>
+{
+	static const int num_components = 3;
+	static const bool hermite = false;
+	static const bool extrapolate = true;
+};
+
+template <>
+struct InterpBatchTraits<LVector4f>
+{
+	static const int num_components = 4;
+	static const bool hermite = true;
+	static const bool extrapolate = false;
+};
+
+/**
+ * Interpolates the variables of every batched CInterpolatedGroup in a single
+ * pass.
+ *
+ * The newest samples of each variable's history are mirrored into flat
+ * arrays: the change times per variable and the values per component. Each
+ * frame the blend weights are worked out per variable from the mirrored
+ * times. Then every component of every variable is blended four at a time
+ * and written back to the variable. The IInterpolatedVar still owns the
+ * history and a variable is only mirrored again when its history changes.
+ *
+ * Variables that can't be blended this way, such as arrays, looping
+ * variables and other types, still get a slot. The pass calls their
+ * Interpolate() instead.
+ */
+class EXPCL_PANDABSP CInterpolationBatch
+{
+public:
+	// How many of the newest samples are mirrored per variable.
+	static const int HISTORY = 8;
+	static const int MAX_COMPONENTS = 4;
+
+	CInterpolationBatch();
+
+	template <typename Type>
+	int add_var( CInterpolatedGroup *group, IInterpolatedVar *watcher, Type *data );
+	void remove_var( int slot );
+
+	void add_group( CInterpolatedGroup *group );
+	void remove_group( CInterpolatedGroup *group );
+
+	INLINE void set_needs_interpolation( int slot, bool flag )
+	{
+		_needs[slot] = flag;
+	}
+	INLINE bool get_needs_interpolation( int slot ) const
+	{
+		return _needs[slot] != 0;
+	}
+
+	void interpolate( float now );
+
+	static CInterpolationBatch *get_global_ptr();
+
+private:
+	enum SlotFlags
+	{
+		SF_in_use	= 1 << 0,
+		// Interpolated through the IInterpolatedVar instead.
+		SF_fallback	= 1 << 1,
+		SF_hermite	= 1 << 2,
+		SF_extrapolate	= 1 << 3,
+		SF_linear_only	= 1 << 4,
+	};
+
+	typedef void SyncFunc( CInterpolationBatch *batch, int slot );
+
+	int add_slot( CInterpolatedGroup *group, IInterpolatedVar *watcher, void *data,
+		      int num_components, int flags, SyncFunc *sync );
+
+	template <typename Type>
+	static void sync_var( CInterpolationBatch *batch, int slot );
+
+	bool same_sample( int slot, int a, int b ) const;
+
+private:
+	// Per slot
+	pvector<IInterpolatedVar *> _watchers;
+	pvector<void *> _data;
+	pvector<SyncFunc *> _sync;
+	pvector<unsigned int> _versions;
+	pvector<int> _slot_group;
+	pvector<unsigned char> _flags;
+	pvector<unsigned char> _needs;
+	pvector<unsigned char> _num_components;
+	pvector<int> _count;
+	pvector<int> _total_count;
+	pvector<float> _interp_amount;
+	pvector<float> _last_networked_time;
+	pvector<int> _free_slots;
+
+	// HISTORY entries per slot, newest first.
+	pvector<float> _times;
+	// HISTORY entries per component, MAX_COMPONENTS components per slot.
+	pvector<float> _values;
+
+	// Per group
+	pvector<CInterpolatedGroup *> _groups;
+	pvector<unsigned char> _group_active;
+	pvector<unsigned char> _group_pending;
+
+	// Per blended component, rebuilt each pass.
+	pvector<float> _p0;
+	pvector<float> _p1;
+	pvector<float> _p2;
+	pvector<float> _w0;
+	pvector<float> _w1;
+	pvector<float> _w2;
+	pvector<float> _out;
+	pvector<float *> _dest;
+
+	static CInterpolationBatch *_global_ptr;
+};
+
 /**
  * This class manages and interpolates a group of interpolated variables.
  */
@@ -47,6 +205,7 @@ class EXPCL_PANDABSP CInterpolatedGroup
 {
 PUBLISHED:
 	CInterpolatedGroup();
+	~CInterpolatedGroup();
 
 	void set_interpolation_enabled( bool enable );
 	bool interpolation_enabled() const;
@@ -67,6 +226,11 @@ PUBLISHED:
 	// Interpolate the variables
 	void interpolate( float now );
 
+	// Batched groups are interpolated together by interpolate_all().
+	void set_batched( bool batched );
+	INLINE bool is_batched() const;
+	static void interpolate_all( float now );
+
 	// Returns true if any of our variables are needing interpolation.
 	bool needs_interpolation() const;
 
@@ -79,19 +243,17 @@ public:
 	VarMapping_t *get_var_mapping();
 
 private:
+	friend class CInterpolationBatch;
+
 	bool _enabled;
+	bool _batched;
+	// Our index in CInterpolationBatch's group list.
+	int _batch_index;
 	bool _needs_interpolation;
 	VarMapping_t _var_map;
 	ClockObject *_clock;
 };
 
-INLINE CInterpolatedGroup::CInterpolatedGroup() :
-	_needs_interpolation( true ),
-	_enabled( true ),
-	_clock( ClockObject::get_global_clock() )
-{
-}
-
 INLINE void CInterpolatedGroup::add_float( float *data, IInterpolatedVar *watcher, int type )
 {
 	add_var( data, watcher, type );
@@ -132,6 +294,16 @@ INLINE bool CInterpolatedGroup::interpolation_enabled() const
 	return _enabled;
 }
 
+INLINE bool CInterpolatedGroup::is_batched() const
+{
+	return _batched;
+}
+
+INLINE void CInterpolatedGroup::interpolate_all( float now )
+{
+	CInterpolationBatch::get_global_ptr()->interpolate( now );
+}
+
 INLINE VarMapping_t *CInterpolatedGroup::get_var_mapping()
 {
 	return &_var_map;
@@ -144,3 +316,76 @@ INLINE bool CInterpolatedGroup::needs_interpolation() const
 {
 	return _needs_interpolation;
 }
+
+/**
+ * Gives the variable a slot in the batch. Returns the slot.
+ */
+template <typename Type>
+int CInterpolationBatch::add_var( CInterpolatedGroup *group, IInterpolatedVar *watcher, Type *data )
+{
+	typedef InterpBatchTraits<Type> Traits;
+
+	int flags = 0;
+	SyncFunc *sync = nullptr;
+	if ( Traits::num_components == 0 ||
+	     dynamic_cast<CInterpolatedVarArrayBase<Type, false> *>( watcher ) == nullptr )
+	{
+		flags |= SF_fallback;
+	}
+	else
+	{
+		sync = &CInterpolationBatch::sync_var<Type>;
+		if ( Traits::hermite )
+			flags |= SF_hermite;
+		if ( Traits::extrapolate )
+			flags |= SF_extrapolate;
+	}
+
+	return add_slot( group, watcher, (void *)data, Traits::num_components, flags, sync );
+}
+
+/**
+ * Copies the newest samples of the variable's history into the slot.
+ */
+template <typename Type>
+void CInterpolationBatch::sync_var( CInterpolationBatch *batch, int slot )
+{
+	CInterpolatedVarArrayBase<Type, false> *var =
+		static_cast<CInterpolatedVarArrayBase<Type, false> *>( batch->_watchers[slot] );
+	const int num_components = InterpBatchTraits<Type>::num_components;
+
+	int total = var->m_VarHistory.Count();
+	int count = std::min( total, (int)HISTORY );
+
+	float *times = &batch->_times[slot * HISTORY];
+	float *values = &batch->_values[slot * HISTORY * MAX_COMPONENTS];
+	for ( int h = 0; h < count; h++ )
+	{
+		const typename CInterpolatedVarArrayBase<Type, false>::CInterpolatedVarEntry &entry =
+			var->m_VarHistory[h];
+		const float *value = (const float *)entry.GetValue();
+
+		times[h] = entry.changetime;
+		for ( int c = 0; c < num_components; c++ )
+		{
+			values[c * HISTORY + h] = value[c];
+		}
+	}
+
+	batch->_count[slot] = count;
+	batch->_total_count[slot] = total;
+	batch->_interp_amount[slot] = var->m_InterpolationAmount;
+	batch->_last_networked_time[slot] = var->m_LastNetworkedTime;
+	batch->_versions[slot] = var->m_nHistoryVersion;
+
+	unsigned char &flags = batch->_flags[slot];
+	if ( var->m_fType & INTERPOLATE_LINEAR_ONLY )
+		flags |= SF_linear_only;
+	else
+		flags &= ~SF_linear_only;
+	// Looping values wrap around, leave those to the var.
+	if ( var->m_bLooping != nullptr && var->m_bLooping[0] )
+		flags |= SF_fallback;
+	else
+		flags &= ~SF_fallback;
+}
@@ -176,7 +176,17 @@ PUBLISHED:
 	virtual void SetDebugName( const char *pName ) = 0;
 
 public:
+	IInterpolatedVar() :
+		m_nHistoryVersion( 0 )
+	{
+	}
+
 	virtual void _Setup( void *data, int type ) = 0;
+
+	// Bumped whenever the history or anything that affects how it is
+	// interpolated changes, so CInterpolationBatch knows when its copy is
+	// stale.
+	unsigned int m_nHistoryVersion;
 };
 
 template <typename Type, bool IS_ARRAY>
@@ -477,6 +487,7 @@ class CInterpolatedVarArrayBase : public IInterpolatedVar
 {
 PUBLISHED:
 	friend class CInterpolatedVarPrivate;
+	friend class CInterpolationBatch;
 
 	CInterpolatedVarArrayBase( const char *pDebugName = "no debug name" );
 	virtual ~CInterpolatedVarArrayBase();
@@ -662,6 +673,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::_Setup( void *pData,
 {
 	m_pValue = (Type *)pData;
 	m_fType = type;
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -669,6 +681,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetInterpolationAmount(
 	float seconds )
 {
 	m_InterpolationAmount = seconds;
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -682,6 +695,7 @@ void CInterpolatedVarArrayBase<Type, IS_ARRAY>::NoteLastNetworkedValue()
 {
 	memcpy( m_LastNetworkedValue, m_pValue, m_nMaxCount * sizeof( Type ) );
 	m_LastNetworkedTime = g_flLastPacketTimestamp;
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -759,6 +773,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::ClearHistory()
 		m_VarHistory[i].DeleteEntry();
 	}
 	m_VarHistory.RemoveAll();
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -801,6 +816,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::AddToHead(
 
 	CInterpolatedVarEntry *e = &m_VarHistory[newslot];
 	e->NewEntry( values, m_nMaxCount, changeTime );
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -842,7 +858,11 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::RemoveOldEntries(
 			break;
 		newCount = i;
 	}
-	m_VarHistory.Truncate( newCount );
+	if ( newCount != m_VarHistory.Count() )
+	{
+		m_VarHistory.Truncate( newCount );
+		++m_nHistoryVersion;
+	}
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -856,7 +876,11 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::RemoveEntriesPreviousTo(
 			// We need to preserve this sample (ie: the one right before this
 			// timestamp) and the sample right before it (for hermite blending), and
 			// we can get rid of everything else.
-			m_VarHistory.Truncate( i + 3 );
+			if ( i + 3 < m_VarHistory.Count() )
+			{
+				m_VarHistory.Truncate( i + 3 );
+				++m_nHistoryVersion;
+			}
 			break;
 		}
 	}
@@ -1275,6 +1299,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::Copy(
 		CInterpolatedVarEntry *src = &pSrc->m_VarHistory[i];
 		dest->NewEntry( src->GetValue(), m_nMaxCount, src->changetime );
 	}
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -1331,6 +1356,8 @@ inline Type *CInterpolatedVarArrayBase<Type, IS_ARRAY>::GetHistoryValue(
 	{
 		CInterpolatedVarEntry *entry = &m_VarHistory[index];
 		changetime = entry->changetime;
+		// The caller may write through the returned pointer.
+		++m_nHistoryVersion;
 		return &entry->GetValue()[iArrayIndex];
 	}
 	else
@@ -1351,6 +1378,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetHistoryValuesForItem(
 		CInterpolatedVarEntry *entry = &m_VarHistory[i];
 		entry->GetValue()[item] = value;
 	}
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
@@ -1359,6 +1387,7 @@ inline void CInterpolatedVarArrayBase<Type, IS_ARRAY>::SetLooping(
 {
 	assert( iArrayIndex >= 0 && iArrayIndex < m_nMaxCount );
 	m_bLooping[iArrayIndex] = looping;
+	++m_nHistoryVersion;
 }
 
 template <typename Type, bool IS_ARRAY>
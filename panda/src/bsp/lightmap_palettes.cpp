@@ -14,8 +14,13 @@
 #include "bsploader.h"
 #include "TexturePacker.h"
 
+#include <datagram.h>
+#include <datagramIterator.h>
+#include <virtualFileSystem.h>
+
 #include <bitset>
 #include <cstdio>
+#include <cstring>
 
 NotifyCategoryDef( lightmapPalettizer, "" );
 
@@ -27,12 +32,21 @@ static const int max_palette = 1024;
 // is verrry slow atm.
 //#define LMPALETTE_SPLIT
 
+// Baked palette file, written next to the .bsp by p3rad.
+static const char lmpalette_ident[4] = { 'L', 'M', 'P', 'L' };
+static const int lmpalette_version = 1;
+
 LightmapPalettizer::LightmapPalettizer( const BSPLoader *loader ) :
-        _loader( loader )
+        _bspdata( loader->get_bspdata() )
+{
+}
+
+LightmapPalettizer::LightmapPalettizer( bspdata_t *bspdata ) :
+        _bspdata( bspdata )
 {
 }
 
-INLINE PNMImage lightmap_img_for_face( const BSPLoader *loader, const dface_t *face, int lmnum = 0, bool bounced = false )
+INLINE PNMImage lightmap_img_for_face( bspdata_t *bspdata, const dface_t *face, int lmnum = 0, bool bounced = false )
 {
         int width = face->lightmap_size[0] + 1;
         int height = face->lightmap_size[1] + 1;
@@ -60,9 +74,9 @@ INLINE PNMImage lightmap_img_for_face( const BSPLoader *loader, const dface_t *f
                 {
                         colorrgbexp32_t *sample;
                         if ( !bounced )
-                                sample = SampleLightmap( loader->get_bspdata(), face, luxel, 0, lmnum );
+                                sample = SampleLightmap( bspdata, face, luxel, 0, lmnum );
                         else
-                                sample = SampleBouncedLightmap( loader->get_bspdata(), face, luxel );
+                                sample = SampleBouncedLightmap( bspdata, face, luxel );
 
 			// Luxel is in linear-space.
 			LVector3 luxel_col;
@@ -87,9 +101,9 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
         result_vec.push_back( pal );
 
         // First step, build sources.
-        for ( int facenum = 0; facenum < _loader->get_bspdata()->numfaces; facenum++ )
+        for ( int facenum = 0; facenum < _bspdata->numfaces; facenum++ )
         {
-                dface_t *face = _loader->get_bspdata()->dfaces + facenum;
+                dface_t *face = _bspdata->dfaces + facenum;
                 if ( face->lightofs == -1 )
                 {
                         // Face does not have a lightmap.
@@ -98,17 +112,17 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
 
                 LightmapSource src;
                 src.facenum = facenum;
-                src.lightmap_img[0] = lightmap_img_for_face( _loader, face, 0, true ); // bounced lightmap
+                src.lightmap_img[0] = lightmap_img_for_face( _bspdata, face, 0, true ); // bounced lightmap
                 if ( face->bumped_lightmap )
                 {
                         for ( int n = 0; n < NUM_BUMP_VECTS + 1; n++ )
                         {
-                                src.lightmap_img[n + 1] = lightmap_img_for_face( _loader, face, n );
+                                src.lightmap_img[n + 1] = lightmap_img_for_face( _bspdata, face, n );
                         }
                 }
                 else
                 {
-                        src.lightmap_img[1] = lightmap_img_for_face( _loader, face, 0 );
+                        src.lightmap_img[1] = lightmap_img_for_face( _bspdata, face, 0 );
                 }
                 
                 _sources.push_back( src );
@@ -116,7 +130,7 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
 
         for ( size_t i = 0; i < _sources.size(); i++ )
         {
-                dface_t *face = _loader->get_bspdata()->dfaces + _sources[i].facenum;
+                dface_t *face = _bspdata->dfaces + _sources[i].facenum;
 
 #ifdef LMPALETTE_SPLIT
                 bool any_fit = false;
@@ -206,7 +220,7 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
                                 }
                         }
 
-                        if ( _loader->get_bspdata()->dfaces[src->facenum].bumped_lightmap )
+                        if ( _bspdata->dfaces[src->facenum].bumped_lightmap )
                         {
                                 for ( int n = 0; n < NUM_BUMP_VECTS + 1; n++ )
                                 {
@@ -256,3 +270,220 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
 
         return dir;
 }
+
+INLINE unsigned int lmpalette_hash( unsigned int hash, const void *data, size_t size )
+{
+        // FNV-1a
+        const unsigned char *bytes = (const unsigned char *)data;
+        for ( size_t i = 0; i < size; i++ )
+        {
+                hash ^= bytes[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+/**
+ * Returns a hash of everything the palettes are built from, so a baked
+ * palette file can tell if the level was relit after it was written.
+ */
+unsigned int LightmapPalettizer::get_lighting_hash() const
+{
+        unsigned int hash = 2166136261u;
+
+        hash = lmpalette_hash( hash, &_bspdata->numfaces, sizeof( int ) );
+        for ( int facenum = 0; facenum < _bspdata->numfaces; facenum++ )
+        {
+                const dface_t *face = _bspdata->dfaces + facenum;
+                hash = lmpalette_hash( hash, &face->lightofs, sizeof( face->lightofs ) );
+                hash = lmpalette_hash( hash, &face->bouncedlightofs, sizeof( face->bouncedlightofs ) );
+                hash = lmpalette_hash( hash, face->lightmap_size, sizeof( face->lightmap_size ) );
+                hash = lmpalette_hash( hash, &face->bumped_lightmap, sizeof( face->bumped_lightmap ) );
+        }
+
+        hash = lmpalette_hash( hash, _bspdata->lightdata.data(),
+                               _bspdata->lightdata.size() * sizeof( colorrgbexp32_t ) );
+        hash = lmpalette_hash( hash, _bspdata->bouncedlightdata.data(),
+                               _bspdata->bouncedlightdata.size() * sizeof( colorrgbexp32_t ) );
+
+        return hash;
+}
+
+/**
+ * Returns the baked palette file that goes with the indicated .bsp file.
+ */
+Filename LightmapPalettizer::get_palette_filename( const Filename &bsp_file )
+{
+        Filename filename = bsp_file;
+        filename.set_extension( "lmpal" );
+        return filename;
+}
+
+/**
+ * Writes the packed palette images and the per-face placements to disk,
+ * in the form the texture will be uploaded in.
+ */
+bool LightmapPalettizer::write_palettes( const LightmapPaletteDirectory &dir, const Filename &filename ) const
+{
+        Datagram dg;
+        dg.append_data( lmpalette_ident, sizeof( lmpalette_ident ) );
+        dg.add_uint16( lmpalette_version );
+        dg.add_uint32( get_lighting_hash() );
+        dg.add_int32( _bspdata->numfaces );
+
+        pmap<const LightmapPaletteDirectory::LightmapPaletteEntry *, int> palette_index;
+
+        dg.add_uint16( (uint16_t)dir.entries.size() );
+        for ( size_t i = 0; i < dir.entries.size(); i++ )
+        {
+                Texture *tex = dir.entries[i]->palette_tex;
+                palette_index[dir.entries[i]] = (int)i;
+
+                CPTA_uchar image = tex->get_ram_image();
+                if ( image.is_null() || tex->get_ram_image_compression() != Texture::CM_off )
+                {
+                        lightmapPalettizer_cat.error()
+                                << "Palette " << i << " has no uncompressed image to write\n";
+                        return false;
+                }
+
+                dg.add_uint32( tex->get_x_size() );
+                dg.add_uint32( tex->get_y_size() );
+                dg.add_uint32( tex->get_z_size() );
+                dg.add_uint8( tex->get_component_type() );
+                dg.add_uint8( tex->get_format() );
+                dg.add_uint32( (uint32_t)image.size() );
+                dg.append_data( image.p(), image.size() );
+        }
+
+        dg.add_uint32( (uint32_t)dir.face_entries.size() );
+        for ( auto itr = dir.face_index.begin(); itr != dir.face_index.end(); ++itr )
+        {
+                const LightmapPaletteDirectory::LightmapFacePaletteEntry *entry = itr->second;
+                dg.add_int32( itr->first );
+                dg.add_uint16( (uint16_t)palette_index[entry->palette] );
+                dg.add_int32( entry->xshift );
+                dg.add_int32( entry->yshift );
+                dg.add_bool( entry->flipped );
+        }
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        Filename out = filename;
+        out.set_binary();
+        if ( !vfs->write_file( out, (const unsigned char *)dg.get_data(), dg.get_length(), false ) )
+        {
+                lightmapPalettizer_cat.error()
+                        << "Couldn't write " << filename << "\n";
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Fills in the directory from a baked palette file.  Returns false,
+ * leaving the directory untouched, if the file is missing or was not
+ * written for the lighting currently in the level.
+ */
+bool LightmapPalettizer::read_palettes( const Filename &filename, LightmapPaletteDirectory &dir ) const
+{
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        Filename in = filename;
+        in.set_binary();
+        if ( !vfs->exists( in ) )
+        {
+                return false;
+        }
+
+        vector_uchar buffer;
+        if ( !vfs->read_file( in, buffer, true ) )
+        {
+                return false;
+        }
+
+        Datagram dg( std::move( buffer ) );
+        DatagramIterator dgi( dg );
+
+        if ( dg.get_length() < sizeof( lmpalette_ident ) ||
+             memcmp( dg.get_data(), lmpalette_ident, sizeof( lmpalette_ident ) ) != 0 )
+        {
+                lightmapPalettizer_cat.warning()
+                        << filename << " is not a lightmap palette file\n";
+                return false;
+        }
+        dgi.skip_bytes( sizeof( lmpalette_ident ) );
+
+        if ( dgi.get_uint16() != lmpalette_version ||
+             dgi.get_uint32() != get_lighting_hash() ||
+             dgi.get_int32() != _bspdata->numfaces )
+        {
+                lightmapPalettizer_cat.info()
+                        << filename << " is out of date, palettizing lightmaps\n";
+                return false;
+        }
+
+        LightmapPaletteDirectory result;
+
+        int num_palettes = dgi.get_uint16();
+        for ( int i = 0; i < num_palettes; i++ )
+        {
+                int width = dgi.get_uint32();
+                int height = dgi.get_uint32();
+                int pages = dgi.get_uint32();
+                Texture::ComponentType type = (Texture::ComponentType)dgi.get_uint8();
+                Texture::Format format = (Texture::Format)dgi.get_uint8();
+                size_t size = dgi.get_uint32();
+                if ( dgi.get_remaining_size() < size )
+                {
+                        lightmapPalettizer_cat.error()
+                                << filename << " is truncated\n";
+                        return false;
+                }
+
+                PT( LightmapPaletteDirectory::LightmapPaletteEntry ) entry = new LightmapPaletteDirectory::LightmapPaletteEntry;
+                entry->palette_tex = new Texture;
+                entry->palette_tex->setup_2d_texture_array( width, height, pages, type, format );
+                entry->palette_tex->set_minfilter( SamplerState::FT_linear_mipmap_linear );
+                entry->palette_tex->set_magfilter( SamplerState::FT_linear );
+                if ( size != entry->palette_tex->get_expected_ram_image_size() )
+                {
+                        lightmapPalettizer_cat.error()
+                                << filename << " has a bad image for palette " << i << "\n";
+                        return false;
+                }
+
+                PTA_uchar image = PTA_uchar::empty_array( size );
+                memcpy( image.p(), (const unsigned char *)dg.get_data() + dgi.get_current_index(), size );
+                dgi.skip_bytes( size );
+                entry->palette_tex->set_ram_image( image );
+
+                result.entries.push_back( entry );
+        }
+
+        int num_faces = dgi.get_uint32();
+        for ( int i = 0; i < num_faces; i++ )
+        {
+                int facenum = dgi.get_int32();
+                int palette = dgi.get_uint16();
+                if ( facenum < 0 || facenum >= _bspdata->numfaces || palette >= num_palettes )
+                {
+                        lightmapPalettizer_cat.error()
+                                << filename << " has a bad face entry\n";
+                        return false;
+                }
+
+                PT( LightmapPaletteDirectory::LightmapFacePaletteEntry ) face_entry = new LightmapPaletteDirectory::LightmapFacePaletteEntry;
+                face_entry->palette = result.entries[palette];
+                face_entry->xshift = dgi.get_int32();
+                face_entry->yshift = dgi.get_int32();
+                face_entry->flipped = dgi.get_bool();
+                face_entry->palette_size[0] = face_entry->palette->palette_tex->get_x_size();
+                face_entry->palette_size[1] = face_entry->palette->palette_tex->get_y_size();
+
+                result.face_index[facenum] = face_entry;
+                result.face_entries.push_back( face_entry );
+        }
+
+        dir = result;
+        return true;
+}
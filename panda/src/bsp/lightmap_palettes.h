@@ -16,6 +16,8 @@
 #include <pvector.h>
 #include <notifyCategoryProxy.h>
 #include <aa_luse.h>
+#include <filename.h>
+#include <texture.h>
 
 #include "TexturePacker.h"
 #include "mathlib.h"
@@ -24,6 +26,7 @@
 
 class BSPLoader;
 class TexturePacker;
+struct bspdata_t;
 
 //#define NUM_LIGHTMAPS 1 + ((NUM_BUMP_VECTS + 1) * 2)
 #define NUM_LIGHTMAPS 1 + (NUM_BUMP_VECTS + 1)
@@ -97,10 +100,21 @@ class EXPCL_PANDABSP LightmapPalettizer
 {
 public:
         LightmapPalettizer( const BSPLoader *loader );
+        LightmapPalettizer( bspdata_t *bspdata );
         LightmapPaletteDirectory palettize_lightmaps();
 
+        // Palettes baked at compile time by p3rad, so the level load
+        // doesn't have to pack the lightmaps itself.
+        bool write_palettes( const LightmapPaletteDirectory &dir, const Filename &filename ) const;
+        bool read_palettes( const Filename &filename, LightmapPaletteDirectory &dir ) const;
+
+        static Filename get_palette_filename( const Filename &bsp_file );
+
+private:
+        unsigned int get_lighting_hash() const;
+
 private:
-        const BSPLoader *_loader;
+        bspdata_t *_bspdata;
         pvector<LightmapSource> _sources;
 };
 
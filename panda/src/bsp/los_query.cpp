@@ -0,0 +1,303 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file los_query.cpp
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#include "los_query.h"
+#include "raytrace.h"
+
+#include <asyncTaskManager.h>
+#include <configVariableInt.h>
+#include <pStatCollector.h>
+#include <pStatTimer.h>
+
+#include <algorithm>
+#include <thread>
+
+static ConfigVariableInt bsp_los_threads
+( "bsp-los-threads", -1,
+  PRC_DESC( "Number of threads to split large batches of line-of-sight queries "
+            "across.  -1 uses one per core, 0 runs them on the calling thread." ) );
+
+static ConfigVariableInt bsp_los_lines_per_task
+( "bsp-los-lines-per-task", 256,
+  PRC_DESC( "Number of lines each thread traces at a time when a batch of "
+            "line-of-sight queries is split across threads.  Batches no "
+            "bigger than this are run on the calling thread." ) );
+
+static PStatCollector los_collector( "AI:LineOfSight" );
+
+static const char *los_chain_name = "bsp_los";
+
+// The same offsets BSPLoader::trace_line() applies.
+INLINE LPoint3 los_start( const LPoint3 &start )
+{
+        return ( start + LPoint3( 0, 0, 0.05 ) ) * 16;
+}
+
+INLINE LPoint3 los_end( const LPoint3 &end )
+{
+        return end * 16;
+}
+
+LOSQueryBatch::LOSQueryBatch()
+{
+}
+
+/**
+ * Adds a line to the batch and returns its index.
+ */
+int LOSQueryBatch::add_line( const LPoint3 &start, const LPoint3 &end, unsigned int mask )
+{
+        losline_t line;
+        line.start = start;
+        line.end = end;
+        line.mask = mask;
+        line.fraction = 1.0f;
+        line.clear = true;
+        _lines.push_back( line );
+        return (int)_lines.size() - 1;
+}
+
+void LOSQueryBatch::clear()
+{
+        _lines.clear();
+}
+
+/**
+ * Returns a BitArray with bit n set if line n is clear, to read all of the
+ * results at once.
+ */
+BitArray LOSQueryBatch::get_clear_lines() const
+{
+        BitArray result;
+        for ( size_t i = 0; i < _lines.size(); i++ )
+        {
+                if ( _lines[i].clear )
+                {
+                        result.set_bit( (int)i );
+                }
+        }
+        return result;
+}
+
+/**
+ * Returns where line n stops, the same as BSPLoader::clip_line().  Only
+ * meaningful if the batch was run with clip = true.
+ */
+LPoint3 LOSQueryBatch::get_clipped_end( int n ) const
+{
+        nassertr( n >= 0 && n < (int)_lines.size(), LPoint3::zero() );
+        const losline_t &line = _lines[n];
+        if ( line.clear )
+        {
+                return line.end;
+        }
+        return line.start + ( line.end - line.start ) * line.fraction;
+}
+
+/**
+ * Traces every line of the batch.  If clip is true, the fraction of each
+ * line that is clear is found too, which needs full intersection tests;
+ * otherwise only occlusion is tested, which is cheaper.  A null scene has
+ * nothing to hit, so every line is clear.
+ */
+void LOSQueryBatch::run( RayTraceScene *scene, bool clip )
+{
+        PStatTimer timer( los_collector );
+
+        size_t num_lines = _lines.size();
+        if ( scene == nullptr || num_lines == 0 )
+        {
+                for ( size_t i = 0; i < num_lines; i++ )
+                {
+                        _lines[i].clear = true;
+                        _lines[i].fraction = 1.0f;
+                }
+                return;
+        }
+
+        size_t per_task = (size_t)std::max( bsp_los_lines_per_task.get_value(), 16 );
+
+        int num_threads = 0;
+        if ( Thread::is_threading_supported() && num_lines > per_task )
+        {
+                num_threads = bsp_los_threads.get_value();
+                if ( num_threads < 0 )
+                {
+                        num_threads = std::max( (int)std::thread::hardware_concurrency(), 1 );
+                }
+        }
+
+        if ( num_threads <= 1 )
+        {
+                run_range( scene, 0, num_lines, clip );
+                return;
+        }
+
+        AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+        AsyncTaskChain *chain = mgr->find_task_chain( los_chain_name );
+        if ( chain == nullptr )
+        {
+                chain = mgr->make_task_chain( los_chain_name );
+                chain->set_num_threads( num_threads );
+        }
+
+        pvector<losrange_t> ranges;
+        ranges.reserve( ( num_lines + per_task - 1 ) / per_task );
+        for ( size_t i = 0; i < num_lines; i += per_task )
+        {
+                ranges.push_back( { this, scene, i, std::min( i + per_task, num_lines ), clip } );
+        }
+
+        // The calling thread takes the first range itself.
+        for ( size_t i = 1; i < ranges.size(); i++ )
+        {
+                PT( GenericAsyncTask ) task = new GenericAsyncTask( "los-query", run_range_task, &ranges[i] );
+                task->set_task_chain( los_chain_name );
+                mgr->add( task );
+        }
+
+        run_range( scene, ranges[0].begin, ranges[0].end, clip );
+
+        chain->wait_for_tasks();
+}
+
+AsyncTask::DoneStatus LOSQueryBatch::run_range_task( GenericAsyncTask *task, void *data )
+{
+        losrange_t *range = (losrange_t *)data;
+        range->batch->run_range( range->scene, range->begin, range->end, range->clip );
+        return AsyncTask::DS_done;
+}
+
+void LOSQueryBatch::run_range( RayTraceScene *scene, size_t begin, size_t end, bool clip )
+{
+        if ( clip )
+        {
+                clip_range( scene, begin, end );
+        }
+        else
+        {
+                occlude_range( scene, begin, end );
+        }
+}
+
+/**
+ * Tests the lines for occlusion sixteen at a time.  A packet shares one
+ * mask, so a change of mask starts a new packet.
+ */
+void LOSQueryBatch::occlude_range( RayTraceScene *scene, size_t begin, size_t end )
+{
+        LPoint3 starts[16];
+        LPoint3 ends[16];
+
+        size_t i = begin;
+        while ( i < end )
+        {
+                unsigned int mask = _lines[i].mask;
+                int count = 0;
+                while ( i + count < end && count < 16 && _lines[i + count].mask == mask )
+                {
+                        starts[count] = los_start( _lines[i + count].start );
+                        ends[count] = los_end( _lines[i + count].end );
+                        count++;
+                }
+
+                int occluded = scene->occluded_sixteen_lines( starts, ends, count, mask );
+                for ( int j = 0; j < count; j++ )
+                {
+                        losline_t &line = _lines[i + j];
+                        line.clear = ( occluded & ( 1 << j ) ) == 0;
+                        line.fraction = line.clear ? 1.0f : 0.0f;
+                }
+
+                i += count;
+        }
+}
+
+/**
+ * Traces the lines four at a time, finding how far each one gets.
+ */
+void LOSQueryBatch::clip_range( RayTraceScene *scene, size_t begin, size_t end )
+{
+        for ( size_t i = begin; i < end; i += 4 )
+        {
+                // Pad the last packet by repeating its final line.
+                size_t n[4];
+                ALIGN_16BYTE uint32_t masks[4];
+                for ( int j = 0; j < 4; j++ )
+                {
+                        n[j] = std::min( i + j, end - 1 );
+                        masks[j] = _lines[n[j]].mask;
+                }
+
+                FourVectors start4, end4;
+                start4.LoadAndSwizzle( los_start( _lines[n[0]].start ), los_start( _lines[n[1]].start ),
+                                       los_start( _lines[n[2]].start ), los_start( _lines[n[3]].start ) );
+                end4.LoadAndSwizzle( los_end( _lines[n[0]].end ), los_end( _lines[n[1]].end ),
+                                     los_end( _lines[n[2]].end ), los_end( _lines[n[3]].end ) );
+
+                RayTraceHitResult4 result;
+                scene->trace_four_lines( start4, end4, LoadAlignedIntSIMD( masks ), &result );
+
+                ALIGN_16BYTE float fraction[4];
+                StoreAlignedSIMD( fraction, result.hit_fraction );
+
+                for ( int j = 0; j < 4 && i + j < end; j++ )
+                {
+                        losline_t &line = _lines[i + j];
+                        line.clear = !( fraction[j] < 1.0f );
+                        line.fraction = std::min( fraction[j], 1.0f );
+                }
+        }
+}
+
+/**
+ * Returns the index of the nearest of the targets that can be seen from
+ * start, or -1 if none of them can.  Targets are tested nearest first,
+ * sixteen at a time, so usually only one packet is traced.
+ */
+int LOSQueryBatch::find_nearest_visible( RayTraceScene *scene, const LPoint3 &start,
+                                         const LPoint3 *targets, int num_targets,
+                                         unsigned int mask )
+{
+        PStatTimer timer( los_collector );
+
+        pvector<std::pair<float, int>> order;
+        order.reserve( num_targets );
+        for ( int i = 0; i < num_targets; i++ )
+        {
+                order.push_back( { ( targets[i] - start ).length_squared(), i } );
+        }
+        std::sort( order.begin(), order.end() );
+
+        LPoint3 trace_start = los_start( start );
+        LPoint3 starts[16];
+        LPoint3 ends[16];
+        for ( int i = 0; i < num_targets; i += 16 )
+        {
+                int count = std::min( num_targets - i, 16 );
+                for ( int j = 0; j < count; j++ )
+                {
+                        starts[j] = trace_start;
+                        ends[j] = los_end( targets[order[i + j].second] );
+                }
+
+                int occluded = scene->occluded_sixteen_lines( starts, ends, count, mask );
+                for ( int j = 0; j < count; j++ )
+                {
+                        if ( ( occluded & ( 1 << j ) ) == 0 )
+                        {
+                                return order[i + j].second;
+                        }
+                }
+        }
+
+        return -1;
+}
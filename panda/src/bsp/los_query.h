@@ -0,0 +1,98 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file los_query.h
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#ifndef BSP_LOS_QUERY_H
+#define BSP_LOS_QUERY_H
+
+#include "config_bsp.h"
+
+#include <referenceCount.h>
+#include <pvector.h>
+#include <aa_luse.h>
+#include <bitArray.h>
+#include <genericAsyncTask.h>
+
+class RayTraceScene;
+
+/**
+ * A batch of line-of-sight queries against the level, for the AI to check
+ * all of its lines in one call instead of one trace_line() at a time.  Fill
+ * it with add_line(), run it with BSPLoader::run_los_queries(), then read
+ * the results.  The lines are traced as ray packets, split across a pool of
+ * threads when there are enough of them.
+ *
+ * Points are in the same space as BSPLoader::trace_line().
+ */
+class EXPCL_PANDABSP LOSQueryBatch : public ReferenceCount
+{
+PUBLISHED:
+        LOSQueryBatch();
+
+        // The default mask is TRACETYPE_WORLD.
+        int add_line( const LPoint3 &start, const LPoint3 &end, unsigned int mask = 1 );
+        void clear();
+
+        INLINE int get_num_lines() const
+        {
+                return (int)_lines.size();
+        }
+
+        INLINE bool is_clear( int n ) const
+        {
+                nassertr( n >= 0 && n < (int)_lines.size(), false );
+                return _lines[n].clear;
+        }
+        BitArray get_clear_lines() const;
+
+        // Only filled in when the batch was run with clip = true.
+        INLINE float get_fraction( int n ) const
+        {
+                nassertr( n >= 0 && n < (int)_lines.size(), 1.0f );
+                return _lines[n].fraction;
+        }
+        LPoint3 get_clipped_end( int n ) const;
+
+public:
+        void run( RayTraceScene *scene, bool clip );
+
+        static int find_nearest_visible( RayTraceScene *scene, const LPoint3 &start,
+                                         const LPoint3 *targets, int num_targets,
+                                         unsigned int mask );
+
+private:
+        struct losline_t
+        {
+                LPoint3 start;
+                LPoint3 end;
+                unsigned int mask;
+                float fraction;
+                bool clear;
+        };
+
+        struct losrange_t
+        {
+                LOSQueryBatch *batch;
+                RayTraceScene *scene;
+                size_t begin;
+                size_t end;
+                bool clip;
+        };
+
+        void run_range( RayTraceScene *scene, size_t begin, size_t end, bool clip );
+        void occlude_range( RayTraceScene *scene, size_t begin, size_t end );
+        void clip_range( RayTraceScene *scene, size_t begin, size_t end );
+
+        static AsyncTask::DoneStatus run_range_task( GenericAsyncTask *task, void *data );
+
+        pvector<losline_t> _lines;
+};
+
+#endif // BSP_LOS_QUERY_H
@@ -0,0 +1,220 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file nearest_point_grid.cpp
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#include "nearest_point_grid.h"
+
+#include <float.h>
+#include <math.h>
+
+// Roughly how many points we want in each cell.
+#define POINTS_PER_CELL 2
+#define MAX_GRID_DIM 64
+
+NearestPointGrid::NearestPointGrid()
+{
+        clear();
+}
+
+void NearestPointGrid::clear()
+{
+        for ( int i = 0; i < 3; i++ )
+        {
+                _mins[i] = 0;
+                _cell_size[i] = 1;
+                _inv_cell_size[i] = 1;
+                _dims[i] = 1;
+        }
+        _cell_start.clear();
+        _points.clear();
+        _indices.clear();
+}
+
+/**
+ * Builds the grid over the indicated points. find_nearest() returns indices
+ * into this list.
+ */
+void NearestPointGrid::build( const pvector<LPoint3> &points )
+{
+        clear();
+
+        if ( points.empty() )
+        {
+                return;
+        }
+
+        LPoint3 mins( FLT_MAX );
+        LPoint3 maxs( -FLT_MAX );
+        for ( size_t i = 0; i < points.size(); i++ )
+        {
+                for ( int j = 0; j < 3; j++ )
+                {
+                        mins[j] = std::min( mins[j], points[i][j] );
+                        maxs[j] = std::max( maxs[j], points[i][j] );
+                }
+        }
+
+        // Pick a cell size that gives us about POINTS_PER_CELL points per
+        // cell if they were spread out evenly.
+        LVector3 extents = maxs - mins;
+        PN_stdfloat volume = 1;
+        int num_axes = 0;
+        for ( int i = 0; i < 3; i++ )
+        {
+                if ( extents[i] > 0.001f )
+                {
+                        volume *= extents[i];
+                        num_axes++;
+                }
+        }
+        int target_cells = std::max( 1, (int)points.size() / POINTS_PER_CELL );
+        PN_stdfloat side = num_axes > 0 ? pow( volume / target_cells, 1.0f / num_axes ) : 1;
+
+        int num_cells = 1;
+        for ( int i = 0; i < 3; i++ )
+        {
+                _mins[i] = mins[i];
+                if ( extents[i] > 0.001f && side > 0 )
+                {
+                        _dims[i] = std::max( 1, std::min( (int)ceil( extents[i] / side ), MAX_GRID_DIM ) );
+                        _cell_size[i] = extents[i] / _dims[i];
+                }
+                else
+                {
+                        _dims[i] = 1;
+                        _cell_size[i] = std::max( extents[i], (PN_stdfloat)0.001f );
+                }
+                _inv_cell_size[i] = 1.0f / _cell_size[i];
+                num_cells *= _dims[i];
+        }
+
+        // Counting sort the points by cell.
+        pvector<int> point_cells( points.size() );
+        _cell_start.resize( num_cells + 1, 0 );
+        for ( size_t i = 0; i < points.size(); i++ )
+        {
+                const LPoint3 &p = points[i];
+                int cell = get_cell_index( get_cell_coord( p[0], 0 ),
+                                           get_cell_coord( p[1], 1 ),
+                                           get_cell_coord( p[2], 2 ) );
+                point_cells[i] = cell;
+                _cell_start[cell + 1]++;
+        }
+        for ( int i = 0; i < num_cells; i++ )
+        {
+                _cell_start[i + 1] += _cell_start[i];
+        }
+
+        pvector<int> fill( _cell_start );
+        _points.resize( points.size() * 3 );
+        _indices.resize( points.size() );
+        for ( size_t i = 0; i < points.size(); i++ )
+        {
+                int slot = fill[point_cells[i]]++;
+                _points[slot * 3 + 0] = points[i][0];
+                _points[slot * 3 + 1] = points[i][1];
+                _points[slot * 3 + 2] = points[i][2];
+                _indices[slot] = (int)i;
+        }
+}
+
+/**
+ * Returns the index of the point closest to the indicated position, or -1 if
+ * the grid is empty. Searches outward from the position's cell one shell of
+ * cells at a time, until no unsearched cell can be closer than the best
+ * point found so far.
+ */
+int NearestPointGrid::find_nearest( const LPoint3 &pos ) const
+{
+        if ( _indices.empty() )
+        {
+                return -1;
+        }
+
+        int c[3];
+        for ( int i = 0; i < 3; i++ )
+        {
+                c[i] = get_cell_coord( pos[i], i );
+        }
+
+        int max_ring = std::max( _dims[0], std::max( _dims[1], _dims[2] ) );
+
+        int best = -1;
+        PN_stdfloat best_dist2 = FLT_MAX;
+
+        for ( int ring = 0; ring < max_ring; ring++ )
+        {
+                int lo[3], hi[3];
+                for ( int i = 0; i < 3; i++ )
+                {
+                        lo[i] = std::max( c[i] - ring, 0 );
+                        hi[i] = std::min( c[i] + ring, _dims[i] - 1 );
+                }
+
+                for ( int z = lo[2]; z <= hi[2]; z++ )
+                {
+                        for ( int y = lo[1]; y <= hi[1]; y++ )
+                        {
+                                for ( int x = lo[0]; x <= hi[0]; x++ )
+                                {
+                                        // Only the cells on the surface of this shell, the
+                                        // inner ones were searched already.
+                                        int d = std::max( std::abs( x - c[0] ),
+                                                          std::max( std::abs( y - c[1] ), std::abs( z - c[2] ) ) );
+                                        if ( d != ring )
+                                        {
+                                                continue;
+                                        }
+
+                                        int cell = get_cell_index( x, y, z );
+                                        int end = _cell_start[cell + 1];
+                                        for ( int n = _cell_start[cell]; n < end; n++ )
+                                        {
+                                                const PN_stdfloat *p = &_points[n * 3];
+                                                PN_stdfloat dx = p[0] - pos[0];
+                                                PN_stdfloat dy = p[1] - pos[1];
+                                                PN_stdfloat dz = p[2] - pos[2];
+                                                PN_stdfloat dist2 = dx * dx + dy * dy + dz * dz;
+                                                if ( dist2 < best_dist2 )
+                                                {
+                                                        best_dist2 = dist2;
+                                                        best = n;
+                                                }
+                                        }
+                                }
+                        }
+                }
+
+                if ( best == -1 )
+                {
+                        continue;
+                }
+
+                // Anything in the next shell is at least this far away.
+                PN_stdfloat bound = FLT_MAX;
+                for ( int i = 0; i < 3; i++ )
+                {
+                        if ( c[i] - ring > 0 )
+                        {
+                                bound = std::min( bound, pos[i] - ( _mins[i] + ( c[i] - ring ) * _cell_size[i] ) );
+                        }
+                        if ( c[i] + ring < _dims[i] - 1 )
+                        {
+                                bound = std::min( bound, ( _mins[i] + ( c[i] + ring + 1 ) * _cell_size[i] ) - pos[i] );
+                        }
+                }
+                if ( bound == FLT_MAX || ( bound > 0 && bound * bound >= best_dist2 ) )
+                {
+                        break;
+                }
+        }
+
+        return _indices[best];
+}
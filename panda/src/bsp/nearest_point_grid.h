@@ -0,0 +1,63 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file nearest_point_grid.h
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#ifndef NEAREST_POINT_GRID_H
+#define NEAREST_POINT_GRID_H
+
+#include "config_bsp.h"
+
+#include <pvector.h>
+#include <luse.h>
+
+/**
+ * A uniform grid over a fixed set of points, used to find the point closest
+ * to a position. The points are stored flat and sorted by cell, and queries
+ * do not allocate, so it is safe to query from several threads at once.
+ */
+class EXPCL_PANDABSP NearestPointGrid
+{
+public:
+        NearestPointGrid();
+
+        void build( const pvector<LPoint3> &points );
+        void clear();
+
+        int find_nearest( const LPoint3 &pos ) const;
+
+        INLINE int get_num_points() const
+        {
+                return (int)_indices.size();
+        }
+
+private:
+        INLINE int get_cell_coord( PN_stdfloat value, int axis ) const
+        {
+                int c = (int)( ( value - _mins[axis] ) * _inv_cell_size[axis] );
+                return std::max( 0, std::min( c, _dims[axis] - 1 ) );
+        }
+        INLINE int get_cell_index( int x, int y, int z ) const
+        {
+                return ( z * _dims[1] + y ) * _dims[0] + x;
+        }
+
+private:
+        PN_stdfloat _mins[3];
+        PN_stdfloat _cell_size[3];
+        PN_stdfloat _inv_cell_size[3];
+        int _dims[3];
+
+        // Points of cell n are _cell_start[n] up to _cell_start[n + 1].
+        pvector<int> _cell_start;
+        pvector<PN_stdfloat> _points;
+        pvector<int> _indices;
+};
+
+#endif // NEAREST_POINT_GRID_H
@@ -204,8 +204,13 @@ void Py_CL_BSPLoader::load_geometry()
 {
 	load_cubemaps();
 
+	// Use the palettes p3rad baked for this level if they are still
+	// current, otherwise pack them now.
 	LightmapPalettizer lmp( this );
-	_lightmap_dir = lmp.palettize_lightmaps();
+	if ( !lmp.read_palettes( LightmapPalettizer::get_palette_filename( _map_file ), _lightmap_dir ) )
+	{
+		_lightmap_dir = lmp.palettize_lightmaps();
+	}
 
 	make_faces();
 	SceneGraphReducer gr;
@@ -272,8 +277,8 @@ void Py_CL_BSPLoader::load_entities()
 				remove_model( modelnum );
 				_model_data[modelnum].model_root = get_model( 0 );
 				_model_data[modelnum].merged_modelnum = 0;
-				NodePath( _model_data[modelnum].decal_rbc ).remove_node();
-				_model_data[modelnum].decal_rbc = nullptr;
+				NodePath( _model_data[modelnum].decal_node ).remove_node();
+				_model_data[modelnum].decal_node = nullptr;
 
 				dmodel_t *mdl = &_bspdata->dmodels[modelnum];
 
@@ -314,8 +319,8 @@ void Py_CL_BSPLoader::load_entities()
 					}
 					remove_model( modelnum );
 					_model_data[modelnum].model_root = _model_data[0].model_root;
-					NodePath( _model_data[modelnum].decal_rbc ).remove_node();
-					_model_data[modelnum].decal_rbc = _model_data[0].decal_rbc;
+					NodePath( _model_data[modelnum].decal_node ).remove_node();
+					_model_data[modelnum].decal_node = _model_data[0].decal_node;
 					_model_data[modelnum].merged_modelnum = 0;
 					continue;
 				}
@@ -335,7 +340,7 @@ void Py_CL_BSPLoader::load_entities()
 			const BSPMaterial *bspmat = BSPMaterial::get_from_file( mat );
 			Texture *tex = TexturePool::load_texture( bspmat->get_keyvalue( "$basetexture" ) );
 			LPoint3 vpos( origin[0], origin[1], origin[2] );
-			_decal_mgr.decal_trace( mat, LPoint2( tex->get_orig_file_x_size() / 16.0, tex->get_orig_file_y_size() / 16.0 ),
+			_decal_mgr.queue_decal( mat, LPoint2( tex->get_orig_file_x_size() / 16.0, tex->get_orig_file_y_size() / 16.0 ),
 						0.0, vpos, vpos, LColorf( 1.0 ), DECALFLAGS_STATIC );
 		}
 		else
@@ -354,6 +359,10 @@ void Py_CL_BSPLoader::load_entities()
 			_entities.push_back( entitydef_t( entity, linked ) );
 		}
 	}
+
+	// Trace the level's decals all at once, now that the brush models they
+	// might land on have been merged.
+	_decal_mgr.flush_decals();
 }
 
 //============================================================================================
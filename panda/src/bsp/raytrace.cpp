@@ -1,6 +1,10 @@
 #include "raytrace.h"
 
 #include <geomVertexReader.h>
+#include <lightMutexHolder.h>
+#include <cullTraverserData.h>
+
+#include <algorithm>
 
 #include <embree3/rtcore.h>
 
@@ -39,9 +43,14 @@ RayTraceGeometry::RayTraceGeometry( int type, const std::string &name ) :
         nassertv( RayTrace::get_device() != nullptr );
         _geometry = rtcNewGeometry( RayTrace::get_device(), (RTCGeometryType)type );
         // All bits on by default
-        rtcSetGeometryMask( _geometry, BitMask32::all_on().get_word() );
+        _mask = BitMask32::all_on().get_word();
+        rtcSetGeometryMask( _geometry, _mask );
         _geom_id = 0;
         _rtscene = nullptr;
+        _instanced_scene = nullptr;
+        _instance = nullptr;
+        _dynamic = false;
+        _dirty = false;
         _last_trans = nullptr;
 
         set_cull_callback();
@@ -62,14 +71,16 @@ RayTraceGeometry::~RayTraceGeometry()
 
 void RayTraceGeometry::update_rtc_transform( const TransformState *ts )
 {
-        if ( ts != _last_trans )
+        if ( _instance && ts != _last_trans )
         {
                 _last_trans = ts;
 
-                const LMatrix4 &mat = _last_trans->get_mat();
+                // Panda's matrices transform row vectors, so the rows of our
+                // matrix are the columns of the one embree expects.
+                LMatrix4f mat = LCAST( float, _last_trans->get_mat() );
 
-                rtcSetGeometryTransform( _geometry, 0, RTC_FORMAT_FLOAT4X4_ROW_MAJOR, mat.get_data() );
-                rtcCommitGeometry( _geometry );
+                rtcSetGeometryTransform( _instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, mat.get_data() );
+                rtcCommitGeometry( _instance );
                 if ( _rtscene )
                         _rtscene->_scene_needs_rebuild = true;
 
@@ -78,11 +89,80 @@ void RayTraceGeometry::update_rtc_transform( const TransformState *ts )
         }
 }
 
+/**
+ * The cull traversal already knows our net transform, so a dynamic geometry
+ * in the scene graph can tell whether it moved without walking up to the root.
+ */
+bool RayTraceGeometry::cull_callback( CullTraverser *trav, CullTraverserData &data )
+{
+        if ( _dynamic && _rtscene )
+        {
+                CPT( TransformState ) net_transform = data.get_net_transform( trav );
+                if ( net_transform != _last_trans )
+                {
+                        _rtscene->mark_dirty( this, net_transform );
+                }
+        }
+
+        return true;
+}
+
+void RayTraceGeometry::transform_changed()
+{
+        PandaNode::transform_changed();
+        mark_transform_dirty();
+}
+
+void RayTraceGeometry::parents_changed()
+{
+        PandaNode::parents_changed();
+        mark_transform_dirty();
+}
+
+/**
+ * Tells the scene the net transform of this dynamic geometry has changed.
+ * This happens automatically when the node itself is moved or reparented, or
+ * when the cull traversal finds it somewhere new, but must be called by hand
+ * when an ancestor of a geometry that isn't rendered is moved.
+ */
+void RayTraceGeometry::mark_transform_dirty()
+{
+        if ( _dynamic && _rtscene )
+        {
+                _rtscene->mark_dirty( this );
+        }
+}
+
+/**
+ * Called after the embree geometry has been rebuilt, so the scene holding it
+ * is committed again.
+ */
+void RayTraceGeometry::geometry_changed()
+{
+        if ( _instanced_scene )
+        {
+                rtcCommitScene( _instanced_scene );
+                if ( _rtscene )
+                        _rtscene->_scene_needs_rebuild = true;
+        }
+        else if ( _rtscene )
+        {
+                _rtscene->_static_needs_rebuild = true;
+        }
+}
+
 void RayTraceGeometry::set_mask( unsigned int mask )
 {
         nassertv( _geometry != nullptr );
         rtcSetGeometryMask( _geometry, mask );
         _mask = mask;
+
+        if ( _instance )
+        {
+                rtcSetGeometryMask( _instance, mask );
+                rtcCommitGeometry( _instance );
+        }
+        geometry_changed();
 }
 
 void RayTraceGeometry::set_build_quality( int quality )
@@ -90,6 +170,12 @@ void RayTraceGeometry::set_build_quality( int quality )
         rtcSetGeometryBuildQuality( _geometry, (RTCBuildQuality)quality );
 };
 
+void RayTraceGeometry::set_dynamic( bool dynamic )
+{
+        nassertv( _rtscene == nullptr );
+        _dynamic = dynamic;
+}
+
 //==================================================================//
 
 IMPLEMENT_CLASS( RayTraceTriangleMesh );
@@ -174,6 +260,7 @@ void RayTraceTriangleMesh::build()
         }
 
         rtcCommitGeometry( _geometry );
+        geometry_changed();
 
         raytrace_cat.debug()
                 << "Built triangle mesh to embree\n";
@@ -181,23 +268,86 @@ void RayTraceTriangleMesh::build()
 
 //==================================================================//
 
-RayTraceScene::RayTraceScene()
+RayTraceScene::RayTraceScene() :
+        _scene_needs_rebuild( false ),
+        _static_needs_rebuild( false ),
+        _next_geom_id( 0 ),
+        _dirty_lock( "RayTraceScene::_dirty_lock" )
 {
         nassertv( RayTrace::get_device() != nullptr );
         _scene = rtcNewScene( RayTrace::get_device() );
+
+        // All of the static geometry goes into one scene, instanced once into
+        // the top-level scene, so moving a dynamic geometry only rebuilds the
+        // small top-level tree.
+        _static_scene = rtcNewScene( RayTrace::get_device() );
+        _static_instance = rtcNewGeometry( RayTrace::get_device(), RTC_GEOMETRY_TYPE_INSTANCE );
+        rtcSetGeometryInstancedScene( _static_instance, _static_scene );
+        rtcSetGeometryMask( _static_instance, BitMask32::all_on().get_word() );
+        rtcSetGeometryTransform( _static_instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR,
+                                 LMatrix4f::ident_mat().get_data() );
+        rtcCommitGeometry( _static_instance );
+        _static_inst_id = alloc_geom_id();
+        rtcAttachGeometryByID( _scene, _static_instance, _static_inst_id );
+
         raytrace_cat.debug()
                 << "Made new raytrace scene\n";
 }
 
 RayTraceScene::~RayTraceScene()
 {
+        remove_all();
         if ( _scene )
                 rtcReleaseScene( _scene );
+        if ( _static_instance )
+                rtcReleaseGeometry( _static_instance );
+        if ( _static_scene )
+                rtcReleaseScene( _static_scene );
+}
+
+unsigned int RayTraceScene::alloc_geom_id()
+{
+        if ( !_free_geom_ids.empty() )
+        {
+                unsigned int geom_id = _free_geom_ids.back();
+                _free_geom_ids.pop_back();
+                return geom_id;
+        }
+
+        return _next_geom_id++;
+}
+
+void RayTraceScene::free_geom_id( unsigned int geom_id )
+{
+        _free_geom_ids.push_back( geom_id );
 }
 
 void RayTraceScene::add_geometry( RayTraceGeometry *geom )
 {
-        unsigned int geom_id = rtcAttachGeometry( _scene, geom->get_geometry() );
+        nassertv( geom->_rtscene == nullptr );
+
+        unsigned int geom_id = alloc_geom_id();
+        if ( geom->_dynamic )
+        {
+                geom->_instanced_scene = rtcNewScene( RayTrace::get_device() );
+                rtcAttachGeometry( geom->_instanced_scene, geom->get_geometry() );
+                rtcCommitScene( geom->_instanced_scene );
+
+                geom->_instance = rtcNewGeometry( RayTrace::get_device(), RTC_GEOMETRY_TYPE_INSTANCE );
+                rtcSetGeometryInstancedScene( geom->_instance, geom->_instanced_scene );
+                rtcSetGeometryMask( geom->_instance, geom->_mask );
+                geom->_last_trans = nullptr;
+                geom->update_rtc_transform( NodePath( geom ).get_net_transform() );
+
+                rtcAttachGeometryByID( _scene, geom->_instance, geom_id );
+                _scene_needs_rebuild = true;
+        }
+        else
+        {
+                rtcAttachGeometryByID( _static_scene, geom->get_geometry(), geom_id );
+                _static_needs_rebuild = true;
+        }
+
         RTCError err = rtcGetDeviceError( RayTrace::get_device() );
         raytrace_cat.debug()
                 << "add_geometry: rtcError: " << err << "\n";
@@ -206,25 +356,59 @@ void RayTraceScene::add_geometry( RayTraceGeometry *geom )
         _geoms[geom_id] = geom;
         raytrace_cat.debug()
                 << "Attached geometry " << geom_id << "\n";
-        _scene_needs_rebuild = true;
 }
 
-void RayTraceScene::remove_geometry( RayTraceGeometry *geom )
+/**
+ * Takes the geometry out of the embree scenes, leaving _geoms alone.
+ */
+void RayTraceScene::detach_geometry( RayTraceGeometry *geom )
 {
-        rtcDetachGeometry( _scene, geom->_geom_id );
+        if ( geom->_instance )
+        {
+                rtcDetachGeometry( _scene, geom->_geom_id );
+                rtcReleaseGeometry( geom->_instance );
+                rtcReleaseScene( geom->_instanced_scene );
+                geom->_instance = nullptr;
+                geom->_instanced_scene = nullptr;
+                _scene_needs_rebuild = true;
+        }
+        else
+        {
+                rtcDetachGeometry( _static_scene, geom->_geom_id );
+                _static_needs_rebuild = true;
+        }
+
+        if ( geom->_dirty )
+        {
+                LightMutexHolder holder( _dirty_lock );
+                pvector<RayTraceGeometry *>::iterator it =
+                        std::find( _dirty_geoms.begin(), _dirty_geoms.end(), geom );
+                if ( it != _dirty_geoms.end() )
+                {
+                        _dirty_geoms.erase( it );
+                }
+                geom->_dirty = false;
+                geom->_dirty_trans = nullptr;
+        }
+
+        free_geom_id( geom->_geom_id );
         geom->_geom_id = 0;
         geom->_rtscene = nullptr;
+        geom->_last_trans = nullptr;
+}
+
+void RayTraceScene::remove_geometry( RayTraceGeometry *geom )
+{
+        nassertv( geom->_rtscene == this );
         _geoms.remove( geom->_geom_id );
+        detach_geometry( geom );
 }
 
 void RayTraceScene::remove_all()
 {
         for ( size_t i = 0; i < _geoms.size(); i++ )
         {
-                RayTraceGeometry *geom = _geoms[i];
-                rtcDetachGeometry( _scene, geom->_geom_id );
-                geom->_geom_id = 0;
-                geom->_rtscene = nullptr;
+                detach_geometry( _geoms.get_data( i ) );
         }
 
         _geoms.clear();
@@ -232,29 +416,103 @@ void RayTraceScene::remove_all()
 
 void RayTraceScene::set_build_quality( int quality )
 {
-        rtcSetSceneBuildQuality( _scene, (RTCBuildQuality)quality );
+        rtcSetSceneBuildQuality( _static_scene, (RTCBuildQuality)quality );
+}
+
+/**
+ * Queues the dynamic geometry to have its instance transform updated by the
+ * next update().  If the caller already knows the new net transform, it may
+ * be passed in; otherwise update() will look it up.  May be called from any
+ * thread.
+ */
+void RayTraceScene::mark_dirty( RayTraceGeometry *geom, const TransformState *net_transform )
+{
+        LightMutexHolder holder( _dirty_lock );
+
+        geom->_dirty_trans = net_transform;
+        if ( !geom->_dirty )
+        {
+                geom->_dirty = true;
+                _dirty_geoms.push_back( geom );
+        }
 }
 
 void RayTraceScene::update()
 {
         nassertv( _scene != nullptr );
 
-        size_t num_geoms = _geoms.size();
-        for ( size_t i = 0; i < num_geoms; i++ )
+        pvector<RayTraceGeometry *> dirty_geoms;
         {
-                RayTraceGeometry *geom = _geoms[i];
-                geom->update_rtc_transform( NodePath( geom ).get_net_transform() );
+                LightMutexHolder holder( _dirty_lock );
+                dirty_geoms.swap( _dirty_geoms );
         }
 
-        if ( _scene_needs_rebuild )
+        // Only the geometries that have moved are looked at.
+        for ( size_t i = 0; i < dirty_geoms.size(); i++ )
+        {
+                RayTraceGeometry *geom = dirty_geoms[i];
+
+                CPT( TransformState ) net_transform;
+                {
+                        LightMutexHolder holder( _dirty_lock );
+                        if ( !geom->_dirty )
+                        {
+                                continue;
+                        }
+                        net_transform = geom->_dirty_trans;
+                        geom->_dirty_trans = nullptr;
+                        geom->_dirty = false;
+                }
+
+                if ( net_transform == nullptr )
+                {
+                        net_transform = NodePath( geom ).get_net_transform();
+                }
+                geom->update_rtc_transform( net_transform );
+        }
+
+        if ( _static_needs_rebuild )
         {
                 raytrace_cat.info()
+                        << "Committing static scene\n";
+                rtcCommitScene( _static_scene );
+                _static_needs_rebuild = false;
+                _scene_needs_rebuild = true;
+        }
+
+        if ( _scene_needs_rebuild )
+        {
+                raytrace_cat.debug()
                         << "Committing scene\n";
                 rtcCommitScene( _scene );
                 _scene_needs_rebuild = false;
         }
 }
 
+/**
+ * Embree gives hit normals in the space of the instance that was hit; this
+ * brings the normal of a hit on a dynamic geometry back to world space.
+ */
+LVector3 RayTraceScene::get_world_normal( unsigned int inst_id, const LVector3 &normal )
+{
+        if ( inst_id == _static_inst_id || inst_id == RTC_INVALID_GEOMETRY_ID )
+        {
+                return normal;
+        }
+
+        int idx = _geoms.find( inst_id );
+        if ( idx == -1 || _geoms.get_data( idx )->_last_trans == nullptr )
+        {
+                return normal;
+        }
+
+        // Normals transform by the inverse transpose.
+        const LMatrix4 &inv = _geoms.get_data( idx )->_last_trans->get_inverse()->get_mat();
+        return LVector3( inv.get_row3( 0 ).dot( normal ),
+                         inv.get_row3( 1 ).dot( normal ),
+                         inv.get_row3( 2 ).dot( normal ) );
+}
+
 RayTraceHitResult RayTraceScene::trace_ray( const LPoint3 &start, const LVector3 &dir,
         float distance, const BitMask32 &mask )
 {
@@ -296,10 +554,10 @@ RayTraceHitResult RayTraceScene::trace_ray( const LPoint3 &start, const LVector3
 
         // Store the results
         result.hit_fraction = rhit.ray.tfar / distance;
-        result.hit_normal = LVector3( rhit.hit.Ng_x,
-                rhit.hit.Ng_y, rhit.hit.Ng_z );
+        result.hit_normal = get_world_normal( rhit.hit.instID[0],
+                LVector3( rhit.hit.Ng_x, rhit.hit.Ng_y, rhit.hit.Ng_z ) );
         result.hit_uv = LVector2( rhit.hit.u, rhit.hit.v );
-        result.geom_id = rhit.hit.geomID;
+        result.geom_id = resolve_geom_id( rhit.hit.geomID, rhit.hit.instID[0] );
         result.prim_id = rhit.hit.primID;
         // If the ray/line didn't trace all the way to the end,
         // we have a hit.
@@ -319,6 +577,37 @@ RayTraceHitResult RayTraceScene::trace_ray( const LPoint3 &start, const LVector3
         return result;
 }
 
+/**
+ * Returns true if anything in the mask lies along the ray within the
+ * distance.  Cheaper than trace_ray(), since the first hit found ends the
+ * traversal.
+ */
+bool RayTraceScene::is_ray_occluded( const LPoint3 &start, const LVector3 &dir,
+        float distance, const BitMask32 &mask )
+{
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+        ALIGN_16BYTE RTCRay ray;
+        ray.mask = mask.get_word();
+        ray.org_x = start[0];
+        ray.org_y = start[1];
+        ray.org_z = start[2];
+        ray.dir_x = dir[0];
+        ray.dir_y = dir[1];
+        ray.dir_z = dir[2];
+        ray.tnear = 0;
+        ray.tfar = distance;
+        ray.time = 0;
+        ray.flags = 0;
+
+        rtcOccluded1( _scene, &ctx, &ray );
+
+        // Embree sets tfar to -inf when the ray is occluded.
+        return ray.tfar < 0.0f;
+}
+
 void RayTraceScene::trace_four_rays( const FourVectors &start, const FourVectors &direction,
         const fltx4 &distance, const u32x4 &mask, RayTraceHitResult4 *res )
 {
@@ -343,11 +632,193 @@ void RayTraceScene::trace_four_rays( const FourVectors &start, const FourVectors
         
         rtcIntersect4( Four_NegativeOnes_NonSIMD, _scene, &ctx, &rhit4 );
 
-        res->geom_id = LoadAlignedIntSIMD( rhit4.hit.geomID );
+        ALIGN_16BYTE unsigned int geom_id[4];
+        for ( int i = 0; i < 4; i++ )
+        {
+                geom_id[i] = resolve_geom_id( rhit4.hit.geomID[i], rhit4.hit.instID[0][i] );
+        }
+        res->geom_id = LoadAlignedIntSIMD( geom_id );
 
         fltx4 factor = ReciprocalSIMD( distance );
         res->hit_fraction = MulSIMD( LoadAlignedSIMD( rhit4.ray.tfar ), factor );
         //res->hit = CmpLtSIMD( res->hit_fraction, Four_Ones );
 }
 
-//==================================================================//
\ No newline at end of file
+int RayTraceScene::occluded_four_rays( const FourVectors &start, const FourVectors &direction,
+        const fltx4 &distance, const u32x4 &mask )
+{
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+
+        ALIGN_16BYTE RTCRay4 ray4;
+        StoreAlignedSIMD( ray4.org_x, start.x );
+        StoreAlignedSIMD( ray4.org_y, start.y );
+        StoreAlignedSIMD( ray4.org_z, start.z );
+        StoreAlignedSIMD( ray4.dir_x, direction.x );
+        StoreAlignedSIMD( ray4.dir_y, direction.y );
+        StoreAlignedSIMD( ray4.dir_z, direction.z );
+        StoreAlignedUIntSIMD( ray4.mask, mask );
+        StoreAlignedSIMD( ray4.tnear, Four_Zeros );
+        StoreAlignedSIMD( ray4.tfar, distance );
+        StoreAlignedSIMD( ray4.time, Four_Zeros );
+        StoreAlignedUIntSIMD( ray4.flags, Four_Zeros );
+
+        rtcOccluded4( Four_NegativeOnes_NonSIMD, _scene, &ctx, &ray4 );
+
+        return TestSignSIMD( LoadAlignedSIMD( ray4.tfar ) );
+}
+
+/**
+ * Fills in an embree ray packet of N lines, traces it for occlusion with
+ * the given function, and returns the mask of occluded lines.
+ */
+template<class RayN, int N>
+static int occluded_lines_packet( RTCScene scene, const LPoint3 *start, const LPoint3 *end,
+        int count, unsigned int mask,
+        void ( *occluded )( const int *, RTCScene, RTCIntersectContext *, RayN * ) )
+{
+        nassertr( count >= 0 && count <= N, 0 );
+
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+
+        alignas( 64 ) int valid[N];
+        RayN rays;
+        for ( int i = 0; i < N; i++ )
+        {
+                if ( i >= count )
+                {
+                        valid[i] = 0;
+                        continue;
+                }
+
+                LVector3 delta = end[i] - start[i];
+                float distance = delta.length();
+                delta /= distance;
+
+                valid[i] = -1;
+                rays.org_x[i] = start[i][0];
+                rays.org_y[i] = start[i][1];
+                rays.org_z[i] = start[i][2];
+                rays.dir_x[i] = delta[0];
+                rays.dir_y[i] = delta[1];
+                rays.dir_z[i] = delta[2];
+                rays.tnear[i] = 0;
+                rays.tfar[i] = distance;
+                rays.time[i] = 0;
+                rays.mask[i] = mask;
+                rays.flags[i] = 0;
+        }
+
+        occluded( valid, scene, &ctx, &rays );
+
+        int result = 0;
+        for ( int i = 0; i < count; i++ )
+        {
+                if ( rays.tfar[i] < 0.0f )
+                {
+                        result |= 1 << i;
+                }
+        }
+        return result;
+}
+
+int RayTraceScene::occluded_eight_lines( const LPoint3 *start, const LPoint3 *end, int count,
+        unsigned int mask )
+{
+        return occluded_lines_packet<RTCRay8, 8>( _scene, start, end, count, mask, rtcOccluded8 );
+}
+
+int RayTraceScene::occluded_sixteen_lines( const LPoint3 *start, const LPoint3 *end, int count,
+        unsigned int mask )
+{
+        return occluded_lines_packet<RTCRay16, 16>( _scene, start, end, count, mask, rtcOccluded16 );
+}
+
+// Stream queries go to embree this many rays at a time.
+static const size_t ray_stream_batch = 256;
+
+INLINE void init_rtc_ray( RTCRay &ray, const RayTraceRay &in )
+{
+        ray.org_x = in.origin[0];
+        ray.org_y = in.origin[1];
+        ray.org_z = in.origin[2];
+        ray.dir_x = in.direction[0];
+        ray.dir_y = in.direction[1];
+        ray.dir_z = in.direction[2];
+        ray.tnear = 0;
+        ray.tfar = in.distance;
+        ray.time = 0;
+        ray.mask = in.mask;
+        ray.id = 0;
+        ray.flags = 0;
+}
+
+/**
+ * Traces any number of rays, filling in a result for each.  The rays are
+ * handed to embree in large batches, which lets it reorder incoherent rays
+ * for better traversal.
+ */
+void RayTraceScene::trace_rays( const RayTraceRay *rays, RayTraceHitResult *results, size_t count )
+{
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        RTCRayHit rhits[ray_stream_batch];
+        for ( size_t i = 0; i < count; i += ray_stream_batch )
+        {
+                size_t n = std::min( count - i, ray_stream_batch );
+                for ( size_t j = 0; j < n; j++ )
+                {
+                        init_rtc_ray( rhits[j].ray, rays[i + j] );
+                        rhits[j].hit.geomID = RTC_INVALID_GEOMETRY_ID;
+                        rhits[j].hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+                }
+
+                rtcIntersect1M( _scene, &ctx, rhits, (unsigned int)n, sizeof( RTCRayHit ) );
+
+                for ( size_t j = 0; j < n; j++ )
+                {
+                        const RTCRayHit &rhit = rhits[j];
+                        RayTraceHitResult &result = results[i + j];
+                        result.hit_fraction = rhit.ray.tfar / rays[i + j].distance;
+                        result.hit_normal = get_world_normal( rhit.hit.instID[0],
+                                LVector3( rhit.hit.Ng_x, rhit.hit.Ng_y, rhit.hit.Ng_z ) );
+                        result.hit_uv = LVector2( rhit.hit.u, rhit.hit.v );
+                        result.geom_id = resolve_geom_id( rhit.hit.geomID, rhit.hit.instID[0] );
+                        result.prim_id = rhit.hit.primID;
+                        result.hit = result.hit_fraction < 1.0f;
+                }
+        }
+}
+
+/**
+ * Tests any number of rays for occlusion, setting occluded[i] to whether
+ * ray i hit anything.
+ */
+void RayTraceScene::occluded_rays( const RayTraceRay *rays, bool *occluded, size_t count )
+{
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        RTCRay rtc_rays[ray_stream_batch];
+        for ( size_t i = 0; i < count; i += ray_stream_batch )
+        {
+                size_t n = std::min( count - i, ray_stream_batch );
+                for ( size_t j = 0; j < n; j++ )
+                {
+                        init_rtc_ray( rtc_rays[j], rays[i + j] );
+                }
+
+                rtcOccluded1M( _scene, &ctx, rtc_rays, (unsigned int)n, sizeof( RTCRay ) );
+
+                for ( size_t j = 0; j < n; j++ )
+                {
+                        occluded[i + j] = rtc_rays[j].tfar < 0.0f;
+                }
+        }
+}
+
+//==================================================================//
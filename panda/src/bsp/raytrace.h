@@ -12,6 +12,7 @@
 #include <cullTraverser.h>
 #include <cullTraverserData.h>
 #include <simpleHashMap.h>
+#include <lightMutex.h>
 
 NotifyCategoryDeclNoExport(raytrace);
 
@@ -85,6 +86,39 @@ PUBLISHED:
         }
 };
 
+/**
+ * A single ray of a stream passed to RayTraceScene::trace_rays() or
+ * RayTraceScene::occluded_rays().
+ */
+class EXPCL_PANDABSP RayTraceRay
+{
+public:
+        LPoint3 origin;
+        LVector3 direction;
+        float distance;
+        unsigned int mask;
+
+        INLINE RayTraceRay()
+        {
+                distance = 0;
+                mask = 0;
+        }
+
+        INLINE RayTraceRay( const LPoint3 &start, const LPoint3 &end, unsigned int ray_mask )
+        {
+                set_line( start, end );
+                mask = ray_mask;
+        }
+
+        INLINE void set_line( const LPoint3 &start, const LPoint3 &end )
+        {
+                LVector3 delta = end - start;
+                origin = start;
+                distance = delta.length();
+                direction = delta / distance;
+        }
+};
+
 #ifndef CPPPARSER
 class ALIGN_16BYTE EXPCL_PANDABSP RayTraceHitResult4
 {
@@ -125,6 +159,17 @@ PUBLISHED:
         RayTraceHitResult trace_ray( const LPoint3 &origin, const LVector3 &direction,
                 float distance, const BitMask32 &mask );
 
+        // Occlusion-only queries.  These stop at the first hit they find and
+        // don't report what was hit, so use them when only a yes or no is
+        // needed.
+        INLINE bool is_line_occluded( const LPoint3 &start, const LPoint3 &end, const BitMask32 &mask )
+        {
+                LPoint3 delta = end - start;
+                return is_ray_occluded( start, delta.normalized(), delta.length(), mask );
+        }
+        bool is_ray_occluded( const LPoint3 &origin, const LVector3 &direction,
+                float distance, const BitMask32 &mask );
+
         void set_build_quality( int quality );
 
         void update();
@@ -153,14 +198,69 @@ public:
         }
         void trace_four_rays( const FourVectors &origin, const FourVectors &direction,
                 const fltx4 &distance, const u32x4 &mask, RayTraceHitResult4 *res );
+
+        // Returns a mask with bit i set if line/ray i is occluded.
+        INLINE int occluded_four_lines( const FourVectors &start, const FourVectors &end,
+                const u32x4 &mask )
+        {
+                FourVectors direction = end;
+                direction -= start;
+                fltx4 length4 = direction.length();
+                direction.VectorNormalize();
+                return occluded_four_rays( start, direction, length4, mask );
+        }
+        int occluded_four_rays( const FourVectors &origin, const FourVectors &direction,
+                const fltx4 &distance, const u32x4 &mask );
 #endif
 
+        // Wider occlusion packets, for up to 8 or 16 lines with a shared
+        // mask.  Returns a mask with bit i set if line i is occluded.
+        int occluded_eight_lines( const LPoint3 *start, const LPoint3 *end, int count,
+                unsigned int mask );
+        int occluded_sixteen_lines( const LPoint3 *start, const LPoint3 *end, int count,
+                unsigned int mask );
+
+        // Stream queries for any number of incoherent rays.
+        void trace_rays( const RayTraceRay *rays, RayTraceHitResult *results, size_t count );
+        void occluded_rays( const RayTraceRay *rays, bool *occluded, size_t count );
+
+        void mark_dirty( RayTraceGeometry *geom, const TransformState *net_transform = nullptr );
+
 private:
+        unsigned int alloc_geom_id();
+        void free_geom_id( unsigned int geom_id );
+        void detach_geometry( RayTraceGeometry *geom );
+
+        INLINE unsigned int resolve_geom_id( unsigned int geom_id, unsigned int inst_id ) const
+        {
+                // Static geometry lives in a scene of its own, under one
+                // instance; everything else is hit through its own instance.
+                return inst_id == _static_inst_id ? geom_id : inst_id;
+        }
+        LVector3 get_world_normal( unsigned int inst_id, const LVector3 &normal );
+
+        // Top-level scene, holding the static scene's instance and one
+        // instance per dynamic geometry.
         RTCScene _scene;
         bool _scene_needs_rebuild;
 
+        RTCScene _static_scene;
+        RTCGeometry _static_instance;
+        unsigned int _static_inst_id;
+        bool _static_needs_rebuild;
+
+        // IDs are shared between the static scene and the top-level scene, so
+        // a geometry's ID is the same whether or not it is dynamic.
+        unsigned int _next_geom_id;
+        pvector<unsigned int> _free_geom_ids;
+
         SimpleHashMap<unsigned int, RayTraceGeometry *, int_hash> _geoms;
 
+        // Dynamic geometries whose transform has changed since the last
+        // update().
+        pvector<RayTraceGeometry *> _dirty_geoms;
+        LightMutex _dirty_lock;
+
         friend class RayTraceGeometry;
 };
 
@@ -173,7 +273,12 @@ PUBLISHED:
                 PandaNode( name ),
                 _geometry( nullptr ),
                 _geom_id( 0 ),
+                _mask( BitMask32::all_on().get_word() ),
                 _rtscene( nullptr ),
+                _instanced_scene( nullptr ),
+                _instance( nullptr ),
+                _dynamic( false ),
+                _dirty( false ),
                 _last_trans( nullptr )
         {
         }
@@ -197,6 +302,17 @@ PUBLISHED:
 
         void set_build_quality( int quality );
 
+        // Dynamic geometry is placed in the scene by its net transform, and
+        // moving it only updates its instance.  Static geometry is used as
+        // built.  Must be set before the geometry is added to a scene.
+        void set_dynamic( bool dynamic );
+        INLINE bool is_dynamic() const
+        {
+                return _dynamic;
+        }
+
+        void mark_transform_dirty();
+
         virtual void build() = 0;        
 
 public:
@@ -209,12 +325,30 @@ public:
 
         void update_rtc_transform( const TransformState *ts );
 
+        virtual bool cull_callback( CullTraverser *trav, CullTraverserData &data );
+
 protected:
+        virtual void transform_changed();
+        virtual void parents_changed();
+
+        void geometry_changed();
+
         RTCGeometry _geometry;
         unsigned int _geom_id;
         unsigned int _mask;
         RayTraceScene *_rtscene;
 
+        // Only for dynamic geometry: a scene holding just _geometry, and the
+        // instance of it in the RayTraceScene.
+        RTCScene _instanced_scene;
+        RTCGeometry _instance;
+        bool _dynamic;
+
+        // Set while the geometry is in the scene's dirty list.  _dirty_trans
+        // is the new net transform, if the cull traversal found it for us.
+        bool _dirty;
+        CPT(TransformState) _dirty_trans;
+
         CPT(TransformState) _last_trans;
 
         friend class RayTraceScene;
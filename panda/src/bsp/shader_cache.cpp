@@ -0,0 +1,317 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file shader_cache.cpp
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#include "shader_cache.h"
+#include "shader_spec.h"
+#include "shader_generator.h"
+
+#include <virtualFileSystem.h>
+#include <graphicsStateGuardian.h>
+#include <lightMutexHolder.h>
+#include <configVariableFilename.h>
+#include <configVariableBool.h>
+
+#include <cstring>
+
+static ConfigVariableFilename bsp_shader_cache_dir
+( "bsp-shader-cache-dir", "",
+  PRC_DESC( "Directory to keep the shaders generated for BSP materials in, "
+            "so they don't have to be generated and compiled again on the next "
+            "run.  Leave empty to disable the cache." ) );
+
+static ConfigVariableBool bsp_shader_cache_binaries
+( "bsp-shader-cache-binaries", true,
+  PRC_DESC( "Also cache the linked program binaries, when the driver supports "
+            "them.  They are thrown away if the driver changes." ) );
+
+static const char shader_cache_ident[4] = { 'B', 'S', 'P', 'S' };
+static const int shader_cache_version = 1;
+
+BSPShaderCache *BSPShaderCache::_global_ptr = nullptr;
+
+BSPShaderCache::BSPShaderCache() :
+        _dir( bsp_shader_cache_dir.get_value() ),
+        _binaries( false ),
+        _gsg( nullptr ),
+        _lock( "BSPShaderCache" )
+{
+        if ( !_dir.empty() )
+        {
+                VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+                if ( !vfs->is_directory( _dir ) && !vfs->make_directory_full( _dir ) )
+                {
+                        bspShaderGenerator_cat.warning()
+                                << "Couldn't create shader cache directory " << _dir
+                                << ", shaders will not be cached\n";
+                        _dir = Filename();
+                }
+        }
+}
+
+BSPShaderCache *BSPShaderCache::get_global_ptr()
+{
+        if ( !_global_ptr )
+        {
+                _global_ptr = new BSPShaderCache;
+        }
+
+        return _global_ptr;
+}
+
+/**
+ * Specifies the GSG the shaders will be compiled by.  Program binaries are
+ * only kept for, and only given back to, the driver that made them.
+ */
+void BSPShaderCache::set_gsg( GraphicsStateGuardian *gsg )
+{
+        LightMutexHolder holder( _lock );
+
+        _gsg = gsg;
+        _binaries = gsg != nullptr && bsp_shader_cache_binaries;
+        _driver = "";
+        if ( gsg != nullptr )
+        {
+                _driver = gsg->get_driver_vendor() + "\n" +
+                        gsg->get_driver_renderer() + "\n" +
+                        gsg->get_driver_version();
+        }
+        _pending.clear();
+}
+
+INLINE uint64_t shader_cache_hash( uint64_t hash, const std::string &str )
+{
+        // FNV-1a
+        for ( size_t i = 0; i < str.size(); i++ )
+        {
+                hash ^= (unsigned char)str[i];
+                hash *= 1099511628211ull;
+        }
+        // Keep "ab" + "c" apart from "a" + "bc".
+        hash ^= 0xff;
+        hash *= 1099511628211ull;
+        return hash;
+}
+
+/**
+ * Returns a hash of everything that goes into the generated shader: the
+ * spec's source files and the permutation defines.  Unlike
+ * ShaderPermutations::get_hash(), this does not depend on the inputs, so it
+ * is the same from one run to the next.
+ */
+uint64_t BSPShaderCache::get_key( const ShaderSpec *spec, const ShaderPermutations *perms ) const
+{
+        uint64_t hash = 14695981039346656037ull;
+        hash = shader_cache_hash( hash, spec->get_name() );
+        hash = shader_cache_hash( hash, spec->_vertex.full_source );
+        hash = shader_cache_hash( hash, spec->_pixel.full_source );
+        hash = shader_cache_hash( hash, spec->_geom.full_source );
+        hash = shader_cache_hash( hash, perms->permutations );
+        hash = shader_cache_hash( hash, std::to_string( perms->flags ) );
+        return hash;
+}
+
+Filename BSPShaderCache::get_filename( const ShaderSpec *spec, uint64_t key ) const
+{
+        char hex[17];
+        sprintf( hex, "%016llx", (unsigned long long)key );
+        Filename filename( _dir, spec->get_name() + "-" + hex + ".bsh" );
+        filename.set_binary();
+        return filename;
+}
+
+/**
+ * Returns the shader for the permutations from disk, or nullptr if it has
+ * not been cached yet.
+ */
+CPT( Shader ) BSPShaderCache::load_shader( const ShaderSpec *spec, const ShaderPermutations *perms )
+{
+        if ( !is_enabled() )
+        {
+                return nullptr;
+        }
+
+        uint64_t key = get_key( spec, perms );
+        cacheentry_t entry;
+        entry.filename = get_filename( spec, key );
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        vector_uchar buffer;
+        if ( !vfs->exists( entry.filename ) || !vfs->read_file( entry.filename, buffer, true ) )
+        {
+                return nullptr;
+        }
+
+        Datagram dg( std::move( buffer ) );
+        if ( dg.get_length() < sizeof( shader_cache_ident ) ||
+             memcmp( dg.get_data(), shader_cache_ident, sizeof( shader_cache_ident ) ) != 0 )
+        {
+                return nullptr;
+        }
+
+        DatagramIterator dgi( dg, sizeof( shader_cache_ident ) );
+        if ( dgi.get_uint16() != shader_cache_version || dgi.get_uint64() != key )
+        {
+                return nullptr;
+        }
+
+        // Make sure it's really our permutation and not a hash collision.
+        ShaderPermutations stored;
+        stored.local_object();
+        stored.fillin( dgi );
+        size_t header_length = dgi.get_current_index();
+        if ( stored.permutations != perms->permutations || stored.flags != perms->flags )
+        {
+                return nullptr;
+        }
+
+        std::string vertex = dgi.get_string32();
+        std::string fragment = dgi.get_string32();
+        std::string geometry = dgi.get_string32();
+        std::string driver = dgi.get_string();
+        unsigned int format = dgi.get_uint32();
+        std::string binary = dgi.get_string32();
+
+        entry.shader = Shader::make( Shader::SL_GLSL, vertex, fragment, geometry );
+        if ( entry.shader == nullptr )
+        {
+                return nullptr;
+        }
+
+        LightMutexHolder holder( _lock );
+
+        if ( _binaries )
+        {
+                if ( !binary.empty() && driver == _driver )
+                {
+                        entry.shader->set_compiled( format, binary.data(), binary.size() );
+                }
+                else
+                {
+                        // Not compiled yet, or by a different driver.  Pick
+                        // up the binary once this driver has linked it.
+                        entry.header = Datagram( dg.get_data(), header_length );
+                        entry.shader->set_cache_compiled_shader( true );
+                        _pending.push_back( entry );
+                }
+        }
+
+        return entry.shader;
+}
+
+/**
+ * Writes a newly generated shader to disk.  The program binary is added
+ * later by flush(), once the driver has linked the shader.
+ */
+void BSPShaderCache::store_shader( const ShaderSpec *spec, const ShaderPermutations *perms, Shader *shader )
+{
+        if ( !is_enabled() )
+        {
+                return;
+        }
+
+        cacheentry_t entry;
+        uint64_t key = get_key( spec, perms );
+        entry.filename = get_filename( spec, key );
+        entry.shader = shader;
+        entry.header.append_data( shader_cache_ident, sizeof( shader_cache_ident ) );
+        entry.header.add_uint16( shader_cache_version );
+        entry.header.add_uint64( key );
+        perms->write_datagram( entry.header );
+
+        LightMutexHolder holder( _lock );
+
+        write_entry( entry );
+
+        if ( _binaries )
+        {
+                shader->set_cache_compiled_shader( true );
+                _pending.push_back( entry );
+        }
+}
+
+bool BSPShaderCache::write_entry( const cacheentry_t &entry )
+{
+        Datagram dg( entry.header );
+        dg.add_string32( entry.shader->get_text( Shader::ST_vertex ) );
+        dg.add_string32( entry.shader->get_text( Shader::ST_fragment ) );
+        dg.add_string32( entry.shader->get_text( Shader::ST_geometry ) );
+
+        unsigned int format = 0;
+        std::string binary;
+        if ( _binaries && entry.shader->get_compiled( format, binary ) )
+        {
+                dg.add_string( _driver );
+        }
+        else
+        {
+                dg.add_string( "" );
+                format = 0;
+                binary = "";
+        }
+        dg.add_uint32( format );
+        dg.add_string32( binary );
+
+        VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+        if ( !vfs->write_file( entry.filename, (const unsigned char *)dg.get_data(), dg.get_length(), false ) )
+        {
+                bspShaderGenerator_cat.warning()
+                        << "Couldn't write " << entry.filename << "\n";
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Writes out the program binaries of any cached shaders the driver has
+ * linked since the last call.  Called every frame by the shader generator.
+ */
+void BSPShaderCache::flush()
+{
+        LightMutexHolder holder( _lock );
+
+        if ( _pending.empty() )
+        {
+                return;
+        }
+
+        PreparedGraphicsObjects *prepared = _gsg != nullptr ? _gsg->get_prepared_objects() : nullptr;
+
+        for ( size_t i = 0; i < _pending.size(); )
+        {
+                cacheentry_t &entry = _pending[i];
+
+                bool done;
+                unsigned int format;
+                std::string binary;
+                if ( entry.shader->get_compiled( format, binary ) )
+                {
+                        write_entry( entry );
+                        done = true;
+                }
+                else
+                {
+                        // Once the shader is prepared we have all the driver
+                        // will give us.
+                        done = prepared == nullptr || entry.shader->is_prepared( prepared );
+                }
+
+                if ( done )
+                {
+                        _pending[i] = _pending.back();
+                        _pending.pop_back();
+                }
+                else
+                {
+                        i++;
+                }
+        }
+}
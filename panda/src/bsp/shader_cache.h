@@ -0,0 +1,86 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) CIO Team.
+ * All rights reserved.
+ *
+ * @file shader_cache.h
+ * @author agent
+ * @date October 17, 2026
+ */
+
+#ifndef BSP_SHADER_CACHE_H
+#define BSP_SHADER_CACHE_H
+
+#include "config_bsp.h"
+
+#include <shader.h>
+#include <filename.h>
+#include <lightMutex.h>
+#include <pvector.h>
+#include <datagram.h>
+#include <datagramIterator.h>
+
+class ShaderSpec;
+class ShaderPermutations;
+class GraphicsStateGuardian;
+
+/**
+ * Keeps every shader permutation the BSPShaderGenerator makes on disk, keyed
+ * by a hash of the shader's source and its permutation defines.  The
+ * generated sources are written as soon as the permutation is first made,
+ * and the linked program binary is added once the driver has produced one,
+ * so later runs can skip both generating and compiling the shader.
+ */
+class EXPCL_PANDABSP BSPShaderCache
+{
+PUBLISHED:
+        static BSPShaderCache *get_global_ptr();
+
+        void set_gsg( GraphicsStateGuardian *gsg );
+
+        INLINE bool is_enabled() const
+        {
+                return !_dir.empty();
+        }
+        INLINE const Filename &get_cache_dir() const
+        {
+                return _dir;
+        }
+
+        void flush();
+
+public:
+        CPT( Shader ) load_shader( const ShaderSpec *spec, const ShaderPermutations *perms );
+        void store_shader( const ShaderSpec *spec, const ShaderPermutations *perms, Shader *shader );
+
+private:
+        BSPShaderCache();
+
+        struct cacheentry_t
+        {
+                Filename filename;
+                // Everything up to the shader sources.
+                Datagram header;
+                PT( Shader ) shader;
+        };
+
+        uint64_t get_key( const ShaderSpec *spec, const ShaderPermutations *perms ) const;
+        Filename get_filename( const ShaderSpec *spec, uint64_t key ) const;
+        bool write_entry( const cacheentry_t &entry );
+
+        Filename _dir;
+        // Identifies the driver that compiled the cached program binaries.
+        std::string _driver;
+        bool _binaries;
+        GraphicsStateGuardian *_gsg;
+
+        // Entries written without a program binary, waiting on the driver.
+        pvector<cacheentry_t> _pending;
+
+        LightMutex _lock;
+
+        static BSPShaderCache *_global_ptr;
+};
+
+#endif // BSP_SHADER_CACHE_H
@@ -199,7 +199,7 @@ SHADERFEATURE_PARSE_FUNC( EnvmapFeature )
 
                 if ( mat->has_keyvalue( "$envmaptint" ) )
                 {
-                        envmap_tint = CKeyValues::to_3f( mat->get_keyvalue( "$envmaptint" ) );
+                        envmap_tint = mat->get_keyvalue_3f( "$envmaptint" );
                 }
         }
         
@@ -241,8 +241,7 @@ SHADERFEATURE_PARSE_FUNC( DetailFeature )
                 }
                 if ( mat->has_keyvalue( "$detailtint" ) )
                 {
-                        detail_tint = CKeyValues::to_3f
-                        ( mat->get_keyvalue( "$detailtint" ) );
+                        detail_tint = mat->get_keyvalue_3f( "$detailtint" );
                 }
         }  
 }
@@ -343,7 +342,7 @@ SHADERFEATURE_PARSE_FUNC( SelfIllumFeature )
 
                 if ( mat->has_keyvalue( "$selfillumtint" ) )
                 {
-                        selfillumtint = CKeyValues::to_3f( mat->get_keyvalue( "$selfillumtint" ) );
+                        selfillumtint = mat->get_keyvalue_3f( "$selfillumtint" );
                 }
         }
 }
@@ -16,8 +16,10 @@
 #include "cubemaps.h"
 #include "aux_data_attrib.h"
 #include "bsploader.h"
+#include "shader_cache.h"
 
 #include <pStatTimer.h>
+#include <lightMutexHolder.h>
 #include <config_pgraphnodes.h>
 #include <material.h>
 #include <auxBitplaneAttrib.h>
@@ -45,6 +47,8 @@
 #include <colorScaleAttrib.h>
 #include <cullBinAttrib.h>
 #include <lens.h>
+#include <geomNode.h>
+#include <shaderAttrib.h>
 
 using namespace std;
 
@@ -108,6 +112,8 @@ BSPShaderGenerator::BSPShaderGenerator( GraphicsOutput *output, GraphicsStateGua
 
 	_planar_reflections = new PlanarReflections( this );
 
+	BSPShaderCache::get_global_ptr()->set_gsg( gsg );
+
         if ( want_pssm )
         {
                 _pssm_split_texture_array = new Texture( "pssmSplitTextureArray" );
@@ -260,6 +266,84 @@ void BSPShaderGenerator::update()
 
 		_pta_fogdata[1][3] = 1.0f;//self->_fog->get_linear
 	}
+
+	BSPShaderCache::get_global_ptr()->flush();
+}
+
+/**
+ * Generates and prepares the shaders for everything under the indicated
+ * node, so they are compiled now rather than when they are first seen
+ * during gameplay.  The shaders are compiled on the next frame.
+ *
+ * The node does not have to be parented to render yet, it is prepared with
+ * the state it will have once it is.
+ */
+void BSPShaderGenerator::prewarm_shaders( const NodePath &root )
+{
+	nassertv( !root.is_empty() );
+
+	CPT( RenderState ) state = root.get_net_state();
+	if ( !_render.is_empty() && !_render.is_ancestor_of( root ) )
+	{
+		state = _render.get_net_state()->compose( state );
+	}
+
+	// This takes care of the textures and any explicit shaders.
+	root.node()->prepare_scene( _gsg, state );
+
+	// The generated shaders have to be synthesized from the state each Geom
+	// will be rendered with, prepare_scene() doesn't know about those.
+	pset<const Shader *> prepared;
+	prewarm_node( root.node(), state, prepared );
+}
+
+void BSPShaderGenerator::prewarm_node( PandaNode *node, const RenderState *state,
+                                       pset<const Shader *> &prepared )
+{
+        if ( node->is_geom_node() )
+        {
+                GeomNode *gn = DCAST( GeomNode, node );
+                GeomNode::Geoms geoms = gn->get_geoms();
+                int num_geoms = geoms.get_num_geoms();
+                for ( int i = 0; i < num_geoms; i++ )
+                {
+                        CPT( RenderState ) geom_state = state->compose( geoms.get_geom_state( i ) );
+
+                        const ShaderAttrib *sattr;
+                        geom_state->get_attrib_def( sattr );
+                        if ( !sattr->auto_shader() )
+                        {
+                                continue;
+                        }
+
+                        // Same animation spec the GSG asks us for.
+                        GeomVertexAnimationSpec spec;
+                        if ( sattr->get_flag( ShaderAttrib::F_hardware_skinning ) )
+                        {
+                                spec.set_hardware( 4, true );
+                        }
+
+                        CPT( ShaderAttrib ) generated = synthesize_shader( geom_state, spec );
+                        if ( generated == nullptr || generated->get_shader() == nullptr )
+                        {
+                                continue;
+                        }
+
+                        const Shader *shader = generated->get_shader();
+                        if ( prepared.insert( shader ).second )
+                        {
+                                ( (Shader *)shader )->prepare( _gsg->get_prepared_objects() );
+                        }
+                }
+        }
+
+        PandaNode::Children children = node->get_children();
+        int num_children = children.get_num_children();
+        for ( int i = 0; i < num_children; i++ )
+        {
+                PandaNode *child = children.get_child( i );
+                prewarm_node( child, state->compose( child->get_state() ), prepared );
+        }
 }
 
 CPT( RenderAttrib ) apply_node_inputs( const RenderState *rs, CPT( RenderAttrib ) shattr )
@@ -273,6 +357,14 @@ CPT( RenderAttrib ) apply_node_inputs( const RenderState *rs, CPT( RenderAttrib
                 if ( ada->get_data()->is_exact_type( CNodeShaderInput::get_class_type() ) )
                 {
                         CNodeShaderInput *bsp_node_input = DCAST( CNodeShaderInput, ada->get_data() );
+
+                        // The node's cubemap may be swapped by another cull thread.
+                        PT( Texture ) envmap;
+                        {
+                                LightMutexHolder holder( bsp_node_input->lock );
+                                envmap = bsp_node_input->cubemap_tex;
+                        }
+
                         shattr = DCAST( ShaderAttrib, shattr )->set_shader_inputs(
                                 {
                                         ShaderInput( "lightCount", bsp_node_input->light_count ),
@@ -280,7 +372,7 @@ CPT( RenderAttrib ) apply_node_inputs( const RenderState *rs, CPT( RenderAttrib
                                         ShaderInput( "lightData2", bsp_node_input->light_data2 ),
                                         ShaderInput( "lightTypes", bsp_node_input->light_type ),
                                         ShaderInput( "ambientCube", bsp_node_input->ambient_cube ),
-                                        ShaderInput( "envmapSampler", bsp_node_input->cubemap_tex )
+                                        ShaderInput( "envmapSampler", envmap )
                                 } );
                         inputs_supplied = true;
                 }
@@ -305,6 +397,15 @@ CPT( RenderAttrib ) apply_node_inputs( const RenderState *rs, CPT( RenderAttrib
                 shattr = DCAST( ShaderAttrib, shattr )->set_shader_inputs( inputs );
         }
 
+        // The GSG takes the instance count from the generated attrib, not
+        // from the one on the node.
+        const ShaderAttrib *node_shattr;
+        rs->get_attrib_def( node_shattr );
+        if ( node_shattr->get_instance_count() > 0 )
+        {
+                shattr = DCAST( ShaderAttrib, shattr )->set_instance_count( node_shattr->get_instance_count() );
+        }
+
         return shattr;
 }
 
@@ -448,6 +549,13 @@ Texture *BSPShaderGenerator::get_identity_cubemap()
 
 CPT( Shader ) BSPShaderGenerator::make_shader( const ShaderSpec *spec, const ShaderPermutations *perms )
 {
+	BSPShaderCache *cache = BSPShaderCache::get_global_ptr();
+	CPT( Shader ) cached = cache->load_shader( spec, perms );
+	if ( cached != nullptr )
+	{
+		return cached;
+	}
+
 	std::ostringstream vshader, gshader, fshader;
 
 	// Slip the defines into the shader source.
@@ -470,5 +578,11 @@ CPT( Shader ) BSPShaderGenerator::make_shader( const ShaderSpec *spec, const Sha
 			<< spec->_pixel.after_defines;
 	}
 
-	return Shader::make( Shader::SL_GLSL, vshader.str(), fshader.str(), gshader.str() );
+	PT( Shader ) shader = Shader::make( Shader::SL_GLSL, vshader.str(), fshader.str(), gshader.str() );
+	if ( shader != nullptr )
+	{
+		cache->store_shader( spec, perms, shader );
+	}
+
+	return shader;
 }
@@ -159,7 +159,12 @@ PUBLISHED:
 
         void update();
 
+        void prewarm_shaders( const NodePath &root );
+
 private:
+        void prewarm_node( PandaNode *node, const RenderState *state,
+                           pset<const Shader *> &prepared );
+
         struct SplitShadowMap
         {
                 PT( GraphicsOutput ) buffer;
@@ -130,6 +130,16 @@ void ShaderSpec::setup_permutations( ShaderPermutations &result,
 	{
 		result.add_permutation( "STATIC_PROP_LIGHTING" );
 	}
+	if ( spa->is_instanced() )
+	{
+		result.add_permutation( "STATIC_PROP_INSTANCED" );
+		if ( spa->has_static_lighting() )
+		{
+			result.add_input( ShaderInput( "staticPropLighting", spa->get_instance_lighting() ) );
+			result.add_input( ShaderInput( "staticPropLightingRows",
+				LVecBase4i( spa->get_instance_lighting_rows(), 0, 0, 0 ) ) );
+		}
+	}
 
 	const AuxBitplaneAttrib *aba;
 	state->get_attrib_def( aba );
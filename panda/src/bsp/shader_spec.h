@@ -17,6 +17,8 @@
 #include <pmap.h>
 #include <shaderAttrib.h>
 #include <geomVertexAnimationSpec.h>
+#include <datagram.h>
+#include <datagramIterator.h>
 
 #include <unordered_map>
 
@@ -158,6 +160,38 @@ PUBLISHED:
         {
 		return hash;
         }
+
+public:
+	// Only the defines and flags are written, the inputs are bound
+	// again for each state.  That is all that goes into the shader
+	// itself, so it is enough to key a shader on disk.
+	INLINE void write_datagram( Datagram &dg ) const
+	{
+		dg.add_string32( permutations );
+		dg.add_int32( flags );
+		dg.add_uint16( (uint16_t)flag_indices.size() );
+		for ( size_t i = 0; i < flag_indices.size(); i++ )
+		{
+			dg.add_int32( flag_indices[i] );
+		}
+	}
+
+	INLINE void fillin( DatagramIterator &dgi )
+	{
+		permutations_stream.str( "" );
+		permutations_stream << dgi.get_string32();
+		flags = 0;
+		flag_indices.clear();
+		int tflags = dgi.get_int32();
+		int nflags = dgi.get_uint16();
+		for ( int i = 0; i < nflags; i++ )
+		{
+			add_flag( dgi.get_int32() );
+		}
+		nassertv( flags == tflags );
+		hash = 0u;
+		complete();
+	}
 };
 
 /**
@@ -20,6 +20,16 @@ CPT( RenderAttrib ) StaticPropAttrib::make( bool static_lighting )
 	return return_new( attr );
 }
 
+CPT( RenderAttrib ) StaticPropAttrib::make_instanced( Texture *lighting, int lighting_rows )
+{
+	StaticPropAttrib *attr = new StaticPropAttrib;
+	attr->_static_lighting = lighting != nullptr;
+	attr->_instanced = true;
+	attr->_instance_lighting = lighting;
+	attr->_instance_lighting_rows = lighting_rows;
+	return return_new( attr );
+}
+
 int StaticPropAttrib::compare_to_impl( const RenderAttrib *other ) const
 {
 	const StaticPropAttrib *spa_other = (const StaticPropAttrib *)other;
@@ -27,6 +37,18 @@ int StaticPropAttrib::compare_to_impl( const RenderAttrib *other ) const
 	{
 		return _static_lighting < spa_other->_static_lighting ? -1 : 1;
 	}
+	if ( _instanced != spa_other->_instanced )
+	{
+		return _instanced < spa_other->_instanced ? -1 : 1;
+	}
+	if ( _instance_lighting != spa_other->_instance_lighting )
+	{
+		return _instance_lighting < spa_other->_instance_lighting ? -1 : 1;
+	}
+	if ( _instance_lighting_rows != spa_other->_instance_lighting_rows )
+	{
+		return _instance_lighting_rows < spa_other->_instance_lighting_rows ? -1 : 1;
+	}
 	return 0;
 }
 
@@ -34,5 +56,8 @@ size_t StaticPropAttrib::get_hash_impl() const
 {
 	size_t hash = 0;
 	hash = int_hash::add_hash( hash, (int)_static_lighting );
+	hash = int_hash::add_hash( hash, (int)_instanced );
+	hash = pointer_hash::add_hash( hash, _instance_lighting );
+	hash = int_hash::add_hash( hash, _instance_lighting_rows );
 	return hash;
 }
\ No newline at end of file
@@ -14,6 +14,8 @@
 
 #include "config_bsp.h"
 
+#include <texture.h>
+
 class EXPCL_PANDABSP StaticPropAttrib : RenderAttrib
 {
 	DECLARE_ATTRIB( StaticPropAttrib, RenderAttrib );
@@ -21,20 +23,42 @@ class EXPCL_PANDABSP StaticPropAttrib : RenderAttrib
 private:
 	INLINE StaticPropAttrib() :
 		RenderAttrib(),
-		_static_lighting( false )
+		_static_lighting( false ),
+		_instanced( false ),
+		_instance_lighting_rows( 0 )
 	{
 	}
 
 PUBLISHED:
 	static CPT( RenderAttrib ) make( bool static_lighting = true );
+	static CPT( RenderAttrib ) make_instanced( Texture *lighting, int lighting_rows );
 
 	INLINE bool has_static_lighting() const
 	{
 		return _static_lighting;
 	}
 
+	// The Geom is drawn once per prop instance.  The instance's transform is
+	// in the instanceMatrix vertex column, and its lighting for vertex n is
+	// at gl_InstanceID * rows + n in the lighting buffer texture.
+	INLINE bool is_instanced() const
+	{
+		return _instanced;
+	}
+	INLINE Texture *get_instance_lighting() const
+	{
+		return _instance_lighting;
+	}
+	INLINE int get_instance_lighting_rows() const
+	{
+		return _instance_lighting_rows;
+	}
+
 private:
 	bool _static_lighting;
+	bool _instanced;
+	PT( Texture ) _instance_lighting;
+	int _instance_lighting_rows;
 };
 
 #endif // STATICPROPS_H
\ No newline at end of file
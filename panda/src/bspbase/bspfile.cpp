@@ -134,6 +134,66 @@ void            DecompressVis( bspdata_t *data, const byte* src, byte* const des
         } while ( out - dest < row );
 }
 
+// =====================================================================================
+//  GetVisMatrix
+//      Returns the uncompressed PVS in the visibility lump, or NULL if there
+//      isn't one. The lump is 4 byte aligned in the file, so this points
+//      straight into a mapped image. If the image itself is not 4 byte
+//      aligned in memory, NULL is returned and the caller decompresses the
+//      per leaf visibility instead.
+// =====================================================================================
+const dvismatrix_t *GetVisMatrix( const bspdata_t *data )
+{
+#ifdef WORDS_BIGENDIAN
+        // The rows are stored little endian.
+        return NULL;
+#else
+        if ( data->visdatasize < (int)( sizeof( dvismatrix_t ) + sizeof( dvismatrixfooter_t ) ) )
+        {
+                return NULL;
+        }
+
+        const byte *lump = data->dvisdata;
+        if ( ( (uintptr_t)lump & 3 ) != 0 )
+        {
+                return NULL;
+        }
+
+        const dvismatrixfooter_t *footer =
+                (const dvismatrixfooter_t *)( lump + data->visdatasize - sizeof( dvismatrixfooter_t ) );
+        if ( footer->magic != PVSMATRIX_MAGIC || footer->ofs < 0 || ( footer->ofs & 3 ) != 0 ||
+             footer->ofs + (int)sizeof( dvismatrix_t ) > data->visdatasize )
+        {
+                return NULL;
+        }
+
+        const dvismatrix_t *matrix = (const dvismatrix_t *)( lump + footer->ofs );
+        if ( matrix->magic != PVSMATRIX_MAGIC || matrix->numleafs <= 0 || matrix->numclusters <= 0 ||
+             matrix->rowwords != ( data->dmodels[0].visleafs + 31 ) >> 5 )
+        {
+                return NULL;
+        }
+
+        size_t size = sizeof( dvismatrix_t ) + matrix->numleafs * sizeof( int ) +
+                (size_t)matrix->numclusters * matrix->rowwords * sizeof( unsigned int );
+        if ( footer->ofs + size + sizeof( dvismatrixfooter_t ) > (size_t)data->visdatasize )
+        {
+                return NULL;
+        }
+
+        const int *clusters = matrix->get_leaf_clusters();
+        for ( int i = 0; i < matrix->numleafs; i++ )
+        {
+                if ( clusters[i] < 0 || clusters[i] >= matrix->numclusters )
+                {
+                        return NULL;
+                }
+        }
+
+        return matrix;
+#endif
+}
+
 //
 // =====================================================================================
 //
@@ -371,6 +431,124 @@ static int CopyLump( int lump, pvector<T> &dest, const dheader_t* const header )
 }
 
 
+template<class T, int MaxEntries>
+static int MapLump( int lump, bsplump_t<T, MaxEntries> &dest, const dheader_t* const header,
+                    const byte* const image, const size_t image_length, const int flags )
+{
+        int             length, ofs;
+
+        length = header->lumps[lump].filelen;
+        ofs = header->lumps[lump].fileofs;
+
+        if ( length < 0 || ofs < 0 || (size_t)ofs + (size_t)length > image_length )
+        {
+                Error( "LoadBSPFile: lump %i (offset %i, length %i) is outside of the file", lump, ofs, length );
+        }
+
+        if ( length % sizeof( T ) )
+        {
+                Error( "LoadBSPFile: odd lump size for lump %i, length %i, size %i", lump, length, (int)sizeof( T ) );
+        }
+
+        int count = length / sizeof( T );
+        if ( count > MaxEntries )
+        {
+                Error( "LoadBSPFile: lump %i has %i entries, limit is %i", lump, count, MaxEntries );
+        }
+
+        const byte *src = image + ofs;
+
+#ifndef WORDS_BIGENDIAN
+        // The lump can be used in place as long as it is suitably aligned.
+        // Big endian hosts always copy, since the lump has to be swapped.
+        if ( ( flags & BSPLOAD_NOCOPY ) && ( (uintptr_t)src % alignof( T ) ) == 0 )
+        {
+                dest.set_view( (const T *)src, count );
+                return count;
+        }
+#endif
+
+        if ( flags & ( BSPLOAD_COMPACT | BSPLOAD_NOCOPY ) )
+        {
+                dest.alloc( count );
+        }
+        else
+        {
+                // Leave room to grow the lump, as LoadBSPImage( header ) does.
+                dest.alloc_max();
+        }
+        memcpy( dest, src, length );
+
+        return count;
+}
+
+template<class T>
+static int MapLump( int lump, pvector<T> &dest, const dheader_t* const header,
+                    const byte* const image, const size_t image_length )
+{
+        int             length, ofs;
+
+        length = header->lumps[lump].filelen;
+        ofs = header->lumps[lump].fileofs;
+
+        if ( length < 0 || ofs < 0 || (size_t)ofs + (size_t)length > image_length )
+        {
+                Error( "LoadBSPFile: lump %i (offset %i, length %i) is outside of the file", lump, ofs, length );
+        }
+
+        if ( length % sizeof( T ) )
+        {
+                Error( "LoadBSPFile: odd lump size for lump %i, length %i, size %i", lump, length, (int)sizeof( T ) );
+        }
+
+        dest.resize( length / sizeof( T ) );
+        memcpy( dest.data(), image + ofs, length );
+
+        return (int)dest.size();
+}
+
+// =====================================================================================
+//  bspdata_t
+// =====================================================================================
+bspdata_t::bspdata_t( bool compact ) :
+        nummodels( 0 ),
+        visdatasize( 0 ),
+        numtexrefs( 0 ),
+        entdatasize( 0 ),
+        numleafs( 0 ),
+        numplanes( 0 ),
+        numvertexes( 0 ),
+        numnodes( 0 ),
+        numtexinfo( 0 ),
+        numfaces( 0 ),
+        numorigfaces( 0 ),
+        numedges( 0 ),
+        nummarksurfaces( 0 ),
+        numsurfedges( 0 ),
+        numentities( 0 )
+{
+        if ( compact )
+        {
+                return;
+        }
+
+        dmodels.alloc_max();
+        dvisdata.alloc_max();
+        dtexrefs.alloc_max();
+        dentdata.alloc_max();
+        dleafs.alloc_max();
+        dplanes.alloc_max();
+        dvertexes.alloc_max();
+        dnodes.alloc_max();
+        texinfo.alloc_max();
+        dfaces.alloc_max();
+        dorigfaces.alloc_max();
+        dedges.alloc_max();
+        dmarksurfaces.alloc_max();
+        dsurfedges.alloc_max();
+        entities.alloc_max();
+}
+
 // =====================================================================================
 //  LoadBSPFile
 //      balh
@@ -466,6 +644,103 @@ bspdata_t            *LoadBSPImage( dheader_t* const header )
         return data;
 }
 
+// =====================================================================================
+//  LoadBSPImage
+//      Loads a bsp image without modifying it. With BSPLOAD_COMPACT, every
+//      lump is sized to its count in the file rather than MAX_MAP_*. With
+//      BSPLOAD_NOCOPY, lumps refer directly into the image, which is neither
+//      modified nor freed. Without it, the image may be freed as soon as this
+//      returns.
+// =====================================================================================
+bspdata_t            *LoadBSPImage( const dheader_t* const image_header, const size_t image_length, const int flags )
+{
+        unsigned int     i;
+
+        if ( image_length < sizeof( dheader_t ) )
+        {
+                Error( "Not a valid PBSP file. File is only %i bytes long", (int)image_length );
+        }
+
+        // Swap a private copy of the header, the image may be read-only.
+        dheader_t header_copy;
+        memcpy( &header_copy, image_header, sizeof( dheader_t ) );
+        dheader_t *header = &header_copy;
+        for ( i = 0; i < sizeof( dheader_t ) / 4; i++ )
+        {
+                ( (int*)header )[i] = LittleLong( ( (int*)header )[i] );
+        }
+
+        if ( header->ident != PBSP_MAGIC )
+        {
+                Error( "Not a valid PBSP file. Ident of file is %i, not %i", header->ident, PBSP_MAGIC );
+        }
+
+        if ( header->version != BSPVERSION )
+        {
+                Error( "BSP is version %i, not %i", header->version, BSPVERSION );
+        }
+
+        const byte *image = (const byte *)image_header;
+
+        bspdata_t *data = new bspdata_t( true );
+
+        data->nummodels = MapLump( LUMP_MODELS, data->dmodels, header, image, image_length, flags );
+        data->numvertexes = MapLump( LUMP_VERTEXES, data->dvertexes, header, image, image_length, flags );
+        data->numplanes = MapLump( LUMP_PLANES, data->dplanes, header, image, image_length, flags );
+        data->numleafs = MapLump( LUMP_LEAFS, data->dleafs, header, image, image_length, flags );
+        data->numnodes = MapLump( LUMP_NODES, data->dnodes, header, image, image_length, flags );
+        data->numtexinfo = MapLump( LUMP_TEXINFO, data->texinfo, header, image, image_length, flags );
+        data->numfaces = MapLump( LUMP_FACES, data->dfaces, header, image, image_length, flags );
+        data->nummarksurfaces = MapLump( LUMP_MARKSURFACES, data->dmarksurfaces, header, image, image_length, flags );
+        data->numsurfedges = MapLump( LUMP_SURFEDGES, data->dsurfedges, header, image, image_length, flags );
+        data->numedges = MapLump( LUMP_EDGES, data->dedges, header, image, image_length, flags );
+        data->numtexrefs = MapLump( LUMP_TEXTURES, data->dtexrefs, header, image, image_length, flags );
+        data->visdatasize = MapLump( LUMP_VISIBILITY, data->dvisdata, header, image, image_length, flags );
+        data->entdatasize = MapLump( LUMP_ENTITIES, data->dentdata, header, image, image_length, flags );
+
+        // The vector lumps are already sized to the file, they are just copied.
+        MapLump( LUMP_BRUSHES, data->dbrushes, header, image, image_length );
+        MapLump( LUMP_BRUSHSIDES, data->dbrushsides, header, image, image_length );
+        MapLump( LUMP_LEAFBRUSHES, data->dleafbrushes, header, image, image_length );
+        MapLump( LUMP_LEAFAMBIENTINDEX, data->leafambientindex, header, image, image_length );
+        MapLump( LUMP_LEAFAMBIENTLIGHTING, data->leafambientlighting, header, image, image_length );
+        MapLump( LUMP_BOUNCEDLIGHTING, data->bouncedlightdata, header, image, image_length );
+        MapLump( LUMP_DIRECTLIGHTING, data->lightdata, header, image, image_length );
+        MapLump( LUMP_DIRECTSUNLIGHTING, data->sunlightdata, header, image, image_length );
+        MapLump( LUMP_STATICPROPS, data->dstaticprops, header, image, image_length );
+        MapLump( LUMP_STATICPROPVERTEXDATA, data->dstaticpropvertexdatas, header, image, image_length );
+        MapLump( LUMP_STATICPROPLIGHTING, data->staticproplighting, header, image, image_length );
+        MapLump( LUMP_VERTNORMALS, data->vertnormals, header, image, image_length );
+        MapLump( LUMP_VERTNORMALINDICES, data->vertnormalindices, header, image, image_length );
+        MapLump( LUMP_CUBEMAPDATA, data->cubemapdata, header, image, image_length );
+        MapLump( LUMP_CUBEMAPS, data->cubemaps, header, image, image_length );
+
+#ifdef WORDS_BIGENDIAN
+        // Nothing was mapped in place on a big endian host.
+        SwapBSPFile( data, false );
+#endif
+
+        // The checksums are only used by the compile tools, don't walk every
+        // lump (and fault in every mapped page) just to compute them.
+        data->dmodels_checksum = 0;
+        data->dvertexes_checksum = 0;
+        data->dplanes_checksum = 0;
+        data->dleafs_checksum = 0;
+        data->dnodes_checksum = 0;
+        data->texinfo_checksum = 0;
+        data->dfaces_checksum = 0;
+        data->dorigfaces_checksum = 0;
+        data->dmarksurfaces_checksum = 0;
+        data->dsurfedges_checksum = 0;
+        data->dedges_checksum = 0;
+        data->dtexrefs_checksum = 0;
+        data->dvisdata_checksum = 0;
+        data->dlightdata_checksum = 0;
+        data->dentdata_checksum = 0;
+
+        return data;
+}
+
 //
 // =====================================================================================
 //
@@ -1015,7 +1290,7 @@ return NULL;
 #endif
 */
 
-#define ENTRIES(a)		(sizeof(a)/sizeof(*(a)))
+#define ENTRIES(a)		((a).get_max_entries())
 #define ENTRYSIZE(a)	(sizeof(*(a)))
 
 // =====================================================================================
@@ -1075,8 +1350,8 @@ void            PrintBSPFileSizes(bspdata_t *data)
         totalmemory += ArrayUsage( "texrefs", data->numtexrefs, ENTRIES( data->dtexrefs ), ENTRYSIZE( data->dtexrefs ) );
 
         totalmemory += GlobUsage( "lightdata", data->lightdata.size(), g_max_map_lightdata );
-        totalmemory += GlobUsage( "visdata", data->visdatasize, sizeof( data->dvisdata ) );
-        totalmemory += GlobUsage( "entdata", data->entdatasize, sizeof( data->dentdata ) );
+        totalmemory += GlobUsage( "visdata", data->visdatasize, data->dvisdata.get_max_entries() );
+        totalmemory += GlobUsage( "entdata", data->entdatasize, data->dentdata.get_max_entries() );
         if ( numallocblocks == -1 )
         {
                 Log( "* AllocBlock    [ not available to the " PLATFORM_VERSIONSTRING " version ]\n" );
@@ -1141,7 +1416,7 @@ bool            ParseEntity(bspdata_t *data)
                 Error( "ParseEntity: { not found" );
         }
 
-        if ( data->numentities == MAX_MAP_ENTITIES )
+        if ( data->numentities == data->entities.get_capacity() )
         {
                 Error( "data->numentities == MAX_MAP_ENTITIES" );
         }
@@ -1205,6 +1480,22 @@ bool            ParseEntity(bspdata_t *data)
 void            ParseEntities(bspdata_t *data)
 {
         data->numentities = 0;
+
+        if ( data->entities.get_capacity() == 0 )
+        {
+                // A compact bspdata_t has no entity storage yet. Every entity
+                // opens with a brace, so the brace count bounds the entity count.
+                int numbraces = 0;
+                for ( int i = 0; i < data->entdatasize; i++ )
+                {
+                        if ( data->dentdata[i] == '{' )
+                        {
+                                numbraces++;
+                        }
+                }
+                data->entities.alloc( std::min( numbraces, MAX_MAP_ENTITIES ) );
+        }
+
         ParseFromMemory( data->dentdata, data->entdatasize );
 
         while ( ParseEntity(data) )
@@ -1311,7 +1602,7 @@ void            UnparseEntities(bspdata_t *data)
 
                         if ( !strcmp( ValueForKey( mapent, "classname" ), "info_sunlight" ) )
                         {
-                                if ( data->numentities == MAX_MAP_ENTITIES )
+                                if ( data->numentities == data->entities.get_capacity() )
                                 {
                                         Error( "data->numentities == MAX_MAP_ENTITIES" );
                                 }
@@ -435,62 +435,167 @@ entity_t;
 // BSP File Data
 //
 
+// =====================================================================================
+//  bsplump_t
+//      Storage for one of the fixed-layout lumps in bspdata_t.
+//
+//      The compile tools fill these in place up to the MAX_MAP_* design limit,
+//      so a full-size bspdata_t gives every lump MaxEntries elements up front.
+//      The runtime loader instead sizes each lump to the count in the file, or
+//      points it straight at the lump inside a .bsp image it keeps resident, in
+//      which case the lump does not own (and will not free) its elements.
+// =====================================================================================
+template<class T, int MaxEntries>
+class bsplump_t
+{
+public:
+        bsplump_t() :
+                _data( nullptr ),
+                _capacity( 0 ),
+                _owned( false )
+        {
+        }
+
+        ~bsplump_t()
+        {
+                clear();
+        }
+
+        void clear()
+        {
+                if ( _owned )
+                        delete[] _data;
+                _data = nullptr;
+                _capacity = 0;
+                _owned = false;
+        }
+
+        void alloc( int count )
+        {
+                clear();
+                // Always hand out a valid pointer, even for an empty lump.
+                _data = new T[count > 0 ? count : 1];
+                _capacity = count;
+                _owned = true;
+        }
+
+        void alloc_max()
+        {
+                alloc( MaxEntries );
+        }
+
+        void set_view( const T *data, int count )
+        {
+                clear();
+                // The image is mapped copy-on-write, so it is safe to hand out
+                // a non-const pointer to it.
+                _data = const_cast<T *>( data );
+                _capacity = count;
+                _owned = false;
+        }
+
+        T &operator []( size_t i )
+        {
+                return _data[i];
+        }
+        const T &operator []( size_t i ) const
+        {
+                return _data[i];
+        }
+
+        operator T *()
+        {
+                return _data;
+        }
+        operator const T *() const
+        {
+                return _data;
+        }
+
+        int get_capacity() const
+        {
+                return _capacity;
+        }
+        bool is_view() const
+        {
+                return _data != nullptr && !_owned;
+        }
+
+        static int get_max_entries()
+        {
+                return MaxEntries;
+        }
+
+private:
+        bsplump_t( const bsplump_t & ) = delete;
+        bsplump_t &operator =( const bsplump_t & ) = delete;
+
+        T *_data;
+        int _capacity;
+        bool _owned;
+};
+
 struct bspdata_t
 {
+        // By default every fixed-layout lump is allocated at its MAX_MAP_*
+        // limit, which is what the compile tools expect. A compact bspdata_t
+        // starts with empty lumps so the loader can size them to the file.
+        bspdata_t( bool compact = false );
+
         int      nummodels;
-        dmodel_t dmodels[MAX_MAP_MODELS];
+        bsplump_t<dmodel_t, MAX_MAP_MODELS> dmodels;
         int      dmodels_checksum;
 
         int      visdatasize;
-        byte     dvisdata[MAX_MAP_VISIBILITY];
+        bsplump_t<byte, MAX_MAP_VISIBILITY> dvisdata;
         int      dvisdata_checksum;
 
         int      numtexrefs;
-        texref_t dtexrefs[MAX_MAP_TEXTURES];                                  // (dtexlump_t)
+        bsplump_t<texref_t, MAX_MAP_TEXTURES> dtexrefs;                      // (dtexlump_t)
         int      dtexrefs_checksum;
 
         int      entdatasize;
-        char     dentdata[MAX_MAP_ENTSTRING];
+        bsplump_t<char, MAX_MAP_ENTSTRING> dentdata;
         int      dentdata_checksum;
 
         int      numleafs;
-        dleaf_t  dleafs[MAX_MAP_LEAFS];
+        bsplump_t<dleaf_t, MAX_MAP_LEAFS> dleafs;
         int      dleafs_checksum;
 
         int      numplanes;
-        dplane_t dplanes[MAX_INTERNAL_MAP_PLANES];
+        bsplump_t<dplane_t, MAX_INTERNAL_MAP_PLANES> dplanes;
         int      dplanes_checksum;
 
         int      numvertexes;
-        dvertex_t dvertexes[MAX_MAP_VERTS];
+        bsplump_t<dvertex_t, MAX_MAP_VERTS> dvertexes;
         int      dvertexes_checksum;
 
         int      numnodes;
-        dnode_t  dnodes[MAX_MAP_NODES];
+        bsplump_t<dnode_t, MAX_MAP_NODES> dnodes;
         int      dnodes_checksum;
 
         int      numtexinfo;
-        texinfo_t texinfo[MAX_INTERNAL_MAP_TEXINFO];
+        bsplump_t<texinfo_t, MAX_INTERNAL_MAP_TEXINFO> texinfo;
         int      texinfo_checksum;
 
         int      numfaces;
-        dface_t  dfaces[MAX_MAP_FACES];
+        bsplump_t<dface_t, MAX_MAP_FACES> dfaces;
         int      dfaces_checksum;
 
         int	numorigfaces;
-        dface_t	dorigfaces[MAX_MAP_FACES];
+        bsplump_t<dface_t, MAX_MAP_FACES> dorigfaces;
         int	dorigfaces_checksum;
 
         int      numedges;
-        dedge_t  dedges[MAX_MAP_EDGES];
+        bsplump_t<dedge_t, MAX_MAP_EDGES> dedges;
         int      dedges_checksum;
 
         int      nummarksurfaces;
-        unsigned short dmarksurfaces[MAX_MAP_MARKSURFACES];
+        bsplump_t<unsigned short, MAX_MAP_MARKSURFACES> dmarksurfaces;
         int      dmarksurfaces_checksum;
 
         int      numsurfedges;
-        int      dsurfedges[MAX_MAP_SURFEDGES];
+        bsplump_t<int, MAX_MAP_SURFEDGES> dsurfedges;
         int      dsurfedges_checksum;
 
         pvector<dleafambientlighting_t> leafambientlighting;
@@ -512,7 +617,18 @@ struct bspdata_t
 	int      dlightdata_checksum;
 
         int      numentities;
-        entity_t entities[MAX_MAP_ENTITIES];
+        bsplump_t<entity_t, MAX_MAP_ENTITIES> entities;
+};
+
+// Flags for LoadBSPImage()
+enum
+{
+        // Size each lump to its count in the file instead of MAX_MAP_*.
+        BSPLOAD_COMPACT         = 1 << 0,
+        // Point lumps directly into the image instead of copying them out.
+        // The caller keeps the image alive for the lifetime of the bspdata_t.
+        // Implies BSPLOAD_COMPACT.
+        BSPLOAD_NOCOPY          = 1 << 1,
 };
 
 extern _BSPEXPORT bspdata_t *g_bspdata;
@@ -521,7 +637,44 @@ extern _BSPEXPORT void     DecompressVis( bspdata_t *data, const byte* src, byte
 extern _BSPEXPORT int      CompressVis( const byte* const src, const unsigned int src_length,
                              byte* dest, unsigned int dest_length );
 
+// Optional uncompressed PVS, appended after the compressed rows in
+// LUMP_VISIBILITY by p3vis -pvsmatrix. Leafs with identical PVS rows
+// share a cluster, and each cluster has one dense row of little endian
+// words where bit n is leaf n + 1, like a decompressed row. Tools that
+// only follow visofs never see it.
+#define PVSMATRIX_MAGIC ( ( 'M' << 24 ) + ( 'S' << 16 ) + ( 'V' << 8 ) + 'P' )
+
+struct dvismatrix_t
+{
+        int magic;
+        int numleafs;                   // including the solid leaf 0
+        int numclusters;
+        int rowwords;
+
+        // followed by int leafclusters[numleafs]
+        // and unsigned int rows[numclusters][rowwords]
+
+        const int *get_leaf_clusters() const
+        {
+                return (const int *)( this + 1 );
+        }
+        const unsigned int *get_rows() const
+        {
+                return (const unsigned int *)( get_leaf_clusters() + numleafs );
+        }
+};
+
+// The last two ints of the lump when a matrix is present.
+struct dvismatrixfooter_t
+{
+        int magic;
+        int ofs;                        // of the dvismatrix_t in the lump
+};
+
+extern _BSPEXPORT const dvismatrix_t *GetVisMatrix( const bspdata_t *data );
+
 extern _BSPEXPORT bspdata_t     *LoadBSPImage( dheader_t* header );
+extern _BSPEXPORT bspdata_t     *LoadBSPImage( const dheader_t* header, size_t image_length, int flags );
 extern _BSPEXPORT bspdata_t     *LoadBSPFile( const char* const filename );
 extern _BSPEXPORT void     WriteBSPFile( bspdata_t *data, const char* const filename );
 extern _BSPEXPORT void     PrintBSPFileSizes( bspdata_t *data );
@@ -1,7 +1,9 @@
 #ifndef BSPCOMMON_CONFIG_H_
 #define BSPCOMMON_CONFIG_H_
 
-#ifdef BUILDING_BSPCOMMON
+#ifndef _WIN32
+#define _BSPEXPORT
+#elif defined(BUILDING_BSPCOMMON)
 #define _BSPEXPORT __declspec(dllexport)
 #else
 #define _BSPEXPORT __declspec(dllimport)
@@ -15,20 +15,20 @@
 #include "blockmem.h"
 
 #ifdef SYSTEM_POSIX
-#ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
-#endif
-#ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #include <pthread.h>
 #endif
-#ifdef HAVE_PTHREAD_H
-#include <pthread.h>
-#endif
-#endif
 
 #include "hlassert.h"
 
+#include <lightMutexHolder.h>
+#include <atomicAdjust.h>
+#include <thread>
+
+// Index of the worker thread we are running on, -1 outside of RunThreadsOn.
+static thread_local int t_threadnum = -1;
+
 BSPThread::BSPThread() :
         Thread( "bspthread", "bspthread_sync" ),
         _func( nullptr ),
@@ -40,6 +40,7 @@ BSPThread::BSPThread() :
 void BSPThread::thread_main()
 {
         //Thread::thread_main();
+        t_threadnum = _val;
         ( *_func )( _val );
         _finished = true;
 }
@@ -66,133 +67,278 @@ pvector<PT( BSPThread )> g_threadhandles;
 #define THREADTIMES_SIZE 100
 #define THREADTIMES_SIZEf (float)(THREADTIMES_SIZE)
 
-static int      dispatch = 0;
 static int      workcount = 0;
-static int      oldf = 0;
 static bool     pacifier = false;
 static bool     threaded = false;
 static double   threadstart = 0;
 static double   threadtimes[THREADTIMES_SIZE];
 
-int             GetThreadWork()
+// Number of work items handed out, and the last percentage reported.
+static AtomicAdjust::Integer dispatch = 0;
+static AtomicAdjust::Integer oldf = 0;
+
+// =====================================================================================
+//  Work-stealing dispatch
+//
+//  The work items are split up front into one contiguous range per thread. A thread
+//  takes items off the front of its own range a chunk at a time, so it only touches
+//  shared state once per chunk. When its range runs dry it steals the back half of the
+//  fullest remaining range. Each range has its own lock, so threads only contend when
+//  stealing.
+// =====================================================================================
+
+// Most items a thread takes from its own range at once.
+#define MAX_WORK_CHUNK 32
+
+struct workqueue_t
 {
-        int             r, f, i;
-        double          ct, finish, finish2, finish3;
-        static const char *s1 = NULL; // avoid frequent call of Localize() in PrintConsole
-        static const char *s2 = NULL;
+        // Remaining slots that other threads may steal, guarded by lock.
+        LightMutex lock;
+        int begin;
+        int end;
 
-        ThreadLock();
-        if ( s1 == NULL )
-                s1 = Localize( "  (%d%%: est. time to completion %ld/%ld/%ld secs)   " );
-        if ( s2 == NULL )
-                s2 = Localize( "  (%d%%: est. time to completion <1 sec)   " );
+        // The chunk the owning thread is working through, only touched by the owner.
+        int local_begin;
+        int local_end;
 
-        if ( dispatch == 0 )
+        // Keep each queue on its own cache line.
+        char pad[64];
+};
+
+static workqueue_t workqueues[MAX_THREADS];
+static int      numworkqueues = 0;
+
+// Maps slots to work items when the work was ordered by cost, otherwise empty.
+static pvector<int> workorder;
+
+static int      GetWorkQueueCount()
+{
+        return std::max( 1, std::min( g_numthreads, MAX_THREADS ) );
+}
+
+// =====================================================================================
+//  SetupThreadWork
+//      Splits workcnt items among the threads. If costfunc is given, the items are
+//      handed out most expensive first and split so each thread starts with the same
+//      total cost.
+// =====================================================================================
+static void     SetupThreadWork( int workcnt, q_threadcostfunction *costfunc )
+{
+        workcount = workcnt;
+        AtomicAdjust::set( dispatch, 0 );
+        AtomicAdjust::set( oldf, -1 );
+
+        numworkqueues = GetWorkQueueCount();
+        workorder.clear();
+
+        if ( costfunc == nullptr || workcnt <= numworkqueues )
+        {
+                for ( int i = 0; i < numworkqueues; i++ )
+                {
+                        workqueue_t *q = &workqueues[i];
+                        q->begin = (int)( (int64_t)workcnt * i / numworkqueues );
+                        q->end = (int)( (int64_t)workcnt * ( i + 1 ) / numworkqueues );
+                        q->local_begin = q->local_end = 0;
+                }
+                return;
+        }
+
+        pvector<std::pair<float, int>> costs( workcnt );
+        for ( int i = 0; i < workcnt; i++ )
         {
-                oldf = 0;
+                costs[i] = std::make_pair( costfunc( i ), i );
         }
+        std::sort( costs.begin(), costs.end(), std::greater<std::pair<float, int>>() );
 
-        if ( dispatch > workcount )
+        // Give each item to the thread with the least work so far.
+        pvector<double> load( numworkqueues, 0.0 );
+        pvector<pvector<int>> assigned( numworkqueues );
+        for ( int i = 0; i < workcnt; i++ )
         {
-                Developer( DEVELOPER_LEVEL_ERROR, "dispatch > workcount!!!\n" );
-                ThreadUnlock();
-                return -1;
+                int best = (int)( std::min_element( load.begin(), load.end() ) - load.begin() );
+                load[best] += std::max( costs[i].first, 0.0f );
+                assigned[best].push_back( costs[i].second );
         }
-        if ( dispatch == workcount )
+
+        workorder.reserve( workcnt );
+        for ( int i = 0; i < numworkqueues; i++ )
         {
-                Developer( DEVELOPER_LEVEL_MESSAGE, "dispatch == workcount, work is complete\n" );
-                ThreadUnlock();
-                return -1;
+                workqueue_t *q = &workqueues[i];
+                q->begin = (int)workorder.size();
+                workorder.insert( workorder.end(), assigned[i].begin(), assigned[i].end() );
+                q->end = (int)workorder.size();
+                q->local_begin = q->local_end = 0;
         }
-        if ( dispatch < 0 )
+}
+
+// =====================================================================================
+//  StealThreadWork
+//      Moves the back half of the fullest other range into thread's own range.
+//      Returns false if there is no work left anywhere.
+// =====================================================================================
+static bool     StealThreadWork( int thread )
+{
+        while ( true )
         {
-                Developer( DEVELOPER_LEVEL_ERROR, "negative dispatch!!!\n" );
-                ThreadUnlock();
-                return -1;
+                int victim = -1;
+                int most = 0;
+                for ( int i = 0; i < numworkqueues; i++ )
+                {
+                        if ( i == thread )
+                        {
+                                continue;
+                        }
+                        // Racy peek, we check again under the lock.
+                        int left = workqueues[i].end - workqueues[i].begin;
+                        if ( left > most )
+                        {
+                                most = left;
+                                victim = i;
+                        }
+                }
+
+                if ( victim == -1 )
+                {
+                        return false;
+                }
+
+                int begin, end;
+                {
+                        LightMutexHolder holder( workqueues[victim].lock );
+                        workqueue_t *q = &workqueues[victim];
+                        int left = q->end - q->begin;
+                        if ( left <= 0 )
+                        {
+                                // Somebody beat us to it, look again.
+                                continue;
+                        }
+                        int take = ( left + 1 ) / 2;
+                        end = q->end;
+                        begin = end - take;
+                        q->end = begin;
+                }
+
+                LightMutexHolder holder( workqueues[thread].lock );
+                workqueues[thread].begin = begin;
+                workqueues[thread].end = end;
+                return true;
         }
+}
 
-        f = THREADTIMES_SIZE * dispatch / workcount;
+static void     PrintThreadProgress( int r )
+{
+        int             f, i, last;
+        double          ct, finish, finish2, finish3;
+        static const char *s1 = NULL; // avoid frequent call of Localize() in PrintConsole
+        static const char *s2 = NULL;
+
+        f = (int)( (int64_t)THREADTIMES_SIZE * r / workcount );
+        last = AtomicAdjust::get( oldf );
         if ( pacifier )
         {
                 printf
-                ( "\r%6d /%6d", dispatch, workcount );
+                ( "\r%6d /%6d", r, workcount );
+        }
+
+        // Only the thread that moves the percentage along reports it.
+        if ( f == last || AtomicAdjust::compare_and_exchange( oldf, last, f ) != last )
+        {
+                return;
+        }
+
+        if ( pacifier )
+        {
+                if ( s1 == NULL )
+                        s1 = Localize( "  (%d%%: est. time to completion %ld/%ld/%ld secs)   " );
+                if ( s2 == NULL )
+                        s2 = Localize( "  (%d%%: est. time to completion <1 sec)   " );
 
-                if ( f != oldf )
+                ct = I_FloatTime();
+                /* Fill in current time for threadtimes record */
+                for ( i = std::max( last, 0 ); i <= f; i++ )
                 {
-                        ct = I_FloatTime();
-                        /* Fill in current time for threadtimes record */
-                        for ( i = oldf; i <= f; i++ )
+                        if ( threadtimes[i] < 1 )
                         {
-                                if ( threadtimes[i] < 1 )
-                                {
-                                        threadtimes[i] = ct;
-                                }
+                                threadtimes[i] = ct;
                         }
-                        oldf = f;
+                }
 
-                        if ( f > 10 )
-                        {
-                                finish = ( ct - threadtimes[0] ) * ( THREADTIMES_SIZEf - f ) / f;
-                                finish2 = 10.0 * ( ct - threadtimes[f - 10] ) * ( THREADTIMES_SIZEf - f ) / THREADTIMES_SIZEf;
-                                finish3 = THREADTIMES_SIZEf * ( ct - threadtimes[f - 1] ) * ( THREADTIMES_SIZEf - f ) / THREADTIMES_SIZEf;
+                if ( f > 10 )
+                {
+                        finish = ( ct - threadtimes[0] ) * ( THREADTIMES_SIZEf - f ) / f;
+                        finish2 = 10.0 * ( ct - threadtimes[f - 10] ) * ( THREADTIMES_SIZEf - f ) / THREADTIMES_SIZEf;
+                        finish3 = THREADTIMES_SIZEf * ( ct - threadtimes[f - 1] ) * ( THREADTIMES_SIZEf - f ) / THREADTIMES_SIZEf;
 
-                                if ( finish > 1.0 )
-                                {
-                                        printf
-                                        ( s1, f, (long)( finish ), (long)( finish2 ),
-                                                (long)( finish3 ) );
-                                }
-                                else
-                                {
-                                        printf
-                                        ( s2, f );
+                        if ( finish > 1.0 )
+                        {
+                                printf
+                                ( s1, f, (long)( finish ), (long)( finish2 ),
+                                        (long)( finish3 ) );
+                        }
+                        else
+                        {
+                                printf
+                                ( s2, f );
 
-                                }
                         }
                 }
         }
         else
         {
-                if ( f != oldf )
+                for ( i = last / 10 + 1; i <= f / 10; i++ )
                 {
-                        oldf = f;
-                        switch ( f )
+                        if ( i > 0 )
                         {
-                        case 10:
-                        case 20:
-                        case 30:
-                        case 40:
-                        case 50:
-                        case 60:
-                        case 70:
-                        case 80:
-                        case 90:
-                        case 100:
-                                /*
-                                case 5:
-                                case 15:
-                                case 25:
-                                case 35:
-                                case 45:
-                                case 55:
-                                case 65:
-                                case 75:
-                                case 85:
-                                case 95:
-                                */
                                 printf
-                                ( "%d%%...", f );
-                        default:
-                                break;
+                                ( "%d%%...", i * 10 );
                         }
                 }
         }
+}
 
-        r = dispatch;
-        dispatch++;
+int             GetThreadWork()
+{
+        int thread = std::max( 0, std::min( GetCurrentThreadNumber(), numworkqueues - 1 ) );
+        workqueue_t *q = &workqueues[thread];
 
-        ThreadUnlock();
-        return r;
+        if ( q->local_begin == q->local_end )
+        {
+                // Grab the next chunk of our own range, stealing more if we ran out.
+                while ( true )
+                {
+                        {
+                                LightMutexHolder holder( q->lock );
+                                int left = q->end - q->begin;
+                                if ( left > 0 )
+                                {
+                                        // Take smaller chunks as the range drains, so there is
+                                        // still something left to steal near the end.
+                                        int take = std::max( 1, std::min( left / ( 2 * numworkqueues ), MAX_WORK_CHUNK ) );
+                                        q->local_begin = q->begin;
+                                        q->local_end = q->begin + take;
+                                        q->begin += take;
+                                        break;
+                                }
+                        }
+
+                        if ( !StealThreadWork( thread ) )
+                        {
+                                Developer( DEVELOPER_LEVEL_MESSAGE, "dispatch == workcount, work is complete\n" );
+                                return -1;
+                        }
+                }
+        }
+
+        int slot = q->local_begin++;
+        int r = AtomicAdjust::add( dispatch, 1 ) - 1;
+        PrintThreadProgress( r );
+
+        return workorder.empty() ? slot : workorder[slot];
+}
+
+int             GetCurrentThreadNumber()
+{
+        return std::max( t_threadnum, 0 );
 }
 
 q_threadfunction *workfunction;
@@ -215,10 +361,25 @@ static void     ThreadWorkerFunction( int unused )
 #pragma warning(pop)
 #endif
 
-void            RunThreadsOnIndividual( int workcnt, bool showpacifier, q_threadfunction func )
+void            RunThreadsOnIndividual( int workcnt, bool showpacifier, q_threadfunction func,
+                                        q_threadcostfunction *costfunc )
 {
         workfunction = func;
-        RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction );
+        RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction, costfunc );
+}
+
+// =====================================================================================
+//  GetHardwareThreadCount
+//      Number of threads to use when the user didn't ask for a number.
+// =====================================================================================
+static int      GetHardwareThreadCount()
+{
+        int count = (int)std::thread::hardware_concurrency();
+        if ( count < 1 )
+        {
+                count = 1;
+        }
+        return std::min( count, MAX_THREADS );
 }
 
 #ifndef SINGLE_THREADED
@@ -235,24 +396,6 @@ int             g_numthreads = DEFAULT_NUMTHREADS;
 static CRITICAL_SECTION crit;
 static int      enter;
 
-int GetCurrentThreadNumber()
-{
-        Thread *th = Thread::get_current_thread();
-
-        int num = 0;
-
-        for ( size_t i = 0; i < g_threadhandles.size(); i++ )
-        {
-                if ( g_threadhandles[i] == th )
-                {
-                        num = i;
-                        break;
-                }
-        }
-
-        return num;
-}
-
 void            ThreadSetPriority( ThreadPriority type )
 {
         /*
@@ -308,16 +451,9 @@ static void     AdjustPriority( HANDLE hThread )
 
 void            ThreadSetDefault()
 {
-        SYSTEM_INFO     info;
-
         if ( g_numthreads == -1 )                                // not set manually
         {
-                GetSystemInfo( &info );
-                g_numthreads = info.dwNumberOfProcessors;
-                if ( g_numthreads < 1 || g_numthreads > 32 )
-                {
-                        g_numthreads = 1;
-                }
+                g_numthreads = GetHardwareThreadCount();
         }
 }
 
@@ -370,7 +506,8 @@ void            threads_UninitCrit()
         //DeleteCriticalSection(&crit);
 }
 
-void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction func )
+void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction func,
+                              q_threadcostfunction *costfunc )
 {
         string           threadid[MAX_THREADS];
         int             i;
@@ -384,24 +521,22 @@ void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction f
         {
                 threadtimes[i] = 0;
         }
-        dispatch = 0;
-        workcount = workcnt;
-        oldf = -1;
+        if ( workcnt < 0 )
+        {
+                Developer( DEVELOPER_LEVEL_ERROR, "RunThreadsOn: Workcount(%i) < 0\n", workcnt );
+        }
+        hlassume( workcnt >= 0, assume_BadWorkcount );
+
+        SetupThreadWork( workcnt, costfunc );
         pacifier = showpacifier;
         threaded = true;
         q_entry = func;
 
-        if ( workcount < dispatch )
-        {
-                Developer( DEVELOPER_LEVEL_ERROR, "RunThreadsOn: Workcount(%i) < dispatch(%i)\n", workcount, dispatch );
-        }
-        hlassume( workcount >= dispatch, assume_BadWorkcount );
-
         //
         // Create all the threads (suspended)
         //
         threads_InitCrit();
-        for ( i = 0; i < g_numthreads; i++ )
+        for ( i = 0; i < numworkqueues; i++ )
         {
                 /*
                 HANDLE          hThread = CreateThread(NULL,
@@ -505,7 +640,7 @@ void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction f
 
 int             g_numthreads = DEFAULT_NUMTHREADS;
 
-void            ThreadSetPriority( q_threadpriority type )
+void            ThreadSetPriority( ThreadPriority type )
 {
         int             val;
 
@@ -515,15 +650,16 @@ void            ThreadSetPriority( q_threadpriority type )
         // Unless you are root -high is useless . . . 
         switch ( g_threadpriority )
         {
-        case eThreadPriorityLow:
+        case TP_low:
                 val = PRIO_MAX;
                 break;
 
-        case eThreadPriorityHigh:
+        case TP_high:
+        case TP_urgent:
                 val = PRIO_MIN;
                 break;
 
-        case eThreadPriorityNormal:
+        case TP_normal:
         default:
                 val = 0;
                 break;
@@ -535,7 +671,7 @@ void            ThreadSetDefault()
 {
         if ( g_numthreads == -1 )
         {
-                g_numthreads = 1;
+                g_numthreads = GetHardwareThreadCount();
         }
 }
 
@@ -558,10 +694,11 @@ void            ThreadUnlock()
         }
 }
 
-q_threadfunction q_entry;
+q_threadfunction *q_entry;
 
 static void*    CDECL ThreadEntryStub( void* pParam )
 {
+        t_threadnum = (int)(intptr_t)pParam;
         q_entry( (int)(intptr_t)pParam );
         return NULL;
 }
@@ -595,7 +732,8 @@ void            threads_UninitCrit()
 * RunThreadsOn
 * =============
 */
-void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction func )
+void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction func,
+                              q_threadcostfunction *costfunc )
 {
         int             i;
         pthread_t       work_threads[MAX_THREADS];
@@ -610,9 +748,7 @@ void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction f
                 threadtimes[i] = 0;
         }
 
-        dispatch = 0;
-        workcount = workcnt;
-        oldf = -1;
+        SetupThreadWork( workcnt, costfunc );
         pacifier = showpacifier;
         threaded = true;
         q_entry = func;
@@ -635,15 +771,15 @@ void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction f
         }
 #endif
 
-        for ( i = 0; i < g_numthreads; i++ )
+        for ( i = 0; i < numworkqueues; i++ )
         {
-                if ( pthread_create( &work_threads[i], &attrib, ThreadEntryStub, (void*)i ) == -1 )
+                if ( pthread_create( &work_threads[i], &attrib, ThreadEntryStub, (void*)(intptr_t)i ) != 0 )
                 {
                         Error( "pthread_create failed" );
                 }
         }
 
-        for ( i = 0; i < g_numthreads; i++ )
+        for ( i = 0; i < numworkqueues; i++ )
         {
                 if ( pthread_join( work_threads[i], &status ) == -1 )
                 {
@@ -681,7 +817,7 @@ void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction f
 
 int             g_numthreads = 1;
 
-void            ThreadSetPriority( q_threadpriority type )
+void            ThreadSetPriority( ThreadPriority type )
 {
 }
 
@@ -706,14 +842,14 @@ void            ThreadUnlock()
 {
 }
 
-void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction func )
+void            RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction func,
+                              q_threadcostfunction *costfunc )
 {
         int             i;
         double          start, end;
 
-        dispatch = 0;
-        workcount = workcnt;
-        oldf = -1;
+        g_numthreads = 1;
+        SetupThreadWork( workcnt, costfunc );
         pacifier = showpacifier;
         threadstart = I_FloatTime();
         start = threadstart;
@@ -15,13 +15,11 @@
 #define	MAX_THREADS	64
 
 typedef void q_threadfunction( int );
+// Relative cost of a work item, used to balance work across the threads.
+typedef float q_threadcostfunction( int );
 
-#ifdef _WIN32
+// -1 means one thread per hardware thread.
 #define DEFAULT_NUMTHREADS -1
-#endif
-#ifdef SYSTEM_POSIX
-#define DEFAULT_NUMTHREADS 1
-#endif
 
 class _BSPEXPORT BSPThread : public Thread
 {
@@ -55,8 +53,10 @@ extern _BSPEXPORT int      GetThreadWork();
 extern _BSPEXPORT void     ThreadLock();
 extern _BSPEXPORT void     ThreadUnlock();
 
-extern _BSPEXPORT void     RunThreadsOnIndividual( int workcnt, bool showpacifier, q_threadfunction );
-extern _BSPEXPORT void     RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction );
+extern _BSPEXPORT void     RunThreadsOnIndividual( int workcnt, bool showpacifier, q_threadfunction,
+                                                   q_threadcostfunction *costfunc = nullptr );
+extern _BSPEXPORT void     RunThreadsOn( int workcnt, bool showpacifier, q_threadfunction,
+                                         q_threadcostfunction *costfunc = nullptr );
 
 #ifdef ZHLT_NETVIS
 extern _BSPEXPORT void     threads_InitCrit();
@@ -65,5 +65,7 @@ extern _BSPEXPORT void     threads_UninitCrit();
 
 #define NamedRunThreadsOn(n,p,f) { printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
 #define NamedRunThreadsOnIndividual(n,p,f) { printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define NamedRunThreadsOnWeighted(n,p,f,c) { printf("%-20s ", #f ":"); RunThreadsOn(n,p,f,c); }
+#define NamedRunThreadsOnIndividualWeighted(n,p,f,c) { printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f,c); }
 
 #endif //**/ THREADS_H__
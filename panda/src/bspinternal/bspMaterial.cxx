@@ -28,14 +28,18 @@ TypeHandle BSPMaterial::_type_handle;
 BSPMaterial::materialcache_t BSPMaterial::_material_cache;
 
 const BSPMaterial *BSPMaterial::get_from_file(const Filename &file) {
-  LightReMutexHolder holder(g_matmutex);
-
-  int idx = _material_cache.find(file);
-  if (idx != -1) {
-    // We've already loaded this material file.
-    return _material_cache.get_data(idx);
+  {
+    LightReMutexHolder holder(g_matmutex);
+    int idx = _material_cache.find(file);
+    if (idx != -1) {
+      // We've already loaded this material file.
+      return _material_cache.get_data(idx);
+    }
   }
 
+  // The file is read and parsed without holding the lock, so materials can
+  // be loaded on several threads at once.
+
   VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
   if (!vfs->exists(file)) {
     bspmaterial_cat.error()
@@ -77,6 +81,10 @@ const BSPMaterial *BSPMaterial::get_from_file(const Filename &file) {
       for (size_t i = 0; i < include_mat->get_num_keyvalues(); i++) {
         mat->set_keyvalue(include_mat->get_key(i), include_mat->get_value(i));
       }
+      for (size_t i = 0; i < include_mat->_keyvalue_numbers.size(); i++) {
+        mat->_keyvalue_numbers[include_mat->_keyvalue_numbers.get_key(i)] =
+          include_mat->_keyvalue_numbers.get_data(i);
+      }
     } else {
       bspmaterial_cat.error()
         << "Patch material " << file << " didn't provide an $include\n";
@@ -88,6 +96,9 @@ const BSPMaterial *BSPMaterial::get_from_file(const Filename &file) {
 
   for (size_t i = 0; i < mat_kv->get_num_keys(); i++) {
     mat->set_keyvalue(mat_kv->get_key(i), mat_kv->get_value(i)); // "$basetexture"   "phase_3/maps/desat_shirt_1.jpg"
+    if (mat_kv->get_value_type(i) != CKeyValues::VT_string) {
+      mat->_keyvalue_numbers[mat_kv->get_key(i)] = mat_kv->get_value_numbers(i);
+    }
   }
 
   // Figure out these values and store
@@ -97,16 +108,34 @@ const BSPMaterial *BSPMaterial::get_from_file(const Filename &file) {
     mat->_surfaceprop = mat->get_keyvalue("$surfaceprop");
   if (mat->has_keyvalue("$contents"))
     mat->_contents = mat->get_keyvalue("$contents");
-  mat->_has_transparency = (mat->has_keyvalue("$translucent") && atoi(mat->get_keyvalue("$translucent").c_str()) == 1) ||
-    (mat->has_keyvalue("$alpha") && atof(mat->get_keyvalue("$alpha").c_str()) < 1.0);
+  mat->_has_transparency = (mat->has_keyvalue("$translucent") && mat->get_keyvalue_int("$translucent") == 1) ||
+    (mat->has_keyvalue("$alpha") && mat->get_keyvalue_float("$alpha") < 1.0);
   mat->_has_bumpmap = mat->has_keyvalue("$bumpmap");
   // UNDONE: This is hardcoded, maybe define a global list of lightmapped shaders?
   mat->_lightmapped = mat->get_shader() == "LightmappedGeneric";
   mat->_skybox = mat->get_shader() == "SkyBox";
 
+  LightReMutexHolder holder(g_matmutex);
+  int idx = _material_cache.find(file);
+  if (idx != -1) {
+    // Another thread loaded it while we were.  Everyone gets the same one.
+    return _material_cache.get_data(idx);
+  }
   _material_cache[file] = mat;
 
   return mat;
 }
 
+/**
+ * Returns the keyvalue as a vector, e.g. "$envmaptint" "1 0.5 0.5".
+ */
+LVecBase3f BSPMaterial::get_keyvalue_3f(const std::string &key) const {
+  int n = _keyvalue_numbers.find(key);
+  if (n != -1 && _keyvalue_numbers.get_data(n).size() >= 3) {
+    const vector_float &numbers = _keyvalue_numbers.get_data(n);
+    return LVecBase3f(numbers[0], numbers[1], numbers[2]);
+  }
+  return CKeyValues::to_3f(get_keyvalue(key));
+}
+
 //====================================================================//
@@ -17,6 +17,8 @@
 #include "simpleHashMap.h"
 #include "pointerTo.h"
 #include "typedReferenceCount.h"
+#include "vector_float.h"
+#include "luse.h"
 
 #define DEFAULT_SHADER	"UnlitNoMat"
 
@@ -42,6 +44,7 @@ PUBLISHED:
     TypedReferenceCount(copy),
     _shader_name(copy._shader_name),
     _shader_keyvalues(copy._shader_keyvalues),
+    _keyvalue_numbers(copy._keyvalue_numbers),
     _file(copy._file),
     _has_env_cubemap(copy._has_env_cubemap),
     _cached_env_cubemap(copy._cached_env_cubemap),
@@ -57,6 +60,7 @@ PUBLISHED:
     TypedReferenceCount::operator = (copy);
     _shader_name = copy._shader_name;
     _shader_keyvalues = copy._shader_keyvalues;
+    _keyvalue_numbers = copy._keyvalue_numbers;
     _file = copy._file;
     _has_env_cubemap = copy._has_env_cubemap;
     _cached_env_cubemap = copy._cached_env_cubemap;
@@ -70,6 +74,7 @@ PUBLISHED:
 
   INLINE void set_keyvalue(const std::string &key, const std::string &value) {
     _shader_keyvalues[key] = value;
+    _keyvalue_numbers.remove(key);
   }
   INLINE std::string get_keyvalue(const std::string &key) const {
     return _shader_keyvalues.get_data(_shader_keyvalues.find(key));
@@ -85,11 +90,20 @@ PUBLISHED:
   }
 
   INLINE int get_keyvalue_int(const std::string &key) const {
+    int n = _keyvalue_numbers.find(key);
+    if (n != -1) {
+      return (int)_keyvalue_numbers.get_data(n)[0];
+    }
     return atoi(get_keyvalue(key).c_str());
   }
   INLINE float get_keyvalue_float(const std::string &key) const {
+    int n = _keyvalue_numbers.find(key);
+    if (n != -1) {
+      return _keyvalue_numbers.get_data(n)[0];
+    }
     return atof(get_keyvalue(key).c_str());
   }
+  LVecBase3f get_keyvalue_3f(const std::string &key) const;
 
   INLINE void set_shader(const std::string &shader_name) {
     _shader_name = shader_name;
@@ -148,6 +162,8 @@ private:
   std::string _surfaceprop;
   std::string _contents;
   SimpleHashMap<std::string, std::string, string_hash> _shader_keyvalues;
+  // The keyvalues that are numbers, already converted by CKeyValues.
+  SimpleHashMap<std::string, vector_float, string_hash> _keyvalue_numbers;
 
   typedef SimpleHashMap<std::string, CPT(BSPMaterial), string_hash> materialcache_t;
   static materialcache_t _material_cache;
@@ -19,10 +19,27 @@
 #include "keyValues.h"
 
 #include "virtualFileSystem.h"
+#include "configVariableBool.h"
+#include "datagram.h"
+#include "datagramIterator.h"
+#include "pmap.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
 
 NotifyCategoryDeclNoExport(keyvalues)
 NotifyCategoryDef(keyvalues, "")
 
+static ConfigVariableBool keyvalues_cache_compiled
+("keyvalues-cache-compiled", false,
+ PRC_DESC("When a KeyValues file is loaded from text, write the compiled form "
+          "next to it, so later loads don't have to parse it again."));
+
+// Compiled KeyValues file, see write_compiled().
+static const char kv_compiled_ident[4] = { 'K', 'V', 'B', 'C' };
+static const int kv_compiled_version = 1;
+
 enum {
 	KVTOKEN_NONE,
 	KVTOKEN_BLOCK_BEGIN,
@@ -265,7 +282,9 @@ void CKeyValues::parse(CKeyValuesTokenizer *tokenizer) {
 				child->parse(tokenizer);
 				_children.push_back(child);
 			} else if (token.type == KVTOKEN_STRING) {
-				_keyvalues[key] = token.data;
+				Value &value = _keyvalues[key];
+				value.str = token.data;
+				value.classified = false;
 			} else {
 				keyvalues_cat.error()
 					<< "Invalid token " << token.type << "\n";
@@ -289,7 +308,19 @@ void CKeyValues::parse(CKeyValuesTokenizer *tokenizer) {
 
 PT(CKeyValues) CKeyValues::load(const Filename &filename) {
 	VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
-	if (!vfs->exists(filename)) {
+
+	// Use the compiled form if it's there and was made from this source.
+	// A compiled file with no source next to it was shipped on its own.
+	Filename compiled = get_compiled_filename(filename);
+	PT(VirtualFile) source = vfs->get_file(filename);
+	if (vfs->exists(compiled)) {
+		PT(CKeyValues) kv = load_compiled(compiled, filename, source);
+		if (kv != nullptr) {
+			return kv;
+		}
+	}
+
+	if (source == nullptr) {
 		keyvalues_cat.error()
 			<< "Unable to find `" << filename.get_fullpath() << "`\n";
 		return nullptr;
@@ -310,9 +341,280 @@ PT(CKeyValues) CKeyValues::load(const Filename &filename) {
 		return nullptr;
 	}
 
+	if (keyvalues_cache_compiled) {
+		kv->write_compiled(compiled);
+	}
+
 	return kv;
 }
 
+/**
+ * Returns the name the compiled form of the indicated KeyValues file is kept
+ * under, e.g. foo.mat -> foo.matc.
+ */
+Filename CKeyValues::get_compiled_filename(const Filename &filename) {
+	Filename compiled = filename;
+	compiled.set_extension(filename.get_extension() + "c");
+	compiled.set_binary();
+	return compiled;
+}
+
+/**
+ * Works out if the value is a number or a list of numbers, and stores them.
+ */
+void CKeyValues::Value::classify() const {
+	classified = true;
+	type = VT_string;
+	numbers.clear();
+
+	const char *p = str.c_str();
+	bool is_int = true;
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == '[' || *p == ']') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+
+		char *end;
+		float num = strtof(p, &end);
+		if (end == p || (*end != '\0' && *end != ' ' && *end != '\t' && *end != ']') ||
+		    !std::isfinite(num)) {
+			// "inf", "nan" and anything that overflows stay strings.
+			numbers.clear();
+			return;
+		}
+		for (const char *c = p; c != end; c++) {
+			if (*c == '.' || *c == 'e' || *c == 'E') {
+				is_int = false;
+			}
+		}
+		if (is_int && (num > 16777216.0f || num < -16777216.0f)) {
+			// Wouldn't survive the trip through a float.
+			numbers.clear();
+			return;
+		}
+		numbers.push_back(num);
+		p = end;
+	}
+
+	if (numbers.empty()) {
+		return;
+	}
+
+	if (numbers.size() > 1) {
+		type = VT_vector;
+	} else if (is_int) {
+		type = VT_int;
+	} else {
+		type = VT_float;
+	}
+}
+
+/**
+ * Writes the tree in compiled form: a table of every distinct string, then
+ * the blocks in a flat array, each naming its parent, with their values
+ * already converted to numbers where they are numbers.  Loading it needs no
+ * tokenizing or number parsing.
+ */
+bool CKeyValues::write_compiled(const Filename &filename) const {
+	// Flatten the tree, parents before children.
+	pvector<const CKeyValues *> blocks;
+	pvector<int> parents;
+	blocks.push_back(this);
+	parents.push_back(-1);
+	for (size_t i = 0; i < blocks.size(); i++) {
+		for (size_t j = 0; j < blocks[i]->_children.size(); j++) {
+			blocks.push_back(blocks[i]->_children[j]);
+			parents.push_back((int)i);
+		}
+	}
+
+	pvector<const std::string *> strings;
+	pmap<std::string, uint32_t> string_index;
+	auto intern = [&](const std::string &str) -> uint32_t {
+		auto result = string_index.insert(std::make_pair(str, (uint32_t)strings.size()));
+		if (result.second) {
+			strings.push_back(&result.first->first);
+		}
+		return result.first->second;
+	};
+
+	Datagram blocks_dg;
+	blocks_dg.add_uint32((uint32_t)blocks.size());
+	for (size_t i = 0; i < blocks.size(); i++) {
+		const CKeyValues *block = blocks[i];
+		blocks_dg.add_uint32(intern(block->_name));
+		blocks_dg.add_int32(parents[i]);
+		blocks_dg.add_uint32((uint32_t)block->_keyvalues.size());
+		for (size_t j = 0; j < block->_keyvalues.size(); j++) {
+			blocks_dg.add_uint32(intern(block->_keyvalues.get_key(j)));
+			blocks_dg.add_uint32(intern(block->get_value(j)));
+			blocks_dg.add_uint8((uint8_t)block->get_value_type(j));
+			const vector_float &numbers = block->get_value_numbers(j);
+			blocks_dg.add_uint16((uint16_t)numbers.size());
+			for (size_t k = 0; k < numbers.size(); k++) {
+				blocks_dg.add_float32(numbers[k]);
+			}
+		}
+	}
+
+	Datagram dg;
+	dg.append_data(kv_compiled_ident, sizeof(kv_compiled_ident));
+	dg.add_uint16(kv_compiled_version);
+
+	// Remember what the source looked like, so we can tell if it changes.
+	VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+	PT(VirtualFile) source = _filename.empty() ? nullptr : vfs->get_file(_filename);
+	dg.add_uint64(source != nullptr ? (uint64_t)source->get_file_size() : 0);
+	dg.add_uint64(source != nullptr ? (uint64_t)source->get_timestamp() : 0);
+
+	dg.add_uint32((uint32_t)strings.size());
+	for (size_t i = 0; i < strings.size(); i++) {
+		dg.add_string32(*strings[i]);
+	}
+	dg.append_data(blocks_dg.get_data(), blocks_dg.get_length());
+
+	// Write it under a temporary name and move it into place, so a reader
+	// never sees a partly written file.
+	Filename temp = Filename::binary_filename(filename.get_fullpath() + ".tmp");
+	if (!vfs->write_file(temp, (const unsigned char *)dg.get_data(), dg.get_length(), false) ||
+	    !vfs->rename_file(temp, filename)) {
+		vfs->delete_file(temp);
+		if (keyvalues_cat.is_debug()) {
+			keyvalues_cat.debug()
+				<< "Couldn't write compiled KeyValues to " << filename << "\n";
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Reports a compiled KeyValues file that can't be read.  Always returns
+ * nullptr.
+ */
+static CKeyValues *corrupt_compiled(const Filename &filename) {
+	keyvalues_cat.error()
+		<< "Corrupt compiled KeyValues file " << filename << "\n";
+	return nullptr;
+}
+
+/**
+ * Reads a file written by write_compiled().  Returns nullptr if it is not a
+ * compiled KeyValues file, it is damaged, or it was compiled from a
+ * different version of the source.
+ */
+PT(CKeyValues) CKeyValues::load_compiled(const Filename &filename, const Filename &source_filename,
+                                         VirtualFile *source) {
+	VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+	vector_uchar buffer;
+	if (!vfs->read_file(filename, buffer, true)) {
+		return nullptr;
+	}
+
+	Datagram dg(std::move(buffer));
+	if (dg.get_length() < sizeof(kv_compiled_ident) + 2 + 16 ||
+	    memcmp(dg.get_data(), kv_compiled_ident, sizeof(kv_compiled_ident)) != 0) {
+		return nullptr;
+	}
+
+	DatagramIterator dgi(dg, sizeof(kv_compiled_ident));
+	if (dgi.get_uint16() != kv_compiled_version) {
+		return nullptr;
+	}
+	uint64_t size = dgi.get_uint64();
+	uint64_t timestamp = dgi.get_uint64();
+	if (source != nullptr &&
+	    (size != (uint64_t)source->get_file_size() || timestamp != (uint64_t)source->get_timestamp())) {
+		return nullptr;
+	}
+
+	// Everything below comes from the file, so check each read fits before
+	// making it; a truncated or damaged file is rejected, and the caller
+	// parses the source instead.
+	if (dgi.get_remaining_size() < 4) {
+		return corrupt_compiled(filename);
+	}
+	uint32_t num_strings = dgi.get_uint32();
+	if (num_strings > dgi.get_remaining_size() / 4) {
+		return corrupt_compiled(filename);
+	}
+	pvector<std::string> strings;
+	strings.reserve(num_strings);
+	for (uint32_t i = 0; i < num_strings; i++) {
+		if (dgi.get_remaining_size() < 4) {
+			return corrupt_compiled(filename);
+		}
+		uint32_t length = dgi.get_uint32();
+		if (length > dgi.get_remaining_size()) {
+			return corrupt_compiled(filename);
+		}
+		strings.push_back(dgi.get_fixed_string(length));
+	}
+
+	if (dgi.get_remaining_size() < 4) {
+		return corrupt_compiled(filename);
+	}
+	uint32_t num_blocks = dgi.get_uint32();
+	// Each block takes at least 12 bytes.
+	if (num_blocks == 0 || num_blocks > dgi.get_remaining_size() / 12) {
+		return corrupt_compiled(filename);
+	}
+	pvector<PT(CKeyValues)> blocks;
+	blocks.reserve(num_blocks);
+	for (uint32_t i = 0; i < num_blocks; i++) {
+		if (dgi.get_remaining_size() < 12) {
+			return corrupt_compiled(filename);
+		}
+		uint32_t name = dgi.get_uint32();
+		int parent = dgi.get_int32();
+		uint32_t num_keys = dgi.get_uint32();
+		if (name >= num_strings || parent >= (int)i || (parent < 0) != (i == 0)) {
+			return corrupt_compiled(filename);
+		}
+
+		PT(CKeyValues) block = new CKeyValues(strings[name]);
+		block->_filename = source_filename;
+		if (parent >= 0) {
+			blocks[parent]->add_child(block);
+		}
+
+		for (uint32_t j = 0; j < num_keys; j++) {
+			if (dgi.get_remaining_size() < 11) {
+				return corrupt_compiled(filename);
+			}
+			uint32_t key = dgi.get_uint32();
+			uint32_t str = dgi.get_uint32();
+			uint8_t type = dgi.get_uint8();
+			int num_numbers = dgi.get_uint16();
+			if (key >= num_strings || str >= num_strings || type > VT_vector ||
+			    (size_t)num_numbers * 4 > dgi.get_remaining_size()) {
+				return corrupt_compiled(filename);
+			}
+
+			Value &value = block->_keyvalues[strings[key]];
+			value.str = strings[str];
+			value.type = (ValueType)type;
+			value.classified = true;
+			value.numbers.resize(num_numbers);
+			for (int k = 0; k < num_numbers; k++) {
+				value.numbers[k] = dgi.get_float32();
+			}
+		}
+
+		blocks.push_back(block);
+	}
+
+	if (dgi.get_remaining_size() != 0) {
+		return corrupt_compiled(filename);
+	}
+
+	return blocks[0];
+}
+
 //------------------------------------------------------------------------------------------------
 // Helper functions for parsing string values that represent numbers.
 //------------------------------------------------------------------------------------------------
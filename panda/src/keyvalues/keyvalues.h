@@ -25,6 +25,7 @@
 #include "vector_float.h"
 
 class CKeyValuesTokenizer;
+class VirtualFile;
 
 /**
  * Represents a single block from a key-values file.
@@ -32,6 +33,14 @@ class CKeyValuesTokenizer;
  */
 class EXPCL_VIF CKeyValues : public ReferenceCount {
 PUBLISHED:
+	// What a value holds, worked out once when the file is read.
+	enum ValueType {
+		VT_string,
+		VT_int,
+		VT_float,
+		VT_vector,
+	};
+
 	CKeyValues(const std::string &name, CKeyValues *parent = nullptr);
 
 	//void set_parent( CKeyValues *parent );
@@ -53,11 +62,30 @@ PUBLISHED:
 	int find_key(const std::string &name) const;
 	const std::string &get_key(size_t n) const;
 	const std::string &get_value(size_t n) const;
+	ValueType get_value_type(size_t n) const;
+	const vector_float &get_value_numbers(size_t n) const;
 
 	const Filename &get_filename() const;
 
+	bool write_compiled(const Filename &filename) const;
+	static Filename get_compiled_filename(const Filename &filename);
+
 private:
+	struct Value {
+		std::string str;
+		// The numbers in the value, unless it is a VT_string.  Worked out
+		// on first use for values read from text.
+		mutable vector_float numbers;
+		mutable ValueType type;
+		mutable bool classified;
+
+		Value() : type(VT_string), classified(false) {}
+		void classify() const;
+	};
+
 	void parse(CKeyValuesTokenizer *tokenizer);
+	static PT(CKeyValues) load_compiled(const Filename &filename, const Filename &source_filename,
+	                                    VirtualFile *source);
 
 PUBLISHED:
 	static PT(CKeyValues) load(const Filename &filename);
@@ -84,7 +112,7 @@ private:
 	PT(CKeyValues) _parent;
 	Filename _filename;
 	std::string _name;
-	SimpleHashMap<std::string, std::string, string_hash> _keyvalues;
+	SimpleHashMap<std::string, Value, string_hash> _keyvalues;
 	pvector<PT(CKeyValues)> _children;
 };
 
@@ -124,7 +152,10 @@ inline size_t CKeyValues::get_num_children() const {
 }
 
 inline std::string &CKeyValues::operator[](const std::string &key) {
-	return _keyvalues[key];
+	// The caller may change the string, so work out its type again later.
+	Value &value = _keyvalues[key];
+	value.classified = false;
+	return value.str;
 }
 
 inline size_t CKeyValues::get_num_keys() const {
@@ -144,7 +175,23 @@ inline const std::string &CKeyValues::get_key(size_t n) const {
 }
 
 inline const std::string &CKeyValues::get_value(size_t n) const {
-	return _keyvalues.get_data(n);
+	return _keyvalues.get_data(n).str;
+}
+
+inline CKeyValues::ValueType CKeyValues::get_value_type(size_t n) const {
+	const Value &value = _keyvalues.get_data(n);
+	if (!value.classified) {
+		value.classify();
+	}
+	return value.type;
+}
+
+inline const vector_float &CKeyValues::get_value_numbers(size_t n) const {
+	const Value &value = _keyvalues.get_data(n);
+	if (!value.classified) {
+		value.classify();
+	}
+	return value.numbers;
 }
 
 inline const Filename &CKeyValues::get_filename() const {
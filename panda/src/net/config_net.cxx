@@ -141,6 +141,24 @@ ConfigVariableInt net_max_write_per_epoch
           "to minimize the impact of the networking layer on the other "
           "threads."));
 
+ConfigVariableBool net_use_epoll
+("net-use-epoll", true,
+ PRC_DESC("Set this true to have each ConnectionReader wait on its sockets "
+          "with epoll instead of select(), on platforms that support it.  "
+          "The sockets are then divided among the reader threads, and each "
+          "thread waits on its own share, rather than all threads taking "
+          "turns at a single select() call.  This scales to many more "
+          "connections."));
+
+ConfigVariableBool collect_udp
+("collect-udp", false,
+ PRC_DESC("Set this true to enable accumulation of several small UDP datagrams "
+          "for sending together, the same way collect-tcp does for TCP.  The "
+          "held datagrams are sent with as few system calls as possible when "
+          "the connection is flushed, or after collect-tcp-interval has "
+          "elapsed.  This may be changed per connection with "
+          "Connection::set_collect_udp()."));
+
 ConfigVariableEnum<ThreadPriority> net_thread_priority
 ("net-thread-priority", TP_low,
  PRC_DESC("The default thread priority when creating threaded readers "
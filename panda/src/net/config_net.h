@@ -35,6 +35,8 @@ extern std::string make_thread_name(const std::string &thread_name, int thread_i
 
 extern ConfigVariableInt net_max_read_per_epoch;
 extern ConfigVariableInt net_max_write_per_epoch;
+extern ConfigVariableBool net_use_epoll;
+extern ConfigVariableBool collect_udp;
 
 extern ConfigVariableEnum<ThreadPriority> net_thread_priority;
 
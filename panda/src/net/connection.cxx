@@ -26,6 +26,22 @@
 #include "socket_udp.h"
 #include "dcast.h"
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#endif
+
+#if !defined(_WIN32) && !(defined(HAVE_THREADS) && defined(SIMPLE_THREADS))
+// Queued TCP datagrams are written with writev().
+#define USE_WRITEV
+#endif
+
+#if defined(__linux__) && !(defined(HAVE_THREADS) && defined(SIMPLE_THREADS))
+// Queued UDP datagrams are sent with sendmmsg().
+#define USE_SENDMMSG
+#endif
+
 
 /**
  * Creates a connection.  Normally this constructor should not be used
@@ -38,9 +54,12 @@ Connection(ConnectionManager *manager, Socket_IP *socket) :
   _socket(socket)
 {
   _collect_tcp = collect_tcp;
+  _collect_udp = collect_udp;
   _collect_tcp_interval = collect_tcp_interval;
   _queued_data_start = 0.0;
-  _queued_count = 0;
+  _queued_bytes = 0;
+  _num_datagrams_sent = 0;
+  _num_send_calls = 0;
 
 #if defined(HAVE_THREADS) && defined(SIMPLE_THREADS)
   // In the presence of SIMPLE_THREADS, we use non-blocking IO.  We simulate
@@ -142,14 +161,67 @@ get_collect_tcp_interval() const {
 }
 
 /**
- * Sends the most recently queued TCP datagram(s) if enough time has elapsed.
- * This only has meaning if set_collect_tcp() has been set to true.
+ * Enables or disables "collect-udp" mode.  This is the UDP counterpart of
+ * set_collect_tcp(): datagrams are held until the connection is flushed, or
+ * until the collect-tcp interval has elapsed, and then all sent at once with
+ * as few system calls as the platform allows.  Each datagram still goes out
+ * as its own packet.
+ *
+ * As with collect-tcp mode, you should call consider_flush() or flush()
+ * periodically, for instance at the end of each frame.
+ */
+void Connection::
+set_collect_udp(bool collect_udp) {
+  _collect_udp = collect_udp;
+}
+
+/**
+ * Returns the current setting of "collect-udp" mode.  See set_collect_udp().
+ */
+bool Connection::
+get_collect_udp() const {
+  return _collect_udp;
+}
+
+/**
+ * Returns the number of datagrams that are currently held, waiting for the
+ * next flush.
+ */
+int Connection::
+get_num_queued_datagrams() {
+  LightReMutexHolder holder(_write_mutex);
+  return (int)_queued_datagrams.size();
+}
+
+/**
+ * Returns the total number of datagrams that have been sent on this
+ * connection.  Together with get_num_send_calls(), this shows how well the
+ * datagrams are being batched.
+ */
+size_t Connection::
+get_num_datagrams_sent() const {
+  return _num_datagrams_sent;
+}
+
+/**
+ * Returns the total number of system calls that have been made to send
+ * datagrams on this connection.
+ */
+size_t Connection::
+get_num_send_calls() const {
+  return _num_send_calls;
+}
+
+/**
+ * Sends the most recently queued datagram(s) if enough time has elapsed.
+ * This only has meaning if set_collect_tcp() or set_collect_udp() has been
+ * set to true.
  */
 bool Connection::
 consider_flush() {
   LightReMutexHolder holder(_write_mutex);
 
-  if (!_collect_tcp) {
+  if (!is_collecting()) {
     return do_flush();
 
   } else {
@@ -166,8 +238,8 @@ consider_flush() {
 }
 
 /**
- * Sends the most recently queued TCP datagram(s) now.  This only has meaning
- * if set_collect_tcp() has been set to true.
+ * Sends the most recently queued datagram(s) now.  This only has meaning if
+ * set_collect_tcp() or set_collect_udp() has been set to true.
  */
 bool Connection::
 flush() {
@@ -296,68 +368,40 @@ bool Connection::
 send_datagram(const NetDatagram &datagram, int tcp_header_size) {
   nassertr(_socket != nullptr, false);
 
-  if (_socket->is_exact_type(Socket_UDP::get_class_type())) {
-    // We have to send UDP right away.
-    Socket_UDP *udp;
-    DCAST_INTO_R(udp, _socket, false);
-
-    LightReMutexHolder holder(_write_mutex);
-    DatagramUDPHeader header(datagram);
+  unsigned char header[4];
+  int header_size;
 
-    vector_uchar data;
-    CPTA_uchar header_data = header.get_array();
-    CPTA_uchar message = datagram.get_array();
-    data.insert(data.end(), header_data.begin(), header_data.end());
-    data.insert(data.end(), message.begin(), message.end());
+  if (_socket->is_exact_type(Socket_UDP::get_class_type())) {
+    DatagramUDPHeader::pack_header(header, datagram);
+    header_size = datagram_udp_header_size;
 
     if (net_cat.is_debug()) {
-      header.verify_datagram(datagram);
+      DatagramUDPHeader(datagram).verify_datagram(datagram);
     }
 
-    int bytes_to_send = data.size();
-    Socket_Address addr = datagram.get_address().get_addr();
-
-    bool okflag = udp->SendTo(data, addr);
-#if defined(HAVE_THREADS) && defined(SIMPLE_THREADS)
-    while (!okflag && udp->GetLastError() == LOCAL_BLOCKING_ERROR && udp->Active()) {
-      Thread::force_yield();
-      okflag = udp->SendTo(data, addr);
+  } else {
+    if (tcp_header_size == 2 && datagram.get_length() >= 0x10000) {
+      net_cat.error()
+        << "Attempt to send TCP datagram of " << datagram.get_length()
+        << " bytes--too long!\n";
+      nassert_raise("Datagram too long");
+      return false;
     }
-#endif  // SIMPLE_THREADS
 
-    if (net_cat.is_spam()) {
-      net_cat.spam()
-        << "Sent UDP datagram with "
-        << bytes_to_send << " bytes to " << (void *)this
-        << ", ok = " << okflag << "\n";
+    if (!DatagramTCPHeader::pack_header(header, datagram, tcp_header_size)) {
+      return false;
     }
+    header_size = tcp_header_size;
 
-    return check_send_error(okflag);
-  }
-
-  // We might queue up TCP packets for later sending.
-  if (tcp_header_size == 2 && datagram.get_length() >= 0x10000) {
-    net_cat.error()
-      << "Attempt to send TCP datagram of " << datagram.get_length()
-      << " bytes--too long!\n";
-    nassert_raise("Datagram too long");
-    return false;
+    if (net_cat.is_debug()) {
+      DatagramTCPHeader(datagram, tcp_header_size).verify_datagram(datagram, tcp_header_size);
+    }
   }
 
-  DatagramTCPHeader header(datagram, tcp_header_size);
-
   LightReMutexHolder holder(_write_mutex);
-  CPTA_uchar header_data = header.get_array();
-  CPTA_uchar message = datagram.get_array();
-  _queued_data.insert(_queued_data.end(), header_data.begin(), header_data.end());
-  _queued_data.insert(_queued_data.end(), message.begin(), message.end());
-  _queued_count++;
-
-  if (net_cat.is_debug()) {
-    header.verify_datagram(datagram, tcp_header_size);
-  }
+  queue_datagram(datagram, header, header_size);
 
-  if (!_collect_tcp ||
+  if (!is_collecting() ||
       TrueClock::get_global_ptr()->get_short_time() - _queued_data_start >= _collect_tcp_interval) {
     return do_flush();
   }
@@ -374,42 +418,10 @@ bool Connection::
 send_raw_datagram(const NetDatagram &datagram) {
   nassertr(_socket != nullptr, false);
 
-  if (_socket->is_exact_type(Socket_UDP::get_class_type())) {
-    // We have to send UDP right away.
-    Socket_UDP *udp;
-    DCAST_INTO_R(udp, _socket, false);
-
-    CPTA_uchar msg = datagram.get_array();
-    vector_uchar data;
-    data.insert(data.end(), msg.begin(), msg.end());
-
-    LightReMutexHolder holder(_write_mutex);
-    Socket_Address addr = datagram.get_address().get_addr();
-    bool okflag = udp->SendTo(data, addr);
-#if defined(HAVE_THREADS) && defined(SIMPLE_THREADS)
-    while (!okflag && udp->GetLastError() == LOCAL_BLOCKING_ERROR && udp->Active()) {
-      Thread::force_yield();
-      okflag = udp->SendTo(data, addr);
-    }
-#endif  // SIMPLE_THREADS
-
-    if (net_cat.is_spam()) {
-      net_cat.spam()
-        << "Sent UDP datagram with "
-        << data.size() << " bytes to " << (void *)this
-        << ", ok = " << okflag << "\n";
-    }
-
-    return check_send_error(okflag);
-  }
-
-  // We might queue up TCP packets for later sending.
   LightReMutexHolder holder(_write_mutex);
-  CPTA_uchar msg = datagram.get_array();
-  _queued_data.insert(_queued_data.end(), msg.begin(), msg.end());
-  _queued_count++;
+  queue_datagram(datagram, nullptr, 0);
 
-  if (!_collect_tcp ||
+  if (!is_collecting() ||
       TrueClock::get_global_ptr()->get_short_time() - _queued_data_start >= _collect_tcp_interval) {
     return do_flush();
   }
@@ -417,36 +429,151 @@ send_raw_datagram(const NetDatagram &datagram) {
   return true;
 }
 
+/**
+ * Adds the datagram to the queue of datagrams to send on the next flush.
+ * Only the header bytes are copied; the datagram's data is shared.  Assumes
+ * the _write_mutex is already held.
+ */
+void Connection::
+queue_datagram(const NetDatagram &datagram,
+               const unsigned char *header, int header_size) {
+  nassertv(header_size >= 0 && header_size <= (int)sizeof(QueuedDatagram::_header));
+
+  _queued_datagrams.push_back(QueuedDatagram());
+  QueuedDatagram &queued = _queued_datagrams.back();
+  if (header_size > 0) {
+    memcpy(queued._header, header, header_size);
+  }
+  queued._header_size = header_size;
+  queued._data = datagram.get_array();
+  if (_socket->is_exact_type(Socket_UDP::get_class_type())) {
+    queued._address = datagram.get_address().get_addr();
+  }
+  _queued_bytes += header_size + queued._data.size();
+}
+
+/**
+ * Returns true if datagrams sent on this connection are held for a later
+ * flush, rather than sent right away.
+ */
+bool Connection::
+is_collecting() const {
+  if (_socket != nullptr && _socket->is_exact_type(Socket_UDP::get_class_type())) {
+    return _collect_udp;
+  }
+  return _collect_tcp;
+}
+
 /**
  * The private implementation of flush(), this assumes the _write_mutex is
  * already held.
  */
 bool Connection::
 do_flush() {
-  if (_queued_data.empty()) {
-    _queued_count = 0;
+  if (_queued_datagrams.empty()) {
     _queued_data_start = TrueClock::get_global_ptr()->get_short_time();
     return true;
   }
 
+  bool is_udp = _socket->is_exact_type(Socket_UDP::get_class_type());
   if (net_cat.is_spam()) {
     net_cat.spam()
-      << "Sending " << _queued_count << " TCP datagram(s) with "
-      << _queued_data.size() << " total bytes to " << (void *)this << "\n";
+      << "Sending " << _queued_datagrams.size()
+      << (is_udp ? " UDP" : " TCP") << " datagram(s) with "
+      << _queued_bytes << " total bytes to " << (void *)this << "\n";
   }
 
+  QueuedDatagrams sending;
+  _queued_datagrams.swap(sending);
+  size_t sending_bytes = _queued_bytes;
+
+  _queued_bytes = 0;
+  _queued_data_start = TrueClock::get_global_ptr()->get_short_time();
+
+  bool okflag;
+  if (is_udp) {
+    okflag = send_udp_batch(sending);
+  } else {
+    okflag = send_tcp_batch(sending, sending_bytes);
+  }
+  _num_datagrams_sent += sending.size();
+
+  return check_send_error(okflag);
+}
+
+/**
+ * Writes the indicated datagrams to the TCP socket.  Where writev() is
+ * available, the headers and the datagram data are handed to the kernel
+ * directly, as many at a time as it will take; otherwise they are first
+ * copied into one buffer.
+ */
+bool Connection::
+send_tcp_batch(const QueuedDatagrams &datagrams, size_t num_bytes) {
   Socket_TCP *tcp;
   DCAST_INTO_R(tcp, _socket, false);
 
-  vector_uchar sending_data;
-  _queued_data.swap(sending_data);
+#ifdef USE_WRITEV
+#ifdef IOV_MAX
+  static const size_t max_iovecs = IOV_MAX;
+#else
+  static const size_t max_iovecs = 1024;
+#endif
 
-  _queued_count = 0;
-  _queued_data_start = TrueClock::get_global_ptr()->get_short_time();
+  pvector<struct iovec> iov;
+  iov.reserve(datagrams.size() * 2);
+  for (const QueuedDatagram &queued : datagrams) {
+    struct iovec vec;
+    if (queued._header_size > 0) {
+      vec.iov_base = (void *)queued._header;
+      vec.iov_len = queued._header_size;
+      iov.push_back(vec);
+    }
+    if (!queued._data.empty()) {
+      vec.iov_base = (void *)queued._data.p();
+      vec.iov_len = queued._data.size();
+      iov.push_back(vec);
+    }
+  }
+
+  size_t next = 0;
+  while (next < iov.size()) {
+    int count = (int)std::min(iov.size() - next, max_iovecs);
+    ssize_t result = writev(tcp->GetSocket(), &iov[next], count);
+    ++_num_send_calls;
+    if (result <= 0) {
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    // Skip past whatever was written.  A short write may leave us partway
+    // into one of the buffers.
+    size_t written = (size_t)result;
+    while (next < iov.size() && written >= iov[next].iov_len) {
+      written -= iov[next].iov_len;
+      ++next;
+    }
+    if (written > 0) {
+      iov[next].iov_base = (char *)iov[next].iov_base + written;
+      iov[next].iov_len -= written;
+    }
+  }
+
+  return true;
+
+#else  // USE_WRITEV
+  vector_uchar sending_data;
+  sending_data.reserve(num_bytes);
+  for (const QueuedDatagram &queued : datagrams) {
+    sending_data.insert(sending_data.end(), queued._header, queued._header + queued._header_size);
+    sending_data.insert(sending_data.end(), queued._data.begin(), queued._data.end());
+  }
 
 #if defined(HAVE_THREADS) && defined(SIMPLE_THREADS)
   int max_send = net_max_write_per_epoch;
   int data_sent = tcp->SendData((char *)sending_data.data(), std::min((size_t)max_send, sending_data.size()));
+  ++_num_send_calls;
   bool okflag = (data_sent == (int)sending_data.size());
   if (!okflag) {
     int total_sent = 0;
@@ -462,6 +589,7 @@ do_flush() {
         Thread::consider_yield();
       }
       data_sent = tcp->SendData((char *)sending_data.data() + total_sent, std::min((size_t)max_send, sending_data.size() - total_sent));
+      ++_num_send_calls;
       if (data_sent > 0) {
         total_sent += data_sent;
       }
@@ -471,11 +599,88 @@ do_flush() {
 
 #else  // SIMPLE_THREADS
   int data_sent = tcp->SendData(sending_data);
+  ++_num_send_calls;
   bool okflag = (data_sent == (int)sending_data.size());
 
 #endif  // SIMPLE_THREADS
 
-  return check_send_error(okflag);
+  return okflag;
+#endif  // USE_WRITEV
+}
+
+/**
+ * Sends each of the indicated datagrams as its own UDP packet.  Where
+ * sendmmsg() is available, many packets are sent with a single call, and the
+ * header and data of each are gathered by the kernel without being copied
+ * together first.
+ */
+bool Connection::
+send_udp_batch(const QueuedDatagrams &datagrams) {
+  Socket_UDP *udp;
+  DCAST_INTO_R(udp, _socket, false);
+
+#ifdef USE_SENDMMSG
+  static const size_t max_messages = 64;
+  struct mmsghdr messages[max_messages];
+  struct iovec iov[max_messages * 2];
+
+  size_t next = 0;
+  while (next < datagrams.size()) {
+    size_t count = std::min(datagrams.size() - next, max_messages);
+    for (size_t i = 0; i < count; ++i) {
+      const QueuedDatagram &queued = datagrams[next + i];
+      struct iovec *vec = &iov[i * 2];
+      vec[0].iov_base = (void *)queued._header;
+      vec[0].iov_len = queued._header_size;
+      vec[1].iov_base = (void *)queued._data.p();
+      vec[1].iov_len = queued._data.size();
+
+      const struct sockaddr *addr = &queued._address.GetAddressInfo();
+      struct msghdr &msg = messages[i].msg_hdr;
+      memset(&messages[i], 0, sizeof(messages[i]));
+      msg.msg_name = (void *)addr;
+      msg.msg_namelen = SA_SIZEOF(addr);
+      msg.msg_iov = vec;
+      msg.msg_iovlen = 2;
+    }
+
+    int result = sendmmsg(udp->GetSocket(), messages, (unsigned int)count, 0);
+    ++_num_send_calls;
+    if (result <= 0) {
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    next += result;
+  }
+
+  return true;
+
+#else  // USE_SENDMMSG
+  for (const QueuedDatagram &queued : datagrams) {
+    vector_uchar data;
+    data.reserve(queued._header_size + queued._data.size());
+    data.insert(data.end(), queued._header, queued._header + queued._header_size);
+    data.insert(data.end(), queued._data.begin(), queued._data.end());
+
+    bool okflag = udp->SendTo(data, queued._address);
+    ++_num_send_calls;
+#if defined(HAVE_THREADS) && defined(SIMPLE_THREADS)
+    while (!okflag && udp->GetLastError() == LOCAL_BLOCKING_ERROR && udp->Active()) {
+      Thread::force_yield();
+      okflag = udp->SendTo(data, queued._address);
+      ++_num_send_calls;
+    }
+#endif  // SIMPLE_THREADS
+
+    if (!okflag) {
+      return false;
+    }
+  }
+
+  return true;
+#endif  // USE_SENDMMSG
 }
 
 /**
@@ -19,6 +19,9 @@
 #include "netAddress.h"
 #include "lightReMutex.h"
 #include "vector_uchar.h"
+#include "pta_uchar.h"
+#include "pvector.h"
+#include "socket_address.h"
 
 class Socket_IP;
 class ConnectionManager;
@@ -41,6 +44,12 @@ PUBLISHED:
   bool get_collect_tcp() const;
   void set_collect_tcp_interval(double interval);
   double get_collect_tcp_interval() const;
+  void set_collect_udp(bool collect_udp);
+  bool get_collect_udp() const;
+
+  int get_num_queued_datagrams();
+  size_t get_num_datagrams_sent() const;
+  size_t get_num_send_calls() const;
 
   BLOCKING bool consider_flush();
   BLOCKING bool flush();
@@ -59,18 +68,39 @@ PUBLISHED:
 private:
   bool send_datagram(const NetDatagram &datagram, int tcp_header_size);
   bool send_raw_datagram(const NetDatagram &datagram);
+  void queue_datagram(const NetDatagram &datagram,
+                      const unsigned char *header, int header_size);
+  bool is_collecting() const;
   bool do_flush();
   bool check_send_error(bool okflag);
 
+  // A datagram waiting to be sent.  The data is referenced, not copied; only
+  // the few bytes of the header are kept here.
+  class QueuedDatagram {
+  public:
+    unsigned char _header[4];
+    int _header_size;
+    CPTA_uchar _data;
+    Socket_Address _address;
+  };
+  typedef pvector<QueuedDatagram> QueuedDatagrams;
+
+  bool send_tcp_batch(const QueuedDatagrams &datagrams, size_t num_bytes);
+  bool send_udp_batch(const QueuedDatagrams &datagrams);
+
   ConnectionManager *_manager;
   Socket_IP *_socket;
   LightReMutex _write_mutex;
 
   bool _collect_tcp;
+  bool _collect_udp;
   double _collect_tcp_interval;
   double _queued_data_start;
-  vector_uchar _queued_data;
-  int _queued_count;
+  QueuedDatagrams _queued_datagrams;
+  size_t _queued_bytes;
+
+  size_t _num_datagrams_sent;
+  size_t _num_send_calls;
 
   friend class ConnectionWriter;
 };
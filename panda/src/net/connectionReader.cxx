@@ -27,10 +27,54 @@
 #include "atomicAdjust.h"
 #include "config_downloader.h"
 
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
 using std::min;
 
 static const int read_buffer_size = maximum_udp_datagram + datagram_udp_header_size;
 
+// The number of events fetched from epoll at a time, per thread.
+static const int epoll_max_events = 256;
+
+/**
+ * The set of sockets watched by one reader thread, when the ConnectionReader
+ * uses epoll.  Each socket belongs to exactly one shard, so the threads never
+ * contend for the same socket.
+ */
+class ConnectionReader::EpollShard {
+public:
+  EpollShard() : _mutex("ConnectionReader::EpollShard") {
+    _epoll_fd = -1;
+    _num_sockets = 0;
+    _next_index = 0;
+    _num_results = 0;
+  }
+
+  int _epoll_fd;
+  int _num_sockets;
+
+  // Sockets removed from this shard, which can't be deleted until the
+  // thread is done with the results of its last wait.
+  Sockets _removed_sockets;
+
+#ifdef __linux__
+  struct epoll_event _events[epoll_max_events];
+#endif
+  int _next_index;
+  int _num_results;
+
+  // Only held by the thread servicing the shard, unless the reader is
+  // polled.
+  Mutex _mutex;
+};
+
 /**
  *
  */
@@ -40,6 +84,10 @@ SocketInfo(const PT(Connection) &connection) :
 {
   _busy = false;
   _error = false;
+  _index = 0;
+  _shard = -1;
+  _registered_socket = BAD_SOCKET;
+  _removed = 0;
 }
 
 /**
@@ -113,6 +161,11 @@ ConnectionReader(ConnectionManager *manager, int num_threads,
 
   _currently_polling_thread = -1;
 
+  if (net_use_epoll) {
+    // This has to be set up before the threads start.
+    init_epoll(std::max(num_threads, 1));
+  }
+
   std::string reader_thread_name = thread_name;
   if (thread_name.empty()) {
     reader_thread_name = "ReaderThread";
@@ -158,6 +211,17 @@ ConnectionReader::
       sinfo->_connection.clear();
     }
   }
+
+#ifdef __linux__
+  for (EpollShard *shard : _epoll_shards) {
+    for (SocketInfo *sinfo : shard->_removed_sockets) {
+      delete sinfo;
+    }
+    close(shard->_epoll_fd);
+    delete shard;
+  }
+  _epoll_shards.clear();
+#endif
 }
 
 /**
@@ -179,15 +243,20 @@ add_connection(Connection *connection) {
   LightMutexHolder holder(_sockets_mutex);
 
   // Make sure it's not already on the _sockets list.
-  Sockets::const_iterator si;
-  for (si = _sockets.begin(); si != _sockets.end(); ++si) {
-    if ((*si)->_connection == connection) {
-      // Whoops, already there.
-      return false;
-    }
+  if (_sockets_by_connection.find(connection) != _sockets_by_connection.end()) {
+    // Whoops, already there.
+    return false;
   }
 
-  _sockets.push_back(new SocketInfo(connection));
+  SocketInfo *sinfo = new SocketInfo(connection);
+  if (!_epoll_shards.empty() && !epoll_add_socket(sinfo)) {
+    delete sinfo;
+    return false;
+  }
+
+  sinfo->_index = _sockets.size();
+  _sockets.push_back(sinfo);
+  _sockets_by_connection[connection] = sinfo;
 
   return true;
 }
@@ -204,18 +273,25 @@ bool ConnectionReader::
 remove_connection(Connection *connection) {
   LightMutexHolder holder(_sockets_mutex);
 
-  // Walk through the list of sockets to find the one we're removing.
-  Sockets::iterator si;
-  si = _sockets.begin();
-  while (si != _sockets.end() && (*si)->_connection != connection) {
-    ++si;
-  }
-  if (si == _sockets.end()) {
+  SocketsByConnection::iterator mi = _sockets_by_connection.find(connection);
+  if (mi == _sockets_by_connection.end()) {
     return false;
   }
-
-  _removed_sockets.push_back(*si);
-  _sockets.erase(si);
+  SocketInfo *sinfo = (*mi).second;
+  _sockets_by_connection.erase(mi);
+
+  // Move the last socket into its place; the order of _sockets doesn't
+  // matter.
+  SocketInfo *last = _sockets.back();
+  _sockets[sinfo->_index] = last;
+  last->_index = sinfo->_index;
+  _sockets.pop_back();
+
+  if (!_epoll_shards.empty()) {
+    epoll_remove_socket(sinfo);
+  } else {
+    _removed_sockets.push_back(sinfo);
+  }
 
   return true;
 }
@@ -231,18 +307,13 @@ bool ConnectionReader::
 is_connection_ok(Connection *connection) {
   LightMutexHolder holder(_sockets_mutex);
 
-  // Walk through the list of sockets to find the one we're asking about.
-  Sockets::iterator si;
-  si = _sockets.begin();
-  while (si != _sockets.end() && (*si)->_connection != connection) {
-    ++si;
-  }
-  if (si == _sockets.end()) {
+  SocketsByConnection::const_iterator mi = _sockets_by_connection.find(connection);
+  if (mi == _sockets_by_connection.end()) {
     // Don't know that connection.
     return false;
   }
 
-  SocketInfo *sinfo = (*si);
+  SocketInfo *sinfo = (*mi).second;
   bool is_ok = !sinfo->_error;
 
   return is_ok;
@@ -421,6 +492,23 @@ finish_socket(SocketInfo *sinfo) {
 
   // By marking the SocketInfo nonbusy, we make it available for future polls.
   sinfo->_busy = false;
+
+#ifdef __linux__
+  if (sinfo->_error && sinfo->_shard >= 0) {
+    // A closed socket stays readable, and epoll is level-triggered, so stop
+    // watching it, or the reader thread would spin on it until the
+    // connection is removed.
+    LightMutexHolder holder(_sockets_mutex);
+    if (!AtomicAdjust::get(sinfo->_removed) &&
+        sinfo->_registered_socket != BAD_SOCKET) {
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      epoll_ctl(_epoll_shards[sinfo->_shard]->_epoll_fd, EPOLL_CTL_DEL,
+                sinfo->_registered_socket, &event);
+      sinfo->_registered_socket = BAD_SOCKET;
+    }
+  }
+#endif  // __linux__
 }
 
 /**
@@ -467,6 +555,7 @@ process_incoming_udp_data(SocketInfo *sinfo) {
   } else if (bytes_read == 0) {
     // The socket was closed (!).  This shouldn't happen with a UDP
     // connection.  Oh well.  Report that and return.
+    sinfo->_error = true;
     if (_manager != nullptr) {
       _manager->connection_reset(sinfo->_connection, 0);
     }
@@ -549,6 +638,7 @@ process_incoming_tcp_data(SocketInfo *sinfo) {
 
     if (bytes_read <= 0) {
       // The socket was closed.  Report that and return.
+      sinfo->_error = true;
       if (_manager != nullptr) {
         _manager->connection_reset(sinfo->_connection, 0);
       }
@@ -603,6 +693,7 @@ process_incoming_tcp_data(SocketInfo *sinfo) {
 
     if (bytes_read <= 0) {
       // The socket was closed.  Report that and return.
+      sinfo->_error = true;
       if (_manager != nullptr) {
         _manager->connection_reset(sinfo->_connection, 0);
       }
@@ -676,6 +767,7 @@ process_raw_incoming_udp_data(SocketInfo *sinfo) {
   } else if (bytes_read == 0) {
     // The socket was closed (!).  This shouldn't happen with a UDP
     // connection.  Oh well.  Report that and return.
+    sinfo->_error = true;
     if (_manager != nullptr) {
       _manager->connection_reset(sinfo->_connection, 0);
     }
@@ -730,6 +822,7 @@ process_raw_incoming_tcp_data(SocketInfo *sinfo) {
 
   if (bytes_read <= 0) {
     // The socket was closed.  Report that and return.
+    sinfo->_error = true;
     if (_manager != nullptr) {
       _manager->connection_reset(sinfo->_connection, 0);
     }
@@ -795,6 +888,14 @@ thread_run(int thread_index) {
  */
 ConnectionReader::SocketInfo *ConnectionReader::
 get_next_available_socket(bool allow_block, int current_thread_index) {
+  if (!_epoll_shards.empty()) {
+    // Each thread only looks at its own sockets.  A polling reader has just
+    // the one shard.
+    int shard_index = (current_thread_index >= 0) ? current_thread_index : 0;
+    nassertr(shard_index < (int)_epoll_shards.size(), nullptr);
+    return get_next_epoll_socket(allow_block, _epoll_shards[shard_index]);
+  }
+
   // Go to sleep on the select() mutex.  This guarantees that only one thread
   // is in this function at a time.
   MutexHolder holder(_select_mutex);
@@ -925,3 +1026,187 @@ accumulate_fdset(Socket_fdset &fdset) {
     }
   }
 }
+
+/**
+ * Creates the indicated number of epoll instances, one for each reader
+ * thread.  Returns true on success, or false if epoll is not available, in
+ * which case the reader falls back to select().
+ */
+bool ConnectionReader::
+init_epoll(int num_shards) {
+#ifdef __linux__
+  for (int i = 0; i < num_shards; ++i) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      net_cat.warning()
+        << "Unable to create epoll instance (" << strerror(errno)
+        << "), using select() instead.\n";
+
+      for (EpollShard *shard : _epoll_shards) {
+        close(shard->_epoll_fd);
+        delete shard;
+      }
+      _epoll_shards.clear();
+      return false;
+    }
+
+    EpollShard *shard = new EpollShard;
+    shard->_epoll_fd = epoll_fd;
+    _epoll_shards.push_back(shard);
+  }
+  return true;
+
+#else
+  return false;
+#endif  // __linux__
+}
+
+/**
+ * Assigns a newly added socket to the shard with the fewest sockets, and
+ * starts watching it.  Assumes _sockets_mutex is held.
+ */
+bool ConnectionReader::
+epoll_add_socket(SocketInfo *sinfo) {
+#ifdef __linux__
+  int shard_index = 0;
+  for (int i = 1; i < (int)_epoll_shards.size(); ++i) {
+    if (_epoll_shards[i]->_num_sockets < _epoll_shards[shard_index]->_num_sockets) {
+      shard_index = i;
+    }
+  }
+  EpollShard *shard = _epoll_shards[shard_index];
+
+  // This is level-triggered: the reader consumes a single datagram each time
+  // a socket comes up, and the sockets are blocking, so it can't read until
+  // the socket runs dry the way edge triggering would require.
+  SOCKET socket = sinfo->get_socket()->GetSocket();
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = sinfo;
+  if (epoll_ctl(shard->_epoll_fd, EPOLL_CTL_ADD, socket, &event) != 0) {
+    net_cat.error()
+      << "Unable to add socket to epoll instance: " << strerror(errno) << "\n";
+    return false;
+  }
+
+  sinfo->_shard = shard_index;
+  sinfo->_registered_socket = socket;
+  shard->_num_sockets++;
+  return true;
+
+#else
+  return false;
+#endif  // __linux__
+}
+
+/**
+ * Stops watching a socket that has just been removed from _sockets.  The
+ * SocketInfo is deleted later by the thread servicing its shard.  Assumes
+ * _sockets_mutex is held.
+ */
+void ConnectionReader::
+epoll_remove_socket(SocketInfo *sinfo) {
+#ifdef __linux__
+  nassertv(sinfo->_shard >= 0 && sinfo->_shard < (int)_epoll_shards.size());
+  EpollShard *shard = _epoll_shards[sinfo->_shard];
+
+  AtomicAdjust::set(sinfo->_removed, 1);
+
+  // If the socket has been closed already, the kernel has taken it out of
+  // the epoll set by itself, and the descriptor might even have been reused
+  // by another socket since.
+  if (sinfo->_registered_socket != BAD_SOCKET &&
+      sinfo->get_socket()->GetSocket() == sinfo->_registered_socket) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(shard->_epoll_fd, EPOLL_CTL_DEL, sinfo->_registered_socket, &event);
+  }
+
+  shard->_num_sockets--;
+  shard->_removed_sockets.push_back(sinfo);
+#endif  // __linux__
+}
+
+/**
+ * The epoll equivalent of get_next_available_socket().  Returns the next
+ * socket of the indicated shard known to have activity, or NULL if no
+ * activity is detected within the timeout interval.
+ */
+ConnectionReader::SocketInfo *ConnectionReader::
+get_next_epoll_socket(bool allow_block, EpollShard *shard) {
+#ifdef __linux__
+  MutexHolder holder(shard->_mutex);
+
+  while (!_shutdown) {
+    // First, hand out the results of the previous wait.
+    while (shard->_next_index < shard->_num_results) {
+      SocketInfo *sinfo =
+        (SocketInfo *)shard->_events[shard->_next_index].data.ptr;
+      shard->_next_index++;
+
+      if (!AtomicAdjust::get(sinfo->_removed) && !sinfo->_error) {
+        sinfo->_busy = true;
+        return sinfo;
+      }
+    }
+    shard->_next_index = 0;
+    shard->_num_results = 0;
+
+    // None of the results of the previous wait are referenced anymore, so
+    // this is a fine time to delete the sockets removed since.
+    {
+      LightMutexHolder sockets_holder(_sockets_mutex);
+      if (!shard->_removed_sockets.empty()) {
+        Sockets still_busy_sockets;
+        for (SocketInfo *sinfo : shard->_removed_sockets) {
+          if (sinfo->_busy) {
+            still_busy_sockets.push_back(sinfo);
+          } else {
+            delete sinfo;
+          }
+        }
+        shard->_removed_sockets.swap(still_busy_sockets);
+      }
+    }
+
+    int timeout = (int)(get_net_max_block() * 1000.0);
+    if (!allow_block) {
+      timeout = 0;
+    }
+#if defined(HAVE_THREADS) && defined(SIMPLE_THREADS)
+    // In the presence of SIMPLE_THREADS, we never wait at all, but rather we
+    // yield the thread if we come up empty (so that we won't block the entire
+    // process).
+    timeout = 0;
+#endif
+
+    int num_results =
+      epoll_wait(shard->_epoll_fd, shard->_events, epoll_max_events, timeout);
+
+    if (num_results < 0) {
+      if (errno != EINTR) {
+        // If we had an error, just return.  But yield the timeslice first.
+        net_cat.error()
+          << "epoll_wait failed: " << strerror(errno) << "\n";
+        Thread::force_yield();
+        return nullptr;
+      }
+      num_results = 0;
+    }
+    shard->_num_results = num_results;
+
+    if (num_results == 0) {
+      if (!allow_block) {
+        return nullptr;
+      }
+      // If we reached net_max_block, go back and reconsider.  (We never
+      // timeout indefinitely, so we can check the shutdown flag every once
+      // in a while.)
+      Thread::force_yield();
+    }
+  }
+#endif  // __linux__
+
+  return nullptr;
+}
@@ -23,6 +23,7 @@
 #include "lightMutex.h"
 #include "pvector.h"
 #include "pset.h"
+#include "pmap.h"
 #include "socket_fdset.h"
 #include "atomicAdjust.h"
 
@@ -60,6 +61,9 @@ PUBLISHED:
   // by a previous call to PR_Poll(), or (b) execute (and possibly block on) a
   // new call to PR_Poll().
 
+  // Where epoll is available (see net-use-epoll), each thread instead waits
+  // on its own epoll instance, and every socket is assigned to one of them.
+
   explicit ConnectionReader(ConnectionManager *manager, int num_threads,
                             const std::string &thread_name = std::string());
   virtual ~ConnectionReader();
@@ -95,6 +99,14 @@ protected:
     PT(Connection) _connection;
     bool _busy;
     bool _error;
+
+    // Position in _sockets.
+    size_t _index;
+
+    // Used by the epoll implementation only.
+    int _shard;
+    SOCKET _registered_socket;
+    AtomicAdjust::Integer _removed;
   };
   typedef pvector<SocketInfo *> Sockets;
 
@@ -119,6 +131,9 @@ protected:
   // Any operations on _sockets are protected by this mutex.
   LightMutex _sockets_mutex;
 
+  typedef pmap<Connection *, SocketInfo *> SocketsByConnection;
+  SocketsByConnection _sockets_by_connection;
+
 private:
   void thread_run(int thread_index);
 
@@ -128,6 +143,12 @@ private:
   void rebuild_select_list();
   void accumulate_fdset(Socket_fdset &fdset);
 
+  class EpollShard;
+  bool init_epoll(int num_shards);
+  bool epoll_add_socket(SocketInfo *sinfo);
+  void epoll_remove_socket(SocketInfo *sinfo);
+  SocketInfo *get_next_epoll_socket(bool allow_block, EpollShard *shard);
+
 private:
   bool _raw_mode;
   int _tcp_header_size;
@@ -162,6 +183,11 @@ private:
   // thread is so waiting.
   AtomicAdjust::Integer _currently_polling_thread;
 
+  // One per thread (or a single one for a polling reader) when the sockets
+  // are monitored with epoll, otherwise empty.
+  typedef pvector<EpollShard *> EpollShards;
+  EpollShards _epoll_shards;
+
   friend class ConnectionManager;
   friend class ReaderThread;
 };
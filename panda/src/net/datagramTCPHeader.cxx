@@ -53,6 +53,39 @@ DatagramTCPHeader(const NetDatagram &datagram, int header_size) {
   nassertv((int)_header.get_length() == header_size);
 }
 
+/**
+ * Writes the header for the indicated datagram directly to dest, which must
+ * have room for header_size bytes.  This produces the same bytes as the
+ * constructor, without building a separate NetDatagram for them.  Returns
+ * true on success, false if the datagram is too long for the header size.
+ */
+bool DatagramTCPHeader::
+pack_header(unsigned char *dest, const NetDatagram &datagram, int header_size) {
+  size_t length = datagram.get_length();
+  switch (header_size) {
+  case 0:
+    return true;
+
+  case datagram_tcp16_header_size:
+    nassertr(length <= 0xffff, false);
+    dest[0] = (unsigned char)(length & 0xff);
+    dest[1] = (unsigned char)((length >> 8) & 0xff);
+    return true;
+
+  case datagram_tcp32_header_size:
+    nassertr(length <= 0xffffffff, false);
+    dest[0] = (unsigned char)(length & 0xff);
+    dest[1] = (unsigned char)((length >> 8) & 0xff);
+    dest[2] = (unsigned char)((length >> 16) & 0xff);
+    dest[3] = (unsigned char)((length >> 24) & 0xff);
+    return true;
+
+  default:
+    nassert_raise("invalid header size");
+    return false;
+  }
+}
+
 /**
  * This constructor decodes a header from a block of data of length
  * datagram_tcp_header_size, presumably just read from a socket.
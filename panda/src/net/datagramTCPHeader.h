@@ -43,6 +43,9 @@ public:
 
   bool verify_datagram(const NetDatagram &datagram, int header_size) const;
 
+  static bool pack_header(unsigned char *dest, const NetDatagram &datagram,
+                          int header_size);
+
 private:
   // The actual data for the header is stored (somewhat recursively) in its
   // own NetDatagram object.  This is just for convenience of packing and
@@ -36,6 +36,24 @@ DatagramUDPHeader(const NetDatagram &datagram) {
   nassertv((int)_header.get_length() == datagram_udp_header_size);
 }
 
+/**
+ * Writes the header for the indicated datagram directly to dest, which must
+ * have room for datagram_udp_header_size bytes.  This produces the same
+ * bytes as the constructor, without building a separate NetDatagram for them.
+ */
+void DatagramUDPHeader::
+pack_header(unsigned char *dest, const NetDatagram &datagram) {
+  const unsigned char *begin = (const unsigned char *)datagram.get_data();
+  const unsigned char *end = begin + datagram.get_length();
+  uint16_t checksum = 0;
+  for (const unsigned char *p = begin; p != end; ++p) {
+    checksum += (uint16_t)(uint8_t)*p;
+  }
+
+  dest[0] = (unsigned char)(checksum & 0xff);
+  dest[1] = (unsigned char)((checksum >> 8) & 0xff);
+}
+
 /**
  * This constructor decodes a header from a block of data of length
  * datagram_udp_header_size, presumably just read from a socket.
@@ -42,6 +42,8 @@ public:
 
   bool verify_datagram(const NetDatagram &datagram) const;
 
+  static void pack_header(unsigned char *dest, const NetDatagram &datagram);
+
 private:
   // The actual data for the header is stored (somewhat recursively) in its
   // own NetDatagram object.  This is just for convenience of packing and
@@ -0,0 +1,910 @@
+/**
+ * PANDA3D BSP TOOLS
+ * Copyright (c) CIO Team. All rights reserved.
+ *
+ * @file incremental.cpp
+ * @author agent
+ * @date October 17, 2026
+ *
+ * @desc Per-face lighting cache for -incremental compiles.
+ *
+ *       Each face is keyed by a hash of its geometry, surface and the
+ *       direct lights whose PVS reaches it. A face whose key is found
+ *       in the cache from the previous compile gets its patch lights
+ *       and final lightmap copied back instead of being lit again.
+ *
+ *       Faces that changed dirty everything that can see them when
+ *       geometry changed (shadows) or when bouncing is on (indirect
+ *       light), plus their neighbors, since the luxel radials blend
+ *       across neighboring faces.
+ */
+
+#include "incremental.h"
+#include "qrad.h"
+#include "lightmap.h"
+#include "lights.h"
+#include "radial.h"
+#include "radstaticprop.h"
+#include "filelib.h"
+#include "log.h"
+
+#include <simpleHashMap.h>
+#include <pset.h>
+
+#include <algorithm>
+
+#define INCREMENTAL_FILE_ID             ( ( 'C' << 24 ) + ( 'N' << 16 ) + ( 'I' << 8 ) + 'R' )
+#define INCREMENTAL_FILE_VERSION        1
+
+enum
+{
+        INC_RESTORE,            // everything is copied from the cache
+        INC_FACELIGHTS,         // facelights are built for a relit neighbor, lightmap is copied
+        INC_RELIGHT,            // lit from scratch
+};
+
+struct incpatch_t
+{
+        LVector3 samplelight;
+        float samplearea;
+        bumpsample_t totallight;
+        LVector3 directlight;
+};
+
+struct incface_t
+{
+        uint64_t hash;          // geometry, surface and the lights that reach it
+        uint64_t geom_hash;     // geometry and surface only
+        LVector3 centroid;
+        byte styles[MAXLIGHTMAPS];
+        int normal_count;
+        pvector<incpatch_t> patches;
+        pvector<colorrgbexp32_t> lightdata;
+        pvector<colorrgbexp32_t> bouncedlightdata;
+};
+
+typedef SimpleHashMap<uint64_t, int, integer_hash<uint64_t> > HashToFace;
+
+static uint64_t s_settings_hash = 0;
+static uint64_t s_world_hash = 0;
+
+// current compile, indexed by face number
+static pvector<incface_t> s_faces;
+static pvector<int> s_cached_face;
+static pvector<unsigned char> s_face_state;
+
+// previous compile
+static pvector<incface_t> s_cache;
+static pvector<int> s_cache_numtransfers;
+static pvector<transfer_t> s_cache_transfers;
+
+// =====================================================================================
+//  Hashing
+// =====================================================================================
+static uint64_t HashBytes( uint64_t hash, const void *data, size_t len )
+{
+        // 64-bit FNV-1a
+        const unsigned char *bytes = (const unsigned char *)data;
+        for ( size_t i = 0; i < len; i++ )
+        {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+        }
+        return hash;
+}
+
+template<class T>
+static INLINE uint64_t HashValue( uint64_t hash, const T &value )
+{
+        return HashBytes( hash, &value, sizeof( T ) );
+}
+
+static INLINE uint64_t HashString( uint64_t hash, const char *str )
+{
+        return HashBytes( hash, str, strlen( str ) + 1 );
+}
+
+static const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+static uint64_t SettingsHash()
+{
+        uint64_t hash = HASH_SEED;
+        hash = HashValue( hash, g_numbounce );
+        hash = HashValue( hash, g_extra );
+        hash = HashValue( hash, g_extrapasses );
+        hash = HashValue( hash, g_fastmode );
+        hash = HashValue( hash, g_direct_scale );
+        hash = HashValue( hash, g_lightscale );
+        hash = HashValue( hash, g_dlight_threshold );
+        hash = HashValue( hash, g_coring );
+        hash = HashValue( hash, g_chop );
+        hash = HashValue( hash, g_texchop );
+        hash = HashValue( hash, g_minchop );
+        hash = HashValue( hash, g_maxchop );
+        hash = HashValue( hash, g_smoothing_threshold );
+        hash = HashValue( hash, g_smoothing_threshold_2 );
+        hash = HashValue( hash, g_indirect_sun );
+        hash = HashValue( hash, g_softsky );
+        hash = HashValue( hash, g_skysamplescale );
+        hash = HashValue( hash, g_colour_qgamma );
+        hash = HashValue( hash, g_colour_lightscale );
+        hash = HashValue( hash, g_texreflectgamma );
+        hash = HashValue( hash, g_texreflectscale );
+        hash = HashValue( hash, g_minlight );
+        hash = HashValue( hash, g_blur );
+        hash = HashValue( hash, g_notextures );
+
+        // props cast shadows anywhere they can see, any change relights everything
+        for ( size_t i = 0; i < g_bspdata->dstaticprops.size(); i++ )
+        {
+                const dstaticprop_t &prop = g_bspdata->dstaticprops[i];
+                hash = HashValue( hash, prop.pos );
+                hash = HashValue( hash, prop.hpr );
+                hash = HashValue( hash, prop.scale );
+                hash = HashString( hash, prop.name );
+                hash = HashValue( hash, prop.flags );
+        }
+
+        return hash;
+}
+
+static uint64_t FaceGeometryHash( int facenum, LVector3 &centroid )
+{
+        const dface_t *f = &g_bspdata->dfaces[facenum];
+        const dplane_t *plane = &g_bspdata->dplanes[f->planenum];
+        const texinfo_t *tex = &g_bspdata->texinfo[f->texinfo];
+
+        uint64_t hash = HASH_SEED;
+        hash = HashValue( hash, plane->normal );
+        hash = HashValue( hash, plane->dist );
+        hash = HashValue( hash, f->side );
+        hash = HashValue( hash, f->bumped_lightmap );
+        hash = HashValue( hash, f->lightmap_mins );
+        hash = HashValue( hash, f->lightmap_size );
+        hash = HashValue( hash, *tex );
+        hash = HashValue( hash, g_face_offset[facenum] );
+
+        if ( g_textures != nullptr && tex->texref >= 0 && tex->texref < g_numtextures )
+        {
+                hash = HashValue( hash, g_textures[tex->texref].reflectivity );
+        }
+
+        centroid.set( 0, 0, 0 );
+        for ( int i = 0; i < f->numedges; i++ )
+        {
+                int edge = g_bspdata->dsurfedges[f->firstedge + i];
+                int v = edge < 0 ? g_bspdata->dedges[-edge].v[1] : g_bspdata->dedges[edge].v[0];
+                const float *point = g_bspdata->dvertexes[v].point;
+                hash = HashBytes( hash, point, sizeof( float ) * 3 );
+                centroid += LVector3( point[0], point[1], point[2] );
+        }
+        if ( f->numedges > 0 )
+        {
+                centroid /= f->numedges;
+        }
+
+        // brush entity keys, e.g. _minlight
+        entity_t *ent = g_face_entity[facenum];
+        if ( ent != nullptr )
+        {
+                for ( epair_t *ep = ent->epairs; ep != nullptr; ep = ep->next )
+                {
+                        hash = HashString( hash, ep->key );
+                        hash = HashString( hash, ep->value );
+                }
+        }
+
+        return hash;
+}
+
+static uint64_t LightHash( const directlight_t *dl )
+{
+        uint64_t hash = HASH_SEED;
+        hash = HashValue( hash, dl->type );
+        hash = HashValue( hash, dl->style );
+        hash = HashValue( hash, dl->origin );
+        hash = HashValue( hash, dl->intensity );
+        hash = HashValue( hash, dl->normal );
+        hash = HashValue( hash, dl->stopdot );
+        hash = HashValue( hash, dl->stopdot2 );
+        hash = HashValue( hash, dl->exponent );
+        hash = HashValue( hash, dl->start_fade_distance );
+        hash = HashValue( hash, dl->end_fade_distance );
+        hash = HashValue( hash, dl->cap_distance );
+        hash = HashValue( hash, dl->quadratic_atten );
+        hash = HashValue( hash, dl->linear_atten );
+        hash = HashValue( hash, dl->constant_atten );
+        hash = HashValue( hash, dl->radius );
+        hash = HashValue( hash, dl->flags );
+        return hash;
+}
+
+// =====================================================================================
+//  Face helpers
+// =====================================================================================
+static void GetFaceLeafs( int facenum, pvector<int> &leafs )
+{
+        leafs.clear();
+        if ( g_face_patches[facenum] == -1 )
+                return;
+
+        for ( int p = g_face_patches[facenum]; p != -1; p = g_patches[p].next )
+        {
+                int leaf = g_patches[p].leafnum;
+                if ( leaf >= 0 && std::find( leafs.begin(), leafs.end(), leaf ) == leafs.end() )
+                {
+                        leafs.push_back( leaf );
+                }
+        }
+}
+
+static int CountFacePatches( int facenum )
+{
+        int count = 0;
+        if ( g_face_patches[facenum] == -1 )
+                return 0;
+
+        for ( int p = g_face_patches[facenum]; p != -1; p = g_patches[p].next )
+        {
+                count++;
+        }
+        return count;
+}
+
+static int LightmapSamples( int facenum, const byte *styles, int normal_count, int *bounced )
+{
+        const dface_t *f = &g_bspdata->dfaces[facenum];
+
+        int lightstyles;
+        for ( lightstyles = 0; lightstyles < MAXLIGHTMAPS; lightstyles++ )
+        {
+                if ( styles[lightstyles] == 255 )
+                        break;
+        }
+
+        int luxels = ( f->lightmap_size[0] + 1 ) * ( f->lightmap_size[1] + 1 );
+        *bounced = lightstyles ? luxels : 0;
+        return luxels * lightstyles * normal_count;
+}
+
+static int FaceLightmapSamples( int facenum, int normal_count, int *bounced )
+{
+        return LightmapSamples( facenum, g_bspdata->dfaces[facenum].styles, normal_count, bounced );
+}
+
+// A restored face gets its cached styles and lightmap back as they are, so
+// the lightmap has to be the size the face has now.
+static bool CachedLightmapFits( int facenum, const incface_t &face )
+{
+        int bounced;
+        int samples = LightmapSamples( facenum, face.styles, face.normal_count, &bounced );
+        if ( samples == 0 )
+        {
+                // no lightmap to restore
+                return true;
+        }
+
+        return (int)face.lightdata.size() == samples && (int)face.bouncedlightdata.size() == bounced;
+}
+
+static INLINE void MarkLeaf( pvector<byte> &leafs, int leaf )
+{
+        // same layout as the PVS, leaf 0 is the solid leaf
+        if ( leaf > 0 && leaf < g_bspdata->numleafs )
+        {
+                leafs[( leaf - 1 ) >> 3] |= 1 << ( ( leaf - 1 ) & 7 );
+        }
+}
+
+static INLINE bool IsSpecialFace( int facenum )
+{
+        return ( g_bspdata->texinfo[g_bspdata->dfaces[facenum].texinfo].flags & TEX_SPECIAL ) != 0;
+}
+
+// =====================================================================================
+//  Cache file
+// =====================================================================================
+class IncrementalReader
+{
+public:
+        IncrementalReader( const char *data, int length ) :
+                _data( data ), _length( length ), _pos( 0 ), _ok( true )
+        {
+        }
+
+        void read( void *out, size_t size )
+        {
+                if ( !_ok || _pos + size > (size_t)_length )
+                {
+                        _ok = false;
+                        memset( out, 0, size );
+                        return;
+                }
+                memcpy( out, _data + _pos, size );
+                _pos += size;
+        }
+
+        template<class T>
+        T get()
+        {
+                T value;
+                read( &value, sizeof( T ) );
+                return value;
+        }
+
+        template<class T>
+        void get_vector( pvector<T> &vec )
+        {
+                int count = get<int>();
+                if ( count < 0 || (size_t)count * sizeof( T ) > (size_t)_length - _pos )
+                {
+                        _ok = false;
+                        return;
+                }
+                vec.resize( count );
+                if ( count > 0 )
+                {
+                        read( vec.data(), count * sizeof( T ) );
+                }
+        }
+
+        bool is_ok() const
+        {
+                return _ok;
+        }
+
+private:
+        const char *_data;
+        int _length;
+        size_t _pos;
+        bool _ok;
+};
+
+template<class T>
+static void WriteValue( FILE *f, const T &value )
+{
+        SafeWrite( f, &value, sizeof( T ) );
+}
+
+template<class T>
+static void WriteVector( FILE *f, const pvector<T> &vec )
+{
+        WriteValue( f, (int)vec.size() );
+        if ( !vec.empty() )
+        {
+                SafeWrite( f, vec.data(), vec.size() * sizeof( T ) );
+        }
+}
+
+static void GetIncrementalFilename( char *filename )
+{
+        safe_snprintf( filename, _MAX_PATH, "%s.rinc", g_Mapname );
+}
+
+static bool LoadIncrementalFile()
+{
+        char filename[_MAX_PATH];
+        GetIncrementalFilename( filename );
+
+        if ( !q_exists( filename ) )
+        {
+                Log( "No incremental lighting cache (%s), lighting every face\n", filename );
+                return false;
+        }
+
+        char *buffer;
+        int length = LoadFile( filename, &buffer );
+        IncrementalReader reader( buffer, length );
+
+        bool ok = reader.get<int>() == INCREMENTAL_FILE_ID &&
+                reader.get<int>() == INCREMENTAL_FILE_VERSION &&
+                reader.get<int>() == (int)sizeof( incpatch_t ) &&
+                reader.get<int>() == (int)sizeof( transfer_t );
+
+        if ( ok && reader.get<uint64_t>() != s_settings_hash )
+        {
+                Log( "Lighting settings or static props changed, lighting every face\n" );
+                Free( buffer );
+                return false;
+        }
+
+        uint64_t world_hash = reader.get<uint64_t>();
+
+        int numfaces = reader.get<int>();
+        ok = ok && reader.is_ok() && numfaces >= 0 && numfaces <= MAX_MAP_FACES;
+        if ( ok )
+        {
+                s_cache.resize( numfaces );
+                for ( int i = 0; i < numfaces && reader.is_ok(); i++ )
+                {
+                        incface_t &face = s_cache[i];
+                        face.hash = reader.get<uint64_t>();
+                        face.geom_hash = reader.get<uint64_t>();
+                        face.centroid = reader.get<LVector3>();
+                        reader.read( face.styles, sizeof( face.styles ) );
+                        face.normal_count = reader.get<int>();
+                        reader.get_vector( face.patches );
+                        reader.get_vector( face.lightdata );
+                        reader.get_vector( face.bouncedlightdata );
+                }
+
+                // transfers are only valid for the exact same set of patches
+                reader.get_vector( s_cache_numtransfers );
+                reader.get_vector( s_cache_transfers );
+                if ( world_hash != s_world_hash || s_cache_numtransfers.size() != g_patches.size() )
+                {
+                        s_cache_numtransfers.clear();
+                        s_cache_transfers.clear();
+                }
+                ok = reader.is_ok();
+        }
+
+        Free( buffer );
+
+        if ( !ok )
+        {
+                Warning( "Incremental lighting cache %s is out of date or corrupt, lighting every face", filename );
+                s_cache.clear();
+                s_cache_numtransfers.clear();
+                s_cache_transfers.clear();
+                return false;
+        }
+
+        return true;
+}
+
+// =====================================================================================
+//  IncrementalPrepare
+//      Hashes the inputs of every face and decides which ones need to be lit.
+//      Run after the patches and direct lights have been created.
+// =====================================================================================
+void IncrementalPrepare()
+{
+        int numfaces = g_bspdata->numfaces;
+        int numleafs = g_bspdata->numleafs;
+
+        s_settings_hash = SettingsHash();
+
+        pvector<uint64_t> light_hashes;
+        pvector<directlight_t *> lights;
+        for ( directlight_t *dl = Lights::activelights; dl != nullptr; dl = dl->next )
+        {
+                lights.push_back( dl );
+                light_hashes.push_back( LightHash( dl ) );
+        }
+
+        s_faces.clear();
+        s_faces.resize( numfaces );
+        s_world_hash = HashValue( HASH_SEED, g_patches.size() );
+
+        pvector<pvector<int> > face_leafs( numfaces );
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                incface_t &face = s_faces[facenum];
+                pvector<int> &leafs = face_leafs[facenum];
+                GetFaceLeafs( facenum, leafs );
+
+                face.geom_hash = FaceGeometryHash( facenum, face.centroid );
+                s_world_hash = HashValue( s_world_hash, face.geom_hash );
+
+                face.hash = face.geom_hash;
+                for ( size_t i = 0; i < lights.size(); i++ )
+                {
+                        directlight_t *dl = lights[i];
+                        bool reaches = dl->pvs == nullptr || leafs.empty() ||
+                                dl->type == emit_skylight || dl->type == emit_skyambient;
+                        for ( size_t j = 0; j < leafs.size() && !reaches; j++ )
+                        {
+                                reaches = PVSCheck( dl->pvs, leafs[j] ) != 0;
+                        }
+                        if ( reaches )
+                        {
+                                face.hash = HashValue( face.hash, light_hashes[i] );
+                        }
+                }
+        }
+
+        s_cached_face.assign( numfaces, -1 );
+        s_face_state.assign( numfaces, INC_RELIGHT );
+
+        s_cache.clear();
+        s_cache_numtransfers.clear();
+        s_cache_transfers.clear();
+        if ( !LoadIncrementalFile() )
+        {
+                return;
+        }
+
+        HashToFace cache_lookup;
+        pset<uint64_t> cache_geometry;
+        for ( size_t i = 0; i < s_cache.size(); i++ )
+        {
+                cache_lookup[s_cache[i].hash] = (int)i;
+                cache_geometry.insert( s_cache[i].geom_hash );
+        }
+
+        pset<uint64_t> current_geometry;
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                current_geometry.insert( s_faces[facenum].geom_hash );
+        }
+
+        // leafs whose surroundings changed
+        pvector<byte> changed( ( MAX_MAP_LEAFS + 7 ) / 8, 0 );
+        bool any_changed = false;
+
+        pvector<bool> dirty( numfaces, false );
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                if ( IsSpecialFace( facenum ) )
+                        continue;
+
+                int idx = cache_lookup.find( s_faces[facenum].hash );
+                if ( idx != -1 )
+                {
+                        int cached = cache_lookup.get_data( idx );
+                        if ( (int)s_cache[cached].patches.size() == CountFacePatches( facenum ) &&
+                             CachedLightmapFits( facenum, s_cache[cached] ) )
+                        {
+                                s_cached_face[facenum] = cached;
+                                continue;
+                        }
+                }
+
+                dirty[facenum] = true;
+
+                // new geometry shadows what it can see, and with bounces
+                // so does any change in the light it reflects
+                if ( g_numbounce > 0 || cache_geometry.find( s_faces[facenum].geom_hash ) == cache_geometry.end() )
+                {
+                        const pvector<int> &leafs = face_leafs[facenum];
+                        for ( size_t i = 0; i < leafs.size(); i++ )
+                        {
+                                MarkLeaf( changed, leafs[i] );
+                                any_changed = true;
+                        }
+                }
+        }
+
+        // removed geometry no longer shadows what it could see
+        for ( size_t i = 0; i < s_cache.size(); i++ )
+        {
+                if ( current_geometry.find( s_cache[i].geom_hash ) == current_geometry.end() )
+                {
+                        dleaf_t *leaf = PointInLeaf( s_cache[i].centroid );
+                        if ( leaf != nullptr )
+                        {
+                                MarkLeaf( changed, leaf - g_bspdata->dleafs );
+                                any_changed = true;
+                        }
+                }
+        }
+
+        if ( any_changed )
+        {
+                pvector<byte> visible( changed );
+                byte pvs[( MAX_MAP_LEAFS + 7 ) / 8];
+                for ( int leaf = 1; leaf < numleafs; leaf++ )
+                {
+                        if ( !PVSCheck( changed.data(), leaf ) )
+                                continue;
+
+                        int visofs = g_bspdata->dleafs[leaf].visofs;
+                        if ( !g_bspdata->visdatasize || visofs == -1 )
+                        {
+                                memset( visible.data(), 255, visible.size() );
+                                break;
+                        }
+
+                        DecompressVis( g_bspdata, &g_bspdata->dvisdata[visofs], pvs, sizeof( pvs ) );
+                        for ( size_t i = 0; i < visible.size(); i++ )
+                        {
+                                visible[i] |= pvs[i];
+                        }
+                }
+
+                for ( int facenum = 0; facenum < numfaces; facenum++ )
+                {
+                        const pvector<int> &leafs = face_leafs[facenum];
+                        if ( leafs.empty() )
+                        {
+                                // we don't know where it is
+                                dirty[facenum] = true;
+                                continue;
+                        }
+                        for ( size_t i = 0; i < leafs.size() && !dirty[facenum]; i++ )
+                        {
+                                dirty[facenum] = PVSCheck( visible.data(), leafs[i] ) != 0;
+                        }
+                }
+        }
+
+        // relit faces blend with their neighbors, so the neighbors are relit
+        // too, and their own neighbors need facelights to blend with
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                s_face_state[facenum] = INC_RESTORE;
+        }
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                if ( IsSpecialFace( facenum ) || ( !dirty[facenum] && s_cached_face[facenum] != -1 ) )
+                        continue;
+
+                s_face_state[facenum] = INC_RELIGHT;
+                const faceneighbor_t *fn = &faceneighbor[facenum];
+                for ( int i = 0; i < fn->numneighbors; i++ )
+                {
+                        s_face_state[fn->neighbor[i]] = INC_RELIGHT;
+                }
+        }
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                if ( s_face_state[facenum] != INC_RELIGHT )
+                        continue;
+
+                const faceneighbor_t *fn = &faceneighbor[facenum];
+                for ( int i = 0; i < fn->numneighbors; i++ )
+                {
+                        if ( s_face_state[fn->neighbor[i]] == INC_RESTORE )
+                        {
+                                s_face_state[fn->neighbor[i]] = INC_FACELIGHTS;
+                        }
+                }
+        }
+
+        int relit = 0;
+        int facelights = 0;
+        for ( int facenum = 0; facenum < numfaces; facenum++ )
+        {
+                if ( IsSpecialFace( facenum ) )
+                        continue;
+
+                if ( s_face_state[facenum] == INC_RELIGHT )
+                        relit++;
+                else if ( s_face_state[facenum] == INC_FACELIGHTS )
+                        facelights++;
+        }
+
+        Log( "Incremental: relighting %d faces, %d more for neighbor samples, %d reused\n",
+             relit, facelights, numfaces - relit - facelights );
+}
+
+// =====================================================================================
+//  IncrementalBuildFacelights
+//      BuildFacelights for faces that need it, otherwise restores what
+//      BuildFacelights would have produced for the rest of the compile.
+// =====================================================================================
+void IncrementalBuildFacelights( int facenum )
+{
+        int cached = s_cached_face.empty() ? -1 : s_cached_face[facenum];
+        if ( cached == -1 || s_face_state[facenum] != INC_RESTORE )
+        {
+                BuildFacelights( facenum );
+                return;
+        }
+
+        const incface_t &face = s_cache[cached];
+
+        dface_t *f = &g_bspdata->dfaces[facenum];
+        f->lightofs = -1;
+        f->bouncedlightofs = -1;
+        f->sunlightofs = -1;
+        memcpy( f->styles, face.styles, sizeof( f->styles ) );
+
+        facelight_t *fl = &facelight[facenum];
+        fl->normal_count = face.normal_count;
+        fl->bumped = face.normal_count > 1;
+
+        if ( g_face_patches[facenum] == -1 )
+                return;
+
+        size_t i = 0;
+        for ( int p = g_face_patches[facenum]; p != -1; p = g_patches[p].next, i++ )
+        {
+                patch_t *patch = &g_patches[p];
+                const incpatch_t &ip = face.patches[i];
+                patch->samplelight = ip.samplelight;
+                patch->samplearea = ip.samplearea;
+                patch->totallight = ip.totallight;
+                patch->directlight = ip.directlight;
+        }
+}
+
+// =====================================================================================
+//  IncrementalCapturePatchLights
+//      Remembers the direct light on every patch, before bouncing adds to it.
+// =====================================================================================
+void IncrementalCapturePatchLights()
+{
+        for ( int facenum = 0; facenum < g_bspdata->numfaces; facenum++ )
+        {
+                incface_t &face = s_faces[facenum];
+                face.patches.clear();
+
+                if ( g_face_patches[facenum] == -1 )
+                        continue;
+
+                for ( int p = g_face_patches[facenum]; p != -1; p = g_patches[p].next )
+                {
+                        const patch_t *patch = &g_patches[p];
+                        incpatch_t ip;
+                        ip.samplelight = patch->samplelight;
+                        ip.samplearea = patch->samplearea;
+                        ip.totallight = patch->totallight;
+                        ip.directlight = patch->directlight;
+                        face.patches.push_back( ip );
+                }
+        }
+}
+
+// =====================================================================================
+//  IncrementalRestoreTransfers
+//      Reuses the transfer lists if no geometry changed at all.
+// =====================================================================================
+bool IncrementalRestoreTransfers()
+{
+        if ( s_cache_numtransfers.empty() || s_cache_numtransfers.size() != g_patches.size() )
+                return false;
+
+        size_t offset = 0;
+        g_total_transfer = 0;
+        for ( size_t i = 0; i < g_patches.size(); i++ )
+        {
+                patch_t *patch = &g_patches[i];
+                patch->numtransfers = s_cache_numtransfers[i];
+                patch->transfers = nullptr;
+                if ( patch->numtransfers > 0 )
+                {
+                        patch->transfers = (transfer_t *)calloc( 1, patch->numtransfers * sizeof( transfer_t ) );
+                        if ( !patch->transfers )
+                                Error( "Memory allocation failure" );
+                        memcpy( patch->transfers, &s_cache_transfers[offset], patch->numtransfers * sizeof( transfer_t ) );
+                }
+                offset += patch->numtransfers;
+                g_total_transfer += patch->numtransfers;
+        }
+
+        s_cache_numtransfers.clear();
+        s_cache_transfers.clear();
+
+        Log( "Reused %d transfers from the incremental lighting cache\n", (int)g_total_transfer );
+        return true;
+}
+
+// =====================================================================================
+//  IncrementalFinalLightFace
+// =====================================================================================
+void IncrementalFinalLightFace( int facenum )
+{
+        int cached = s_cached_face.empty() ? -1 : s_cached_face[facenum];
+        if ( cached == -1 || s_face_state[facenum] == INC_RELIGHT )
+        {
+                FinalLightFace( facenum );
+                return;
+        }
+
+        const incface_t &face = s_cache[cached];
+        const dface_t *f = &g_bspdata->dfaces[facenum];
+        if ( f->lightofs == -1 )
+                return;
+
+        int bounced;
+        int samples = FaceLightmapSamples( facenum, facelight[facenum].normal_count, &bounced );
+        if ( (int)face.lightdata.size() != samples || (int)face.bouncedlightdata.size() != bounced )
+        {
+                // IncrementalPrepare() already relights restored faces whose
+                // lightmap doesn't fit, so this face has its facelights and
+                // can be lit the usual way.
+                if ( s_face_state[facenum] == INC_RESTORE )
+                {
+                        Error( "Incremental lighting cache doesn't match face %d", facenum );
+                }
+                Warning( "Incremental lighting cache doesn't match face %d, relighting it", facenum );
+                FinalLightFace( facenum );
+                return;
+        }
+
+        if ( samples > 0 )
+        {
+                memcpy( &g_bspdata->lightdata[f->lightofs], face.lightdata.data(), samples * sizeof( colorrgbexp32_t ) );
+        }
+        if ( bounced > 0 )
+        {
+                memcpy( &g_bspdata->bouncedlightdata[f->bouncedlightofs], face.bouncedlightdata.data(), bounced * sizeof( colorrgbexp32_t ) );
+        }
+}
+
+// =====================================================================================
+//  IncrementalSave
+//      Writes the inputs and results of this compile for the next one.
+// =====================================================================================
+void IncrementalSave()
+{
+        char filename[_MAX_PATH];
+        GetIncrementalFilename( filename );
+
+        FILE *f = SafeOpenWrite( filename );
+
+        WriteValue( f, (int)INCREMENTAL_FILE_ID );
+        WriteValue( f, (int)INCREMENTAL_FILE_VERSION );
+        WriteValue( f, (int)sizeof( incpatch_t ) );
+        WriteValue( f, (int)sizeof( transfer_t ) );
+        WriteValue( f, s_settings_hash );
+        WriteValue( f, s_world_hash );
+
+        WriteValue( f, g_bspdata->numfaces );
+        for ( int facenum = 0; facenum < g_bspdata->numfaces; facenum++ )
+        {
+                incface_t &face = s_faces[facenum];
+                const dface_t *df = &g_bspdata->dfaces[facenum];
+
+                memcpy( face.styles, df->styles, sizeof( face.styles ) );
+                face.normal_count = facelight[facenum].normal_count;
+                face.lightdata.clear();
+                face.bouncedlightdata.clear();
+
+                if ( df->lightofs != -1 )
+                {
+                        int bounced;
+                        int samples = FaceLightmapSamples( facenum, face.normal_count, &bounced );
+                        face.lightdata.assign( &g_bspdata->lightdata[df->lightofs],
+                                               &g_bspdata->lightdata[df->lightofs] + samples );
+                        if ( df->bouncedlightofs != -1 )
+                        {
+                                face.bouncedlightdata.assign( &g_bspdata->bouncedlightdata[df->bouncedlightofs],
+                                                              &g_bspdata->bouncedlightdata[df->bouncedlightofs] + bounced );
+                        }
+                }
+
+                WriteValue( f, face.hash );
+                WriteValue( f, face.geom_hash );
+                WriteValue( f, face.centroid );
+                SafeWrite( f, face.styles, sizeof( face.styles ) );
+                WriteValue( f, face.normal_count );
+                WriteVector( f, face.patches );
+                WriteVector( f, face.lightdata );
+                WriteVector( f, face.bouncedlightdata );
+
+                // don't hold on to all the lightmaps twice
+                face.patches.clear();
+                face.lightdata.clear();
+                face.bouncedlightdata.clear();
+        }
+
+        // transfer lists, flattened
+        if ( g_numbounce > 0 )
+        {
+                WriteValue( f, (int)g_patches.size() );
+                for ( size_t i = 0; i < g_patches.size(); i++ )
+                {
+                        WriteValue( f, g_patches[i].numtransfers );
+                }
+
+                int total = 0;
+                for ( size_t i = 0; i < g_patches.size(); i++ )
+                {
+                        total += g_patches[i].numtransfers;
+                }
+
+                WriteValue( f, total );
+                for ( size_t i = 0; i < g_patches.size(); i++ )
+                {
+                        if ( g_patches[i].numtransfers > 0 )
+                        {
+                                SafeWrite( f, g_patches[i].transfers, g_patches[i].numtransfers * sizeof( transfer_t ) );
+                        }
+                }
+        }
+        else
+        {
+                WriteValue( f, 0 );
+                WriteValue( f, 0 );
+        }
+
+        fclose( f );
+
+        s_faces.clear();
+        s_cache.clear();
+
+        Log( "Wrote incremental lighting cache %s\n", filename );
+}
@@ -0,0 +1,25 @@
+/**
+ * PANDA3D BSP TOOLS
+ * Copyright (c) CIO Team. All rights reserved.
+ *
+ * @file incremental.h
+ * @author agent
+ * @date October 17, 2026
+ *
+ * @desc Per-face lighting cache for -incremental compiles.
+ *       Faces whose inputs match the cache reuse their lightmaps
+ *       instead of being lit again.
+ */
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+extern void IncrementalPrepare();
+extern void IncrementalCapturePatchLights();
+extern bool IncrementalRestoreTransfers();
+extern void IncrementalSave();
+
+extern void IncrementalBuildFacelights( int facenum );
+extern void IncrementalFinalLightFace( int facenum );
+
+#endif // INCREMENTAL_H
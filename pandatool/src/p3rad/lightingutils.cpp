@@ -393,12 +393,17 @@ static void lightsurface_findintersection_SSE( const FourVectors &start, const F
 
         surf->has_luxel = Four_Zeros;
 
+        ALIGN_16BYTE float hit_fraction[4];
+        ALIGN_16BYTE int32_t geom_id[4];
+        StoreAlignedSIMD( hit_fraction, surf->hit_fraction );
+        StoreAlignedIntSIMD( geom_id, result.geom_id );
+
         for ( int i = 0; i < 4; i++ )
         {
 
-                if ( surf->hit_fraction.m128_f32[i] < 1.0 - EQUAL_EPSILON ) // did we hit something?
+                if ( hit_fraction[i] < 1.0 - EQUAL_EPSILON ) // did we hit something?
                 {
-                        int geomidx = RADTrace::dface_lookup.find( result.geom_id.m128_u32[i] );
+                        int geomidx = RADTrace::dface_lookup.find( geom_id[i] );
                         if ( geomidx != -1 )
                         {
                                 surf->surface[i] = RADTrace::dface_lookup.get_data( geomidx );
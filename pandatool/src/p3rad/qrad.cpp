@@ -56,6 +56,8 @@ A simple summary of RAD goes as follows:
 #include "lights.h"
 #include "vismat.h"
 #include "trace.h"
+#include "incremental.h"
+#include "lightmap_palettes.h"
 //#include "clhelper.h"
 #include <virtualFileSystem.h>
 #include <simpleHashMap.h>
@@ -125,6 +127,7 @@ char            g_source[_MAX_PATH] = "";
 
 char            g_vismatfile[_MAX_PATH] = "";
 bool            g_incremental = DEFAULT_INCREMENTAL;
+bool            g_lmpalettes = DEFAULT_LMPALETTES;
 float           g_indirect_sun = DEFAULT_INDIRECT_SUN;
 bool            g_extra = DEFAULT_EXTRA;
 bool            g_texscale = DEFAULT_TEXSCALE;
@@ -1345,6 +1348,15 @@ static void     CollectLight( LVector3 &total )
         }
 }
 
+// =====================================================================================
+//  PatchTransferCost
+//      Relative cost of gathering light to a patch, for balancing the threads
+// =====================================================================================
+static float PatchTransferCost( int patchnum )
+{
+        return (float)( g_patches[patchnum].numtransfers + 1 );
+}
+
 // =====================================================================================
 //  GatherLight
 //      Get light from other g_patches
@@ -1481,7 +1493,7 @@ static void     BounceLight()
         {
                 // transfer light from to the leaf patches from other patches via transfers
                 // this moves shooter->emitlight to receiver->addlight
-                NamedRunThreadsOn( g_patches.size(), g_estimate, GatherLight );
+                NamedRunThreadsOnWeighted( g_patches.size(), g_estimate, GatherLight, PatchTransferCost );
 
                 // move newly received light (addlight) to light to be sent out (emitlight)
                 // start at children and pull light up to parents
@@ -1737,6 +1749,16 @@ static void     BuildRayTraceEnvironment()
         RADTrace::scene->update();
 }
 
+// =====================================================================================
+//  FaceLightCost
+//      Relative cost of lighting a face, for balancing the threads
+// =====================================================================================
+static float FaceLightCost( int facenum )
+{
+        const dface_t *face = &g_bspdata->dfaces[facenum];
+        return (float)( ( face->lightmap_size[0] + 1 ) * ( face->lightmap_size[1] + 1 ) );
+}
+
 // =====================================================================================
 //  RadWorld
 // =====================================================================================
@@ -1778,6 +1800,11 @@ static void     RadWorld()
 
         ScaleDirectLights();
 
+        if ( g_incremental )
+        {
+                IncrementalPrepare();
+        }
+
         Log( "\n" );
 
         // go!
@@ -1789,7 +1816,15 @@ static void     RadWorld()
         // build initial facelights
         lightinfo = (lightinfo_t *)malloc( g_bspdata->numfaces * sizeof( lightinfo_t ) );
         memset( lightinfo, 0, sizeof( lightinfo ) );
-        NamedRunThreadsOnIndividual( g_bspdata->numfaces, g_estimate, BuildFacelights ); // done
+        if ( g_incremental )
+        {
+                NamedRunThreadsOnIndividualWeighted( g_bspdata->numfaces, g_estimate, IncrementalBuildFacelights, FaceLightCost );
+                IncrementalCapturePatchLights();
+        }
+        else
+        {
+                NamedRunThreadsOnIndividualWeighted( g_bspdata->numfaces, g_estimate, BuildFacelights, FaceLightCost ); // done
+        }
         bfl_collector.stop();
 
         if ( g_numbounce > 0 )
@@ -1804,7 +1839,10 @@ static void     RadWorld()
                 addlight.resize( g_patches.size() );
                 memset( addlight.data(), 0, g_patches.size() * sizeof( bumpsample_t ) );
 
-                MakeAllScales();
+                if ( !g_incremental || !IncrementalRestoreTransfers() )
+                {
+                        MakeAllScales();
+                }
 
                 // spread light around
                 BounceLight();
@@ -1818,7 +1856,15 @@ static void     RadWorld()
         // blend bounced light into direct light and save
         PrecompLightmapOffsets();
 
-        NamedRunThreadsOnIndividual( g_bspdata->numfaces, g_estimate, FinalLightFace );
+        if ( g_incremental )
+        {
+                NamedRunThreadsOnIndividualWeighted( g_bspdata->numfaces, g_estimate, IncrementalFinalLightFace, FaceLightCost );
+                IncrementalSave();
+        }
+        else
+        {
+                NamedRunThreadsOnIndividualWeighted( g_bspdata->numfaces, g_estimate, FinalLightFace, FaceLightCost );
+        }
         if ( g_maxdiscardedlight > 0.01 )
         {
                 Verbose( "Maximum brightness loss (too many light styles on a face) = %f @(%f, %f, %f)\n", g_maxdiscardedlight, g_maxdiscardedpos[0], g_maxdiscardedpos[1], g_maxdiscardedpos[2] );
@@ -1834,6 +1880,28 @@ static void     RadWorld()
         ReportRadTimers();
 }
 
+// =====================================================================================
+//  WriteLightmapPalettes
+//      Packs the final lightmaps into the palettes the engine uploads and
+//      writes them next to the .bsp, so the level load doesn't have to.
+// =====================================================================================
+static void     WriteLightmapPalettes()
+{
+        char palettefile[_MAX_PATH];
+        safe_snprintf( palettefile, _MAX_PATH, "%s.lmpal", g_Mapname );
+
+        LightmapPalettizer lmp( g_bspdata );
+        LightmapPaletteDirectory dir = lmp.palettize_lightmaps();
+        if ( !lmp.write_palettes( dir, Filename::from_os_specific( palettefile ) ) )
+        {
+                Warning( "Couldn't write lightmap palettes to %s, they will be built at load time", palettefile );
+                return;
+        }
+
+        Log( "Wrote %u lightmap palette(s) for %u faces to %s\n",
+             (unsigned)dir.entries.size(), (unsigned)dir.face_entries.size(), palettefile );
+}
+
 // =====================================================================================
 //  Usage
 // =====================================================================================
@@ -1867,7 +1935,8 @@ static void     Usage()
         Log( "    -sky #          : Set ambient sunlight contribution in the shade outside\n" );
         Log( "    -lights file    : Manually specify a lights.rad file to use\n" );
         Log( "    -noskyfix       : Disable light_environment being global\n" );
-        Log( "    -incremental    : Use or create an incremental transfer list file\n\n" );
+        Log( "    -incremental    : Reuse lighting of unchanged faces from, and update, <map>.rinc\n" );
+        Log( "    -nolmpalettes   : Don't bake the lightmap palettes into <map>.lmpal\n\n" );
         Log( "    -dump           : Dumps light patches to a file for hlrad debugging info\n\n" );
         Log( "    -texdata #      : Alter maximum texture memory limit (in kb)\n" );
         Log( "    -lightdata #    : Alter maximum lighting memory limit (in kb)\n" ); //lightdata
@@ -2053,6 +2122,7 @@ static void     Settings()
         Log( "spread angles        [ %17s ] [ %17s ]\n", g_allow_spread ? "on" : "off", DEFAULT_ALLOW_SPREAD ? "on" : "off" );
         Log( "sky lighting fix     [ %17s ] [ %17s ]\n", g_sky_lighting_fix ? "on" : "off", DEFAULT_SKY_LIGHTING_FIX ? "on" : "off" );
         Log( "incremental          [ %17s ] [ %17s ]\n", g_incremental ? "on" : "off", DEFAULT_INCREMENTAL ? "on" : "off" );
+        Log( "lightmap palettes    [ %17s ] [ %17s ]\n", g_lmpalettes ? "on" : "off", DEFAULT_LMPALETTES ? "on" : "off" );
         Log( "dump                 [ %17s ] [ %17s ]\n", g_dumppatches ? "on" : "off", DEFAULT_DUMPPATCHES ? "on" : "off" );
 
         // ------------------------------------------------------------------------
@@ -2510,6 +2580,10 @@ int             main( const int argc, char** argv )
                                 {
                                         g_incremental = true;
                                 }
+                                else if ( !strcasecmp( argv[i], "-nolmpalettes" ) )
+                                {
+                                        g_lmpalettes = false;
+                                }
                                 else if ( !strcasecmp( argv[i], "-chart" ) )
                                 {
                                         g_chart = true;
@@ -2750,6 +2824,13 @@ int             main( const int argc, char** argv )
                         if ( g_chart )
                                 PrintBSPFileSizes( g_bspdata );
 
+                        // WriteBSPFile() swaps g_bspdata in place, so the
+                        // palettes have to be built from it first.
+                        if ( g_lmpalettes )
+                        {
+                                WriteLightmapPalettes();
+                        }
+
                         WriteBSPFile( g_bspdata, g_source );
 
                         end = I_FloatTime();
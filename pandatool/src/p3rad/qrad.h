@@ -67,6 +67,7 @@
 #define DEFAULT_SMOOTHING_VALUE     45.0
 #define DEFAULT_SMOOTHING2_VALUE	-1.0
 #define DEFAULT_INCREMENTAL         false
+#define DEFAULT_LMPALETTES          true
 
 
 // ------------------------------------------------------------------------
@@ -498,6 +499,7 @@ extern bool     g_estimate;
 extern char     g_source[_MAX_PATH];
 extern float    g_fade;
 extern bool     g_incremental;
+extern bool     g_lmpalettes;
 extern bool     g_circus;
 extern bool		g_allow_spread;
 extern bool     g_sky_lighting_fix;
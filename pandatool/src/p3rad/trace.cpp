@@ -106,38 +106,45 @@ void RADTrace::test_four_lines( const FourVectors &start, const FourVectors &end
         //PStatTimer timer( test4lines_collector );
 
         RayTraceHitResult4 result;
-
-        float frac_vis;
-        int contents;
-
         scene->trace_four_lines( start, end, test_static_props ? Four_ALL_CONTENTS_OR_PROPS : Four_ALL_CONTENTS, &result );
 
+        ALIGN_16BYTE float hit_fraction[4];
+        ALIGN_16BYTE int32_t geom_id[4];
+        ALIGN_16BYTE float frac_vis[4];
+        StoreAlignedSIMD( hit_fraction, result.hit_fraction );
+        StoreAlignedIntSIMD( geom_id, result.geom_id );
+
         for ( int i = 0; i < 4; i++ )
         {
-                frac_vis = 0.0;
-
-                if ( result.hit_fraction.m128_f32[i] < 1.0 - EQUAL_EPSILON )
+                unsigned int contents = CONTENTS_EMPTY;
+                if ( hit_fraction[i] < 1.0 - EQUAL_EPSILON )
                 {
-                        RayTraceGeometry *geom = scene->get_geometry( result.geom_id.m128_u32[i] );
-                        //if ( geom == nullptr )
-                        //{
-                        //        std::cout << "Null trace geom:\n"
-                        //                << "\thit fraction: " << result.hit_fraction.m128_f32[i] << "\n"
-                        //                << "\thit?: " << result.hit.m128_i32[i] << "\n";
-                        //}
-                        contents = geom->get_mask().get_word();
+                        contents = scene->get_geometry( (unsigned int)geom_id[i] )->get_mask().get_word();
                 }
-                else
-                {
-                        contents = CONTENTS_EMPTY;
-                }
-                if ( ( contents & contents_mask ) != 0 )
-                {
-                        frac_vis = 1.0;
-                }
-                
-                *fraction4 = SetComponentSIMD( *fraction4, i, frac_vis );
+
+                frac_vis[i] = ( contents & contents_mask ) != 0 ? 1.0f : 0.0f;
         }
+
+        *fraction4 = LoadAlignedSIMD( frac_vis );
+}
+
+/**
+ * Traces four lines at once and returns a bitmask with bit i set if line i
+ * reached its end point without hitting anything.
+ */
+int RADTrace::test_four_lines_clear( const FourVectors &start, const FourVectors &end,
+                                     bool test_static_props )
+{
+        // Hits right at the end point don't count.
+        FourVectors delta = end;
+        delta -= start;
+        delta *= 1.0f - EQUAL_EPSILON;
+        FourVectors stop = start;
+        stop += delta;
+
+        int occluded = scene->occluded_four_lines( start, stop,
+                test_static_props ? Four_ALL_CONTENTS_OR_PROPS : Four_ALL_CONTENTS );
+        return ~occluded & 0xf;
 }
 
 dface_t *RADTrace::get_dface( const RayTraceHitResult &result )
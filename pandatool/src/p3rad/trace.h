@@ -19,6 +19,8 @@ public:
         static void test_four_lines( const FourVectors &start, const FourVectors &end,
                                      fltx4 *fraction4, unsigned int contents_mask,
                                      bool test_static_props = false );
+        static int test_four_lines_clear( const FourVectors &start, const FourVectors &end,
+                                          bool test_static_props = false );
         static unsigned int test_line( const vec3_t start, const vec3_t end,
                                        float &fraction_visible, bool test_static_props = false );
 
@@ -77,7 +77,54 @@ void PvsForOrigin( LVector3& org, byte *pvs )
         DecompressVis( g_bspdata, &g_bspdata->dvisdata[visofs], pvs, sizeof( pvs ) );
 }
 
-void TestPatchToPatch( int patchidx1, int patchidx2, int head, transfer_t *transfers, int thread )
+/*
+==============
+Patch visibility batching
+
+Candidate patch pairs are collected and traced four at a time
+rather than one line per pair.
+==============
+*/
+struct visbatch_t
+{
+        int patch;
+        int others[4];
+        LVector3 start;
+        LVector3 ends[4];
+        int count;
+        transfer_t *transfers;
+};
+
+static void FlushVisBatch( visbatch_t &batch )
+{
+        if ( batch.count == 0 )
+                return;
+
+        // pad the packet with copies of the last line
+        for ( int i = batch.count; i < 4; i++ )
+        {
+                batch.ends[i] = batch.ends[batch.count - 1];
+        }
+
+        FourVectors start4, end4;
+        start4.DuplicateVector( batch.start );
+        end4.LoadAndSwizzle( batch.ends[0], batch.ends[1], batch.ends[2], batch.ends[3] );
+
+        int clear = RADTrace::test_four_lines_clear( start4, end4 );
+        for ( int i = 0; i < batch.count; i++ )
+        {
+                if ( clear & ( 1 << i ) )
+                {
+                        // line traced from patch1 to patch2 without hitting anything
+                        // create a transfer
+                        MakeTransfer( batch.patch, batch.others[i], batch.transfers );
+                }
+        }
+
+        batch.count = 0;
+}
+
+void TestPatchToPatch( int patchidx1, int patchidx2, visbatch_t &batch )
 {
         LVector3 tmp;
 
@@ -100,8 +147,8 @@ void TestPatchToPatch( int patchidx1, int patchidx2, int head, transfer_t *trans
                 // FIXME: should be based on form-factor (ie, include visible angles, etc)
                 if ( tmp.dot( tmp ) * 0.0625 < patch2->area )
                 {
-                        TestPatchToPatch( patchidx1, patch2->child1, head, transfers, thread );
-                        TestPatchToPatch( patchidx2, patch2->child2, head, transfers, thread );
+                        TestPatchToPatch( patchidx1, patch2->child1, batch );
+                        TestPatchToPatch( patchidx1, patch2->child2, batch );
                         return;
                 }
         }
@@ -113,16 +160,11 @@ void TestPatchToPatch( int patchidx1, int patchidx2, int head, transfer_t *trans
         if ( DotProduct( patch2->origin, patch->normal ) > patch->plane_dist + PLANE_TEST_EPSILON )
         {
                 // push out origins from face so that don't intersect their owners
-                vec3_t p1, p2;
-                VectorAdd( patch->origin, patch->normal, p1 );
-                VectorAdd( patch2->origin, patch2->normal, p2 );
-                float frac_vis = 0.0;
-                int contents = RADTrace::test_line( p1, p2 );
-                if ( contents == CONTENTS_EMPTY )
+                batch.others[batch.count] = patchidx2;
+                batch.ends[batch.count] = patch2->origin + patch2->normal;
+                if ( ++batch.count == 4 )
                 {
-                        // line traced from patch1 to patch2 without hitting anything
-                        // create a transfer
-                        MakeTransfer( patchidx1, patchidx2, transfers );
+                        FlushVisBatch( batch );
                 }
         }
 }
@@ -134,7 +176,7 @@ TestPatchToFace
 Sets vis bits for all patches in the face
 ==============
 */
-void TestPatchToFace( unsigned int patchnum, int facenum, int head, transfer_t *transfers, int thread )
+void TestPatchToFace( unsigned int patchnum, int facenum, visbatch_t &batch )
 {
         if ( g_face_parents[facenum] == -1 || patchnum == -1 )
                 return;
@@ -158,7 +200,7 @@ void TestPatchToFace( unsigned int patchnum, int facenum, int head, transfer_t *
                         }
 
                         int patchidx2 = patch2 - g_patches.data();
-                        TestPatchToPatch( patchnum, patchidx2, head, transfers, thread );
+                        TestPatchToPatch( patchnum, patchidx2, batch );
                 }
         }
 }
@@ -180,6 +222,12 @@ void BuildVisRow( int patchnum, byte *pvs, int head, transfer_t *transfers, int
 
         patch = &g_patches[patchnum];
 
+        visbatch_t batch;
+        batch.patch = patchnum;
+        batch.start = patch->origin + patch->normal;
+        batch.count = 0;
+        batch.transfers = transfers;
+
         for ( j = 0; j < GetNumWorldLeafs( g_bspdata ); j++ )
         {
                 if ( !( pvs[( j ) >> 3] & ( 1 << ( ( j ) & 7 ) ) ) )
@@ -201,9 +249,11 @@ void BuildVisRow( int patchnum, byte *pvs, int head, transfer_t *transfers, int
                         if ( patch->facenum == l )
                                 continue;
 
-                        TestPatchToFace( patchnum, l, head, transfers, thread );
+                        TestPatchToFace( patchnum, l, batch );
                 }
         }
+
+        FlushVisBatch( batch );
 }
 
 transfer_t *BuildVisLeafs_Start()
@@ -21,6 +21,8 @@ Contains code by Skyler "Zipster" York (zipster89134@hotmail.com) - Included wit
 #include "zlib.h"
 #endif
 
+#include <pmap.h>
+
 /*
 
 NOTES
@@ -52,6 +54,7 @@ unsigned        g_bitlongs;
 
 bool            g_fastvis = DEFAULT_FASTVIS;
 bool            g_fullvis = DEFAULT_FULLVIS;
+bool            g_pvsmatrix = DEFAULT_PVSMATRIX;
 bool            g_estimate = DEFAULT_ESTIMATE;
 bool            g_chart = DEFAULT_CHART;
 bool            g_info = DEFAULT_INFO;
@@ -725,6 +728,88 @@ static void     CalcVis()
 #ifndef ZHLT_NETVIS
 
 
+// =====================================================================================
+//  AppendVisMatrix
+//      Appends every leaf's PVS uncompressed after the compressed rows, so the
+//      engine can test visibility without decompressing anything at load.
+//      Leafs with identical rows share a cluster to keep the matrix small.
+// =====================================================================================
+static void     AppendVisMatrix()
+{
+        int numvisleafs = g_bspdata->dmodels[0].visleafs;
+        int numleafs = numvisleafs + 1;
+        int rowwords = ( numvisleafs + 31 ) >> 5;
+
+        // DecompressVis bounds checks against the lump size
+        g_bspdata->visdatasize = vismap_p - vismap;
+
+        pvector<int> leafclusters( numleafs, 0 );
+        pvector<unsigned int> rows;
+        pmap<pvector<unsigned int>, int> row_clusters;
+
+        pvector<unsigned int> row( rowwords );
+        for ( int i = 0; i < numleafs; i++ )
+        {
+                memset( row.data(), 0, rowwords * sizeof( unsigned int ) );
+
+                // leaf 0 is solid and sees nothing
+                if ( i > 0 && g_bspdata->dleafs[i].visofs != -1 )
+                {
+                        DecompressVis( g_bspdata, &vismap[g_bspdata->dleafs[i].visofs],
+                                       (byte *)row.data(), rowwords * sizeof( unsigned int ) );
+                }
+
+                pmap<pvector<unsigned int>, int>::iterator it = row_clusters.find( row );
+                if ( it == row_clusters.end() )
+                {
+                        it = row_clusters.insert( pmap<pvector<unsigned int>, int>::value_type( row, (int)row_clusters.size() ) ).first;
+                        rows.insert( rows.end(), row.begin(), row.end() );
+                }
+                leafclusters[i] = it->second;
+        }
+
+        int numclusters = (int)row_clusters.size();
+
+        // the matrix is read in place as words
+        while ( ( vismap_p - vismap ) & 3 )
+        {
+                *vismap_p++ = 0;
+        }
+
+        size_t size = sizeof( dvismatrix_t ) + numleafs * sizeof( int ) +
+                rows.size() * sizeof( unsigned int ) + sizeof( dvismatrixfooter_t );
+        if ( vismap_p + size > vismap_end )
+        {
+                Warning( "PVS matrix (%i clusters, %i bytes) doesn't fit in the visibility lump, not writing it",
+                         numclusters, (int)size );
+                g_bspdata->visdatasize = vismap_p - vismap;
+                return;
+        }
+
+        dvismatrix_t header;
+        header.magic = PVSMATRIX_MAGIC;
+        header.numleafs = numleafs;
+        header.numclusters = numclusters;
+        header.rowwords = rowwords;
+
+        dvismatrixfooter_t footer;
+        footer.magic = PVSMATRIX_MAGIC;
+        footer.ofs = vismap_p - vismap;
+
+        memcpy( vismap_p, &header, sizeof( header ) );
+        vismap_p += sizeof( header );
+        memcpy( vismap_p, leafclusters.data(), numleafs * sizeof( int ) );
+        vismap_p += numleafs * sizeof( int );
+        memcpy( vismap_p, rows.data(), rows.size() * sizeof( unsigned int ) );
+        vismap_p += rows.size() * sizeof( unsigned int );
+        memcpy( vismap_p, &footer, sizeof( footer ) );
+        vismap_p += sizeof( footer );
+
+        g_bspdata->visdatasize = vismap_p - vismap;
+
+        Log( "PVS matrix: %i leafs in %i clusters, %i bytes\n", numleafs, numclusters, (int)size );
+}
+
 // AJM: MVD
 // =====================================================================================
 //  SaveVisData
@@ -1105,7 +1190,8 @@ static void     Usage()
         Log( "\n-= %s Options =-\n\n", g_Program );
         Log( "    -lang file      : localization file\n" );
         Log( "    -full           : Full vis\n" );
-        Log( "    -fast           : Fast vis\n\n" );
+        Log( "    -fast           : Fast vis\n" );
+        Log( "    -pvsmatrix      : Also write the PVS uncompressed, grouped into clusters\n\n" );
 #ifdef ZHLT_NETVIS
         Log( "    -connect address : Connect to netvis server at address as a client\n" );
         Log( "    -server          : Run as the netvis server\n" );
@@ -1198,6 +1284,7 @@ static void     Settings()
         // HLVIS Specific Settings
         Log( "fast vis            [ %7s ] [ %7s ]\n", g_fastvis ? "on" : "off", DEFAULT_FASTVIS ? "on" : "off" );
         Log( "full vis            [ %7s ] [ %7s ]\n", g_fullvis ? "on" : "off", DEFAULT_FULLVIS ? "on" : "off" );
+        Log( "pvs matrix          [ %7s ] [ %7s ]\n", g_pvsmatrix ? "on" : "off", DEFAULT_PVSMATRIX ? "on" : "off" );
 
 #ifdef ZHLT_NETVIS
         if ( g_vismode == VIS_MODE_SERVER )
@@ -1361,6 +1448,10 @@ int             main( const int argc, char** argv )
                                 {
                                         g_fullvis = true;
                                 }
+                                else if ( !strcasecmp( argv[i], "-pvsmatrix" ) )
+                                {
+                                        g_pvsmatrix = true;
+                                }
                                 else if ( !strcasecmp( argv[i], "-dev" ) )
                                 {
                                         if ( i + 1 < argc )	//added "1" .--vluzacn
@@ -1736,6 +1827,11 @@ int             main( const int argc, char** argv )
                         g_bspdata->visdatasize = vismap_p - g_bspdata->dvisdata;
                         Log( "g_visdatasize:%i  compressed from %i\n", g_bspdata->visdatasize, originalvismapsize );
 
+                        if ( g_pvsmatrix )
+                        {
+                                AppendVisMatrix();
+                        }
+
                         if ( g_chart )
                         {
                                 PrintBSPFileSizes( g_bspdata );
@@ -31,6 +31,7 @@
 #define DEFAULT_ESTIMATE    true
 #endif
 #define DEFAULT_FASTVIS     false
+#define DEFAULT_PVSMATRIX   false
 #define DEFAULT_NETVIS_PORT 21212
 #define DEFAULT_NETVIS_RATE 60
 
@@ -136,6 +137,7 @@ typedef struct
 
 extern bool     g_fastvis;
 extern bool     g_fullvis;
+extern bool     g_pvsmatrix;
 
 extern int      g_numportals;
 extern unsigned g_portalleafs;
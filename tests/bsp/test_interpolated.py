@@ -0,0 +1,65 @@
+import pytest
+
+bsp = pytest.importorskip("panda3d.bsp")
+from panda3d.core import LVector3f
+
+
+def make_group(batched, flags):
+    group = bsp.CInterpolatedGroup()
+    group.set_batched(batched)
+    value = LVector3f(0)
+    var = bsp.CInterpolatedVec3("value")
+    group.add_vec3(value, var, bsp.LATCH_SIMULATION_VAR | flags)
+    assert group.is_batched() == batched
+    return group, value, var
+
+
+def run_groups(flags, samples, frames):
+    plain, plain_value, plain_var = make_group(False, flags)
+    batched, batched_value, batched_var = make_group(True, flags)
+
+    results = []
+    samples = list(samples)
+    for now in frames:
+        while samples and samples[0][0] <= now:
+            changetime, sample = samples.pop(0)
+            for group, value in ((plain, plain_value), (batched, batched_value)):
+                value.set(*sample)
+                group.on_latch_interpolated_vars(bsp.LATCH_SIMULATION_VAR, changetime)
+
+        plain.interpolate(now)
+        bsp.CInterpolatedGroup.interpolate_all(now)
+        results.append((LVector3f(plain_value), LVector3f(batched_value)))
+
+    batched.set_batched(False)
+    return results
+
+
+def motion(count):
+    # Uneven steps and a stop, so hermite, linear and held cases all occur.
+    t = 0.0
+    for i in range(count):
+        t += 0.05 + 0.01 * (i % 3)
+        x = min(i, count // 2) * 1.5
+        yield t, (x, x * x * 0.1, -x)
+
+
+def frame_times(end):
+    return [i * 0.016 for i in range(int(end / 0.016) + 20)]
+
+
+@pytest.mark.parametrize("flags", [0, bsp.INTERPOLATE_LINEAR_ONLY])
+def test_batched_matches_unbatched(flags):
+    samples = list(motion(20))
+    results = run_groups(flags, samples, frame_times(samples[-1][0]))
+    for plain, batched in results:
+        assert batched.almost_equal(plain, 1e-4)
+
+
+def test_batched_matches_unbatched_time_reversed():
+    samples = list(motion(12))
+    frames = frame_times(samples[-1][0])
+    frames = frames + frames[len(frames) // 2::-1]
+    results = run_groups(0, samples, frames)
+    for plain, batched in results:
+        assert batched.almost_equal(plain, 1e-4)
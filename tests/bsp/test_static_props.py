@@ -0,0 +1,68 @@
+import os
+import pytest
+
+bsp = pytest.importorskip("panda3d.bsp")
+from panda3d.core import Filename, load_prc_file_data
+
+
+@pytest.fixture(scope='module')
+def level():
+    # There is no level with static props in the tree, so one has to be
+    # pointed to.
+    path = os.environ.get('BSP_TEST_LEVEL')
+    if not path:
+        pytest.skip("set BSP_TEST_LEVEL to a level with static props")
+    return Filename.from_os_specific(path)
+
+
+def load_level(level, instanced):
+    load_prc_file_data("", "bsp-instance-static-props {0}".format(int(instanced)))
+    loader = bsp.BSPLoader()
+    bsp.BSPLoader.set_global_ptr(loader)
+    assert loader.read(level)
+    return loader
+
+
+def instanced_groups(loader):
+    result = loader.get_result()
+    return [np for np in result.get_children() if np.get_instance_count() > 0]
+
+
+def count_props(loader):
+    # Props that weren't instanced get a node each, unless they were
+    # flattened into a leaf group.
+    result = loader.get_result()
+    count = 0
+    for np in result.get_children():
+        if np.get_instance_count() > 0:
+            count += np.get_instance_count()
+        elif np.node().is_of_type(bsp.BSPProp) and not np.get_name().startswith("propGroupLeaf"):
+            count += 1
+    return count
+
+
+def test_static_props_not_instanced(level):
+    loader = load_level(level, False)
+    try:
+        assert not instanced_groups(loader)
+        assert count_props(loader) > 0
+    finally:
+        loader.cleanup()
+
+
+def test_static_props_instanced(level):
+    plain = load_level(level, False)
+    try:
+        plain_count = count_props(plain)
+    finally:
+        plain.cleanup()
+
+    loader = load_level(level, True)
+    try:
+        assert instanced_groups(loader)
+        # Instancing takes props out of the flattened leaf groups, so it can
+        # only find more of them, never lose any.
+        assert count_props(loader) >= plain_count
+    finally:
+        loader.cleanup()
+        load_prc_file_data("", "bsp-instance-static-props 0")
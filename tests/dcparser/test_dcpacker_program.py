@@ -0,0 +1,161 @@
+import os
+import time
+
+import pytest
+
+direct = pytest.importorskip("panda3d.direct")
+core = pytest.importorskip("panda3d.core")
+
+
+DC_SOURCE = """
+dclass Thing {
+  setPos(int16 / 10 x, int16 / 10 y, int16 / 10 z) broadcast;
+  setH(int16 % 360 / 10 h) broadcast;
+  setRanged(uint8(0-100) value) broadcast;
+  setIds(uint32 a, uint64 b, int64 c, int8 d, uint16 e) broadcast;
+  setFloat(float64 f) broadcast;
+  setName(string name) broadcast;
+  setData(blob data) broadcast;
+  setList(uint32 values[]) broadcast;
+  setX(int32 x) broadcast;
+  setY(int32 y) broadcast;
+  setXY : setX, setY;
+};
+"""
+
+SAMPLES = [
+    ("setPos", (1.5, -2.3, 100.0)),
+    ("setH", (-90.0,)),
+    ("setH", (450.0,)),
+    ("setRanged", (42,)),
+    ("setIds", (0xffffffff, 0xffffffffffffffff, -0x8000000000000000, -128, 65535)),
+    ("setIds", (1.0, 2, 3, 4, 5)),
+    ("setFloat", (3.25,)),
+    ("setFloat", (7,)),
+    ("setName", ("hello",)),
+    ("setData", (b"\x00\x01\x02",)),
+    ("setX", (-12345,)),
+    ("setXY", (1, -1)),
+]
+
+
+@pytest.fixture
+def dcfile(tmpdir):
+    path = tmpdir.join("test.dc")
+    path.write(DC_SOURCE)
+
+    dcfile = direct.DCFile()
+    assert dcfile.read(core.Filename.from_os_specific(str(path)))
+    return dcfile
+
+
+def get_field(dcfile, name):
+    return dcfile.get_class_by_name("Thing").get_field_by_name(name)
+
+
+def pack(field, args, use_programs):
+    packer = direct.DCPacker()
+    packer.set_use_programs(use_programs)
+    packer.begin_pack(field)
+    field.pack_args(packer, args)
+    assert packer.end_pack()
+    return packer.get_bytes()
+
+
+def unpack(field, data, use_programs):
+    packer = direct.DCPacker()
+    packer.set_use_programs(use_programs)
+    packer.set_unpack_data(data)
+    packer.begin_unpack(field)
+    args = field.unpack_args(packer)
+    assert packer.end_unpack()
+    return args
+
+
+def test_program_fields(dcfile):
+    for name, args in SAMPLES:
+        assert get_field(dcfile, name).has_program()
+
+    # Arrays are still packed by walking the field.
+    assert not get_field(dcfile, "setList").has_program()
+
+
+def test_program_matches_walker(dcfile):
+    for name, args in SAMPLES:
+        field = get_field(dcfile, name)
+
+        data = pack(field, args, True)
+        assert data == pack(field, args, False)
+
+        result = unpack(field, data, True)
+        assert type(result) is tuple
+        assert result == unpack(field, data, False)
+
+
+def test_program_range_error(dcfile):
+    field = get_field(dcfile, "setRanged")
+
+    for use_programs in (True, False):
+        packer = direct.DCPacker()
+        packer.set_use_programs(use_programs)
+        packer.begin_pack(field)
+        with pytest.raises(ValueError):
+            field.pack_args(packer, (150,))
+
+
+def test_program_wrong_args(dcfile):
+    field = get_field(dcfile, "setPos")
+
+    for args in ((1, 2), (1, 2, 3, 4), (1, (2,), 3)):
+        for use_programs in (True, False):
+            packer = direct.DCPacker()
+            packer.set_use_programs(use_programs)
+            packer.begin_pack(field)
+            with pytest.raises(TypeError):
+                field.pack_args(packer, args)
+
+
+def test_program_truncated(dcfile):
+    field = get_field(dcfile, "setIds")
+    data = pack(field, (1, 2, 3, 4, 5), True)
+
+    for use_programs in (True, False):
+        packer = direct.DCPacker()
+        packer.set_use_programs(use_programs)
+        packer.set_unpack_data(data[:-1])
+        packer.begin_unpack(field)
+        with pytest.raises(RuntimeError):
+            field.unpack_args(packer)
+
+
+def test_program_benchmark():
+    # Times unpacking and repacking the default value of every field in
+    # direct.dc, with and without the fields' programs.
+    path = os.path.join(os.path.dirname(__file__), "..", "..",
+                        "direct", "src", "distributed", "direct.dc")
+    if not os.path.exists(path):
+        pytest.skip("direct.dc not found")
+
+    dcfile = direct.DCFile()
+    assert dcfile.read(core.Filename.from_os_specific(os.path.abspath(path)))
+
+    fields = []
+    for i in range(dcfile.get_num_classes()):
+        dclass = dcfile.get_class(i)
+        for j in range(dclass.get_num_fields()):
+            field = dclass.get_field(j)
+            if field.has_program():
+                fields.append((field, field.get_default_value()))
+    assert fields
+
+    times = {}
+    for use_programs in (False, True):
+        start = time.perf_counter()
+        for k in range(200):
+            for field, data in fields:
+                args = unpack(field, data, use_programs)
+                assert pack(field, args, use_programs) == data
+        times[use_programs] = time.perf_counter() - start
+
+    print("\n%d fields: walker %.3fs, programs %.3fs" %
+          (len(fields), times[False], times[True]))
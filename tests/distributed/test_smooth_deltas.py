@@ -0,0 +1,370 @@
+import os
+import socket
+import struct
+import time
+
+import pytest
+
+core = pytest.importorskip("panda3d.core")
+direct = pytest.importorskip("panda3d.direct")
+
+
+DC_FILE = os.path.join(os.path.dirname(__file__), '..', '..',
+                       'direct', 'src', 'distributed', 'direct.dc')
+
+CLIENT_OBJECT_SET_FIELD = 120
+STATESERVER_OBJECT_SET_FIELD = 2020
+
+AI_CHANNEL = 4000
+
+# The clock delta of every node; CDistributedSmoothNodeBase doesn't hold a
+# reference to it.
+class ClockDelta:
+    delta = 0.0
+
+CLOCK_DELTA = ClockDelta()
+
+
+def read_dc_file(dc_file):
+    if not os.path.exists(DC_FILE):
+        pytest.skip("direct.dc not found")
+    assert dc_file.read(core.Filename.from_os_specific(DC_FILE))
+    return dc_file
+
+
+def recv_exactly(sock, size):
+    data = b''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        assert chunk, "connection closed"
+        data += chunk
+    return data
+
+
+class Loopback:
+    """A CConnectionRepository connected to a socket that stands in for the
+    server, which reads and writes its datagrams with the default two byte
+    length header."""
+
+    def __init__(self, listener, client_datagram=True):
+        self.repo = direct.CConnectionRepository()
+        self.dc_file = read_dc_file(self.repo.get_dc_file())
+        self.dclass = self.dc_file.get_class_by_name('DistributedSmoothNode')
+        self.repo.set_client_datagram(client_datagram)
+        # Anything not handled natively is left to the caller.
+        self.repo.set_handle_c_updates(False)
+
+        port = listener.getsockname()[1]
+        if not self.repo.try_connect_net(core.URLSpec('http://127.0.0.1:%d' % port)):
+            pytest.skip("cannot connect to localhost")
+        self.peer, addr = listener.accept()
+        self.peer.settimeout(5.0)
+        self.nodes = []
+
+    def make_node(self, do_id, is_ai=False, location=(1000, 2000), bind=False):
+        node = direct.CDistributedSmoothNodeBase()
+        node.set_repository(self.repo, is_ai, AI_CHANNEL)
+        node.set_clock_delta(CLOCK_DELTA)
+        node_path = core.NodePath('smooth-%d' % do_id)
+        node.initialize(node_path, self.dclass, do_id)
+        node.set_location(*location)
+        if bind:
+            node.bind_native_updates(True)
+        self.nodes.append(node)
+        return node, node_path
+
+    def close(self):
+        # The nodes may outlive us; don't leave them pointing at the
+        # repository.
+        direct.CDistributedSmoothNodeBase.flush_deltas()
+        for node in self.nodes:
+            node.unbind_native_updates()
+        self.repo.disconnect()
+        self.peer.close()
+
+    def recv(self):
+        """Returns the next update sent by the repository, as the message
+        type, object, field name and arguments."""
+        self.repo.flush()
+        length, = struct.unpack('<H', recv_exactly(self.peer, 2))
+        dg = core.Datagram(recv_exactly(self.peer, length))
+        di = core.DatagramIterator(dg)
+        if not self.repo.get_client_datagram():
+            # The channels and the sender.
+            for i in range(di.get_uint8()):
+                di.get_uint64()
+            di.get_uint64()
+        msg_type = di.get_uint16()
+        do_id = di.get_uint32()
+        field = self.dc_file.get_field_by_index(di.get_uint16())
+
+        packer = direct.DCPacker()
+        packer.set_unpack_data(di.get_remaining_bytes())
+        packer.begin_unpack(field)
+        args = field.unpack_args(packer)
+        assert packer.end_unpack()
+        return msg_type, do_id, field.get_name(), args
+
+    def send(self, do_id, field_name, args):
+        """Sends the repository an update, in the form it expects, and waits
+        for it to be applied natively."""
+        field = self.dclass.get_field_by_name(field_name)
+        if self.repo.get_client_datagram():
+            dg = field.client_format_update(do_id, args)
+        else:
+            dg = field.ai_format_update(do_id, AI_CHANNEL, 1234, args)
+        data = dg.get_message()
+        self.peer.sendall(struct.pack('<H', len(data)) + data)
+
+        count = self.repo.get_num_native_updates() + 1
+        end = time.time() + 5.0
+        while self.repo.get_num_native_updates() < count:
+            assert not self.repo.check_datagram(), "update not handled natively"
+            assert time.time() < end, "update not received"
+            time.sleep(0.001)
+
+
+@pytest.fixture
+def listener():
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.bind(('127.0.0.1', 0))
+    server.listen(4)
+    yield server
+    server.close()
+
+
+@pytest.fixture
+def client(listener):
+    loopback = Loopback(listener)
+    yield loopback
+    loopback.close()
+
+
+@pytest.fixture
+def ai(listener):
+    loopback = Loopback(listener, client_datagram=False)
+    yield loopback
+    loopback.close()
+
+
+def broadcast(loopback, node):
+    node.broadcast_pos_hpr_delta()
+    direct.CDistributedSmoothNodeBase.flush_deltas()
+    return loopback.recv()
+
+
+def relay(sender, receiver, node):
+    """Broadcasts the node's offsets from the sender and applies the update
+    to the receiver, as the server would.  Returns the update's field name and
+    arguments."""
+    msg_type, do_id, name, args = broadcast(sender, node)
+    receiver.send(do_id, name, args)
+    return name, args
+
+
+def test_pack_sm_deltas():
+    dc_file = read_dc_file(direct.DCFile())
+    field = dc_file.get_class_by_name('DistributedSmoothNode').get_field_by_name('setSmDeltas')
+
+    deltas = [(1000, 1.2, -12.8, 0.0, 3.5), (4000000000, 12.7, 0.1, -0.3, -63.5)]
+    packer = direct.DCPacker()
+    packer.begin_pack(field)
+    assert field.pack_args(packer, (deltas, -1234))
+    assert packer.end_pack()
+    # A uint32 and four int8 per node, after the array length.
+    assert packer.get_length() == 2 + 2 * 8 + 2
+
+    packer.set_unpack_data(packer.get_bytes())
+    packer.begin_unpack(field)
+    unpacked, timestamp = field.unpack_args(packer)
+    assert packer.end_unpack()
+    assert timestamp == -1234
+    assert len(unpacked) == len(deltas)
+    for got, expected in zip(unpacked, deltas):
+        assert got[0] == expected[0]
+        assert got[1:] == pytest.approx(expected[1:])
+
+    # An offset that doesn't fit in an int8.
+    packer = direct.DCPacker()
+    packer.begin_pack(field)
+    with pytest.raises(ValueError):
+        field.pack_args(packer, ([(1000, 12.8, 0, 0, 0)], 0))
+
+
+def test_delta_offsets_round_trip(client, listener):
+    receiver = Loopback(listener)
+    try:
+        node, node_path = client.make_node(1000)
+        other, other_path = receiver.make_node(1000, bind=True)
+
+        assert relay(client, receiver, node)[0] == 'setSmPosHpr'
+
+        # Moves that don't fall on tenths, which must not add up to any
+        # drift on the other end.  None of them land near a half tenth.
+        x = y = z = 0.0
+        for i in range(15):
+            x += 0.32
+            y -= 0.123
+            z += 0.04
+            node_path.set_pos(x, y, z)
+            name, args = relay(client, receiver, node)
+            assert name.startswith('setSmDelta')
+            assert other_path.get_x() == pytest.approx(round(x, 1), abs=1e-4)
+            assert other_path.get_y() == pytest.approx(round(y, 1), abs=1e-4)
+            assert other_path.get_z() == pytest.approx(round(z, 1), abs=1e-4)
+
+        # Only what changed is sent.
+        node_path.set_x(x + 1.0)
+        name, args = relay(client, receiver, node)
+        assert name == 'setSmDeltaXY'
+        assert args[:2] == pytest.approx((1.0, 0.0))
+    finally:
+        receiver.close()
+
+
+def test_delta_heading_wraps(client, listener):
+    receiver = Loopback(listener)
+    try:
+        node, node_path = client.make_node(1000)
+        other, other_path = receiver.make_node(1000, bind=True)
+
+        node_path.set_h(355)
+        assert relay(client, receiver, node)[0] == 'setSmPosHpr'
+        assert other_path.get_h() == pytest.approx(355)
+
+        # The short way around, across 0.
+        for h, dh in ((3, 8), (358, -5), (-10, -8), (20, 30)):
+            node_path.set_h(h)
+            name, args = relay(client, receiver, node)
+            assert name == 'setSmDeltaXYH'
+            assert args[2] == pytest.approx(dh)
+            assert 0 <= other_path.get_h() < 360
+            assert other_path.get_h() == pytest.approx(h % 360)
+    finally:
+        receiver.close()
+
+
+def test_delta_keyframe_when_offset_too_big(client):
+    node, node_path = client.make_node(1000)
+    assert broadcast(client, node)[2] == 'setSmPosHpr'
+
+    # 12.7 feet fits in an int8 of tenths; 12.8 doesn't.
+    node_path.set_x(12.7)
+    msg_type, do_id, name, args = broadcast(client, node)
+    assert msg_type == CLIENT_OBJECT_SET_FIELD
+    assert do_id == 1000
+    assert name == 'setSmDeltaXY'
+    assert args[0] == pytest.approx(12.7)
+
+    node_path.set_x(25.5)
+    msg_type, do_id, name, args = broadcast(client, node)
+    assert name == 'setSmPosHpr'
+    assert args[0] == pytest.approx(25.5)
+
+    # Likewise 63.5 degrees, in half degrees.
+    node_path.set_h(63.5)
+    assert broadcast(client, node)[2] == 'setSmDeltaXYH'
+    node_path.set_h(127.5)
+    msg_type, do_id, name, args = broadcast(client, node)
+    assert name == 'setSmPosHpr'
+    assert args[3] == pytest.approx(127.5)
+
+    # So does a change in P or R, which have no offsets.
+    node_path.set_p(10)
+    assert broadcast(client, node)[2] == 'setSmPosHpr'
+
+
+def test_delta_stop_away_from_keyframe(client):
+    node, node_path = client.make_node(1000)
+    assert broadcast(client, node)[2] == 'setSmPosHpr'
+
+    # At rest on the keyframe, one setSmStop is sent, and then nothing.
+    assert broadcast(client, node)[2] == 'setSmStop'
+    node.broadcast_pos_hpr_delta()
+    node.send_everything()
+    assert client.recv()[2] == 'setSmPosHprL'
+
+    # At rest away from the keyframe, the rest position is sent as one, so
+    # that observers that arrive later see it, and then nothing.
+    node_path.set_pos(1, 2, 0)
+    assert broadcast(client, node)[2] == 'setSmDeltaXY'
+    msg_type, do_id, name, args = broadcast(client, node)
+    assert name == 'setSmPosHpr'
+    assert args[:3] == pytest.approx((1, 2, 0))
+    node.broadcast_pos_hpr_delta()
+    node.send_everything()
+    assert client.recv()[2] == 'setSmPosHprL'
+
+
+def test_sm_deltas_batched_by_location(ai):
+    nodes = []
+    for do_id, location in ((1000, (1, 2)), (1001, (1, 3)), (1002, (1, 2))):
+        node, node_path = ai.make_node(do_id, is_ai=True, location=location)
+        node.broadcast_pos_hpr_delta()
+        nodes.append((node, node_path))
+    direct.CDistributedSmoothNodeBase.flush_deltas()
+    assert sorted(ai.recv()[1] for i in range(3)) == [1000, 1001, 1002]
+
+    for node, node_path in nodes:
+        node_path.set_x(node_path.get_x() + 1)
+        node.broadcast_pos_hpr_delta()
+    direct.CDistributedSmoothNodeBase.flush_deltas()
+
+    updates = {}
+    for i in range(2):
+        msg_type, do_id, name, args = ai.recv()
+        assert msg_type == STATESERVER_OBJECT_SET_FIELD
+        updates[do_id] = (name, args)
+
+    # The nodes in the same location go out together, on the first of them.
+    name, args = updates[1000]
+    assert name == 'setSmDeltas'
+    assert sorted(delta[0] for delta in args[0]) == [1000, 1002]
+    name, args = updates[1001]
+    assert name == 'setSmDeltaXY'
+
+    # Moving a node flushes its queued offsets to its old location.
+    node, node_path = nodes[2]
+    node_path.set_x(node_path.get_x() + 1)
+    node.broadcast_pos_hpr_delta()
+    node.set_location(1, 3)
+    msg_type, do_id, name, args = ai.recv()
+    assert (do_id, name) == (1002, 'setSmDeltaXY')
+
+
+def test_sm_deltas_sent_separately_by_client(client):
+    nodes = [client.make_node(do_id) for do_id in (1000, 1001)]
+    for node, node_path in nodes:
+        assert broadcast(client, node)[2] == 'setSmPosHpr'
+
+    # A client may only update its own objects.
+    for node, node_path in nodes:
+        node_path.set_y(1)
+        node.broadcast_pos_hpr_delta()
+    direct.CDistributedSmoothNodeBase.flush_deltas()
+    updates = sorted(client.recv()[1:3] for i in range(2))
+    assert updates == [(1000, 'setSmDeltaXY'), (1001, 'setSmDeltaXY')]
+
+
+def test_sm_deltas_applied_in_location(client):
+    carrier, carrier_path = client.make_node(1000, location=(1, 2), bind=True)
+    near, near_path = client.make_node(1001, location=(1, 2), bind=True)
+    far, far_path = client.make_node(1002, location=(1, 3), bind=True)
+
+    deltas = [(1000, 1, 0, 0, 0), (1001, 0, 1, 0, 45), (1002, 1, 1, 1, 0)]
+    client.send(1000, 'setSmDeltas', (deltas, 0))
+    assert carrier_path.get_pos() == core.LPoint3(1, 0, 0)
+    assert near_path.get_pos() == core.LPoint3(0, 1, 0)
+    assert near_path.get_h() == pytest.approx(45)
+    assert far_path.get_pos() == core.LPoint3(0, 0, 0)
+
+
+def test_sm_deltas_ai_applies_only_carrier(ai):
+    carrier, carrier_path = ai.make_node(1000, is_ai=True, bind=True)
+    other, other_path = ai.make_node(1001, is_ai=True, bind=True)
+
+    deltas = [(1000, 1, 0, 0, -1), (1001, 0, 1, 0, 0)]
+    ai.send(1000, 'setSmDeltas', (deltas, 0))
+    assert carrier_path.get_pos() == core.LPoint3(1, 0, 0)
+    assert carrier_path.get_h() == pytest.approx(359)
+    assert other_path.get_pos() == core.LPoint3(0, 0, 0)
@@ -0,0 +1,63 @@
+import socket
+import time
+
+import pytest
+
+from panda3d import core
+
+
+def wait_for(condition, timeout=5.0):
+    end = time.time() + timeout
+    while not condition():
+        if time.time() > end:
+            return False
+        time.sleep(0.01)
+    return True
+
+
+@pytest.mark.skipif(not core.Thread.is_threading_supported(),
+                    reason="requires threads")
+def test_reader_idles_after_peer_closes():
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.bind(('127.0.0.1', 0))
+    server.listen(1)
+    port = server.getsockname()[1]
+
+    # The connection belongs to another manager, so the reader's manager
+    # can't close it when the peer goes away; the reader has to stop
+    # watching the socket by itself.
+    owner = core.QueuedConnectionManager()
+    manager = core.QueuedConnectionManager()
+    reader = core.QueuedConnectionReader(manager, 1)
+
+    conn = owner.open_TCP_client_connection('127.0.0.1', port, 3000)
+    assert conn is not None
+    peer, addr = server.accept()
+    server.close()
+
+    assert reader.add_connection(conn)
+
+    # A datagram gets through, with the default two byte length header.
+    peer.sendall(b'\x03\x00abc')
+    assert wait_for(reader.data_available)
+    datagram = core.NetDatagram()
+    assert reader.get_data(datagram)
+    assert datagram.get_message() == b'abc'
+
+    peer.close()
+    assert wait_for(manager.reset_connection_available)
+    reset = core.PointerToConnection()
+    assert manager.get_reset_connection(reset)
+    assert reset.p() == conn
+    assert wait_for(lambda: not reader.is_connection_ok(conn))
+
+    # The closed socket stays readable.  The reader thread must not keep
+    # waking up for it.
+    start = time.process_time()
+    time.sleep(1.0)
+    assert time.process_time() - start < 0.5
+    assert not manager.reset_connection_available()
+
+    reader.remove_connection(conn)
+    reader.shutdown()
+    owner.close_connection(conn)
@@ -0,0 +1,227 @@
+import pytest
+
+rplight = pytest.importorskip("panda3d._rplight")
+
+
+def covered_tiles(region):
+    x, y, w, h = region
+    return set((x + i, y + j) for i in range(w) for j in range(h))
+
+
+def test_shadow_atlas_empty():
+    atlas = rplight.ShadowAtlas(512, 32)
+    assert atlas.get_tile_size() == 32
+    assert atlas.get_required_tiles(128) == 4
+    assert atlas.num_used_tiles == 0
+    assert atlas.coverage == 0
+    assert atlas.has_free_region(16, 16)
+    assert not atlas.has_free_region(17, 17)
+
+
+def test_shadow_atlas_reserve_whole():
+    atlas = rplight.ShadowAtlas(512, 32)
+    region = atlas.find_and_reserve_region(16, 16)
+    assert tuple(region) == (0, 0, 16, 16)
+    assert tuple(atlas.region_to_uv(region)) == (0, 0, 1, 1)
+    assert atlas.coverage == 1
+    assert not atlas.has_free_region(1, 1)
+
+    atlas.free_region(region)
+    assert atlas.num_used_tiles == 0
+    assert atlas.has_free_region(16, 16)
+
+
+def test_shadow_atlas_regions_disjoint():
+    atlas = rplight.ShadowAtlas(512, 32)
+    used = set()
+    regions = []
+    for size in (8, 4, 4, 2, 2, 2, 2, 1, 1, 1, 1):
+        region = atlas.find_and_reserve_region(size, size)
+        assert tuple(region) != (-1, -1, -1, -1)
+        tiles = covered_tiles(region)
+        assert not (tiles & used)
+        assert all(0 <= x < 16 and 0 <= y < 16 for x, y in tiles)
+        used |= tiles
+        regions.append(region)
+
+    assert atlas.num_used_tiles == len(used)
+
+    for region in regions:
+        atlas.free_region(region)
+    assert atlas.num_used_tiles == 0
+    assert atlas.has_free_region(16, 16)
+
+
+def test_shadow_atlas_full():
+    atlas = rplight.ShadowAtlas(512, 32)
+    regions = [atlas.find_and_reserve_region(8, 8) for i in range(4)]
+    assert not atlas.has_free_region(1, 1)
+    assert tuple(atlas.find_and_reserve_region(1, 1)) == (-1, -1, -1, -1)
+
+    # The freed block is handed out again
+    atlas.free_region(regions[2])
+    assert atlas.has_free_region(8, 8)
+    assert not atlas.has_free_region(9, 9)
+    assert tuple(atlas.find_and_reserve_region(8, 8)) == tuple(regions[2])
+
+
+def test_shadow_atlas_buddies_merge():
+    atlas = rplight.ShadowAtlas(512, 32)
+    regions = [atlas.find_and_reserve_region(1, 1) for i in range(256)]
+    assert len(set(tuple(region) for region in regions)) == 256
+    assert atlas.coverage == 1
+
+    for region in regions[:-1]:
+        atlas.free_region(region)
+    assert not atlas.has_free_region(16, 16)
+    assert atlas.has_free_region(8, 8)
+
+    atlas.free_region(regions[-1])
+    assert atlas.has_free_region(16, 16)
+
+
+def test_shadow_atlas_keeps_big_blocks():
+    atlas = rplight.ShadowAtlas(512, 32)
+    # Small regions are packed together, so a big block stays free.
+    for i in range(16):
+        atlas.find_and_reserve_region(1, 1)
+    assert atlas.has_free_region(8, 8)
+    assert tuple(atlas.find_and_reserve_region(8, 8)) != (-1, -1, -1, -1)
+    assert tuple(atlas.find_and_reserve_region(8, 8)) != (-1, -1, -1, -1)
+    assert tuple(atlas.find_and_reserve_region(8, 8)) != (-1, -1, -1, -1)
+
+
+def test_shadow_atlas_npot_region():
+    atlas = rplight.ShadowAtlas(512, 32)
+    region = atlas.find_and_reserve_region(3, 3)
+    assert tuple(region)[2:] == (3, 3)
+    # It takes up a whole 4x4 block
+    assert atlas.num_used_tiles == 16
+    atlas.free_region(region)
+    assert atlas.num_used_tiles == 0
+
+
+def test_shadow_atlas_npot_size():
+    # 10 x 10 tiles, the rest of the 16 x 16 tree is unusable
+    atlas = rplight.ShadowAtlas(320, 32)
+    assert atlas.has_free_region(8, 8)
+    assert not atlas.has_free_region(16, 16)
+
+    used = covered_tiles(atlas.find_and_reserve_region(8, 8))
+    assert not atlas.has_free_region(8, 8)
+
+    for i in range(9):
+        region = atlas.find_and_reserve_region(2, 2)
+        tiles = covered_tiles(region)
+        assert all(x < 10 and y < 10 for x, y in tiles)
+        assert not (tiles & used)
+        used |= tiles
+
+    assert not atlas.has_free_region(1, 1)
+    assert atlas.coverage == 1
+
+
+def test_shadow_atlas_invalid():
+    atlas = rplight.ShadowAtlas(512, 32)
+    assert not atlas.has_free_region(0, 0)
+    assert not atlas.has_free_region(32, 32)
+    assert tuple(atlas.find_and_reserve_region(32, 32)) == (-1, -1, -1, -1)
+    assert atlas.num_used_tiles == 0
+
+
+@pytest.fixture(scope='module')
+def atlas_buffer():
+    from panda3d.core import GraphicsEngine, GraphicsPipe, GraphicsPipeSelection
+    from panda3d.core import FrameBufferProperties, WindowProperties
+
+    pipe = GraphicsPipeSelection.get_global_ptr().make_default_pipe()
+    if pipe is None or not pipe.is_valid():
+        pytest.skip("GraphicsPipe is invalid")
+
+    engine = GraphicsEngine.get_global_ptr()
+    buffer = engine.make_output(pipe, 'atlas', 0, FrameBufferProperties(),
+                                WindowProperties.size(32, 32),
+                                GraphicsPipe.BF_refuse_window)
+    if buffer is None:
+        pytest.skip("GraphicsPipe cannot make offscreen buffers")
+
+    yield buffer
+    engine.remove_window(buffer)
+
+
+def read_source_regions(cmd_list, regions):
+    """Replays the store_source commands in the list onto the slot -> uv
+    region mapping the GPU would end up with."""
+    import struct
+    from panda3d.core import PTA_uchar
+
+    count = cmd_list.num_commands
+    data = PTA_uchar.empty_array(count * 32 * 4)
+    cmd_list.write_commands_to(data, count)
+    floats = struct.unpack('<{0}f'.format(count * 32), data.get_data())
+    ints = struct.unpack('<{0}i'.format(count * 32), data.get_data())
+
+    def to_int(k):
+        if rplight.GPUCommand.get_uses_integer_packing():
+            return ints[k]
+        return int(floats[k])
+
+    for i in range(count):
+        base = i * 32
+        if to_int(base) == rplight.GPUCommand.CMD_store_source:
+            # Type, slot, mvp, uv region
+            regions[to_int(base + 1)] = floats[base + 18:base + 22]
+
+
+def test_shadow_atlas_full_deferred_source_released(atlas_buffer):
+    from panda3d.core import NodePath, BoundingSphere
+
+    scene = NodePath("scene")
+    shadow_mgr = rplight.ShadowManager()
+    shadow_mgr.set_max_updates(4)
+    shadow_mgr.set_scene(scene)
+    shadow_mgr.set_tag_state_manager(rplight.TagStateManager(scene.attach_new_node("cam")))
+    shadow_mgr.set_atlas_graphics_output(atlas_buffer)
+    shadow_mgr.set_atlas_size(512)
+    shadow_mgr.init()
+
+    cmd_list = rplight.GPUCommandList()
+    mgr = rplight.InternalLightManager()
+    mgr.set_shadow_manager(shadow_mgr)
+    mgr.set_command_list(cmd_list)
+    mgr.set_camera_pos((0, 0, 0))
+    mgr.set_shadow_update_distance(1000)
+
+    def make_light(pos):
+        light = rplight.RPSpotLight()
+        light.set_radius(1)
+        light.set_pos(pos)
+        light.set_casts_shadows(True)
+        # A quarter of the atlas each
+        light.set_shadow_map_resolution(256)
+        mgr.add_light(light)
+        return light
+
+    # Fill the atlas, with every light in view.
+    lights = [make_light((100, 0, 0))] + [make_light((i * 2, 5, 0)) for i in range(3)]
+    regions = {}
+    mgr.update()
+    shadow_mgr.update()
+    read_source_regions(cmd_list, regions)
+    assert shadow_mgr.atlas.coverage == 1
+
+    # The first light goes out of view and moves, so it gives up its region
+    # for the update. A new light in view takes that region, and the first
+    # one can't evict anything, so it has to wait.
+    mgr.set_camera_frustum(BoundingSphere((0, 0, 0), 20))
+    lights[0].set_pos((101, 0, 0))
+    lights.append(make_light((0, -5, 0)))
+    mgr.update()
+    shadow_mgr.update()
+    read_source_regions(cmd_list, regions)
+
+    # The GPU must not be left sampling a region which now belongs to
+    # another source.
+    used = [uv for uv in regions.values() if uv[2] > 0 and uv[3] > 0]
+    assert len(used) == 4
+    assert len(set(used)) == len(used)